@@ -0,0 +1,533 @@
+/* indu - Incremental NCurses Disk Usage
+
+  Based on ncdu by Yorhel (https://dev.yorhel.nl/ncdu)
+  Copyright (c) Yorhel
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+/* indu-bench: generates synthetic directory trees and times indu on them.
+ *
+ * Every tree is generated from a fixed seed, so the same arguments give the
+ * same trees on every run. For each tree, the phases below are run a number
+ * of times with the indu binary given on the command line, and the fastest
+ * and median time of each phase is reported as a table on stdout and
+ * optionally as JSON.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <termios.h>
+
+
+#define MAX_RUNS 100
+#define MAX_RESULTS 256
+
+static char indu[PATH_MAX];
+static char workdir[PATH_MAX];
+static int repeat = 3;
+static int scale = 1;
+static uint64_t seed = 1;
+
+struct result {
+  const char *tree, *phase;
+  double runs[MAX_RUNS];
+  int nruns;
+};
+
+static struct result results[MAX_RESULTS];
+static int nresults;
+
+
+static void die(const char *fmt, ...) {
+  va_list arg;
+  va_start(arg, fmt);
+  vfprintf(stderr, fmt, arg);
+  va_end(arg);
+  exit(1);
+}
+
+
+/* xorshift64*, good enough for picking names and sizes */
+static uint64_t rnd_state;
+
+static uint64_t rnd(void) {
+  rnd_state ^= rnd_state >> 12;
+  rnd_state ^= rnd_state << 25;
+  rnd_state ^= rnd_state >> 27;
+  return rnd_state * 2685821657736338717ULL;
+}
+
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Tree generation. All paths are relative to the current directory, which
+ * is the root of the tree being generated. */
+
+static void mkfile(const char *path, uint64_t size) {
+  int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if(fd < 0 || ftruncate(fd, size) || close(fd))
+    die("Can't create %s: %s\n", path, strerror(errno));
+}
+
+
+static void mkdir_p(const char *path) {
+  if(mkdir(path, 0755) && errno != EEXIST)
+    die("Can't create %s: %s\n", path, strerror(errno));
+}
+
+
+/* File sizes are spread over a few orders of magnitude, files are sparse so
+ * that generating a tree is fast and doesn't need much disk space */
+static uint64_t rnd_size(void) {
+  return rnd() % (1 << (rnd() % 24));
+}
+
+
+/* A chain of nested directories, each with a few files */
+static void gen_deep(void) {
+  char name[32];
+  int i, j;
+
+  for(i=0; i<400*scale; i++) {
+    for(j=0; j<4; j++) {
+      snprintf(name, sizeof(name), "f%d", j);
+      mkfile(name, rnd_size());
+    }
+    mkdir_p("d");
+    if(chdir("d"))
+      die("Can't enter directory: %s\n", strerror(errno));
+  }
+}
+
+
+/* A single directory with many files */
+static void gen_flat(void) {
+  char name[32];
+  int i;
+
+  for(i=0; i<50000*scale; i++) {
+    snprintf(name, sizeof(name), "file-%08"PRIx64, rnd());
+    mkfile(name, rnd_size());
+  }
+}
+
+
+/* Files that have several links spread over a number of directories */
+static void gen_hlink(void) {
+  char name[64], lname[64];
+  int i, j;
+
+  for(i=0; i<100; i++) {
+    snprintf(name, sizeof(name), "d%d", i);
+    mkdir_p(name);
+  }
+  for(i=0; i<2000*scale; i++) {
+    snprintf(name, sizeof(name), "d%d/f%d", (int)(rnd() % 100), i);
+    mkfile(name, rnd_size());
+    for(j=0; j<4; j++) {
+      snprintf(lname, sizeof(lname), "d%d/l%d-%d", (int)(rnd() % 100), i, j);
+      if(link(name, lname))
+        die("Can't link %s: %s\n", lname, strerror(errno));
+    }
+  }
+}
+
+
+/* A balanced tree of 1000 leaf directories with files of mixed sizes. This
+ * tree is also used for the churn phases. */
+#define MIXED_LEAVES 1000
+
+static void gen_mixed(void) {
+  char name[64];
+  int i, j;
+
+  for(i=0; i<MIXED_LEAVES; i++) {
+    snprintf(name, sizeof(name), "%d", i/100);
+    mkdir_p(name);
+    snprintf(name, sizeof(name), "%d/%d", i/100, i/10%10);
+    mkdir_p(name);
+    snprintf(name, sizeof(name), "%d/%d/%d", i/100, i/10%10, i%10);
+    mkdir_p(name);
+    for(j=0; j<20*scale; j++) {
+      snprintf(name, sizeof(name), "%d/%d/%d/f%d", i/100, i/10%10, i%10, j);
+      mkfile(name, rnd_size());
+    }
+  }
+}
+
+
+/* Changes pct percent of the leaf directories of the mixed tree: one file is
+ * removed and another is added */
+static void churn(int pct, int round) {
+  char name[64];
+  int i, n = MIXED_LEAVES*pct/100;
+
+  while(n-- > 0) {
+    i = rnd() % MIXED_LEAVES;
+    snprintf(name, sizeof(name), "%d/%d/%d/f%d", i/100, i/10%10, i%10, (int)(rnd() % (20*scale)));
+    unlink(name);
+    snprintf(name, sizeof(name), "%d/%d/%d/c%d-%d", i/100, i/10%10, i%10, round, n);
+    mkfile(name, rnd_size());
+  }
+}
+
+
+struct tree {
+  const char *name;
+  void (*gen)(void);
+  int churn;
+};
+
+static const struct tree trees[] = {
+  { "deep",  gen_deep,  0 },
+  { "flat",  gen_flat,  0 },
+  { "hlink", gen_hlink, 0 },
+  { "mixed", gen_mixed, 1 },
+};
+
+#define NTREES (int)(sizeof(trees)/sizeof(*trees))
+
+
+static int rm_item(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+  (void)st; (void)flag; (void)ftw;
+  return remove(path);
+}
+
+
+static void rm_tree(const char *path) {
+  if(access(path, F_OK) == 0 && nftw(path, rm_item, 64, FTW_DEPTH|FTW_PHYS))
+    die("Can't remove %s: %s\n", path, strerror(errno));
+}
+
+
+/* Runs indu with the given arguments, output goes to /dev/null. Returns the
+ * time it took. */
+static double run(char *const *args) {
+  double start = now();
+  pid_t pid;
+  int st, fd;
+
+  if((pid = fork()) < 0)
+    die("Can't fork: %s\n", strerror(errno));
+  if(!pid) {
+    if((fd = open("/dev/null", O_RDWR)) >= 0) {
+      dup2(fd, 0);
+      dup2(fd, 1);
+      dup2(fd, 2);
+    }
+    execv(indu, args);
+    _exit(127);
+  }
+  if(waitpid(pid, &st, 0) < 0 || !WIFEXITED(st) || WEXITSTATUS(st) != 0) {
+    fputs("Error running", stderr);
+    for(; *args; args++)
+      fprintf(stderr, " %s", *args);
+    die("\n");
+  }
+  return now() - start;
+}
+
+
+/* Opens the browser on an export in a pseudo-terminal, waits until it has
+ * been drawn and then changes the sort order a few times before quitting.
+ * Returns the time from the first drawing of the browser until indu exits,
+ * which is mostly spent sorting and drawing. */
+static double browse(const char *export) {
+  static const char keys[] = "nsCnsCnsCq";
+  struct winsize ws = { 40, 120, 0, 0 };
+  struct pollfd pfd;
+  char *args[] = { indu, "--ignore-config", "-f", (char *)export, NULL };
+  static const char want[] = "Total disk usage";
+  char buf[4096+sizeof(want)];
+  double drawn = 0;
+  size_t keep = 0, n;
+  ssize_t r;
+  pid_t pid;
+  int m, s, st;
+
+  if((m = posix_openpt(O_RDWR|O_NOCTTY)) < 0 || grantpt(m) || unlockpt(m))
+    die("Can't open a pseudo-terminal: %s\n", strerror(errno));
+  ioctl(m, TIOCSWINSZ, &ws);
+
+  if((pid = fork()) < 0)
+    die("Can't fork: %s\n", strerror(errno));
+  if(!pid) {
+    setsid();
+    if((s = open(ptsname(m), O_RDWR)) < 0)
+      _exit(127);
+    ioctl(s, TIOCSCTTY, 0);
+    dup2(s, 0);
+    dup2(s, 1);
+    dup2(s, 2);
+    close(m);
+    setenv("TERM", "xterm", 1);
+    execv(indu, args);
+    _exit(127);
+  }
+
+  /* The output has to be read anyway, or indu blocks on a full terminal */
+  pfd.fd = m;
+  pfd.events = POLLIN;
+  while(poll(&pfd, 1, 10000) > 0 && (r = read(m, buf+keep, 4096)) > 0) {
+    if(drawn)
+      continue;
+    buf[keep+r] = 0;
+    if(strstr(buf, want)) {
+      drawn = now();
+      if(write(m, keys, sizeof(keys)-1) != sizeof(keys)-1)
+        die("Can't write to pseudo-terminal: %s\n", strerror(errno));
+    }
+    /* The string may be split over two reads, keep the end of this one */
+    n = keep + r;
+    keep = n < sizeof(want)-2 ? n : sizeof(want)-2;
+    memmove(buf, buf+n-keep, keep);
+  }
+  if(!drawn)
+    kill(pid, SIGKILL);
+  if(waitpid(pid, &st, 0) < 0 || !drawn || !WIFEXITED(st) || WEXITSTATUS(st) != 0)
+    die("Error running the browser on %s\n", export);
+  close(m);
+  return now() - drawn;
+}
+
+
+static struct result *result(const char *tree, const char *phase) {
+  int i;
+
+  for(i=0; i<nresults; i++)
+    if(results[i].tree == tree && strcmp(results[i].phase, phase) == 0)
+      return &results[i];
+  if(nresults == MAX_RESULTS)
+    die("Too many results\n");
+  results[nresults].tree = tree;
+  results[nresults].phase = phase;
+  results[nresults].nruns = 0;
+  return &results[nresults++];
+}
+
+
+static void add(const char *tree, const char *phase, double t) {
+  struct result *r = result(tree, phase);
+  if(r->nruns < MAX_RUNS)
+    r->runs[r->nruns++] = t;
+}
+
+
+static void bench_tree(const struct tree *t) {
+  char root[PATH_MAX], cache[PATH_MAX], export[PATH_MAX];
+  char *cold[] = { indu, "--ignore-config", "-0", "-o", "/dev/null", root, NULL };
+  char *cached[] = { indu, "--ignore-config", "-0", "-C", cache, "-o", "/dev/null", root, NULL };
+  char *exp_args[] = { indu, "--ignore-config", "-0", "-o", export, root, NULL };
+  char *imp_args[] = { indu, "--ignore-config", "-0", "-f", export, "-o", "/dev/null", NULL };
+  static const int churns[] = { 1, 10, 50 };
+  static char phases[3][32];
+  double start;
+  int i, j, cwd;
+
+  snprintf(root, sizeof(root), "%s/%s", workdir, t->name);
+  snprintf(cache, sizeof(cache), "%s/%s.cache", workdir, t->name);
+  snprintf(export, sizeof(export), "%s/%s.json", workdir, t->name);
+  rnd_state = seed * 0x9E3779B97F4A7C15ULL + (uint64_t)(t - trees) + 1;
+
+  fprintf(stderr, "Generating %s tree...\n", t->name);
+  if((cwd = open(".", O_RDONLY)) < 0)
+    die("Can't open the current directory: %s\n", strerror(errno));
+  mkdir_p(root);
+  if(chdir(root))
+    die("Can't enter %s: %s\n", root, strerror(errno));
+  start = now();
+  t->gen();
+  add(t->name, "generate", now() - start);
+  if(fchdir(cwd))
+    die("Can't go back to the current directory: %s\n", strerror(errno));
+
+  for(i=0; i<repeat; i++) {
+    fprintf(stderr, "Benchmarking %s tree (%d/%d)...\n", t->name, i+1, repeat);
+    add(t->name, "cold scan", run(cold));
+    unlink(cache);
+    add(t->name, "cache build", run(cached));
+    add(t->name, "warm scan", run(cached));
+    add(t->name, "export", run(exp_args));
+    add(t->name, "import", run(imp_args));
+    add(t->name, "sort/draw", browse(export));
+  }
+
+  if(t->churn) {
+    if(chdir(root))
+      die("Can't enter %s: %s\n", root, strerror(errno));
+    for(j=0; j<(int)(sizeof(churns)/sizeof(*churns)); j++) {
+      snprintf(phases[j], sizeof(phases[j]), "churn %d%%", churns[j]);
+      for(i=0; i<repeat; i++) {
+        /* Cached directories are compared by mtime, with a resolution of a
+         * second */
+        sleep(1);
+        churn(churns[j], j*repeat+i);
+        add(t->name, phases[j], run(cached));
+      }
+    }
+    if(fchdir(cwd))
+      die("Can't go back to the current directory: %s\n", strerror(errno));
+  }
+  close(cwd);
+
+  rm_tree(root);
+  unlink(cache);
+  unlink(export);
+}
+
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+
+static void print_results(const char *json) {
+  FILE *f;
+  double *r;
+  int i, j, n;
+
+  printf("%-8s %-14s %10s %10s\n", "tree", "phase", "min", "median");
+  for(i=0; i<nresults; i++) {
+    r = results[i].runs;
+    n = results[i].nruns;
+    qsort(r, n, sizeof(*r), cmp_double);
+    printf("%-8s %-14s %9.3fs %9.3fs\n", results[i].tree, results[i].phase, r[0], r[n/2]);
+  }
+
+  if(!json)
+    return;
+  if(strcmp(json, "-") == 0)
+    f = stdout;
+  else if((f = fopen(json, "w")) == NULL)
+    die("Can't open %s: %s\n", json, strerror(errno));
+  fprintf(f, "{\"progname\":\"indu-bench\",\"progver\":\"%s\",\"timestamp\":%lu,\"scale\":%d,\"seed\":%"PRIu64",\"results\":[",
+    PACKAGE_VERSION, (unsigned long)time(NULL), scale, seed);
+  for(i=0; i<nresults; i++) {
+    r = results[i].runs;
+    n = results[i].nruns;
+    fprintf(f, "%s\n{\"tree\":\"%s\",\"phase\":\"%s\",\"min\":%.6f,\"median\":%.6f,\"runs\":[",
+      i ? "," : "", results[i].tree, results[i].phase, r[0], r[n/2]);
+    for(j=0; j<n; j++)
+      fprintf(f, "%s%.6f", j ? "," : "", r[j]);
+    fputs("]}", f);
+  }
+  fputs("]}\n", f);
+  if(f != stdout && fclose(f))
+    die("Error writing %s: %s\n", json, strerror(errno));
+}
+
+
+static void usage(void) {
+  fputs(
+    "indu-bench <options> <indu binary>\n"
+    "\n"
+    "  -d DIR      Generate the trees in DIR (default: $TMPDIR)\n"
+    "  -j FILE     Also write the results as JSON to FILE\n"
+    "  -r NUM      Number of runs of every phase (3)\n"
+    "  -s NUM      Scale the size of the trees by NUM (1)\n"
+    "  -S NUM      Seed for generating the trees (1)\n"
+    "  -t TREES    Comma-separated list of trees (deep,flat,hlink,mixed)\n",
+    stderr);
+  exit(1);
+}
+
+
+int main(int argc, char **argv) {
+  const char *dir = getenv("TMPDIR"), *json = NULL, *only = NULL;
+  char root[PATH_MAX], *end;
+  int c, i;
+
+  while((c = getopt(argc, argv, "d:j:r:s:S:t:")) != -1) {
+    switch(c) {
+    case 'd': dir = optarg; break;
+    case 'j': json = optarg; break;
+    case 'r':
+      repeat = strtol(optarg, &end, 10);
+      if(*end || repeat < 1 || repeat > MAX_RUNS)
+        usage();
+      break;
+    case 's':
+      scale = strtol(optarg, &end, 10);
+      if(*end || scale < 1 || scale > 1000)
+        usage();
+      break;
+    case 'S':
+      seed = strtoull(optarg, &end, 10);
+      if(*end)
+        usage();
+      break;
+    case 't': only = optarg; break;
+    default: usage();
+    }
+  }
+  if(optind != argc-1)
+    usage();
+  /* The churn phases run indu from inside the tree */
+  if(!realpath(argv[optind], indu) || access(indu, X_OK))
+    die("Can't run %s: %s\n", argv[optind], strerror(errno));
+
+  snprintf(workdir, sizeof(workdir), "%s/indu-bench-XXXXXX", dir && *dir ? dir : "/tmp");
+  if(!mkdtemp(workdir))
+    die("Can't create a directory in %s: %s\n", dir && *dir ? dir : "/tmp", strerror(errno));
+  if(!realpath(workdir, root))
+    die("Can't resolve %s: %s\n", workdir, strerror(errno));
+  strcpy(workdir, root);
+
+  for(i=0; i<NTREES; i++) {
+    if(only) {
+      const char *p = strstr(only, trees[i].name);
+      size_t len = strlen(trees[i].name);
+      if(!p || (p != only && p[-1] != ',') || (p[len] && p[len] != ','))
+        continue;
+    }
+    bench_tree(&trees[i]);
+  }
+  /* This also removes the lock files next to the caches */
+  rm_tree(workdir);
+
+  print_results(json);
+  return 0;
+}
@@ -25,6 +25,8 @@
 */
 
 #include "global.h"
+#include "dir_cache.h"
+#include "dir_watch.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -34,6 +36,7 @@
 
 static int info_show = 0, info_page = 0, info_start = 0;
 static const char *message = NULL;
+int browse_partial = 0;
 
 
 
@@ -45,7 +48,7 @@ static void browse_draw_info(struct dir *dr) {
 
   nccreate(11, 60, "Item info");
 
-  if(dr->hlnk) {
+  if(dir_hlnk(dr)) {
     nctab(41, info_page == 0, 1, "Info");
     nctab(50, info_page == 1, 2, "Links");
   }
@@ -100,7 +103,7 @@ static void browse_draw_info(struct dir *dr) {
     break;
 
   case 1:
-    for(i=0,t=dr->hlnk; t!=dr; t=t->hlnk,i++) {
+    for(i=0,t=dir_hlnk(dr); t!=dr; t=dir_hlnk(t),i++) {
       if(info_start > i)
         continue;
       if(i-info_start > 5)
@@ -121,6 +124,9 @@ static void browse_draw_info(struct dir *dr) {
 static void browse_draw_flag(struct dir *n, int *x) {
   addchc(n->flags & FF_BSEL ? UIC_FLAG_SEL : UIC_FLAG,
       n == dirlist_parent ? ' ' :
+        browse_partial
+        && n->flags & FF_DIR
+        && dir_mem_busy(n) ? '*' :
         n->flags & FF_EXL ? '<' :
         n->flags & FF_ERR ? '!' :
        n->flags & FF_SERR ? '.' :
@@ -131,7 +137,8 @@ static void browse_draw_flag(struct dir *n, int *x) {
      !(n->flags & FF_FILE
     || n->flags & FF_DIR) ? '@' :
         n->flags & FF_DIR
-        && n->sub == NULL ? 'e' :
+        && n->sub == NULL
+        && !n->items ? 'e' :
                             ' ');
   *x += 2;
 }
@@ -293,10 +300,23 @@ void browse_draw(void) {
   /* top line - basic info */
   uic_set(UIC_HD);
   mvhline(0, 0, ' ', wincols);
-  mvprintw(0,0,"%s %s ~ Use the arrow keys to navigate, press ", PACKAGE_NAME, PACKAGE_VERSION);
-  addchc(UIC_KEY_HD, '?');
-  addstrc(UIC_HD, " for help");
-  if(dir_import_active)
+  if(browse_partial) {
+    mvprintw(0,0,"%s %s ~ %s in progress, press ", PACKAGE_NAME, PACKAGE_VERSION,
+      browse_partial == BROWSE_DELETE ? "Deletion" : "Scan");
+    addchc(UIC_KEY_HD, 'b');
+    addstrc(UIC_HD, " to return to it");
+  } else {
+    mvprintw(0,0,"%s %s ~ Use the arrow keys to navigate, press ", PACKAGE_NAME, PACKAGE_VERSION);
+    addchc(UIC_KEY_HD, '?');
+    addstrc(UIC_HD, " for help");
+  }
+  if(browse_partial == BROWSE_DELETE)
+    mvaddstr(0, wincols-10, "[deleting]");
+  else if(browse_partial)
+    mvaddstr(0, wincols-10, "[scanning]");
+  else if(dir_scan_verifying())
+    mvaddstr(0, wincols-11, "[verifying]");
+  else if(dir_import_active)
     mvaddstr(0, wincols-10, "[imported]");
   else if(!can_delete)
     mvaddstr(0, wincols-11, "[read-only]");
@@ -384,26 +404,26 @@ int browse_key(int ch) {
       info_page = 0;
       break;
     case '2':
-      if(sel->hlnk)
+      if(dir_hlnk(sel))
         info_page = 1;
       break;
     case KEY_RIGHT:
     case 'l':
-      if(sel->hlnk) {
+      if(dir_hlnk(sel)) {
         info_page = 1;
         catch++;
       }
       break;
     case KEY_LEFT:
     case 'h':
-      if(sel->hlnk) {
+      if(dir_hlnk(sel)) {
         info_page = 0;
         catch++;
       }
       break;
     case KEY_UP:
     case 'k':
-      if(sel->hlnk && info_page == 1) {
+      if(dir_hlnk(sel) && info_page == 1) {
         if(info_start > 0)
           info_start--;
         catch++;
@@ -412,8 +432,8 @@ int browse_key(int ch) {
     case KEY_DOWN:
     case 'j':
     case ' ':
-      if(sel->hlnk && info_page == 1) {
-        for(i=0,t=sel->hlnk; t!=sel; t=t->hlnk)
+      if(dir_hlnk(sel) && info_page == 1) {
+        for(i=0,t=dir_hlnk(sel); t!=sel; t=dir_hlnk(t))
           i++;
         if(i > info_start+6)
           info_start++;
@@ -422,6 +442,34 @@ int browse_key(int ch) {
       break;
     }
 
+  /* the tree is still being built, leave it alone */
+  if(!catch && browse_partial)
+    switch(ch) {
+    case 'q':
+      if(info_show)
+        break;
+      /* fall through */
+    case 'b':
+      return 1;
+    case 'r':
+    case 'd':
+    case '?':
+    case 'T':
+    case 'U':
+      message = browse_partial == BROWSE_DELETE ? "Not available while deleting."
+        : "Not available until the scan has finished.";
+      catch++;
+      break;
+    case 10:
+    case KEY_RIGHT:
+    case 'l':
+      if(browse_partial == BROWSE_SCAN && sel != NULL && sel != dirlist_parent && sel->flags & FF_CACHED) {
+        message = "Cached, this can be opened after the scan.";
+        catch++;
+      }
+      break;
+    }
+
   if(!catch)
     switch(ch) {
     /* selecting items */
@@ -524,6 +572,8 @@ int browse_key(int ch) {
       if(dirlist_par) {
         dir_ui = 2;
         dir_mem_init(dirlist_par);
+        if(!dir_cache_reopen())
+          dir_watch_load();
         dir_scan_init(getpath(dirlist_par));
       }
       info_show = 0;
@@ -555,6 +605,14 @@ int browse_key(int ch) {
       help_init();
       info_show = 0;
       break;
+    case 'T':
+      top_init();
+      info_show = 0;
+      break;
+    case 'U':
+      rollup_init(dirlist_par);
+      info_show = 0;
+      break;
     case 'd':
       if(sel == NULL || sel == dirlist_parent)
         break;
@@ -581,16 +639,37 @@ int browse_key(int ch) {
   sel = dirlist_get(0);
   if(!info_show || sel == dirlist_parent)
     info_show = info_page = info_start = 0;
-  else if(sel && !sel->hlnk)
+  else if(sel && !dir_hlnk(sel))
     info_page = info_start = 0;
 
   return 0;
 }
 
 
+void browse_verified(void) {
+  static char verified[64];
+  int n;
+
+  if((n = dir_scan_verified()) > 0) {
+    snprintf(verified, sizeof(verified), "%d cached director%s had changed, refresh to update.",
+      n, n == 1 ? "y" : "ies");
+    message = verified;
+  }
+}
+
+
 void browse_init(struct dir *par) {
   pstate = ST_BROWSE;
   message = NULL;
+  browse_partial = 0;
+  dirlist_open(par);
+}
+
+
+void browse_init_partial(struct dir *par, int what) {
+  message = NULL;
+  info_show = 0;
+  browse_partial = what;
   dirlist_open(par);
 }
 
@@ -33,6 +33,22 @@ int  browse_key(int);
 void browse_draw(void);
 void browse_init(struct dir *);
 
+/* Picks up the outcome of the background check of the directories trusted
+ * under --cache-trust, see dir_scan_verified(). Called from the input loop
+ * between keys, as it saves the cache. */
+void browse_verified(void);
+
+/* Opens the browser on a tree that is still being scanned (BROWSE_SCAN), from
+ * the progress thread, or deleted from (BROWSE_DELETE), without changing
+ * pstate. Until it is closed, items may be added or removed between calls,
+ * dirs that are still being scanned are flagged, keys that would modify the
+ * tree have no effect, and browse_key() returns 1 to go back to the progress
+ * screen. */
+#define BROWSE_SCAN   1
+#define BROWSE_DELETE 2
+extern int browse_partial;
+void browse_init_partial(struct dir *, int);
+
 
 #endif
 
@@ -28,8 +28,12 @@
 #include "global.h"
 
 #include <string.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 
 #define DS_CONFIRM  0
@@ -41,7 +45,53 @@ int delete_confirm = 1;
 static struct dir *root, *nextsel, *curdir;
 static char ignoreerr = 0, state;
 static signed char seloption;
-static int lasterrno;
+static int lasterrno; /* 0 if the contents of a cached directory were gone */
+static int browsing;  /* showing the browser while deleting */
+
+
+/* A directory being deleted. The contents of a directory are removed by the
+ * thread that takes its task, its subdirectories become tasks of their own.
+ * Once they are all finished, the directory itself is removed and the task
+ * goes to the finished list, where the main thread takes it to update the
+ * tree. Tasks are finished before their parent, so the main thread frees a
+ * subtree only after everything in it has been handled.
+ *
+ * The worker threads only read the tree: the names and flags of the items
+ * in a directory are read with lock held when its task is taken, and nothing
+ * is freed before the task that it belongs to is finished. The browser can
+ * be used meanwhile, the main thread holds lock while it handles keys and
+ * draws, as those may reorder the items of a directory. */
+struct task {
+  struct dir *dir;
+  struct task *parent, *next;
+  int fd;       /* of dir, while its contents are being removed */
+  int pending;  /* unfinished subdirectory tasks, plus one for the contents */
+  int keep;     /* something in dir couldn't be removed, so dir stays */
+  struct dir **deleted; /* items of dir that have been removed */
+  int ndeleted;
+  int64_t freed;  /* sizes of the files in deleted */
+  uint64_t nfreed; /* items removed */
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER; /* task queued or quit set */
+static pthread_cond_t event = PTHREAD_COND_INITIALIZER; /* something for the main thread */
+static pthread_cond_t resolved = PTHREAD_COND_INITIALIZER; /* error handled by the user */
+
+/* All protected by lock. Finished tasks are kept in order, so that the
+ * subdirectories of a directory are freed before it. */
+static struct task *queue, *expand, *finished, **finished_tail;
+static int ntasks;    /* tasks that haven't been taken from finished yet */
+static int stop;      /* aborted by the user */
+static int quit;      /* tells the threads to exit */
+static int ignore;    /* copy of ignoreerr for the threads */
+static struct dir *err_item, *started;
+static int err_no;
+/* What has been removed: the sizes and items that have been taken out of the
+ * tree, plus for the tasks that haven't been freed yet the files that they
+ * removed and their directories. That adds up to what the browser showed. */
+static int64_t freed;
+static uint64_t nfreed;
 
 
 static void delete_draw_confirm(void) {
@@ -49,7 +99,7 @@ static void delete_draw_confirm(void) {
 
   ncprint(1, 2, "Are you sure you want to delete \"%s\"%c",
     cropstr(root->name, 21), root->flags & FF_DIR ? ' ' : '?');
-  if(root->flags & FF_DIR && root->sub != NULL)
+  if(root->flags & FF_DIR && (root->sub != NULL || root->items))
     ncprint(2, 18, "and all of its contents?");
 
   if(seloption == 0)
@@ -70,10 +120,17 @@ static void delete_draw_confirm(void) {
 
 
 static void delete_draw_progress(void) {
+  const char *unit;
+  float size;
+
+  size = formatsize(freed, &unit);
   nccreate(6, 60, "Deleting...");
+  ncaddstr(1, 2, cropstr(getpath(started ? started : curdir), 47));
+  ncprint(2, 2, "Freed %.1f %s in %"PRIu64" items", size, unit, nfreed);
 
-  ncaddstr(1, 2, cropstr(getpath(curdir), 47));
-  ncaddstr(4, 41, "Press ");
+  ncaddstr(4, 28, "Press ");
+  addchc(UIC_KEY, 'b');
+  addstrc(UIC_DEFAULT, " to browse, ");
   addchc(UIC_KEY, 'q');
   addstrc(UIC_DEFAULT, " to abort");
 }
@@ -83,7 +140,7 @@ static void delete_draw_error(void) {
   nccreate(6, 60, "Error!");
 
   ncprint(1, 2, "Can't delete %s:", cropstr(getpath(curdir), 42));
-  ncaddstr(2, 4, strerror(lasterrno));
+  ncaddstr(2, 4, lasterrno ? strerror(lasterrno) : "Its cached contents are not available anymore");
 
   if(seloption == 0)
     attron(A_REVERSE);
@@ -101,12 +158,17 @@ static void delete_draw_error(void) {
 
 
 void delete_draw(void) {
+  pthread_mutex_lock(&lock);
   browse_draw();
   switch(state) {
     case DS_CONFIRM:  delete_draw_confirm();  break;
-    case DS_PROGRESS: delete_draw_progress(); break;
+    case DS_PROGRESS:
+      if(!browsing)
+        delete_draw_progress();
+      break;
     case DS_FAILED:   delete_draw_error();    break;
   }
+  pthread_mutex_unlock(&lock);
 }
 
 
@@ -135,8 +197,19 @@ int delete_key(int ch) {
         return 1;
     }
   /* processing deletion */
-  else if(state == DS_PROGRESS)
+  else if(state == DS_PROGRESS && browsing) {
+    pthread_mutex_lock(&lock);
+    if(browse_key(ch))
+      browse_partial = browsing = 0;
+    pthread_mutex_unlock(&lock);
+  } else if(state == DS_PROGRESS)
     switch(ch) {
+      case 'b':
+        pthread_mutex_lock(&lock);
+        browse_init_partial(dirlist_par, BROWSE_DELETE);
+        pthread_mutex_unlock(&lock);
+        browsing = 1;
+        break;
       case 'q':
         return 1;
     }
@@ -168,48 +241,350 @@ int delete_key(int ch) {
 }
 
 
-static int delete_dir(struct dir *dr) {
-  struct dir *nxt, *cur;
-  int r;
-
-  /* check for input or screen resizes */
-  curdir = dr;
-  if(input_handle(1))
+/* Waits for the user to handle an error, returns non-zero if the deletion
+ * has been aborted. Called with lock held. */
+static int task_error(struct dir *d, int err) {
+  while(err_item && !stop)
+    pthread_cond_wait(&resolved, &lock);
+  if(stop)
     return 1;
+  if(ignore)
+    return 0;
+  err_item = d;
+  err_no = err;
+  pthread_cond_signal(&event);
+  while(err_item == d && !stop)
+    pthread_cond_wait(&resolved, &lock);
+  return stop;
+}
 
-  /* do the actual deleting */
-  if(dr->flags & FF_DIR) {
-    if((r = chdir(dr->name)) < 0)
-      goto delete_nxt;
-    if(dr->sub != NULL) {
-      nxt = dr->sub;
-      while(nxt != NULL) {
-        cur = nxt;
-        nxt = cur->next;
-        if(delete_dir(cur))
-          return 1;
+
+static struct task *task_new(struct dir *d, struct task *parent) {
+  struct task *t = xcalloc(1, sizeof(struct task));
+  t->dir = d;
+  t->parent = parent;
+  t->fd = -1;
+  t->pending = 1;
+  ntasks++;
+  return t;
+}
+
+
+/* Marks one part of t as done. The last one removes the directory, if it is
+ * empty, and then does the same for its parent. */
+static void task_done(struct task *t) {
+  struct task *p;
+  int fail, r;
+
+  for(; t; t=p) {
+    p = t->parent;
+    pthread_mutex_lock(&lock);
+    r = --t->pending;
+    fail = t->keep || stop;
+    pthread_mutex_unlock(&lock);
+    if(r > 0)
+      return;
+
+    if(t->fd >= 0)
+      close(t->fd);
+    t->fd = -1;
+    if(!fail && unlinkat(p ? p->fd : AT_FDCWD, t->dir->name, AT_REMOVEDIR)) {
+      r = errno;
+      pthread_mutex_lock(&lock);
+      task_error(t->dir, r);
+      pthread_mutex_unlock(&lock);
+      fail = 1;
+    }
+
+    pthread_mutex_lock(&lock);
+    if(fail)
+      t->keep = 1;
+    else {
+      nfreed++;
+      t->nfreed++;
+    }
+    if(t->keep && p)
+      p->keep = 1;
+    t->next = NULL;
+    *finished_tail = t;
+    finished_tail = &t->next;
+    pthread_cond_signal(&event);
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+
+/* Removes the contents of a directory and queues its subdirectories */
+static void task_run(struct task *t) {
+  struct dir *d, **files = NULL;
+  int n = 0, i, r;
+
+  pthread_mutex_lock(&lock);
+  started = t->dir;
+  r = stop;
+  pthread_mutex_unlock(&lock);
+
+  if(!r && (t->fd = openat(t->parent ? t->parent->fd : AT_FDCWD, t->dir->name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) < 0) {
+    r = errno;
+    pthread_mutex_lock(&lock);
+    task_error(t->dir, r);
+    t->keep = 1;
+    pthread_mutex_unlock(&lock);
+    r = 1;
+  }
+
+  if(!r) {
+    pthread_mutex_lock(&lock);
+    for(d=t->dir->sub; d; d=d->next)
+      if(!(d->flags & FF_DIR))
+        n++;
+    files = xmalloc((n+1)*sizeof(struct dir *));
+    t->deleted = xmalloc((n+1)*sizeof(struct dir *));
+    n = 0;
+
+    for(d=t->dir->sub; d; d=d->next) {
+      if(!(d->flags & FF_DIR))
+        files[n++] = d;
+      else {
+        struct task *s = task_new(d, t);
+        t->pending++;
+        if(d->flags & FF_CACHED) {
+          s->next = expand;
+          expand = s;
+          pthread_cond_signal(&event);
+        } else {
+          s->next = queue;
+          queue = s;
+          pthread_cond_signal(&work);
+        }
       }
     }
-    if((r = chdir("..")) < 0)
-      goto delete_nxt;
-    r = dr->sub == NULL ? rmdir(dr->name) : 0;
-  } else
-    r = unlink(dr->name);
+    pthread_mutex_unlock(&lock);
+  }
 
-delete_nxt:
-  /* error occurred, ask user what to do */
-  if(r == -1 && !ignoreerr) {
+  for(i=0; !r && i<n; i++) {
+    if(unlinkat(t->fd, files[i]->name, 0)) {
+      r = errno;
+      pthread_mutex_lock(&lock);
+      r = task_error(files[i], r);
+      t->keep = 1;
+      pthread_mutex_unlock(&lock);
+    } else {
+      t->deleted[t->ndeleted++] = files[i];
+      pthread_mutex_lock(&lock);
+      freed = adds64(freed, files[i]->size);
+      nfreed++;
+      t->freed = adds64(t->freed, files[i]->size);
+      t->nfreed++;
+      r = stop;
+      pthread_mutex_unlock(&lock);
+    }
+  }
+  if(i < n) {
+    pthread_mutex_lock(&lock);
+    t->keep = 1;
+    pthread_mutex_unlock(&lock);
+  }
+
+  free(files);
+  task_done(t);
+}
+
+
+static void *worker(void *arg) {
+  struct task *t;
+
+  pthread_mutex_lock(&lock);
+  while(1) {
+    while(!queue && !quit)
+      pthread_cond_wait(&work, &lock);
+    if(quit)
+      break;
+    t = queue;
+    queue = t->next;
+    pthread_mutex_unlock(&lock);
+    task_run(t);
+    pthread_mutex_lock(&lock);
+  }
+  pthread_mutex_unlock(&lock);
+  return arg;
+}
+
+
+/* Updates the tree for a finished task. Called with lock held, which is
+ * released while freeing: the threads don't look at the items of a directory
+ * again after taking its task. The browser leaves the directory first if it
+ * is open. */
+static void task_free(struct task *t, struct dir *par) {
+  struct dir *d;
+  int64_t size = par->size;
+  int items = par->items, i;
+
+  if(started == t->dir)
+    started = NULL;
+  if(browsing && !t->keep)
+    for(d=dirlist_par; d; d=d->parent)
+      if(d == t->dir) {
+        dirlist_open(t->dir->parent);
+        break;
+      }
+  pthread_mutex_unlock(&lock);
+  if(!t->keep)
+    freedir(t->dir);
+  else
+    for(i=0; i<t->ndeleted; i++)
+      freedir(t->deleted[i]);
+  free(t->deleted);
+  pthread_mutex_lock(&lock);
+  freed = adds64(freed, size - par->size - t->freed);
+  nfreed += items - par->items - t->nfreed;
+  free(t);
+  ntasks--;
+}
+
+
+/* Threads that delete files: as many as scan with --threads, or one per CPU */
+static int delete_threads(void) {
+  long n = dir_scan_threads > 1 ? dir_scan_threads : sysconf(_SC_NPROCESSORS_ONLN);
+  return n < 1 ? 1 : n > 256 ? 256 : (int)n;
+}
+
+
+/* Deletes the root directory with the worker threads, while the main thread
+ * updates the tree and handles input and errors */
+static void delete_tree(void) {
+  int nthreads = delete_threads();
+  pthread_t *threads = xmalloc(nthreads*sizeof(pthread_t));
+  struct dir *par = root->parent;
+  struct task *t;
+  struct timeval tv;
+  struct timespec ts;
+  unsigned int gen;
+  int i, n, r = 0;
+
+  queue = expand = finished = NULL;
+  finished_tail = &finished;
+  stop = quit = ntasks = 0;
+  ignore = ignoreerr;
+  err_item = started = NULL;
+  freed = nfreed = 0;
+
+  for(n=0; n<nthreads; n++)
+    if((r = pthread_create(&threads[n], NULL, worker, NULL)) != 0)
+      break;
+  if(!n) {
+    state = DS_FAILED;
+    lasterrno = r;
+    while(state == DS_FAILED && !input_handle(0))
+      ;
+    free(threads);
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  queue = task_new(root, NULL);
+  pthread_cond_signal(&work);
+  pthread_mutex_unlock(&lock);
+
+  pthread_mutex_lock(&lock);
+  gen = dirlist_gen;
+  while(ntasks > 0) {
+    /* Subtrees that have been deleted are freed in batches */
+    while((t = finished) != NULL) {
+      if(!(finished = t->next))
+        finished_tail = &finished;
+      task_free(t, par);
+    }
+    if(browsing && gen != dirlist_gen) {
+      dirlist_open(dirlist_par);
+      gen = dirlist_gen;
+    }
+    if(!ntasks)
+      break;
+
+    /* Lazily loaded directories are read from the cache here, the threads
+     * can't do that. One that can't be read is reported like an error of the
+     * threads, after any that is being handled. */
+    while((t = expand) != NULL && !err_item) {
+      expand = t->next;
+      r = -1;
+      if(!stop) {
+        pthread_mutex_unlock(&lock);
+        r = dir_mem_expand(t->dir);
+        pthread_mutex_lock(&lock);
+      }
+      if(r < 0) {
+        if(!stop && !ignore) {
+          err_item = t->dir;
+          err_no = 0;
+        }
+        t->keep = 1;
+        pthread_mutex_unlock(&lock);
+        task_done(t);
+        pthread_mutex_lock(&lock);
+      } else {
+        t->next = queue;
+        queue = t;
+        pthread_cond_signal(&work);
+      }
+    }
+
+    if(err_item) {
+      state = DS_FAILED;
+      lasterrno = err_no;
+      curdir = err_item;
+      pthread_mutex_unlock(&lock);
+      r = 0;
+      while(state == DS_FAILED && !r)
+        r = input_handle(0);
+      pthread_mutex_lock(&lock);
+      curdir = root;
+      state = DS_PROGRESS;
+      stop |= r;
+      ignore = ignoreerr;
+      err_item = NULL;
+      pthread_cond_broadcast(&resolved);
+      continue;
+    }
+
+    gettimeofday(&tv, NULL);
+    ts.tv_sec = tv.tv_sec;
+    ts.tv_nsec = (tv.tv_usec + 50000) * 1000;
+    if(ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    if(!finished && !expand)
+      pthread_cond_timedwait(&event, &lock, &ts);
+    pthread_mutex_unlock(&lock);
+    r = input_handle(1);
+    pthread_mutex_lock(&lock);
+    if(r && !stop) {
+      stop = 1;
+      pthread_cond_broadcast(&resolved);
+    }
+  }
+  quit = 1;
+  pthread_cond_broadcast(&work);
+  pthread_mutex_unlock(&lock);
+
+  for(i=0; i<n; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+}
+
+
+/* A single file is removed right away */
+static void delete_file(void) {
+  if(!unlinkat(AT_FDCWD, root->name, 0))
+    freedir(root);
+  else if(!ignoreerr) {
     state = DS_FAILED;
     lasterrno = errno;
-    curdir = dr;
     while(state == DS_FAILED)
       if(input_handle(0))
-        return 1;
-  } else if(!(dr->flags & FF_DIR && dr->sub != NULL)) {
-    freedir(dr);
-    return 0;
+        return;
   }
-  return root == dr ? 1 : 0;
 }
 
 
@@ -236,10 +611,22 @@ void delete_process(void) {
   /* delete */
   seloption = 0;
   state = DS_PROGRESS;
+  browsing = 0;
   par = root->parent;
-  delete_dir(root);
+  if(root->flags & FF_DIR) {
+    if(root->flags & FF_CACHED)
+      dir_mem_expand(root);
+    delete_tree();
+  } else
+    delete_file();
   if(nextsel)
     nextsel->flags |= FF_BSEL;
+  if(browsing) {
+    /* stay where the user went, the tree is complete again */
+    browsing = 0;
+    browse_init(dirlist_par);
+    return;
+  }
   browse_init(par);
   if(nextsel)
     dirlist_top(-4);
@@ -252,4 +639,3 @@ void delete_init(struct dir *dr, struct dir *s) {
   pstate = ST_DEL;
   nextsel = s;
 }
-
@@ -61,16 +61,17 @@ struct dir_output {
    * scanned directory.
    *
    * The *item struct has the following fields set when item() is called:
-   *   size, asize, ino, dev, flags (only DIR,FILE,ERR,OTHFS,EXL,HLNKC).
+   *   size, asize, flags (only DIR,FILE,ERR,OTHFS,EXL,HLNKC).
    * All other fields/flags should be initialized to NULL or 0.
-   * The name and dir_ext fields are given separately.
+   * The name, dir_ext and dir_link fields are given separately, the latter
+   * has ino, dev and nlink set; hlnk is NULL.
    * All pointers may be overwritten or freed in subsequent calls, so this
    * function should make a copy if necessary.
    *
    * The function should return non-zero on error, at which point errno is
    * assumed to be set to something sensible.
    */
-  int (*item)(struct dir *, const char *, struct dir_ext *, unsigned int);
+  int (*item)(struct dir *, const char *, struct dir_ext *, struct dir_link *);
 
   /* Finalizes the output to go to the next program state or exit indu. Called
    * after item(NULL) has been called for the root item or before any item()
@@ -86,6 +87,23 @@ struct dir_output {
    * available. */
   int64_t size;
   int items;
+
+  /* Set by the output code if item() accepts directories with the FF_CACHED
+   * flag. Those are stubs for an unchanged cached directory: size, asize and
+   * items already include everything below it, and its contents are not
+   * output. */
+  int cached;
+
+  /* Set by the output code if the tree it builds can be browsed before
+   * final(). Returns the tree so far, or NULL if there is none yet. Only
+   * called while the input code waits in dir_progress(). */
+  struct dir *(*partial)(void);
+
+  /* Set by the output code if the tree is browsed after final(). Only then
+   * are directories trusted under --cache-trust, and checked in the
+   * background afterwards; otherwise they are checked during the scan, so
+   * that nothing stale is written out. */
+  int browsed;
 };
 
 
@@ -99,22 +117,228 @@ struct dir_output {
  */
 void dir_mem_init(struct dir *);
 
-/* Initializes the SCAN state and dir_output for exporting to a file. */
+/* Once the tree takes more than dir_mem_limit bytes (set via --memory-limit
+ * option, 0 for no limit), directories that have been scanned completely
+ * are written to a spill file and replaced by FF_CACHED stubs, which
+ * dir_mem_expand() reads back. Directories with hard links in them, the
+ * directory being scanned and the one open in the browser are kept.
+ * dir_mem_spill_open() creates the spill file, returns -1 on error. */
+extern uint64_t dir_mem_limit;
+int dir_mem_spill_open(void);
+
+/* Called by freedir() for FF_CACHED stubs, to drop spilled contents that
+ * won't be read anymore */
+void dir_mem_forget(struct dir *);
+
+/* Reads the contents of an FF_CACHED stub from the spill file or the cache,
+ * turning it into a regular directory whose subdirectories are stubs. Returns
+ * -1 if they are not available anymore, in which case the stub is left as
+ * is. */
+int dir_mem_expand(struct dir *);
+
+/* Whether items are still being added to a directory of the tree that is
+ * being built, i.e. whether it hasn't been scanned completely yet. */
+int dir_mem_busy(struct dir *);
+
+/* The largest files and directories of the tree are kept in two lists as it
+ * is built, refreshed and deleted from. An item is either a node of the
+ * tree, or something below an FF_CACHED stub that is only known by its path
+ * relative to the stub. */
+#define DIR_TOP 100
+struct dir_top {
+  struct dir *d;
+  char *rel; /* path below d, NULL if the item is d itself */
+  int64_t size, asize;
+};
+
+/* Gives the up to DIR_TOP largest files, or directories if dirs is set,
+ * ordered by disk usage. The list is valid until the tree changes. */
+int dir_mem_top(int dirs, const struct dir_top **list);
+
+/* The full path of an item of dir_mem_top(), valid until the next call */
+const char *dir_mem_top_path(const struct dir_top *);
+
+/* Looks up the node of an item of dir_mem_top(), reading the cached
+ * directories on its way. Returns NULL if it's not in the tree anymore. */
+struct dir *dir_mem_top_find(const struct dir_top *);
+
+/* Called by freedir() before dr is removed, and with its parent after its
+ * sizes have been subtracted */
+void dir_mem_top_forget(struct dir *dr);
+void dir_mem_top_fix(struct dir *parent);
+
+/* The lists are saved as <cache>.top after every scan and when indu exits,
+ * so that the items of cached directories are known without reading them on
+ * the next run. dir_mem_top_load() must be called right after
+ * dir_cache_load(). */
+void dir_mem_top_load(void);
+void dir_mem_top_save(void);
+
+/* Rollups of a directory: the sizes of the items below it that aren't
+ * directories, added up by owner and by file name extension. Hard links are
+ * counted for every link. */
+#define ROLLUP_UID 0
+#define ROLLUP_EXT 1
+#define ROLLUP_EXTLEN 15 /* longer extensions count as none */
+struct dir_rollup_row {
+  int64_t uid;  /* ROLLUP_UID: -1 if unknown */
+  char *ext;    /* ROLLUP_EXT: without the dot, "" if none */
+  int64_t size, asize;
+  uint64_t items;
+};
+struct dir_rollup {
+  struct dir_rollup_row *rows[2];
+  int n[2], size[2];
+  void *hash[2];
+};
+void dir_rollup_init(struct dir_rollup *);
+void dir_rollup_add(struct dir_rollup *, const char *name, int64_t uid, int64_t size, int64_t asize);
+/* Orders the rows by disk usage, the rollup can't be added to anymore */
+void dir_rollup_sort(struct dir_rollup *);
+void dir_rollup_free(struct dir_rollup *);
+
+/* Fills the rollups of d, which must be empty, from the tree, and for
+ * FF_CACHED stubs from the spill file or the cache entries without reading
+ * them into the tree. Returns -1 if the contents of a stub weren't available,
+ * in which case those are missing. */
+int dir_mem_rollup(struct dir *d, struct dir_rollup *);
+
+/* Hard links for the outputs that add up the sizes of directories while the
+ * items come in. They are counted the way dir_mem.c does: once in every
+ * directory that contains at least one link to the inode. Every directory
+ * that is opened gets the next serial from dir_hlinks_open(), and
+ * dir_hlinks_link() returns the serial at the previous link to the same
+ * inode, or 0 for the first one. The directories that are still open with a
+ * serial up to that one contain the previous link, and have counted the
+ * inode already. */
+struct dir_hlinks {
+  void *hash;
+  uint64_t serial;
+};
+void dir_hlinks_init(struct dir_hlinks *);
+uint64_t dir_hlinks_open(struct dir_hlinks *);
+uint64_t dir_hlinks_link(struct dir_hlinks *, const struct dir_link *);
+void dir_hlinks_free(struct dir_hlinks *);
+
+/* Initializes the SCAN state and dir_output for exporting to a file. The
+ * export is compressed with zstd if dir_export_compress is set, and written
+ * in the format of dir_export_format (set via --export-format option). */
+#define EXPORT_FORMAT_JSON   0
+#define EXPORT_FORMAT_BINARY 1
+extern int dir_export_format;
+extern int dir_export_compress;
 int dir_export_init(const char *fn);
 
 
+/* Initializes the SCAN state and dir_output for printing a summary of the
+ * scan to stdout: the totals and the dir_summary_top largest directories and
+ * files, in the format of dir_summary_format (set via --summary option), and
+ * the rollups of the root if dir_summary_rollups is set (set via
+ * --summary-rollups option). */
+#define SUMMARY_FORMAT_JSON 0
+#define SUMMARY_FORMAT_CSV  1
+extern int dir_summary_format;
+extern int dir_summary_top;
+extern int dir_summary_rollups;
+void dir_summary_init(void);
+
+/* Prints a string as a JSON string or CSV field, for dir_summary_format */
+void dir_summary_string(const char *str);
+
+
+/* Compares two caches or exports and prints the directories whose totals
+ * differ, by how much they grew, in the format of dir_summary_format.
+ * Returns the exit code. */
+int dir_diff(const char *oldfn, const char *newfn);
+
+
+/* Binary export format, written in a single pass so it can go to a pipe:
+ *
+ *   header   struct export_header
+ *   records  a struct export_record for every item, in the order of the
+ *            dir_output.item() calls, followed by its zero-terminated name
+ *            padded to a multiple of 8 bytes; a record with namelen 0 ends
+ *            the list
+ *   top      ntop x struct export_top for the largest directories below the
+ *            root, by disk usage and largest first
+ *   footer   struct export_footer, the last bytes of the file
+ *
+ * A record refers to the directory it is in by the offset of its record, the
+ * root has parent 0, so the path of any record can be found without reading
+ * the rest of the file. Totals are the sizes of a directory and everything
+ * below it, counting hard links every time like the cache does. Numbers are
+ * stored in native byte order.
+ */
+
+#define EXPORT_MAGIC "INDUEXPT"
+#define EXPORT_VERSION 1
+#define EXPORT_BYTEORDER 0x01020304
+
+/* Number of directories listed in the footer */
+#define EXPORT_TOP 1000
+
+struct export_header {
+  char magic[8];
+  uint32_t version, byteorder;
+  uint64_t timestamp;
+};
+
+struct export_record {
+  uint32_t namelen;
+  uint16_t flags;     /* FF_* as passed to dir_output.item() */
+  uint8_t extflags;   /* FFE_*, 0 if there is no extended information */
+  uint8_t pad;
+  uint64_t parent;
+  int64_t size, asize;
+  uint64_t ino, dev, mtime;
+  uint32_t uid, gid, nlink;
+  uint16_t mode, pad2;
+};
+
+struct export_top {
+  uint64_t offset;    /* of the record of the directory */
+  int64_t size, asize;
+  uint64_t items;
+};
+
+struct export_footer {
+  int64_t size, asize; /* totals of the root */
+  uint64_t items;
+  uint64_t ntop, top;  /* number and offset of the top directories */
+  char magic[8];
+};
+
+
 /* Function set by input code. Returns dir_output.final(). */
 extern int (*dir_process)(void);
 
 /* Scanning a live directory */
 extern int dir_scan_smfs;
 extern int exclude_kernfs;
+extern int dir_scan_validate;
+extern int dir_scan_threads;
+extern int dir_scan_uring;
 void dir_scan_init(const char *path);
 
+/* Whether the cached directories that the last scan trusted under
+ * --cache-trust are being checked for changes in the background: 1 while
+ * the check runs, 2 once it is done and dir_scan_verified() hasn't been
+ * called yet */
+int dir_scan_verifying(void);
+
+/* Applies the results of the background check to the cache and saves it.
+ * Returns the number of directories that had changed, or -1 if the check
+ * isn't done or there was none. */
+int dir_scan_verified(void);
+
 /* Importing a file */
 extern int dir_import_active;
 int dir_import_init(const char *fn);
 
+/* Answers a query ("totals" or "top=N") from the footer of a binary export
+ * and prints the result. Returns the exit code. */
+int dir_import_query(const char *fn, const char *query);
+
 
 /* The currently configured output functions. */
 extern struct dir_output dir_output;
@@ -136,4 +360,20 @@ extern int dir_ui;
 int dir_key(int);
 void dir_draw(void);
 
+/* Scan feedback. Between dir_progress_start() and dir_progress_stop(), the
+ * screen and keyboard belong to a thread that redraws the progress every
+ * update_delay ms, so the input code doesn't touch the terminal. It calls
+ * dir_progress() for every item instead, which hands the current path and
+ * the totals to that thread when it asks for them and returns non-zero once
+ * the user aborted. The error screen, if any, is shown after stopping. */
+void dir_progress_start(void);
+int dir_progress(void);
+void dir_progress_stop(void);
+
+/* Pressing 'b' in the progress screen shows the tree from
+ * dir_output.partial() in the browser, with the scan waiting in
+ * dir_progress() whenever the browser looks at it. When the scan ends while
+ * doing so, this is the directory that was open. */
+extern struct dir *dir_browsed;
+
 #endif
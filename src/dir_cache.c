@@ -29,6 +29,7 @@
 #include "dir_cache_lock.h"
 #include "dir.h"
 #include "util.h"
+#include "stats.h"
 
 #include <khashl.h>
 
@@ -40,7 +41,9 @@
 #include <time.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 /* Maximum length for JSON string values */
 #define MAX_VAL (32*1024)
@@ -48,9 +51,45 @@
 /* Read buffer size for JSON parsing */
 #define READ_BUF_SIZE (64*1024)
 
+/* Number of entries that a background load adds to the hash table at once */
+#define LOAD_BATCH 256
+
+/* Minimum number of buffered bytes before a token is parsed, so that numbers,
+ * literals and escapes never straddle the end of the read buffer */
+#define PARSE_LOOKAHEAD 64
+
 /* Global cache file path */
 char *cache_file = NULL;
 
+/* Format used when saving the cache */
+int cache_format = CACHE_FORMAT_BINARY;
+
+/* Whether updates are appended to the journal */
+int cache_journal = 0;
+
+/* Whether unchanged cached directories are kept as stubs */
+int cache_lazy = 1;
+
+/* Whether every device gets a cache file of its own */
+int cache_shards = 0;
+
+/* Trust windows by path prefix, see dir_cache_trust_set() */
+struct cache_trust {
+  char *path;
+  size_t len;
+  uint64_t secs;
+};
+static struct cache_trust *trusts = NULL;
+static int ntrusts;
+static uint64_t trust_default;
+
+/* cache_file after dir_cache_close(), for dir_cache_reopen() */
+static char *closed_file = NULL;
+
+/* Root of the current scan, see dir_cache_scope() */
+static char *cache_scope = NULL;
+static size_t cache_scope_len;
+
 /* Hash function for string keys - wrapper for khashl */
 static khint_t cache_hash_str(const char *s) {
   return kh_hash_str(s);
@@ -67,51 +106,115 @@ KHASHL_MAP_INIT(KH_LOCAL, cache_ht_t, cache_ht, const char *, struct cache_entry
 /* Static hash table instance */
 static cache_ht_t *cache_table = NULL;
 
-/* Linked list of all cache entries for cleanup */
-struct cache_entry_node {
-  struct cache_entry *entry;
-  struct cache_entry_node *next;
+/* A mapped binary cache file, see below */
+struct cache_map {
+  void *base;
+  size_t size;
+  uint64_t nentries, nchildren, strsize, nbuckets;
+  const struct cache_file_entry *entries;
+  const struct cache_file_child *children;
+  const char *strings;
+  const uint32_t *index;
+  uint8_t *intable;      /* A bit per entry that is set once its path is in
+                            the hash table, so that it needn't be looked up */
+};
+
+#define map_intable(m, i)     ((m)->intable[(i)/8] & (1 << (i)%8))
+#define map_set_intable(m, i) ((m)->intable[(i)/8] |= 1 << (i)%8)
+
+/* The cache file as it was loaded, and the length of the valid part of its
+ * journal */
+struct journal_base {
+  int ok;
+  struct stat st;
+  uint64_t len;
+};
+
+/* A JSON cache file that is being parsed in the background, see shard_load().
+ * Entries are saved in the order of their paths, so a directory that hasn't
+ * been found once upto has passed its path isn't in the file. */
+struct cache_load {
+  pthread_t thread;
+  struct cache_shard *shard;
+  struct parse_ctx *ctx;
+  FILE *f;
+  struct arena arena;    /* holds the parsed entries, the thread can't use cache_arena */
+  const char *upto;      /* path of the last entry added so far, NULL before the first */
+  const char *want;      /* first path that a lookup is waiting for, NULL if none */
+  int ordered;           /* whether the paths so far came in order */
+  int done, stop;
+};
+
+/* A cache file with its journal and lock. Normally there is a single shard
+ * for everything. With --cache-shards, every device has its own file next to
+ * cache_file, which is loaded when the scan first gets to that device and
+ * saved under its own lock, so scans of different devices don't get in each
+ * other's way. */
+struct cache_shard {
+  uint64_t dev;
+  char *file, *journal_file;
+  struct cache_lock lock;
+  struct cache_map map;
+  struct journal_base journal_base;
+  int changed;           /* Has entries stored or dropped in this run */
+  struct cache_load *load; /* NULL if not loaded in the background */
 };
-static struct cache_entry_node *entry_list = NULL;
+
+static struct cache_shard **shards = NULL;
+static int nshards = 0;
+
+/* Protects cache_table, cache_arena and the used flags during a
+ * multi-threaded scan and while cache files are loaded in the background */
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Signalled when a background load has added entries */
+static pthread_cond_t cache_loaded = PTHREAD_COND_INITIALIZER;
+
+static void load_wait(const char *path, struct cache_shard *shard);
+
+/* Holds all entries along with their paths, children and names. Nothing is
+ * freed individually, replaced entries stay around until dir_cache_destroy() */
+static struct arena cache_arena;
 
 
 /* ============================================================================
  * Helper functions for memory management
  * ============================================================================ */
 
-/* Free a cache_child structure and all its nested children recursively */
+/* Free the nested children arrays of a parsed cache_child recursively, the
+ * names are in cache_arena */
 static void free_cache_child(struct cache_child *child) {
   int i;
   if (!child)
     return;
-  if (child->name)
-    free(child->name);
   for (i = 0; i < child->nchildren; i++)
     free_cache_child(&child->children[i]);
   if (child->children)
     free(child->children);
 }
 
-/* Free a cache_entry structure */
-static void free_cache_entry(struct cache_entry *entry) {
-  int i;
-  if (!entry)
-    return;
-  if (entry->path)
-    free(entry->path);
-  for (i = 0; i < entry->nchildren; i++)
-    free_cache_child(&entry->children[i]);
-  if (entry->children)
-    free(entry->children);
-  free(entry);
+static struct cache_entry *cache_entry_new(void) {
+  struct cache_entry *entry = arena_alloc(&cache_arena, sizeof(struct cache_entry));
+  memset(entry, 0, sizeof(*entry));
+  return entry;
+}
+
+static struct cache_child *cache_children_new(int n) {
+  struct cache_child *c = arena_alloc(&cache_arena, n * sizeof(struct cache_child));
+  memset(c, 0, n * sizeof(struct cache_child));
+  return c;
 }
 
-/* Add entry to the tracking list */
-static void add_to_entry_list(struct cache_entry *entry) {
-  struct cache_entry_node *node = xmalloc(sizeof(struct cache_entry_node));
-  node->entry = entry;
-  node->next = entry_list;
-  entry_list = node;
+/* Returns the shard that entries on dev are saved to, NULL if it hasn't
+ * been loaded */
+static struct cache_shard *shard_find(uint64_t dev) {
+  int i;
+  if (!cache_shards)
+    return nshards ? shards[0] : NULL;
+  for (i = 0; i < nshards; i++)
+    if (shards[i]->dev == dev)
+      return shards[i];
+  return NULL;
 }
 
 
@@ -119,9 +222,18 @@ static void add_to_entry_list(struct cache_entry *entry) {
  * JSON Output helpers (for saving cache)
  * ============================================================================ */
 
-/* Output a JSON-escaped string to file */
+/* Output a JSON-escaped string to file, the parts without anything to escape
+ * in a single fwrite() */
 static void output_string(FILE *f, const char *str) {
-  for (; *str; str++) {
+  size_t len = strlen(str), n;
+
+  while (1) {
+    n = json_plain(str, len);
+    fwrite(str, 1, n, f);
+    str += n;
+    len -= n;
+    if (!len)
+      break;
     switch (*str) {
     case '\n': fputs("\\n", f); break;
     case '\r': fputs("\\r", f); break;
@@ -131,12 +243,11 @@ static void output_string(FILE *f, const char *str) {
     case '\\': fputs("\\\\", f); break;
     case '"':  fputs("\\\"", f); break;
     default:
-      if ((unsigned char)*str <= 31 || (unsigned char)*str == 127)
-        fprintf(f, "\\u00%02x", (unsigned char)*str);
-      else
-        fputc(*str, f);
+      fprintf(f, "\\u00%02x", (unsigned char)*str);
       break;
     }
+    str++;
+    len--;
   }
 }
 
@@ -170,7 +281,7 @@ static void output_int64(FILE *f, int64_t n) {
 }
 
 /* Write a cache_child to JSON output */
-static void write_cache_child(FILE *f, struct cache_child *child) {
+static void write_cache_child(FILE *f, const struct cache_child *child) {
   int i;
   int first_field = 1;
 
@@ -282,6 +393,8 @@ struct parse_ctx {
   char *end;
   int line;
   int eof;
+  struct arena *arena; /* for the names of the parsed items */
+  uint64_t verified;   /* of the last parsed item that had it */
   char val[MAX_VAL];
 };
 
@@ -309,6 +422,7 @@ static int parse_fill(struct parse_ctx *ctx) {
 
   ctx->end += nread;
   *ctx->end = '\0';
+  stats_add(STATS_LOAD_BYTES, nread);
 
   return 0;
 }
@@ -316,12 +430,12 @@ static int parse_fill(struct parse_ctx *ctx) {
 /* Skip whitespace */
 static int parse_skip_ws(struct parse_ctx *ctx) {
   while (1) {
-    if (ctx->pos >= ctx->end) {
+    if (ctx->end - ctx->pos < PARSE_LOOKAHEAD && !ctx->eof) {
       if (parse_fill(ctx) < 0)
         return -1;
-      if (ctx->pos >= ctx->end)
-        return 0;
     }
+    if (ctx->pos >= ctx->end)
+      return 0;
 
     switch (*ctx->pos) {
     case ' ':
@@ -360,6 +474,7 @@ static char parse_peek(struct parse_ctx *ctx) {
 
 /* Parse a JSON string into dest (max destlen bytes) */
 static int parse_string(struct parse_ctx *ctx, char *dest, int destlen) {
+  size_t n, c;
   int len = 0;
 
   if (parse_expect(ctx, '"') < 0)
@@ -373,6 +488,17 @@ static int parse_string(struct parse_ctx *ctx, char *dest, int destlen) {
         return -1; /* Unexpected EOF */
     }
 
+    /* Runs of plain characters are copied at once */
+    if ((n = json_plain(ctx->pos, ctx->end - ctx->pos)) > 0) {
+      if (dest && len < destlen - 1) {
+        c = n < (size_t)(destlen - 1 - len) ? n : (size_t)(destlen - 1 - len);
+        memcpy(dest + len, ctx->pos, c);
+        len += c;
+      }
+      ctx->pos += n;
+      continue;
+    }
+
     if (*ctx->pos == '"') {
       ctx->pos++;
       if (dest && len < destlen)
@@ -401,6 +527,8 @@ static int parse_string(struct parse_ctx *ctx, char *dest, int destlen) {
       case 't': c = '\t'; break;
       case 'u':
         /* Skip unicode escapes - just read 4 hex digits */
+        if (ctx->end - ctx->pos < 5 && parse_fill(ctx) < 0)
+          return -1;
         ctx->pos++;
         for (int i = 0; i < 4 && ctx->pos < ctx->end; i++)
           ctx->pos++;
@@ -596,7 +724,7 @@ static int parse_item_info(struct parse_ctx *ctx, struct cache_child *child, uin
       char name[MAX_VAL];
       if (parse_string(ctx, name, MAX_VAL) < 0)
         return -1;
-      child->name = xstrdup(name);
+      child->name = arena_strdup(ctx->arena, name);
     }
     else if (strcmp(ctx->val, "asize") == 0) {
       if (parse_int64(ctx, &iv) < 0)
@@ -674,6 +802,10 @@ static int parse_item_info(struct parse_ctx *ctx, struct cache_child *child, uin
       else
         child->flags |= FF_EXL;
     }
+    else if (strcmp(ctx->val, "verified") == 0) {
+      if (parse_uint64(ctx, &ctx->verified) < 0)
+        return -1;
+    }
     else if (strcmp(ctx->val, "notreg") == 0) {
       if (parse_peek(ctx) == 't') {
         ctx->pos += 4;
@@ -750,8 +882,10 @@ static int parse_item(struct parse_ctx *ctx, struct cache_child *child, uint64_t
       }
 
       /* Parse child item */
-      if (parse_item(ctx, &children[nchildren], dev) < 0)
+      if (parse_item(ctx, &children[nchildren], dev) < 0) {
+        free_cache_child(&children[nchildren]);
         goto err;
+      }
       nchildren++;
     }
 
@@ -769,465 +903,1695 @@ err:
   return -1;
 }
 
-/* Build cache entry from a parsed cache_child (only creates entry for this directory,
- * does NOT recursively process children - they have their own standalone entries in the cache) */
-static void build_cache_entries(struct cache_child *child, const char *parent_path) {
-  char *full_path;
+/* Builds the cache entry of a parsed directory in arena, returns NULL if the
+ * item isn't one. Only the entry of this directory is created; nested
+ * directories have standalone entries of their own in the cache file, the
+ * children stored here are shallow copies without their contents. */
+static struct cache_entry *build_cache_entry(struct cache_child *child, struct arena *arena) {
   struct cache_entry *entry;
-  int absent;
-  khint_t k;
   int i;
 
-  if (!child || !child->name)
-    return;
-
-  /* Build full path */
-  if (parent_path && parent_path[0]) {
-    size_t plen = strlen(parent_path);
-    size_t nlen = strlen(child->name);
-    full_path = xmalloc(plen + 1 + nlen + 1);
-    strcpy(full_path, parent_path);
-    if (parent_path[plen - 1] != '/')
-      strcat(full_path, "/");
-    strcat(full_path, child->name);
-  } else {
-    full_path = xstrdup(child->name);
-  }
-
-  /* Only create cache entries for directories */
-  if (child->flags & FF_DIR) {
-    entry = xcalloc(1, sizeof(struct cache_entry));
-    entry->path = full_path;
-    entry->mtime = child->mtime;
-    entry->dev = child->dev;
-    entry->ino = child->ino;
-    entry->size = child->size;
-    entry->asize = child->asize;
-    entry->items = child->nchildren;
-    entry->used = 0;
-
-    /* Copy children for replay */
-    if (child->nchildren > 0) {
-      entry->children = xcalloc(child->nchildren, sizeof(struct cache_child));
-      entry->nchildren = child->nchildren;
-      for (i = 0; i < child->nchildren; i++) {
-        /* Deep copy children */
-        struct cache_child *src = &child->children[i];
-        struct cache_child *dst = &entry->children[i];
-        dst->name = src->name ? xstrdup(src->name) : NULL;
-        dst->flags = src->flags;
-        dst->size = src->size;
-        dst->asize = src->asize;
-        dst->ino = src->ino;
-        dst->dev = src->dev;
-        dst->mtime = src->mtime;
-        dst->uid = src->uid;
-        dst->gid = src->gid;
-        dst->nlink = src->nlink;
-        dst->mode = src->mode;
-        /* Don't copy nested children here - they have their own standalone entries */
-        dst->children = NULL;
-        dst->nchildren = 0;
-      }
-    }
+  /* Only create cache entries for directories, named by their full path */
+  if (!child || !child->name || !(child->flags & FF_DIR))
+    return NULL;
 
-    /* Add to hash table */
-    k = cache_ht_put(cache_table, entry->path, &absent);
-    if (absent) {
-      kh_val(cache_table, k) = entry;
-      add_to_entry_list(entry);
-    } else {
-      /* Entry already exists, free this one */
-      free_cache_entry(entry);
+  entry = arena_alloc(arena, sizeof(struct cache_entry));
+  memset(entry, 0, sizeof(*entry));
+  entry->path = child->name;
+  entry->mtime = child->mtime;
+  entry->dev = child->dev;
+  entry->ino = child->ino;
+  entry->size = child->size;
+  entry->asize = child->asize;
+  entry->items = child->nchildren;
+  entry->used = 0;
+
+  /* Copy children for replay, the names are already in the arena */
+  if (child->nchildren > 0) {
+    entry->children = arena_alloc(arena, child->nchildren * sizeof(struct cache_child));
+    entry->nchildren = child->nchildren;
+    for (i = 0; i < child->nchildren; i++) {
+      struct cache_child *src = &child->children[i];
+      struct cache_child *dst = &entry->children[i];
+      dst->name = src->name;
+      dst->flags = src->flags;
+      dst->size = src->size;
+      dst->asize = src->asize;
+      dst->ino = src->ino;
+      dst->dev = src->dev;
+      dst->mtime = src->mtime;
+      dst->uid = src->uid;
+      dst->gid = src->gid;
+      dst->nlink = src->nlink;
+      dst->mode = src->mode;
+      dst->children = NULL;
+      dst->nchildren = 0;
     }
-
-    /* NOTE: Do NOT recursively process child directories here!
-     * Child directories have their own standalone entries in the cache file
-     * with full children data. If we recursively create entries from parents,
-     * we'd create entries with 0 children (since parents store shallow copies),
-     * which would then block the correct entry from being added later. */
-  } else {
-    free(full_path);
   }
+  return entry;
 }
 
 
 /* ============================================================================
- * Public API Implementation
- * ============================================================================ */
+ * Binary cache format
+ * ============================================================================
+ *
+ * The binary cache is mapped into memory as-is, so loading it doesn't
+ * allocate anything per entry. Layout, all sections 8-byte aligned:
+ *
+ *   header
+ *   entries    nentries x struct cache_file_entry, one per directory
+ *   children   nchildren x struct cache_file_child, the children of an entry
+ *              are stored consecutively starting at its firstchild. A child
+ *              that is a directory with an entry of its own refers to it by
+ *              entry number + 1 in sub, so that a subtree can be followed
+ *              without looking up any paths.
+ *   strings    nul-terminated paths and names, referenced by offset
+ *   index      nbuckets x uint32_t, open addressing on the path hash with
+ *              linear probing; each bucket holds an entry number + 1, or 0
+ *
+ * Numbers are stored in native byte order; a cache written on a machine of
+ * different endianness is ignored and rebuilt.
+ */
+
+#define CACHE_VERSION 2
+#define CACHE_BYTEORDER 0x01020304
+
+struct cache_file_header {
+  char magic[8];
+  uint32_t version, byteorder;
+  uint64_t timestamp;
+  uint64_t nentries, nchildren, strsize, nbuckets;
+  uint64_t entries, children, strings, index; /* section offsets */
+};
 
-/* Initialize cache system with given filename */
-void dir_cache_init(const char *fn) {
-  char *new_cache_file = xstrdup(fn);  /* Copy first to avoid use-after-free if fn == cache_file */
-  if (cache_file)
-    free(cache_file);
-  cache_file = new_cache_file;
+struct cache_file_entry {
+  uint64_t hash, path;
+  uint64_t mtime, dev, ino;
+  int64_t size, asize;
+  uint64_t firstchild;
+  uint32_t nchildren, verified;
+};
+
+struct cache_file_child {
+  uint64_t name;
+  int64_t size, asize;
+  uint64_t ino, dev, mtime;
+  uint32_t uid, gid, nlink;
+  uint16_t flags, mode;
+  uint32_t sub, pad;
+};
 
-  if (cache_table)
-    cache_ht_destroy(cache_table);
-  cache_table = cache_ht_init();
 
-  /* Initialize the lock subsystem */
-  cache_lock_init(cache_file);
+/* FNV-1a, stored in the file so it must never change */
+static uint64_t cache_path_hash(const char *s) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (; *s; s++) {
+    h ^= (unsigned char)*s;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
 }
 
 
-/* Load cache from file */
-int dir_cache_load(void) {
-  struct parse_ctx ctx;
-  struct cache_child item;
-  int64_t major, minor;
-  FILE *f;
-  int ret = 0;
-  char c;
+static int map_section_ok(const struct cache_map *m, uint64_t off, uint64_t n, size_t size) {
+  return off % 8 == 0 && off <= m->size && n <= (m->size - off) / size;
+}
 
-  if (!cache_file)
-    return -1;
 
-  /* Acquire shared lock for reading (5 second timeout) */
-  if (cache_lock_acquire(CACHE_LOCK_SHARED, 5) < 0) {
-    /* Could not acquire lock - proceed without cache */
-    return 0;
-  }
+/* Maps a binary cache file, returns -1 if it's not a valid cache */
+static int map_load(struct cache_map *m, int fd) {
+  const struct cache_file_header *h;
+  struct stat st;
+  void *base;
 
-  f = fopen(cache_file, "r");
-  if (!f) {
-    cache_lock_release();
-    /* Missing cache file is not an error - just means no cache */
-    if (errno == ENOENT)
-      return 0;
+  if (fstat(fd, &st) < 0 || (uint64_t)st.st_size < sizeof(struct cache_file_header))
     return -1;
-  }
-
-  memset(&ctx, 0, sizeof(ctx));
-  ctx.f = f;
-  ctx.buf = xmalloc(READ_BUF_SIZE);
-  ctx.pos = ctx.buf;
-  ctx.end = ctx.buf;
-  ctx.line = 1;
-  ctx.eof = 0;
-
-  /* Parse header: [1,2,{...}, */
-  if (parse_expect(&ctx, '[') < 0)
+  base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED)
+    return -1;
+  m->base = base;
+  m->size = st.st_size;
+
+  h = base;
+  if (memcmp(h->magic, CACHE_MAGIC, 8) != 0 || h->version != CACHE_VERSION ||
+      h->byteorder != CACHE_BYTEORDER || h->nbuckets <= h->nentries ||
+      h->nentries >= UINT32_MAX ||
+      !map_section_ok(m, h->entries, h->nentries, sizeof(struct cache_file_entry)) ||
+      !map_section_ok(m, h->children, h->nchildren, sizeof(struct cache_file_child)) ||
+      !map_section_ok(m, h->strings, h->strsize, 1) || h->strsize == 0 ||
+      !map_section_ok(m, h->index, h->nbuckets, sizeof(uint32_t)))
     goto err;
 
-  /* Major version */
-  if (parse_int64(&ctx, &major) < 0 || major != 1)
-    goto err;
-  if (parse_expect(&ctx, ',') < 0)
+  m->nentries = h->nentries;
+  m->nchildren = h->nchildren;
+  m->strsize = h->strsize;
+  m->nbuckets = h->nbuckets;
+  m->entries = (const void *)((const char *)base + h->entries);
+  m->children = (const void *)((const char *)base + h->children);
+  m->strings = (const char *)base + h->strings;
+  m->index = (const void *)((const char *)base + h->index);
+
+  /* All offsets into the string pool are checked against strsize, so this
+   * guarantees that every string is terminated */
+  if (m->strings[m->strsize-1] != 0)
     goto err;
+  m->intable = xcalloc(m->nentries/8 + 1, 1);
+  stats_add(STATS_LOAD_BYTES, m->size);
+  stats_add(STATS_LOAD_ENTRIES, m->nentries);
+  return 0;
 
-  /* Minor version */
-  if (parse_int64(&ctx, &minor) < 0)
-    goto err;
-  if (parse_expect(&ctx, ',') < 0)
-    goto err;
+err:
+  munmap(base, st.st_size);
+  memset(m, 0, sizeof(*m));
+  return -1;
+}
 
-  /* Skip metadata object */
-  if (parse_skip_object(&ctx) < 0)
-    goto err;
 
-  /* Parse all directory entries in the root array */
-  while (1) {
-    c = parse_peek(&ctx);
-    if (c == ']') {
-      /* End of root array */
-      ctx.pos++;
-      break;
-    }
-    if (c != ',')
-      goto err;
-    ctx.pos++;
+static void map_unload(struct cache_map *m) {
+  if (m->base)
+    munmap(m->base, m->size);
+  free(m->intable);
+  memset(m, 0, sizeof(*m));
+}
 
-    /* Parse this directory entry */
-    memset(&item, 0, sizeof(item));
-    if (parse_item(&ctx, &item, 0) < 0) {
-      free_cache_child(&item);
-      goto err;
-    }
 
-    /* Build cache entries from the parsed item */
-    build_cache_entries(&item, "");
+/* Returns the number of the entry for path, or -1 */
+static int64_t map_find(const struct cache_map *m, const char *path) {
+  const struct cache_file_entry *r;
+  uint64_t h, b, n;
+  uint32_t i;
 
-    /* Clean up parsed item (entries have been copied) */
-    free_cache_child(&item);
-  }
+  if (!m->base)
+    return -1;
 
-  goto cleanup;
+  h = cache_path_hash(path);
+  b = h % m->nbuckets;
+  for (n = 0; n < m->nbuckets && (i = m->index[b]) != 0; n++) {
+    if (i <= m->nentries) {
+      r = &m->entries[i-1];
+      if (r->hash == h && r->path < m->strsize && strcmp(m->strings + r->path, path) == 0)
+        return i-1;
+    }
+    b = b+1 == m->nbuckets ? 0 : b+1;
+  }
+  return -1;
+}
 
-err:
-  ret = -1;
 
-cleanup:
-  free(ctx.buf);
-  fclose(f);
-  cache_lock_release();
-  return ret;
+/* Fills dst from a mapped child record, the name points into the mapping */
+static void map_child(const struct cache_map *m, const struct cache_file_child *c, struct cache_child *dst) {
+  memset(dst, 0, sizeof(*dst));
+  dst->name = (char *)m->strings + c->name;
+  dst->flags = c->flags;
+  dst->size = c->size;
+  dst->asize = c->asize;
+  dst->ino = c->ino;
+  dst->dev = c->dev;
+  dst->mtime = c->mtime;
+  dst->uid = c->uid;
+  dst->gid = c->gid;
+  dst->nlink = c->nlink;
+  dst->mode = c->mode;
 }
 
 
-/* Look up cached entry by path, validating mtime/dev/ino */
-struct cache_entry *dir_cache_lookup(const char *path, uint64_t mtime, uint64_t dev, uint64_t ino) {
-  khint_t k;
-  struct cache_entry *entry;
+/* Creates a cache_entry for a mapped entry. The path points into the mapping,
+ * the children are read from the mapping as well until they are modified.
+ * Returns NULL if the entry is corrupt. */
+static int map_view_fill(struct cache_shard *shard, int64_t i, struct cache_entry *entry) {
+  const struct cache_map *m = &shard->map;
+  const struct cache_file_entry *r = &m->entries[i];
+  uint32_t j;
 
-  if (!cache_table || !path)
-    return NULL;
+  if (r->path >= m->strsize || r->firstchild > m->nchildren ||
+      r->nchildren > m->nchildren - r->firstchild)
+    return -1;
+  for (j = 0; j < r->nchildren; j++)
+    if (m->children[r->firstchild + j].name >= m->strsize)
+      return -1;
 
-  k = cache_ht_get(cache_table, path);
-  if (k >= kh_end(cache_table))
-    return NULL;
+  memset(entry, 0, sizeof(*entry));
+  entry->path = (char *)m->strings + r->path;
+  entry->shard = shard;
+  entry->mtime = r->mtime;
+  entry->dev = r->dev;
+  entry->ino = r->ino;
+  entry->size = r->size;
+  entry->asize = r->asize;
+  entry->items = r->nchildren;
+  entry->used = 1;
+  entry->nchildren = r->nchildren;
+  entry->mapfirst = r->firstchild;
+  entry->verified = r->verified;
+  return 0;
+}
 
-  entry = kh_val(cache_table, k);
-  if (!entry)
-    return NULL;
 
-  /* Validate the entry - all three must match */
-  if (entry->mtime != mtime || entry->dev != dev || entry->ino != ino)
+static struct cache_entry *map_view(struct cache_shard *shard, int64_t i) {
+  struct cache_entry view, *entry;
+
+  if (map_view_fill(shard, i, &view) < 0)
     return NULL;
+  entry = cache_entry_new();
+  *entry = view;
+  return entry;
+}
 
-  /* Mark as used */
-  entry->used = 1;
 
-  return entry;
+/* Returns child i of entry, see dir_cache_child() */
+static const struct cache_child *entry_child(const struct cache_entry *entry, int i, struct cache_child *tmp) {
+  if (entry->children)
+    return &entry->children[i];
+  map_child(&entry->shard->map, &entry->shard->map.children[entry->mapfirst + i], tmp);
+  return tmp;
 }
 
 
-/* Store a scanned directory in the cache with explicit children */
-void dir_cache_store(const char *path, struct dir *d, struct dir_ext *ext,
-                     struct cache_child *children, int nchildren) {
-  struct cache_entry *entry;
-  int i;
-  khint_t k;
-  int absent;
+/* Whether path is at or below the directory of length len at dir */
+static int path_in(const char *path, const char *dir, size_t len) {
+  return strncmp(path, dir, len) == 0 && (path[len] == '/' || path[len] == 0);
+}
 
-  if (!cache_table || !path || !d)
-    return;
 
-  /* Create new entry */
-  entry = xcalloc(1, sizeof(struct cache_entry));
-  entry->path = xstrdup(path);
-  entry->mtime = ext && (ext->flags & FFE_MTIME) ? ext->mtime : 0;
-  entry->dev = d->dev;
-  entry->ino = d->ino;
-  entry->size = d->size;
-  entry->asize = d->asize;
-  entry->items = d->items;
-  entry->used = 1; /* Mark as used immediately */
+/* Whether path is at or below the root of the current scan */
+static int in_scope(const char *path) {
+  return !cache_scope || path_in(path, cache_scope, cache_scope_len);
+}
 
-  /* Store children (deep copy) */
-  if (nchildren > 0 && children) {
-    entry->children = xcalloc(nchildren, sizeof(struct cache_child));
-    entry->nchildren = nchildren;
 
-    for (i = 0; i < nchildren; i++) {
-      struct cache_child *src = &children[i];
-      struct cache_child *dst = &entry->children[i];
+/* Drops the entries in the scope of the scan that it didn't get to, they
+ * belong to directories that are gone. Dropped entries remain in the hash
+ * table with a NULL value, so that the mapped file doesn't bring them back.
+ * Everything outside the scope is kept as it is. */
+static void cache_prune(void) {
+  struct cache_entry *entry;
+  struct cache_shard *shard;
+  const struct cache_map *m;
+  const char *path;
+  uint64_t i;
+  int absent, j;
+  khint_t k;
 
-      dst->name = src->name ? xstrdup(src->name) : NULL;
-      dst->flags = src->flags;
-      dst->size = src->size;
-      dst->asize = src->asize;
-      dst->ino = src->ino;
-      dst->dev = src->dev;
-      dst->mtime = src->mtime;
-      dst->uid = src->uid;
-      dst->gid = src->gid;
-      dst->mode = src->mode;
-      dst->nlink = src->nlink;
-      dst->children = NULL;
-      dst->nchildren = 0;
+  pthread_mutex_lock(&cache_mutex);
+  load_wait(NULL, NULL);
+  for (k = 0; k < kh_end(cache_table); k++) {
+    if (!__kh_used(cache_table->used, k) || (entry = kh_val(cache_table, k)) == NULL)
+      continue;
+    if (!entry->used && in_scope(entry->path)) {
+      kh_val(cache_table, k) = NULL;
+      entry->retired = 1;
+      if ((shard = shard_find(entry->dev)) != NULL)
+        shard->changed = 1;
     }
   }
-
-  /* Check if entry already exists */
-  k = cache_ht_get(cache_table, path);
-  if (k < kh_end(cache_table)) {
-    /* Replace existing entry */
-    struct cache_entry *old = kh_val(cache_table, k);
-    kh_val(cache_table, k) = entry;
-    /* Don't free old - it's still in entry_list and will be freed at destroy */
-    /* Mark old as unused so it won't be saved */
-    if (old)
-      old->used = 0;
-  } else {
-    /* Add new entry */
-    k = cache_ht_put(cache_table, entry->path, &absent);
-    kh_val(cache_table, k) = entry;
+  for (j = 0; j < nshards; j++) {
+    m = &shards[j]->map;
+    for (i = 0; i < m->nentries; i++) {
+      if (map_intable(m, i) || m->entries[i].path >= m->strsize)
+        continue;
+      path = m->strings + m->entries[i].path;
+      if (in_scope(path) && cache_ht_get(cache_table, path) == kh_end(cache_table)) {
+        k = cache_ht_put(cache_table, path, &absent);
+        kh_val(cache_table, k) = NULL;
+        map_set_intable(m, i);
+        shards[j]->changed = 1;
+      }
+    }
   }
-
-  add_to_entry_list(entry);
+  pthread_mutex_unlock(&cache_mutex);
 }
 
 
-/* Helper to recursively replay a cached subtree */
-static void dir_cache_replay_recursive(const char *parent_path, struct cache_child *child) {
-  struct dir d;
-  struct dir_ext ext;
-  char *child_path;
-  size_t parent_len, child_len;
+/* Iterates over all entries of a shard that are to be saved, after
+ * cache_prune(): the ones in the hash table, followed by the mapped entries
+ * that were never looked up, which are returned through a temporary view */
+struct save_iter {
+  struct cache_shard *shard;
   khint_t k;
-  struct cache_entry *subentry;
-
-  /* Set up dir struct */
-  memset(&d, 0, sizeof(d));
-  d.size = child->size;
-  d.asize = child->asize;
-  d.ino = child->ino;
-  d.dev = child->dev;
-  d.flags = child->flags;
-
-  /* Set up ext struct */
-  memset(&ext, 0, sizeof(ext));
-  if (child->mtime) {
-    ext.mtime = child->mtime;
-    ext.flags |= FFE_MTIME;
-    d.flags |= FF_EXT;
-  }
-  if (child->uid) {
-    ext.uid = child->uid;
-    ext.flags |= FFE_UID;
-    d.flags |= FF_EXT;
-  }
-  if (child->gid) {
-    ext.gid = child->gid;
-    ext.flags |= FFE_GID;
-    d.flags |= FF_EXT;
-  }
-  if (child->mode) {
-    ext.mode = child->mode;
-    ext.flags |= FFE_MODE;
-    d.flags |= FF_EXT;
-  }
-
-  /* Call the output callback */
-  dir_output.item(&d, child->name, &ext, child->nlink);
-
-  /* For directories, recursively replay children */
-  if (child->flags & FF_DIR) {
-    /* Build full path for this child directory */
-    parent_len = strlen(parent_path);
-    child_len = strlen(child->name);
-    child_path = xmalloc(parent_len + 1 + child_len + 1);
-    strcpy(child_path, parent_path);
-    if (parent_len > 0 && parent_path[parent_len - 1] != '/')
-      strcat(child_path, "/");
-    strcat(child_path, child->name);
-
-    /* Look up cached entry for this subdirectory */
-    if (cache_table) {
-      k = cache_ht_get(cache_table, child_path);
-      if (k < kh_end(cache_table)) {
-        subentry = kh_val(cache_table, k);
-        if (subentry) {
-          int i;
-          /* Mark as used */
-          subentry->used = 1;
-          /* Recursively replay children of this subdirectory */
-          for (i = 0; i < subentry->nchildren; i++) {
-            dir_cache_replay_recursive(child_path, &subentry->children[i]);
-          }
-        }
-      }
-    }
+  uint64_t m;
+  struct cache_entry view;
+};
+
+static void save_iter_init(struct save_iter *it, struct cache_shard *shard) {
+  it->shard = shard;
+  it->k = 0;
+  it->m = 0;
+}
 
-    free(child_path);
+static struct cache_entry *save_next(struct save_iter *it) {
+  struct cache_entry *entry;
 
-    /* Close the directory */
-    dir_output.item(NULL, NULL, NULL, 0);
+  for (; it->k < kh_end(cache_table); it->k++) {
+    if (!__kh_used(cache_table->used, it->k))
+      continue;
+    if ((entry = kh_val(cache_table, it->k)) != NULL && shard_find(entry->dev) == it->shard) {
+      it->k++;
+      return entry;
+    }
+  }
+  for (; it->m < it->shard->map.nentries; it->m++) {
+    if (!map_intable(&it->shard->map, it->m) && map_view_fill(it->shard, it->m, &it->view) == 0 &&
+        cache_ht_get(cache_table, it->view.path) == kh_end(cache_table)) {
+      it->m++;
+      return &it->view;
+    }
   }
+  return NULL;
 }
 
-/* Replay cached subtree to dir_output callbacks */
-void dir_cache_replay(struct cache_entry *entry) {
-  int i;
 
-  if (!entry)
-    return;
+/* Iterates over the entries of a shard stored during this run that haven't
+ * been saved yet, those are all in the hash table */
+static struct cache_entry *dirty_next(struct cache_shard *shard, khint_t *k) {
+  struct cache_entry *entry;
 
-  /* Replay each child recursively */
-  for (i = 0; i < entry->nchildren; i++) {
-    dir_cache_replay_recursive(entry->path, &entry->children[i]);
+  for (; *k < kh_end(cache_table); (*k)++) {
+    if (!__kh_used(cache_table->used, *k))
+      continue;
+    entry = kh_val(cache_table, *k);
+    if (entry && entry->dirty && shard_find(entry->dev) == shard) {
+      (*k)++;
+      return entry;
+    }
   }
+  return NULL;
 }
 
 
-/* Helper to fsync a directory by path */
-static int fsync_dir(const char *dirpath) {
-  int fd;
-  int ret;
+static void write_file_child(FILE *f, const struct cache_child *src, uint64_t name, uint32_t sub) {
+  struct cache_file_child c;
+  memset(&c, 0, sizeof(c));
+  c.name = name;
+  c.sub = sub;
+  c.size = src->size;
+  c.asize = src->asize;
+  c.ino = src->ino;
+  c.dev = src->dev;
+  c.mtime = src->mtime;
+  c.uid = src->uid;
+  c.gid = src->gid;
+  c.nlink = src->nlink;
+  c.flags = src->flags;
+  c.mode = src->mode;
+  fwrite(&c, sizeof(c), 1, f);
+}
 
-  fd = open(dirpath, O_RDONLY | O_DIRECTORY);
-  if (fd < 0)
-    return -1;
 
-  ret = fsync(fd);
-  close(fd);
-  return ret;
-}
+/* Returns the entry number + 1 of the directory at dir/name in a cache file
+ * that is being written, or 0 if it has no entry. path is a buffer of
+ * pathsize bytes for building the path. */
+static uint32_t write_find_sub(const char *dir, const char *name, char **path, size_t *pathsize,
+                               const uint32_t *index, uint64_t nbuckets, const uint64_t *hashes, const char **paths) {
+  size_t len = strlen(dir), need = len + strlen(name) + 2;
+  uint64_t hash, b, n;
+  uint32_t i;
 
-/* Save cache to file */
-void dir_cache_save(void) {
+  if (need > *pathsize) {
+    *pathsize = need * 2;
+    *path = xrealloc(*path, *pathsize);
+  }
+  memcpy(*path, dir, len);
+  if (len && dir[len-1] != '/')
+    (*path)[len++] = '/';
+  strcpy(*path + len, name);
+
+  hash = cache_path_hash(*path);
+  b = hash % nbuckets;
+  for (n = 0; n < nbuckets && (i = index[b]) != 0; n++) {
+    if (hashes[i-1] == hash && strcmp(paths[i-1], *path) == 0)
+      return i;
+    b = b+1 == nbuckets ? 0 : b+1;
+  }
+  return 0;
+}
+
+
+/* Writes all saved entries in the binary format */
+static void write_binary(FILE *f, struct cache_shard *shard) {
+  static const char pad[8];
+  struct cache_file_header h;
+  struct cache_file_entry r;
+  struct save_iter it;
+  struct cache_entry *entry;
+  const struct cache_child *child;
+  struct cache_child tmp;
+  uint64_t nentries = 0, nchildren = 0, strsize = 0, soff, coff, n, b, *hashes;
+  uint32_t *index;
+  const char **paths;
+  char *path = NULL;
+  size_t pathsize = 0;
+  int i;
+
+  save_iter_init(&it, shard);
+  while ((entry = save_next(&it)) != NULL) {
+    nentries++;
+    nchildren += entry->nchildren;
+    strsize += strlen(entry->path) + 1;
+    for (i = 0; i < entry->nchildren; i++)
+      strsize += strlen(entry_child(entry, i, &tmp)->name) + 1;
+  }
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, CACHE_MAGIC, 8);
+  h.version = CACHE_VERSION;
+  h.byteorder = CACHE_BYTEORDER;
+  h.timestamp = (uint64_t)time(NULL);
+  h.nentries = nentries;
+  h.nchildren = nchildren;
+  h.strsize = strsize ? strsize : 1;
+  h.nbuckets = nentries + nentries/2 + 1;
+  h.entries = sizeof(h);
+  h.children = h.entries + nentries * sizeof(struct cache_file_entry);
+  h.strings = h.children + nchildren * sizeof(struct cache_file_child);
+  h.index = (h.strings + h.strsize + 7) & ~(uint64_t)7;
+  fwrite(&h, sizeof(h), 1, f);
+
+  /* Entries; strings are laid out as the path of an entry followed by the
+   * names of its children */
+  hashes = xmalloc((nentries ? nentries : 1) * sizeof(uint64_t));
+  paths = xmalloc((nentries ? nentries : 1) * sizeof(const char *));
+  save_iter_init(&it, shard);
+  soff = coff = n = 0;
+  while ((entry = save_next(&it)) != NULL) {
+    memset(&r, 0, sizeof(r));
+    paths[n] = entry->path;
+    r.hash = hashes[n++] = cache_path_hash(entry->path);
+    r.path = soff;
+    r.mtime = entry->mtime;
+    r.dev = entry->dev;
+    r.ino = entry->ino;
+    r.size = entry->size;
+    r.asize = entry->asize;
+    r.firstchild = coff;
+    r.nchildren = entry->nchildren;
+    r.verified = entry->verified;
+    fwrite(&r, sizeof(r), 1, f);
+    soff += strlen(entry->path) + 1;
+    for (i = 0; i < entry->nchildren; i++)
+      soff += strlen(entry_child(entry, i, &tmp)->name) + 1;
+    coff += entry->nchildren;
+  }
+
+  /* The index is needed for linking the children to their entries */
+  index = xcalloc(h.nbuckets, sizeof(uint32_t));
+  for (n = 0; n < nentries; n++) {
+    for (b = hashes[n] % h.nbuckets; index[b]; b = b+1 == h.nbuckets ? 0 : b+1)
+      ;
+    index[b] = n + 1;
+  }
+  stats_add(STATS_SAVE_ENTRIES, nentries);
+
+  save_iter_init(&it, shard);
+  soff = 0;
+  while ((entry = save_next(&it)) != NULL) {
+    soff += strlen(entry->path) + 1;
+    for (i = 0; i < entry->nchildren; i++) {
+      child = entry_child(entry, i, &tmp);
+      write_file_child(f, child, soff, !(child->flags & FF_DIR) ? 0 :
+        write_find_sub(entry->path, child->name, &path, &pathsize, index, h.nbuckets, hashes, paths));
+      soff += strlen(child->name) + 1;
+    }
+  }
+
+  save_iter_init(&it, shard);
+  while ((entry = save_next(&it)) != NULL) {
+    fwrite(entry->path, strlen(entry->path) + 1, 1, f);
+    for (i = 0; i < entry->nchildren; i++) {
+      child = entry_child(entry, i, &tmp);
+      fwrite(child->name, strlen(child->name) + 1, 1, f);
+    }
+  }
+  if (!strsize)
+    fputc(0, f);
+  fwrite(pad, h.index - h.strings - h.strsize, 1, f);
+
+  fwrite(index, sizeof(uint32_t), h.nbuckets, f);
+  free(index);
+  free(hashes);
+  free(paths);
+  free(path);
+}
+
+
+/* Helper to fsync a directory by path */
+static int fsync_dir(const char *dirpath) {
+  int fd;
+  int ret;
+
+  fd = open(dirpath, O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+    return -1;
+
+  ret = fsync(fd);
+  close(fd);
+  return ret;
+}
+
+
+/* ============================================================================
+ * Cache journal
+ * ============================================================================
+ *
+ * With --cache-journal, a save only appends the directories that were
+ * (re)scanned during this run to <cache>.journal, instead of rewriting the
+ * whole cache. Loading reads the cache file and then replays the journal;
+ * later records replace earlier ones. Layout:
+ *
+ *   header     struct journal_header, identifies the cache file the journal
+ *              belongs to; a journal for any other file is ignored
+ *   records    struct journal_record, followed by nchildren x struct
+ *              cache_file_child and strsize bytes of strings, the path of
+ *              the entry first; padded to 8 bytes
+ *
+ * Records carry a checksum, replay stops at the first record that is
+ * incomplete or damaged, and the next save continues from there. The cache
+ * file is rewritten, and the journal removed, as soon as the journal would
+ * grow larger than 1/JOURNAL_RATIO of the cache file.
+ */
+
+#define JOURNAL_MAGIC "INDUJRNL"
+#define JOURNAL_VERSION 3
+#define JOURNAL_RATIO 2
+
+struct journal_header {
+  char magic[8];
+  uint32_t version, byteorder;
+  uint64_t dev, ino, size, mtime; /* of the cache file */
+};
+
+struct journal_record {
+  uint32_t len, sum;
+  uint64_t mtime, dev, ino;
+  int64_t size, asize;
+  uint64_t verified;
+  uint32_t nchildren, strsize;
+};
+
+
+/* FNV-1a over the record, excluding len and sum */
+static uint32_t journal_sum(const char *rec, size_t len) {
+  const unsigned char *p = (const unsigned char *)rec + 8;
+  uint32_t h = 0x811c9dc5;
+  for (; p < (const unsigned char *)rec + len; p++) {
+    h ^= *p;
+    h *= 0x01000193;
+  }
+  return h;
+}
+
+
+static void journal_header_init(struct journal_header *h, const struct stat *st) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, JOURNAL_MAGIC, 8);
+  h->version = JOURNAL_VERSION;
+  h->byteorder = CACHE_BYTEORDER;
+  h->dev = st->st_dev;
+  h->ino = st->st_ino;
+  h->size = st->st_size;
+  h->mtime = st->st_mtime;
+}
+
+
+static int journal_same_base(const struct stat *a, const struct stat *b) {
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+    a->st_size == b->st_size && a->st_mtime == b->st_mtime;
+}
+
+
+/* Size of the record for entry */
+static size_t journal_record_len(const struct cache_entry *entry) {
+  size_t len = sizeof(struct journal_record) + entry->nchildren * sizeof(struct cache_file_child);
+  struct cache_child tmp;
+  int i;
+
+  len += strlen(entry->path) + 1;
+  for (i = 0; i < entry->nchildren; i++)
+    len += strlen(entry_child(entry, i, &tmp)->name) + 1;
+  return (len + 7) & ~(size_t)7;
+}
+
+
+/* Fills buf with the record for entry, buf must hold journal_record_len() bytes */
+static void journal_record_fill(char *buf, size_t len, const struct cache_entry *entry) {
+  struct journal_record *r = (struct journal_record *)buf;
+  struct cache_file_child *c = (struct cache_file_child *)(r + 1);
+  char *strings = (char *)(c + entry->nchildren);
+  const struct cache_child *src;
+  struct cache_child tmp;
+  uint32_t off;
+  int i;
+
+  memset(buf, 0, len);
+  r->len = len;
+  r->mtime = entry->mtime;
+  r->dev = entry->dev;
+  r->ino = entry->ino;
+  r->size = entry->size;
+  r->asize = entry->asize;
+  r->verified = entry->verified;
+  r->nchildren = entry->nchildren;
+
+  strcpy(strings, entry->path);
+  off = strlen(entry->path) + 1;
+  for (i = 0; i < entry->nchildren; i++) {
+    src = entry_child(entry, i, &tmp);
+    c[i].name = off;
+    c[i].size = src->size;
+    c[i].asize = src->asize;
+    c[i].ino = src->ino;
+    c[i].dev = src->dev;
+    c[i].mtime = src->mtime;
+    c[i].uid = src->uid;
+    c[i].gid = src->gid;
+    c[i].nlink = src->nlink;
+    c[i].flags = src->flags;
+    c[i].mode = src->mode;
+    strcpy(strings + off, src->name);
+    off += strlen(src->name) + 1;
+  }
+  r->strsize = off;
+  r->sum = journal_sum(buf, len);
+}
+
+
+/* Adds the entry stored in a journal record to the cache, replacing any
+ * previous entry for the same path. Returns -1 if the record is corrupt. */
+static int journal_record_load(const char *buf, size_t len) {
+  const struct journal_record *r = (const struct journal_record *)buf;
+  const struct cache_file_child *c = (const struct cache_file_child *)(r + 1);
+  const char *strings;
+  struct cache_entry *entry;
+  struct cache_child *dst;
+  int absent;
+  uint32_t i;
+  khint_t k;
+
+  if (r->nchildren > (len - sizeof(*r)) / sizeof(*c))
+    return -1;
+  strings = (const char *)(c + r->nchildren);
+  if (r->strsize == 0 || r->strsize > len - (strings - buf) || strings[r->strsize-1] != 0)
+    return -1;
+  for (i = 0; i < r->nchildren; i++)
+    if (c[i].name >= r->strsize)
+      return -1;
+
+  entry = cache_entry_new();
+  entry->path = arena_strdup(&cache_arena, strings);
+  entry->mtime = r->mtime;
+  entry->dev = r->dev;
+  entry->ino = r->ino;
+  entry->size = r->size;
+  entry->asize = r->asize;
+  entry->verified = r->verified;
+  entry->items = r->nchildren;
+  entry->nchildren = r->nchildren;
+  if (r->nchildren)
+    entry->children = cache_children_new(r->nchildren);
+  for (i = 0; i < r->nchildren; i++) {
+    dst = &entry->children[i];
+    dst->name = arena_strdup(&cache_arena, strings + c[i].name);
+    dst->flags = c[i].flags;
+    dst->size = c[i].size;
+    dst->asize = c[i].asize;
+    dst->ino = c[i].ino;
+    dst->dev = c[i].dev;
+    dst->mtime = c[i].mtime;
+    dst->uid = c[i].uid;
+    dst->gid = c[i].gid;
+    dst->nlink = c[i].nlink;
+    dst->mode = c[i].mode;
+  }
+
+  /* The replaced entry stays in the arena, its path remains the key. An
+   * entry from the shard of another device is kept, the directory was on
+   * that device when it was loaded. */
+  k = cache_ht_put(cache_table, entry->path, &absent);
+  if (absent || !kh_val(cache_table, k) || kh_val(cache_table, k)->dev == entry->dev || !cache_shards) {
+    if (!absent && kh_val(cache_table, k))
+      kh_val(cache_table, k)->retired = 1;
+    kh_val(cache_table, k) = entry;
+  }
+  return 0;
+}
+
+
+/* Replays the journal on top of the loaded cache file */
+static void journal_replay(struct cache_shard *shard) {
+  struct journal_header h, want;
+  struct journal_record r;
+  size_t bufsize = 0;
+  char *buf = NULL;
   FILE *f;
-  char *tmp_path;
-  char *dir_path;
-  char *dir_copy;
-  int tmp_fd;
-  struct cache_entry_node *node;
-  int first = 1;
+
+  shard->journal_base.len = 0;
+  if (!(f = fopen(shard->journal_file, "r")))
+    return;
+
+  journal_header_init(&want, &shard->journal_base.st);
+  if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(&h, &want, sizeof(h)) != 0) {
+    fclose(f);
+    return;
+  }
+  shard->journal_base.len = sizeof(h);
+
+  while (fread(&r, sizeof(r), 1, f) == 1) {
+    if (r.len < sizeof(r) || r.len % 8 != 0)
+      break;
+    if (r.len > bufsize) {
+      bufsize = r.len;
+      buf = xrealloc(buf, bufsize);
+    }
+    memcpy(buf, &r, sizeof(r));
+    if (fread(buf + sizeof(r), r.len - sizeof(r), 1, f) != 1 ||
+        journal_sum(buf, r.len) != r.sum || journal_record_load(buf, r.len) < 0)
+      break;
+    shard->journal_base.len += r.len;
+    stats_add(STATS_LOAD_BYTES, r.len);
+    stats_inc(STATS_LOAD_ENTRIES);
+  }
+
+  free(buf);
+  fclose(f);
+}
+
+
+/* Appends the entries stored during this run to the journal. Returns -1 if
+ * the cache file has to be rewritten instead, because the journal doesn't
+ * belong to it or would become too large. Must be called with the exclusive
+ * lock held. */
+static int journal_append(struct cache_shard *shard) {
+  struct journal_header h;
+  struct cache_entry *entry;
+  struct stat st;
+  uint64_t len = 0;
+  size_t reclen, bufsize = 0;
+  char *buf = NULL, *dir_copy;
+  khint_t it = 0;
+  FILE *f;
+  int fd, created, ok;
+
+  /* Someone else may have rewritten the cache file since it was loaded */
+  if (!shard->journal_base.ok || stat(shard->file, &st) < 0 || !journal_same_base(&st, &shard->journal_base.st))
+    return -1;
+
+  while ((entry = dirty_next(shard, &it)) != NULL)
+    len += journal_record_len(entry);
+  if (len == 0)
+    return 0;
+
+  created = shard->journal_base.len == 0;
+  if (created)
+    len += sizeof(h);
+  if ((shard->journal_base.len + len) * JOURNAL_RATIO > (uint64_t)st.st_size)
+    return -1;
+
+  fd = open(shard->journal_file, O_WRONLY | O_CREAT, 0600);
+  if (fd < 0)
+    return -1;
+  /* Drops a damaged tail, or a journal left behind for another cache file */
+  if (ftruncate(fd, shard->journal_base.len) != 0 || lseek(fd, shard->journal_base.len, SEEK_SET) < 0 ||
+      !(f = fdopen(fd, "w"))) {
+    close(fd);
+    return -1;
+  }
+
+  if (created) {
+    journal_header_init(&h, &st);
+    fwrite(&h, sizeof(h), 1, f);
+  }
+
+  it = 0;
+  while ((entry = dirty_next(shard, &it)) != NULL) {
+    reclen = journal_record_len(entry);
+    if (reclen > bufsize) {
+      bufsize = reclen;
+      buf = xrealloc(buf, bufsize);
+    }
+    journal_record_fill(buf, reclen, entry);
+    fwrite(buf, reclen, 1, f);
+    stats_inc(STATS_SAVE_ENTRIES);
+  }
+  free(buf);
+
+  ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+  ok = fclose(f) == 0 && ok;
+  if (!ok)
+    return -1;
+
+  if (created) {
+    dir_copy = xstrdup(shard->file);
+    fsync_dir(dirname(dir_copy));
+    free(dir_copy);
+  }
+  shard->journal_base.len += len;
+  stats_add(STATS_SAVE_BYTES, len);
+  return 0;
+}
+
+
+/* ============================================================================
+ * Public API Implementation
+ * ============================================================================ */
+
+/* Creates the shard for entries on dev, the single shard of all devices
+ * without --cache-shards */
+static struct cache_shard *shard_new(uint64_t dev) {
+  struct cache_shard *shard = xcalloc(1, sizeof(struct cache_shard));
+  size_t len = strlen(cache_file);
+
+  shard->dev = dev;
+  shard->file = xmalloc(len + 18);
+  if (cache_shards)
+    sprintf(shard->file, "%s.%llx", cache_file, (unsigned long long)dev);
+  else
+    strcpy(shard->file, cache_file);
+  shard->journal_file = xmalloc(strlen(shard->file) + 9);
+  sprintf(shard->journal_file, "%s.journal", shard->file);
+  cache_lock_init(&shard->lock, shard->file);
+
+  shards = xrealloc(shards, (nshards + 1) * sizeof(struct cache_shard *));
+  shards[nshards++] = shard;
+  return shard;
+}
+
+
+static void loads_stop(void);
+
+static void shards_free(void) {
+  int i;
+
+  for (i = 0; i < nshards; i++) {
+    map_unload(&shards[i]->map);
+    cache_lock_cleanup(&shards[i]->lock);
+    free(shards[i]->file);
+    free(shards[i]->journal_file);
+    free(shards[i]);
+  }
+  free(shards);
+  shards = NULL;
+  nshards = 0;
+}
+
+
+/* Initialize cache system with given filename */
+void dir_cache_init(const char *fn) {
+  char *new_cache_file = xstrdup(fn);  /* Copy first to avoid use-after-free if fn == cache_file */
+  if (cache_file)
+    free(cache_file);
+  cache_file = new_cache_file;
+
+  loads_stop();
+  if (cache_table)
+    cache_ht_destroy(cache_table);
+  cache_table = cache_ht_init();
+
+  shards_free();
+  if (!cache_shards)
+    shard_new(0);
+}
+
+
+/* Parses the entries of a JSON cache file after its header, adding the ones
+ * for paths that aren't in the hash table yet. What is there already is
+ * newer: entries from the journal, or directories that have been scanned or
+ * dropped in the meantime. */
+static void *load_run(void *arg) {
+  struct cache_load *load = arg;
+  struct cache_entry *batch[LOAD_BATCH];
+  struct cache_child item;
+  int absent, n, i, fail = 0, stop = 0;
+  uint64_t start = stats_clock();
+  khint_t k;
+  char c;
+
+  while (!stop) {
+    for (n = 0; n < LOAD_BATCH; ) {
+      c = parse_peek(load->ctx);
+      if (c == ']') {
+        stop = 1;
+        break;
+      }
+      if (c != ',') {
+        fail = stop = 1;
+        break;
+      }
+      load->ctx->pos++;
+
+      memset(&item, 0, sizeof(item));
+      load->ctx->verified = 0;
+      if (parse_item(load->ctx, &item, 0) < 0) {
+        free_cache_child(&item);
+        fail = stop = 1;
+        break;
+      }
+      if ((batch[n] = build_cache_entry(&item, &load->arena)) != NULL)
+        batch[n++]->verified = load->ctx->verified;
+      free_cache_child(&item);
+    }
+
+    pthread_mutex_lock(&cache_mutex);
+    for (i = 0; i < n; i++) {
+      k = cache_ht_put(cache_table, batch[i]->path, &absent);
+      if (absent)
+        kh_val(cache_table, k) = batch[i];
+      if (load->upto && strcmp(load->upto, batch[i]->path) >= 0)
+        load->ordered = 0;
+      load->upto = batch[i]->path;
+    }
+    stats_add(STATS_LOAD_ENTRIES, n);
+    /* Waiting lookups are only woken up once they can continue */
+    if (load->want && load->ordered && load->upto && strcmp(load->upto, load->want) > 0) {
+      load->want = NULL;
+      pthread_cond_broadcast(&cache_loaded);
+    }
+    stop |= load->stop;
+    pthread_mutex_unlock(&cache_mutex);
+  }
+
+  free(load->ctx->buf);
+  free(load->ctx);
+  fclose(load->f);
+
+  /* What has been parsed of a corrupt file is kept, but the journal must
+   * not be appended to it */
+  pthread_mutex_lock(&cache_mutex);
+  if (fail)
+    load->shard->journal_base.ok = 0;
+  load->done = 1;
+  pthread_cond_broadcast(&cache_loaded);
+  pthread_mutex_unlock(&cache_mutex);
+  stats_phase(STATS_PHASE_PARSE, start);
+  return NULL;
+}
+
+
+/* Waits until the entry for path has been loaded from the cache file of
+ * shard, if it is in there, or until the files of all shards are loaded
+ * completely if shard or path is NULL. Must be called with cache_mutex
+ * held. */
+static void load_wait(const char *path, struct cache_shard *shard) {
+  struct cache_load *load;
+  uint64_t start = 0;
+  int j;
+
+  for (j = 0; j < nshards; j++) {
+    if (shard && shards[j] != shard)
+      continue;
+    while ((load = shards[j]->load) != NULL && !load->done &&
+        !(path && load->ordered && load->upto && strcmp(load->upto, path) > 0)) {
+      if (path && (!load->want || strcmp(path, load->want) < 0))
+        load->want = path;
+      if (!start)
+        start = stats_clock();
+      pthread_cond_wait(&cache_loaded, &cache_mutex);
+    }
+  }
+  if (start)
+    stats_phase(STATS_PHASE_WAIT, start);
+}
+
+
+/* Stops the background loads and frees the entries they have loaded, before
+ * the hash table that refers to them is destroyed */
+static void loads_stop(void) {
+  struct cache_load *load;
+  int j;
+
+  for (j = 0; j < nshards; j++)
+    if ((load = shards[j]->load) != NULL) {
+      pthread_mutex_lock(&cache_mutex);
+      load->stop = 1;
+      pthread_mutex_unlock(&cache_mutex);
+      pthread_join(load->thread, NULL);
+      arena_clear(&load->arena);
+      free(load);
+      shards[j]->load = NULL;
+    }
+}
+
+
+/* Loads the cache file of a shard. A binary file is mapped, a JSON file is
+ * parsed by a thread of its own while the scan gets going. */
+static int shard_load(struct cache_shard *shard) {
+  struct cache_load *load;
+  struct parse_ctx *ctx;
+  int64_t major, minor;
+  char magic[8];
+  FILE *f;
+  int ret = 0;
+
+  /* Acquire shared lock for reading (5 second timeout) */
+  if (cache_lock_acquire(&shard->lock, CACHE_LOCK_SHARED, 5) < 0) {
+    /* Could not acquire lock - proceed without cache */
+    return 0;
+  }
+
+  f = fopen(shard->file, "r");
+  if (!f) {
+    cache_lock_release(&shard->lock);
+    /* Missing cache file is not an error - just means no cache */
+    if (errno == ENOENT)
+      return 0;
+    return -1;
+  }
+
+  shard->journal_base.ok = fstat(fileno(f), &shard->journal_base.st) == 0;
+
+  if (fread(magic, 1, 8, f) == 8 && memcmp(magic, CACHE_MAGIC, 8) == 0) {
+    if (map_load(&shard->map, fileno(f)) < 0)
+      goto err;
+    goto cleanup;
+  }
+  rewind(f);
+
+  ctx = xcalloc(1, sizeof(struct parse_ctx));
+  ctx->f = f;
+  ctx->buf = xmalloc(READ_BUF_SIZE);
+  ctx->pos = ctx->buf;
+  ctx->end = ctx->buf;
+  ctx->line = 1;
+  ctx->eof = 0;
+
+  /* Parse header: [1,2,{...}, */
+  if (parse_expect(ctx, '[') < 0 ||
+      parse_int64(ctx, &major) < 0 || major != 1 || parse_expect(ctx, ',') < 0 ||
+      parse_int64(ctx, &minor) < 0 || parse_expect(ctx, ',') < 0 ||
+      parse_skip_object(ctx) < 0) {
+    free(ctx->buf);
+    free(ctx);
+    goto err;
+  }
+
+  /* The journal goes first, its entries replace those in the file */
+  if (shard->journal_base.ok)
+    journal_replay(shard);
+  cache_lock_release(&shard->lock);
+
+  /* The file stays open, replacing it doesn't change what is read */
+  load = xcalloc(1, sizeof(struct cache_load));
+  load->shard = shard;
+  load->ctx = ctx;
+  load->f = f;
+  load->ordered = 1;
+  ctx->arena = &load->arena;
+  if (pthread_create(&load->thread, NULL, load_run, load) != 0) {
+    free(ctx->buf);
+    free(ctx);
+    free(load);
+    fclose(f);
+    shard->journal_base.ok = 0;
+    return -1;
+  }
+  shard->load = load;
+  return 0;
+
+err:
+  ret = -1;
+  shard->journal_base.ok = 0;
+
+cleanup:
+  if (shard->journal_base.ok)
+    journal_replay(shard);
+  fclose(f);
+  cache_lock_release(&shard->lock);
+  return ret;
+}
+
+
+/* Load cache from file, with --cache-shards they are loaded on demand */
+int dir_cache_load(void) {
+  uint64_t start;
+  int ret;
+
+  if (!cache_file)
+    return -1;
+  if (cache_shards)
+    return 0;
+  start = stats_clock();
+  ret = shard_load(shards[0]);
+  stats_phase(STATS_PHASE_LOAD, start);
+  return ret;
+}
+
+
+/* Returns the shard for entries on dev, loading it if the scan hasn't been
+ * on that device yet. Must be called with cache_mutex held. */
+static struct cache_shard *shard_get(uint64_t dev) {
+  struct cache_shard *shard;
+  uint64_t start;
+
+  if ((shard = shard_find(dev)) == NULL) {
+    start = stats_clock();
+    shard = shard_new(dev);
+    shard_load(shard);
+    stats_phase(STATS_PHASE_LOAD, start);
+  }
+  return shard;
+}
+
+
+/* Finds the entry for path, creating a view of a mapped entry if it hasn't
+ * been looked up before. The mapped entry is looked for in shard, or in all
+ * loaded shards if it is NULL. Must be called with cache_mutex held. */
+static struct cache_entry *cache_find(const char *path, struct cache_shard *shard) {
+  struct cache_entry *entry = NULL;
+  int64_t i;
+  int absent, j;
+  khint_t k;
+
+  k = cache_ht_get(cache_table, path);
+  if (k < kh_end(cache_table))
+    return kh_val(cache_table, k);
+
+  /* The entry may still be on its way from the background load */
+  load_wait(path, shard);
+  k = cache_ht_get(cache_table, path);
+  if (k < kh_end(cache_table))
+    return kh_val(cache_table, k);
+
+  for (j = 0; j < nshards; j++)
+    if ((!shard || shard == shards[j]) && (i = map_find(&shards[j]->map, path)) >= 0 &&
+        (entry = map_view(shards[j], i)) != NULL)
+      break;
+  if (!entry)
+    return NULL;
+
+  /* The view takes the place of the mapped entry from now on, so changes
+   * made to its children are saved */
+  entry->used = 0;
+  k = cache_ht_put(cache_table, entry->path, &absent);
+  kh_val(cache_table, k) = entry;
+  map_set_intable(&shards[j]->map, i);
+  return entry;
+}
+
+
+/* Returns the number of the mapped entry of child i of a mapped entry, or -1
+ * if the child has no entry in the same file */
+static int64_t map_sub(const struct cache_entry *entry, int i) {
+  const struct cache_map *m = &entry->shard->map;
+  const struct cache_file_child *c = &m->children[entry->mapfirst + i];
+  const char *path;
+  size_t len = strlen(entry->path);
+
+  if (c->sub == 0 || c->sub > m->nentries || m->entries[c->sub-1].path >= m->strsize)
+    return -1;
+
+  /* Make sure that it really is the entry of the child */
+  path = m->strings + m->entries[c->sub-1].path;
+  if (strncmp(path, entry->path, len) != 0)
+    return -1;
+  path += len;
+  if (len && entry->path[len-1] != '/' && *path++ != '/')
+    return -1;
+  return strcmp(path, m->strings + c->name) == 0 ? (int64_t)c->sub-1 : -1;
+}
+
+
+/* Whether a JSON cache file is still being loaded in the background */
+static int loads_busy(void) {
+  int j;
+  for (j = 0; j < nshards; j++)
+    if (shards[j]->load && !shards[j]->load->done)
+      return 1;
+  return 0;
+}
+
+
+/* Finds the entry of child i of entry through the link in entry. The link is
+ * set up on the first lookup: a mapped entry knows the entries of its
+ * subdirectories in the same file, other entries find them by path through
+ * cache_find(). Must be called with cache_mutex held. */
+static struct cache_entry *cache_find_sub(struct cache_entry *entry, int i, struct cache_shard *shard) {
+  struct cache_entry *sub, view;
+  struct cache_child tmp;
+  const char *name;
+  char *path;
+  size_t len;
+  int64_t j;
+  int absent;
+  khint_t k;
+
+  if (entry->subs && (sub = entry->subs[i]) != NULL && !sub->retired)
+    return sub;
+
+  if (entry->shard && (!shard || shard == entry->shard) && !loads_busy() &&
+      (j = map_sub(entry, i)) >= 0 && map_view_fill(entry->shard, j, &view) == 0) {
+    /* Like cache_find(), what is in the hash table for the path takes
+     * precedence over the mapped entry */
+    k = cache_ht_put(cache_table, view.path, &absent);
+    if (absent) {
+      sub = cache_entry_new();
+      *sub = view;
+      sub->used = 0;
+      kh_val(cache_table, k) = sub;
+    } else
+      sub = kh_val(cache_table, k);
+    map_set_intable(&entry->shard->map, j);
+    goto link;
+  }
+
+  name = entry_child(entry, i, &tmp)->name;
+  len = strlen(entry->path);
+  path = xmalloc(len + strlen(name) + 2);
+  memcpy(path, entry->path, len);
+  if (len && entry->path[len-1] != '/')
+    path[len++] = '/';
+  strcpy(path + len, name);
+  sub = cache_find(path, shard);
+  free(path);
+
+link:
+  if (sub) {
+    if (!entry->subs) {
+      entry->subs = arena_alloc(&cache_arena, entry->nchildren * sizeof(struct cache_entry *));
+      memset(entry->subs, 0, entry->nchildren * sizeof(struct cache_entry *));
+    }
+    entry->subs[i] = sub;
+  }
+  return sub;
+}
+
+
+/* Returns the trust window for path, 0 if it isn't trusted */
+static uint64_t trust_window(const char *path) {
+  size_t len = 0;
+  uint64_t secs = trust_default;
+  int i;
+
+  for (i = 0; i < ntrusts; i++)
+    if (trusts[i].len >= len && path_in(path, trusts[i].path, trusts[i].len)) {
+      len = trusts[i].len;
+      secs = trusts[i].secs;
+    }
+  return secs;
+}
+
+
+/* Validates and marks a found entry, must be called with cache_mutex held.
+ * Under a trust window, the time the entry was verified is saved again
+ * once it is half the window old, rather than after every check, so that the
+ * cache of a tree that doesn't change isn't written out on every run. */
+static struct cache_entry *cache_check(struct cache_entry *entry, uint64_t mtime, uint64_t dev, uint64_t ino) {
+  struct cache_shard *shard;
+  uint64_t now, secs;
+
+  /* Validate the entry - all three must match */
+  if (entry && (entry->mtime != mtime || entry->dev != dev || entry->ino != ino))
+    entry = NULL;
+
+  /* Mark as used */
+  if (entry) {
+    entry->used = 1;
+    now = (uint64_t)time(NULL);
+    if ((secs = trust_window(entry->path)) && now - entry->verified > secs/2) {
+      entry->verified = now;
+      entry->dirty = 1;
+      if ((shard = shard_find(entry->dev)) != NULL)
+        shard->changed = 1;
+    }
+  }
+  return entry;
+}
+
+
+void dir_cache_trust_set(const char *path, uint64_t secs) {
+  size_t len;
+  int i;
+
+  if (!path) {
+    trust_default = secs;
+    return;
+  }
+  /* Compared like cache_scope, without the trailing slash; that leaves
+   * nothing of "/", which is fine for path_in() */
+  len = strlen(path);
+  while (len && path[len-1] == '/')
+    len--;
+  for (i = 0; i < ntrusts; i++)
+    if (trusts[i].len == len && strncmp(trusts[i].path, path, len) == 0)
+      break;
+  if (i == ntrusts) {
+    trusts = xrealloc(trusts, ++ntrusts * sizeof(struct cache_trust));
+    trusts[i].path = xmalloc(len + 1);
+    memcpy(trusts[i].path, path, len);
+    trusts[i].path[len] = 0;
+    trusts[i].len = len;
+  }
+  trusts[i].secs = secs;
+}
+
+
+void dir_cache_trust_clear(void) {
+  int i;
+  for (i = 0; i < ntrusts; i++)
+    free(trusts[i].path);
+  free(trusts);
+  trusts = NULL;
+  ntrusts = 0;
+  trust_default = 0;
+}
+
+
+/* Look up cached entry by path, validating mtime/dev/ino */
+struct cache_entry *dir_cache_lookup(const char *path, uint64_t mtime, uint64_t dev, uint64_t ino) {
+  struct cache_entry *entry;
+
+  if (!cache_table || !path)
+    return NULL;
+
+  pthread_mutex_lock(&cache_mutex);
+  entry = cache_check(cache_find(path, shard_get(dev)), mtime, dev, ino);
+  pthread_mutex_unlock(&cache_mutex);
+  return entry;
+}
+
+
+struct cache_entry *dir_cache_sub_lookup(struct cache_entry *entry, int i, uint64_t mtime, uint64_t dev, uint64_t ino) {
+  if (!cache_table)
+    return NULL;
+
+  pthread_mutex_lock(&cache_mutex);
+  entry = cache_check(cache_find_sub(entry, i, shard_get(dev)), mtime, dev, ino);
+  pthread_mutex_unlock(&cache_mutex);
+  return entry;
+}
+
+
+struct cache_entry *dir_cache_sub_trusted(struct cache_entry *entry, int i) {
+  uint64_t secs;
+
+  if (!cache_table || (!ntrusts && !trust_default))
+    return NULL;
+
+  pthread_mutex_lock(&cache_mutex);
+  if ((entry = cache_find_sub(entry, i, NULL)) != NULL) {
+    secs = trust_window(entry->path);
+    if (secs && entry->verified && (uint64_t)time(NULL) - entry->verified <= secs)
+      entry->used = 1;
+    else
+      entry = NULL;
+  }
+  pthread_mutex_unlock(&cache_mutex);
+  return entry;
+}
+
+
+/* Store a scanned directory in the cache with explicit children */
+void dir_cache_store(const char *path, struct dir *d, struct dir_ext *ext, struct dir_link *link,
+                     struct cache_child *children, int nchildren) {
+  struct cache_entry *entry;
+  int i;
   khint_t k;
-  int save_errno;
+  int absent;
 
-  if (!cache_file || !cache_table)
+  if (!cache_table || !path || !d)
     return;
 
-  /* Acquire exclusive lock for writing (10 second timeout) */
-  if (cache_lock_acquire(CACHE_LOCK_EXCLUSIVE, 10) < 0) {
-    /* Could not acquire lock - skip saving */
-    return;
+  pthread_mutex_lock(&cache_mutex);
+  /* Loads the rest of the shard first, so that it isn't lost when saving */
+  shard_get(link->dev)->changed = 1;
+
+  /* Create new entry */
+  entry = cache_entry_new();
+  entry->path = arena_strdup(&cache_arena, path);
+  entry->mtime = ext && (ext->flags & FFE_MTIME) ? ext->mtime : 0;
+  entry->dev = link->dev;
+  entry->ino = link->ino;
+  entry->size = d->size;
+  entry->asize = d->asize;
+  entry->items = d->items;
+  entry->used = 1; /* Mark as used immediately */
+  entry->dirty = 1;
+  entry->verified = (uint64_t)time(NULL);
+
+  /* Store children, the names are already in the arena */
+  if (nchildren > 0 && children) {
+    entry->children = cache_children_new(nchildren);
+    entry->nchildren = nchildren;
+
+    for (i = 0; i < nchildren; i++) {
+      struct cache_child *src = &children[i];
+      struct cache_child *dst = &entry->children[i];
+
+      dst->name = src->name;
+      dst->flags = src->flags;
+      dst->size = src->size;
+      dst->asize = src->asize;
+      dst->ino = src->ino;
+      dst->dev = src->dev;
+      dst->mtime = src->mtime;
+      dst->uid = src->uid;
+      dst->gid = src->gid;
+      dst->mode = src->mode;
+      dst->nlink = src->nlink;
+      dst->children = NULL;
+      dst->nchildren = 0;
+    }
   }
 
-  /* Create temporary file using mkstemp for unique naming
-   * Format: cache_file + ".XXXXXX" */
-  tmp_path = xmalloc(strlen(cache_file) + 8);
-  sprintf(tmp_path, "%s.XXXXXX", cache_file);
+  /* Check if entry already exists */
+  k = cache_ht_get(cache_table, path);
+  if (k < kh_end(cache_table)) {
+    /* Replace existing entry */
+    struct cache_entry *old = kh_val(cache_table, k);
+    kh_val(cache_table, k) = entry;
+    /* Don't free old - it's in the arena and will be freed at destroy */
+    /* Mark old as unused so it won't be saved */
+    if (old) {
+      old->used = 0;
+      old->retired = 1;
+    }
+  } else {
+    /* Add new entry */
+    k = cache_ht_put(cache_table, entry->path, &absent);
+    kh_val(cache_table, k) = entry;
+  }
+  pthread_mutex_unlock(&cache_mutex);
+}
 
-  tmp_fd = mkstemp(tmp_path);
-  if (tmp_fd < 0) {
-    free(tmp_path);
-    cache_lock_release();
-    return;
+
+char *dir_cache_strdup(const char *str) {
+  char *r;
+  pthread_mutex_lock(&cache_mutex);
+  r = arena_strdup(&cache_arena, str);
+  pthread_mutex_unlock(&cache_mutex);
+  return r;
+}
+
+
+/* Look up a cached entry by path without validating it */
+struct cache_entry *dir_cache_get(const char *path) {
+  struct cache_entry *entry;
+
+  if (!cache_table || !path)
+    return NULL;
+
+  pthread_mutex_lock(&cache_mutex);
+  entry = cache_find(path, NULL);
+  if (entry)
+    entry->used = 1;
+  pthread_mutex_unlock(&cache_mutex);
+  return entry;
+}
+
+
+struct cache_entry *dir_cache_sub(struct cache_entry *entry, int i) {
+  if (!cache_table)
+    return NULL;
+
+  pthread_mutex_lock(&cache_mutex);
+  entry = cache_find_sub(entry, i, NULL);
+  if (entry)
+    entry->used = 1;
+  pthread_mutex_unlock(&cache_mutex);
+  return entry;
+}
+
+
+/* Fill a dir/dir_ext/dir_link triple from a cached child, for passing to dir_output.item() */
+void dir_cache_child_item(const struct cache_child *child, struct dir *d, struct dir_ext *ext, struct dir_link *link) {
+  memset(d, 0, offsetof(struct dir, name));
+  d->size = child->size;
+  d->asize = child->asize;
+  d->flags = child->flags;
+
+  link->ino = child->ino;
+  link->dev = child->dev;
+  link->hlnk = NULL;
+  link->nlink = child->nlink;
+
+  memset(ext, 0, sizeof(*ext));
+  if (child->mtime) {
+    ext->mtime = child->mtime;
+    ext->flags |= FFE_MTIME;
+    d->flags |= FF_EXT;
+  }
+  /* uid and gid 0 only differ from unknown ones by the mode, which is known
+   * for everything that was scanned */
+  if (child->uid || child->mode) {
+    ext->uid = child->uid;
+    ext->flags |= FFE_UID;
+    d->flags |= FF_EXT;
+  }
+  if (child->gid || child->mode) {
+    ext->gid = child->gid;
+    ext->flags |= FFE_GID;
+    d->flags |= FF_EXT;
+  }
+  if (child->mode) {
+    ext->mode = child->mode;
+    ext->flags |= FFE_MODE;
+    d->flags |= FF_EXT;
+  }
+}
+
+
+/* Returns child i of an entry */
+const struct cache_child *dir_cache_child(const struct cache_entry *entry, int i, struct cache_child *tmp) {
+  return entry_child(entry, i, tmp);
+}
+
+
+/* Returns the children of an entry for modification */
+static struct cache_child *entry_children(struct cache_entry *entry) {
+  int i;
+
+  if (!entry->children && entry->nchildren) {
+    entry->children = arena_alloc(&cache_arena, entry->nchildren * sizeof(struct cache_child));
+    for (i = 0; i < entry->nchildren; i++)
+      map_child(&entry->shard->map, &entry->shard->map.children[entry->mapfirst + i], &entry->children[i]);
   }
+  return entry->children;
+}
 
-  /* Convert fd to FILE* for convenience */
-  f = fdopen(tmp_fd, "w");
-  if (!f) {
-    save_errno = errno;
-    close(tmp_fd);
-    unlink(tmp_path);
-    free(tmp_path);
-    cache_lock_release();
+
+struct cache_child *dir_cache_children(struct cache_entry *entry) {
+  struct cache_shard *shard;
+  struct cache_child *r;
+
+  pthread_mutex_lock(&cache_mutex);
+  r = entry_children(entry);
+  /* The caller is about to change a record, so the entry has to be saved,
+   * to the journal as well */
+  entry->dirty = 1;
+  if ((shard = shard_find(entry->dev)) != NULL)
+    shard->changed = 1;
+  pthread_mutex_unlock(&cache_mutex);
+  return r;
+}
+
+
+/* Updates the record of path in the entry of its parent directory */
+void dir_cache_update_child(const char *path, struct dir *d, struct dir_ext *ext, struct dir_link *link) {
+  struct cache_shard *shard;
+  struct cache_entry *entry;
+  struct cache_child *c, tmp;
+  const char *name = strrchr(path, '/');
+  char *parent;
+  int i;
+
+  if (!cache_table || !name || !name[1])
     return;
+  if (name == path)
+    parent = xstrdup("/");
+  else {
+    parent = xmalloc(name - path + 1);
+    memcpy(parent, path, name - path);
+    parent[name - path] = 0;
+  }
+  name++;
+
+  pthread_mutex_lock(&cache_mutex);
+  if ((entry = cache_find(parent, NULL)) != NULL) {
+    for (i = 0; i < entry->nchildren; i++)
+      if (strcmp(entry_child(entry, i, &tmp)->name, name) == 0)
+        break;
+    if (i < entry->nchildren) {
+      c = &entry_children(entry)[i];
+      c->flags = d->flags;
+      c->size = d->size;
+      c->asize = d->asize;
+      c->ino = link->ino;
+      c->dev = link->dev;
+      c->mtime = ext && (ext->flags & FFE_MTIME) ? ext->mtime : 0;
+      c->uid = ext && (ext->flags & FFE_UID) ? ext->uid : 0;
+      c->gid = ext && (ext->flags & FFE_GID) ? ext->gid : 0;
+      c->mode = ext && (ext->flags & FFE_MODE) ? ext->mode : 0;
+      c->nlink = link->nlink;
+      entry->dirty = 1;
+      if ((shard = shard_find(entry->dev)) != NULL)
+        shard->changed = 1;
+    }
+  }
+  pthread_mutex_unlock(&cache_mutex);
+  free(parent);
+}
+
+
+/* Turns a cached directory into a stub holding the totals of its subtree */
+int dir_cache_stub(const struct cache_entry *entry, struct dir *d, struct dir_ext *ext) {
+  if (!(entry->tflags & CACHE_TOTALS) || (entry->tflags & (CACHE_TOTALS_HLNK|CACHE_TOTALS_STALE)))
+    return 0;
+
+  d->size = adds64(d->size, entry->tsize);
+  d->asize = adds64(d->asize, entry->tasize);
+  d->items = entry->titems;
+  d->flags |= FF_CACHED;
+  if (entry->tflags & CACHE_TOTALS_SERR)
+    d->flags |= FF_SERR;
+  if ((d->flags & FF_EXT) && ext->mtime < entry->tmtime)
+    ext->mtime = entry->tmtime;
+  return 1;
+}
+
+
+/* Writes all saved entries as JSON; every directory is written as a separate
+ * top-level item with its full path as name */
+/* Entries are written to a JSON cache in the order of their paths, see
+ * struct cache_load */
+struct json_ref {
+  const char *path;
+  struct cache_entry *entry; /* NULL for a mapped entry */
+  uint64_t m;
+};
+
+static int json_ref_cmp(const void *a, const void *b) {
+  return strcmp(((const struct json_ref *)a)->path, ((const struct json_ref *)b)->path);
+}
+
+
+static void write_json(FILE *f, struct cache_shard *shard) {
+  struct cache_entry *entry, view;
+  struct cache_child tmp;
+  struct save_iter it;
+  struct json_ref *refs = NULL;
+  size_t n = 0, size = 0, r;
+  int i;
+
+  save_iter_init(&it, shard);
+  while ((entry = save_next(&it)) != NULL) {
+    if (n == size)
+      refs = xrealloc(refs, (size = size ? size*2 : 1024) * sizeof(struct json_ref));
+    refs[n].path = entry->path;
+    refs[n].entry = entry == &it.view ? NULL : entry;
+    refs[n].m = it.m - 1;
+    n++;
   }
+  qsort(refs, n, sizeof(struct json_ref), json_ref_cmp);
+  stats_add(STATS_SAVE_ENTRIES, n);
 
   /* Write header */
   fputs("[1,2,{\"progname\":\"" PACKAGE "\",\"progver\":\"" PACKAGE_VERSION "\",\"timestamp\":", f);
   output_int(f, (uint64_t)time(NULL));
   fputc('}', f);
 
-  /* We need to write entries as a tree structure
-   * For simplicity, we'll write each used directory entry as a separate item
-   * This creates a flat structure where each directory has its children
-   */
-
-  /* Find and write root entries (entries that are at the top level) */
-  for (k = 0; k < kh_end(cache_table); k++) {
-    if (!__kh_used(cache_table->used, k))
-      continue;
-
-    struct cache_entry *entry = kh_val(cache_table, k);
-    if (!entry || !entry->used)
-      continue;
+  for (r = 0; r < n; r++) {
+    if ((entry = refs[r].entry) == NULL) {
+      map_view_fill(shard, refs[r].m, &view);
+      entry = &view;
+    }
 
     /* Write this entry and its children */
     fputs(",\n[{\"name\":\"", f);
@@ -1254,45 +2618,121 @@ void dir_cache_save(void) {
       fputs(",\"mtime\":", f);
       output_int(f, entry->mtime);
     }
+    if (entry->verified) {
+      fputs(",\"verified\":", f);
+      output_int(f, entry->verified);
+    }
 
     fputc('}', f);
 
     /* Write children */
-    for (int i = 0; i < entry->nchildren; i++) {
+    for (i = 0; i < entry->nchildren; i++) {
       fputs(",\n", f);
-      write_cache_child(f, &entry->children[i]);
+      write_cache_child(f, entry_child(entry, i, &tmp));
     }
 
     fputc(']', f);
-    first = 0;
   }
+  free(refs);
 
   /* Close the root array */
   fputs("]\n", f);
+}
+
+
+/* Marks all entries as saved, so that saving again after a refresh only
+ * journals what changed since. A rewritten cache file is the base of the
+ * journal from now on. */
+static void save_done(struct cache_shard *shard, int rewritten) {
+  struct cache_entry *entry;
+  khint_t it = 0;
+
+  while ((entry = dirty_next(shard, &it)) != NULL)
+    entry->dirty = 0;
+  shard->changed = 0;
+  if (rewritten) {
+    shard->journal_base.ok = stat(shard->file, &shard->journal_base.st) == 0;
+    shard->journal_base.len = 0;
+  }
+}
+
+
+/* Saves the cache file of a shard */
+static void shard_save(struct cache_shard *shard) {
+  FILE *f;
+  char *tmp_path;
+  char *dir_path;
+  char *dir_copy;
+  int tmp_fd;
+  int save_errno;
+
+  /* Acquire exclusive lock for writing (10 second timeout) */
+  if (cache_lock_acquire(&shard->lock, CACHE_LOCK_EXCLUSIVE, 10) < 0) {
+    /* Could not acquire lock - skip saving */
+    return;
+  }
+
+  if (cache_journal && journal_append(shard) == 0) {
+    save_done(shard, 0);
+    cache_lock_release(&shard->lock);
+    return;
+  }
+
+  /* Create temporary file using mkstemp for unique naming
+   * Format: shard file + ".XXXXXX" */
+  tmp_path = xmalloc(strlen(shard->file) + 8);
+  sprintf(tmp_path, "%s.XXXXXX", shard->file);
+
+  tmp_fd = mkstemp(tmp_path);
+  if (tmp_fd < 0) {
+    free(tmp_path);
+    cache_lock_release(&shard->lock);
+    return;
+  }
+
+  /* Convert fd to FILE* for convenience */
+  f = fdopen(tmp_fd, "w");
+  if (!f) {
+    save_errno = errno;
+    close(tmp_fd);
+    unlink(tmp_path);
+    free(tmp_path);
+    cache_lock_release(&shard->lock);
+    return;
+  }
+
+  if (cache_format == CACHE_FORMAT_JSON)
+    write_json(f, shard);
+  else
+    write_binary(f, shard);
 
   /* Flush stdio buffers */
   if (fflush(f) != 0) {
     fclose(f);
     unlink(tmp_path);
     free(tmp_path);
-    cache_lock_release();
+    cache_lock_release(&shard->lock);
     return;
   }
+  stats_add(STATS_SAVE_BYTES, ftell(f));
 
   /* fsync the file data before rename to ensure durability */
   if (fsync(fileno(f)) != 0) {
     fclose(f);
     unlink(tmp_path);
     free(tmp_path);
-    cache_lock_release();
+    cache_lock_release(&shard->lock);
     return;
   }
 
   if (fclose(f) == 0) {
     /* Atomic rename */
-    if (rename(tmp_path, cache_file) == 0) {
+    if (rename(tmp_path, shard->file) == 0) {
+      /* The journal has been merged into the new file */
+      unlink(shard->journal_file);
+      save_done(shard, 1);
       /* fsync the parent directory to ensure the rename is durable */
-      dir_copy = xstrdup(cache_file);
+      dir_copy = xstrdup(shard->file);
       dir_path = dirname(dir_copy);
       fsync_dir(dir_path);
       free(dir_copy);
@@ -1304,24 +2744,171 @@ void dir_cache_save(void) {
   }
 
   free(tmp_path);
-  cache_lock_release();
+  cache_lock_release(&shard->lock);
 }
 
 
-/* Free all cache memory */
-void dir_cache_destroy(void) {
-  struct cache_entry_node *node, *next;
+/* Save cache to file. Only shards that changed are written. */
+void dir_cache_save(void) {
+  uint64_t start;
+  int i;
 
-  /* Cleanup lock subsystem first */
-  cache_lock_cleanup();
+  if (!cache_file || !cache_table)
+    return;
+  start = stats_clock();
+  cache_prune();
+  for (i = 0; i < nshards; i++)
+    if (shards[i]->changed)
+      shard_save(shards[i]);
+  stats_phase(STATS_PHASE_SAVE, start);
+}
+
+
+/* Stops using the cache for scanning */
+void dir_cache_close(void) {
+  free(closed_file);
+  closed_file = cache_file;
+  cache_file = NULL;
+}
+
+
+/* Uses the cache again for scanning */
+int dir_cache_reopen(void) {
+  if (!closed_file || !cache_table)
+    return -1;
+  cache_file = closed_file;
+  closed_file = NULL;
+  return 0;
+}
+
+
+/* Sets the root of the scan that is about to start */
+void dir_cache_scope(const char *path) {
+  struct cache_entry *entry;
+  khint_t k;
+
+  free(cache_scope);
+  cache_scope = xstrdup(path);
+  cache_scope_len = strlen(path);
+  if (cache_scope_len && path[cache_scope_len-1] == '/')
+    cache_scope_len--;
+  if (!cache_table)
+    return;
+
+  /* Entries in the scope are marked used again as the scan gets to them, and
+   * their totals are checked again. An earlier scan in this process may have
+   * left them set, entries that are still being loaded don't have them. */
+  pthread_mutex_lock(&cache_mutex);
+  for (k = 0; k < kh_end(cache_table); k++) {
+    if (!__kh_used(cache_table->used, k) || (entry = kh_val(cache_table, k)) == NULL)
+      continue;
+    if (in_scope(entry->path)) {
+      entry->used = 0;
+      entry->tflags = 0;
+    }
+  }
+  pthread_mutex_unlock(&cache_mutex);
+}
+
+
+/* Drops the entry of a directory */
+void dir_cache_drop(const char *path) {
+  struct cache_entry *entry;
+  struct cache_shard *shard;
+  int absent, j;
+  khint_t k;
+
+  if (!cache_table)
+    return;
+
+  pthread_mutex_lock(&cache_mutex);
+  k = cache_ht_get(cache_table, path);
+  if (k < kh_end(cache_table)) {
+    if ((entry = kh_val(cache_table, k)) != NULL) {
+      entry->retired = 1;
+      if ((shard = shard_find(entry->dev)) != NULL)
+        shard->changed = 1;
+    }
+    kh_val(cache_table, k) = NULL;
+  } else {
+    /* Like cache_prune(), the NULL keeps the mapped entry from being used,
+     * or one that is still being loaded from being added */
+    for (j = 0; j < nshards; j++)
+      if (map_find(&shards[j]->map, path) >= 0 || (shards[j]->load && !shards[j]->load->done)) {
+        k = cache_ht_put(cache_table, arena_strdup(&cache_arena, path), &absent);
+        kh_val(cache_table, k) = NULL;
+        shards[j]->changed = 1;
+        break;
+      }
+  }
+  pthread_mutex_unlock(&cache_mutex);
+}
+
+
+/* Calls fn for the entries at or below path */
+int dir_cache_walk(const char *path, int (*fn)(const char *, void *), void *arg) {
+  struct cache_entry *entry;
+  size_t len = strlen(path);
+  int r = 0;
+  khint_t k;
+
+  if (!cache_table)
+    return 0;
+  if (len && path[len-1] == '/')
+    len--;
+
+  pthread_mutex_lock(&cache_mutex);
+  load_wait(NULL, NULL);
+  for (k = 0; !r && k < kh_end(cache_table); k++)
+    if (__kh_used(cache_table->used, k) && (entry = kh_val(cache_table, k)) != NULL &&
+        entry->used && path_in(entry->path, path, len))
+      r = fn(entry->path, arg);
+  pthread_mutex_unlock(&cache_mutex);
+  return r;
+}
+
+
+/* Calls fn for all entries, in no particular order */
+int dir_cache_each(int (*fn)(const struct cache_entry *, void *), void *arg) {
+  struct cache_entry *entry;
+  struct save_iter it;
+  int i, r = 0;
 
-  /* Free all entries in the list */
-  for (node = entry_list; node; node = next) {
-    next = node->next;
-    free_cache_entry(node->entry);
-    free(node);
+  if (!cache_table)
+    return 0;
+
+  pthread_mutex_lock(&cache_mutex);
+  load_wait(NULL, NULL);
+  for (i = 0; !r && i < nshards; i++) {
+    save_iter_init(&it, shards[i]);
+    while (!r && (entry = save_next(&it)) != NULL)
+      r = fn(entry, arg);
   }
-  entry_list = NULL;
+  pthread_mutex_unlock(&cache_mutex);
+  return r;
+}
+
+
+/* Identifies the cache file the entries in memory correspond to */
+int dir_cache_base(struct stat *st, uint64_t *journal_len) {
+  if (cache_shards || !nshards || !shards[0]->journal_base.ok || shards[0]->changed)
+    return -1;
+  *st = shards[0]->journal_base.st;
+  *journal_len = shards[0]->journal_base.len;
+  return 0;
+}
+
+
+const char *dir_cache_filename(void) {
+  return cache_file ? cache_file : closed_file;
+}
+
+
+/* Free all cache memory */
+void dir_cache_destroy(void) {
+  /* Free all entries */
+  loads_stop();
+  arena_clear(&cache_arena);
 
   /* Destroy hash table */
   if (cache_table) {
@@ -1329,9 +2916,16 @@ void dir_cache_destroy(void) {
     cache_table = NULL;
   }
 
+  /* Views of mapped entries have been freed with the arena */
+  shards_free();
+
   /* Free cache file path */
   if (cache_file) {
     free(cache_file);
     cache_file = NULL;
   }
+  free(closed_file);
+  closed_file = NULL;
+  free(cache_scope);
+  cache_scope = NULL;
 }
@@ -41,6 +41,12 @@ struct cache_child {
   int nchildren;
 };
 
+/* Flags for cache_entry.tflags */
+#define CACHE_TOTALS       0x01 /* The subtree has been checked and tsize etc. are set */
+#define CACHE_TOTALS_HLNK  0x02 /* The subtree contains hard link candidates */
+#define CACHE_TOTALS_SERR  0x04 /* The subtree contains errors */
+#define CACHE_TOTALS_STALE 0x08 /* Parts of the subtree have changed and must be rescanned */
+
 /* Cache entry structure */
 struct cache_entry {
   char *path;              /* Full path (hash key) */
@@ -48,13 +54,57 @@ struct cache_entry {
   int64_t size, asize;     /* Aggregated sizes */
   int items;               /* Item count */
   int used;                /* Still valid in current scan */
-  struct cache_child *children;  /* For subtree replay */
+  struct cache_shard *shard; /* path and child names point into the mapped file of this shard */
+  int dirty;               /* Stored during this run, not yet in the cache file */
+  struct cache_child *children;  /* For subtree replay, NULL if not copied from the mapped file yet */
   int nchildren;
+  uint64_t mapfirst;       /* First child record in the mapped file */
+  /* Entries of the child directories, by child number, as far as they have
+   * been looked up with dir_cache_sub(). NULL until the first lookup. */
+  struct cache_entry **subs;
+  int retired;             /* No longer the entry for path in the hash table */
+  /* Totals of everything below this directory, in the way dir_mem.c adds
+   * them up, computed by the scanner when the subtree is replayed lazily */
+  int64_t tsize, tasize;
+  uint64_t tmtime;
+  int titems, tflags;
+  uint64_t verified;       /* When the directory was last found unchanged or
+                              stored, 0 if unknown */
 };
 
+/* First bytes of a cache file in the binary format */
+#define CACHE_MAGIC "INDUCACH"
+
 /* Global cache file path (set via --cache option) */
 extern char *cache_file;
 
+/* Format of the saved cache (set via --cache-format option). Both formats
+ * are recognized when loading. */
+#define CACHE_FORMAT_BINARY 0
+#define CACHE_FORMAT_JSON   1
+extern int cache_format;
+
+/* Append updated entries to a journal next to the cache file instead of
+ * rewriting it (set via --cache-journal option) */
+extern int cache_journal;
+
+extern int cache_shards;
+
+/* Keep unchanged cached directories as FF_CACHED stubs in memory and only
+ * read their contents from the cache when they are browsed (set via
+ * --lazy-cache option) */
+extern int cache_lazy;
+
+/* Trusts cached directories at or below path that were verified within the
+ * last secs seconds, without checking them for changes (set via
+ * --cache-trust option). A NULL path sets the window for the directories that
+ * no other path applies to, secs 0 turns trusting off. */
+void dir_cache_trust_set(const char *path, uint64_t secs);
+
+/* Removes all trust windows */
+void dir_cache_trust_clear(void);
+
+
 /* Initialize cache system with given filename */
 void dir_cache_init(const char *fn);
 
@@ -64,16 +114,89 @@ int dir_cache_load(void);
 /* Look up cached entry, returns entry if path/mtime/dev/ino match, NULL otherwise */
 struct cache_entry *dir_cache_lookup(const char *path, uint64_t mtime, uint64_t dev, uint64_t ino);
 
-/* Store a scanned directory in the cache with explicit children */
-void dir_cache_store(const char *path, struct dir *d, struct dir_ext *ext,
+/* Store a scanned directory in the cache with explicit children. The names
+ * of the children must have been allocated with dir_cache_strdup(), the
+ * cache takes them over. */
+void dir_cache_store(const char *path, struct dir *d, struct dir_ext *ext, struct dir_link *link,
                      struct cache_child *children, int nchildren);
 
-/* Replay cached subtree to dir_output callbacks */
-void dir_cache_replay(struct cache_entry *entry);
+/* Copies a string into the cache's memory, it lives until dir_cache_destroy() */
+char *dir_cache_strdup(const char *str);
+
+/* Look up cached entry by path without validation, returns NULL if not cached */
+struct cache_entry *dir_cache_get(const char *path);
+
+/* Like dir_cache_get() and dir_cache_lookup() for child i of entry. The
+ * entry of the child is looked up by its path once and linked to its parent,
+ * after that these don't build or hash any paths. */
+struct cache_entry *dir_cache_sub(struct cache_entry *entry, int i);
+struct cache_entry *dir_cache_sub_lookup(struct cache_entry *entry, int i, uint64_t mtime, uint64_t dev, uint64_t ino);
+
+/* Like dir_cache_sub(), but only returns the entry if it was verified within
+ * the trust window that applies to it, see dir_cache_trust_set() */
+struct cache_entry *dir_cache_sub_trusted(struct cache_entry *entry, int i);
+
+/* Returns child i of an entry. tmp is used to hold a child that is only
+ * available in the mapped cache file. */
+const struct cache_child *dir_cache_child(const struct cache_entry *entry, int i, struct cache_child *tmp);
+
+/* Returns the children of an entry for modification, copying them from the
+ * mapped cache file if necessary. Marks the entry as changed, so that it is
+ * saved. */
+struct cache_child *dir_cache_children(struct cache_entry *entry);
+
+/* Updates the record of the directory at path in the cache entry of its
+ * parent, for the root of a scan, which isn't stored through its parent */
+void dir_cache_update_child(const char *path, struct dir *d, struct dir_ext *ext, struct dir_link *link);
+
+/* Fill a dir/dir_ext/dir_link triple from a cached child, suitable for dir_output.item() */
+void dir_cache_child_item(const struct cache_child *child, struct dir *d, struct dir_ext *ext, struct dir_link *link);
+
+/* Turns the dir/dir_ext pair of a cached directory into an FF_CACHED stub if
+ * the totals of its subtree are known and can be used as-is. Returns whether
+ * it did. */
+int dir_cache_stub(const struct cache_entry *entry, struct dir *d, struct dir_ext *ext);
 
 /* Save cache to file */
 void dir_cache_save(void);
 
+/* Stops using the cache for scanning. The entries stay available through
+ * dir_cache_get() until dir_cache_destroy(), for expanding FF_CACHED stubs. */
+void dir_cache_close(void);
+
+/* Uses the cache again for scanning after dir_cache_close(), for refreshing
+ * a directory. Returns -1 if no cache was in use. */
+int dir_cache_reopen(void);
+
+/* Sets the root of the scan that is about to start. When saving, entries at
+ * or below it that the scan didn't get to are dropped, everything outside of
+ * it is kept. */
+void dir_cache_scope(const char *path);
+
+/* Drops the entry of the directory at path, so that the next scan reads the
+ * directory again instead of taking it from the cache */
+void dir_cache_drop(const char *path);
+
+/* Calls fn with the path of every entry at or below path that the last scan
+ * used, until fn returns non-zero, which is then returned. fn must not call
+ * any other dir_cache function. */
+int dir_cache_walk(const char *path, int (*fn)(const char *, void *), void *arg);
+
+/* Calls fn with every entry of the cache file that has been loaded, whether
+ * or not a scan used it, until fn returns non-zero, which is then returned.
+ * The entry is only valid during the call. fn must not call any other
+ * dir_cache function than dir_cache_child(). */
+int dir_cache_each(int (*fn)(const struct cache_entry *, void *), void *arg);
+
+/* Identifies the cache file that the entries in memory were loaded from or
+ * last saved to, by its stat() and the length of the journal that was applied
+ * to it. Returns -1 if there is no such file: with --cache-shards, or when
+ * changes to the entries haven't been saved. */
+int dir_cache_base(struct stat *st, uint64_t *journal_len);
+
+/* The cache file in use, also after dir_cache_close(), NULL if there's none */
+const char *dir_cache_filename(void);
+
 /* Free all cache memory */
 void dir_cache_destroy(void);
 
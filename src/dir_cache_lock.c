@@ -47,19 +47,6 @@
 /* Maximum retry delay in microseconds (500ms) */
 #define MAX_RETRY_DELAY_US 500000
 
-/* Lock file path */
-static char *lock_file_path = NULL;
-
-/* Lock file descriptor (-1 if not held) */
-static int lock_fd = -1;
-
-/* Current lock mode */
-static cache_lock_mode current_mode;
-
-/* Whether we currently hold a lock */
-static int lock_held = 0;
-
-
 /* Check if a process is still running */
 static int process_alive(pid_t pid) {
     if (pid <= 0)
@@ -171,28 +158,29 @@ static int try_flock(int fd, cache_lock_mode mode, int blocking) {
 }
 
 
-/* Initialize the lock subsystem */
-int cache_lock_init(const char *cache_path) {
+/* Initialize a lock, it doesn't need cleaning up before */
+int cache_lock_init(struct cache_lock *lock, const char *cache_path) {
     size_t path_len;
 
-    /* Clean up any existing state */
-    cache_lock_cleanup();
+    lock->path = NULL;
+    lock->fd = -1;
+    lock->held = 0;
 
     if (!cache_path)
         return -1;
 
     /* Create lock file path: cache_path + ".lock" */
     path_len = strlen(cache_path);
-    lock_file_path = xmalloc(path_len + 6);
-    strcpy(lock_file_path, cache_path);
-    strcat(lock_file_path, ".lock");
+    lock->path = xmalloc(path_len + 6);
+    strcpy(lock->path, cache_path);
+    strcat(lock->path, ".lock");
 
     return 0;
 }
 
 
 /* Acquire a lock with timeout */
-int cache_lock_acquire(cache_lock_mode mode, int timeout_sec) {
+int cache_lock_acquire(struct cache_lock *lock, cache_lock_mode mode, int timeout_sec) {
     int fd;
     int ret;
     time_t start_time;
@@ -201,23 +189,23 @@ int cache_lock_acquire(cache_lock_mode mode, int timeout_sec) {
     int first_attempt;
     struct timespec ts;
 
-    if (!lock_file_path)
+    if (!lock->path)
         return -1;
 
     /* Already holding a lock? */
-    if (lock_held) {
+    if (lock->held) {
         /* If we already have an exclusive lock, we can satisfy any request */
-        if (current_mode == CACHE_LOCK_EXCLUSIVE)
+        if (lock->mode == CACHE_LOCK_EXCLUSIVE)
             return 0;
         /* If we have shared and want shared, that's fine */
         if (mode == CACHE_LOCK_SHARED)
             return 0;
         /* Upgrading shared to exclusive requires release first */
-        cache_lock_release();
+        cache_lock_release(lock);
     }
 
     /* Open or create the lock file */
-    fd = open(lock_file_path, O_RDWR | O_CREAT, 0644);
+    fd = open(lock->path, O_RDWR | O_CREAT, 0644);
     if (fd < 0) {
         /* Try to create parent directory structure doesn't exist case */
         return -1;
@@ -245,9 +233,9 @@ int cache_lock_acquire(cache_lock_mode mode, int timeout_sec) {
                 }
             }
 
-            lock_fd = fd;
-            current_mode = mode;
-            lock_held = 1;
+            lock->fd = fd;
+            lock->mode = mode;
+            lock->held = 1;
             return 0;
         }
 
@@ -282,9 +270,9 @@ int cache_lock_acquire(cache_lock_mode mode, int timeout_sec) {
                             return -1;
                         }
                     }
-                    lock_fd = fd;
-                    current_mode = mode;
-                    lock_held = 1;
+                    lock->fd = fd;
+                    lock->mode = mode;
+                    lock->held = 1;
                     return 0;
                 }
                 /* Couldn't get it - someone else might have taken it */
@@ -320,30 +308,30 @@ int cache_lock_acquire(cache_lock_mode mode, int timeout_sec) {
 }
 
 
-/* Release the current lock */
-void cache_lock_release(void) {
-    if (!lock_held || lock_fd < 0)
+/* Release the lock */
+void cache_lock_release(struct cache_lock *lock) {
+    if (!lock->held || lock->fd < 0)
         return;
 
     /* Release the flock */
-    flock(lock_fd, LOCK_UN);
+    flock(lock->fd, LOCK_UN);
 
     /* Close the file descriptor */
-    close(lock_fd);
+    close(lock->fd);
 
-    lock_fd = -1;
-    lock_held = 0;
+    lock->fd = -1;
+    lock->held = 0;
 }
 
 
-/* Cleanup the lock subsystem */
-void cache_lock_cleanup(void) {
+/* Cleanup a lock */
+void cache_lock_cleanup(struct cache_lock *lock) {
     /* Release any held lock */
-    cache_lock_release();
+    cache_lock_release(lock);
 
     /* Free the lock file path */
-    if (lock_file_path) {
-        free(lock_file_path);
-        lock_file_path = NULL;
+    if (lock->path) {
+        free(lock->path);
+        lock->path = NULL;
     }
 }
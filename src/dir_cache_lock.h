@@ -32,16 +32,24 @@ typedef enum {
     CACHE_LOCK_EXCLUSIVE   /* For writing - blocks all access */
 } cache_lock_mode;
 
-/* Initialize lock subsystem with cache file path */
-int cache_lock_init(const char *cache_path);
+/* A lock on one cache file, see cache_lock_init() */
+struct cache_lock {
+    char *path;            /* Lock file path */
+    int fd;                /* Lock file descriptor (-1 if not held) */
+    cache_lock_mode mode;  /* Current lock mode */
+    int held;              /* Whether we currently hold the lock */
+};
+
+/* Initialize a lock on the given cache file */
+int cache_lock_init(struct cache_lock *lock, const char *cache_path);
 
 /* Acquire lock with timeout (-1 = blocking, 0 = non-blocking, >0 = timeout seconds) */
-int cache_lock_acquire(cache_lock_mode mode, int timeout_sec);
+int cache_lock_acquire(struct cache_lock *lock, cache_lock_mode mode, int timeout_sec);
 
-/* Release current lock */
-void cache_lock_release(void);
+/* Release the lock if it is held */
+void cache_lock_release(struct cache_lock *lock);
 
 /* Cleanup on exit */
-void cache_lock_cleanup(void);
+void cache_lock_cleanup(struct cache_lock *lock);
 
 #endif
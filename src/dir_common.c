@@ -25,11 +25,15 @@
 */
 
 #include "global.h"
+#include "stats.h"
 
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 
 int (*dir_process)(void);
@@ -40,8 +44,32 @@ int dir_ui = -1;    /* User interface to use */
 static int confirm_quit_while_scanning_stage_1_passed; /* Additional check before quitting */
 static char *lasterr; /* Path where the last error occurred. */
 static int curpathl; /* Allocated length of dir_curpath */
+static int curpathlen; /* strlen(dir_curpath) */
 static int lasterrl; /* ^ of lasterr */
 
+/* The progress thread draws a copy of the scan state, which the scan makes
+ * in dir_progress() when progress_want is set. shown and the screen are
+ * protected by progress_lock while the thread runs. When progress_want is 2,
+ * the scan also waits there until progress_paused is cleared, so that the
+ * thread can browse the tree meanwhile. */
+static struct {
+  int64_t size;
+  int items;
+  char *curpath, *lasterr;
+  size_t curpathl, lasterrl;
+} shown;
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t progress_thread;
+static int progress_running;
+static int progress_stop;  /* atomic */
+static int progress_want;  /* atomic */
+static int progress_abort; /* atomic */
+static int progress_paused;
+static int progress_browse; /* progress thread only: showing the browser */
+static struct dir *browse_last; /* ^ directory opened last time */
+struct dir *dir_browsed;
+
 
 static void curpath_resize(int s) {
   if(curpathl < s) {
@@ -52,28 +80,34 @@ static void curpath_resize(int s) {
 
 
 void dir_curpath_set(const char *path) {
-  curpath_resize(strlen(path)+1);
+  curpathlen = strlen(path);
+  curpath_resize(curpathlen+1);
   strcpy(dir_curpath, path);
 }
 
 
 void dir_curpath_enter(const char *name) {
-  curpath_resize(strlen(dir_curpath)+strlen(name)+2);
+  int len = strlen(name);
+  curpath_resize(curpathlen+len+2);
   if(dir_curpath[1])
-    strcat(dir_curpath, "/");
-  strcat(dir_curpath, name);
+    dir_curpath[curpathlen++] = '/';
+  memcpy(dir_curpath+curpathlen, name, len+1);
+  curpathlen += len;
 }
 
 
 /* removes last component from dir_curpath */
 void dir_curpath_leave(void) {
-  char *tmp;
-  if((tmp = strrchr(dir_curpath, '/')) == NULL)
+  int i = curpathlen;
+  while(i > 0 && dir_curpath[i-1] != '/')
+    i--;
+  if(i == 0) {
     strcpy(dir_curpath, "/");
-  else if(tmp != dir_curpath)
-    tmp[0] = 0;
+    curpathlen = 1;
+  } else if(i > 1)
+    dir_curpath[curpathlen = i-1] = 0;
   else
-    tmp[1] = 0;
+    dir_curpath[curpathlen = 1] = 0;
 }
 
 
@@ -94,6 +128,39 @@ void dir_setlasterr(const char *path) {
 }
 
 
+static void shown_copy(char **dst, size_t *len, const char *src) {
+  size_t req;
+  if(!src) {
+    if(*dst)
+      **dst = 0;
+    return;
+  }
+  req = strlen(src)+1;
+  if(*len < req) {
+    *len = req < 128 ? 128 : req;
+    *dst = xrealloc(*dst, *len);
+  }
+  memcpy(*dst, src, req);
+}
+
+
+static void progress_publish(void) {
+  pthread_mutex_lock(&progress_lock);
+  shown.size = dir_output.size;
+  shown.items = dir_output.items;
+  shown_copy(&shown.curpath, &shown.curpathl, dir_curpath ? dir_curpath : "");
+  shown_copy(&shown.lasterr, &shown.lasterrl, lasterr);
+  while(__atomic_load_n(&progress_want, __ATOMIC_RELAXED) == 2) {
+    progress_paused = 1;
+    pthread_cond_broadcast(&progress_cond);
+    while(progress_paused)
+      pthread_cond_wait(&progress_cond, &progress_lock);
+  }
+  __atomic_store_n(&progress_want, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&progress_lock);
+}
+
+
 void dir_seterr(const char *fmt, ...) {
   va_list va;
   free(dir_fatalerr);
@@ -122,19 +189,26 @@ static void draw_progress(void) {
 
   ncaddstr(2, 2, "Total items: ");
   uic_set(UIC_NUM);
-  printw("%-9d", dir_output.items);
+  printw("%-9d", shown.items);
 
-  if(dir_output.size) {
+  if(shown.size) {
     ncaddstrc(UIC_DEFAULT, 2, 24, "size: ");
-    printsize(UIC_DEFAULT, dir_output.size);
+    printsize(UIC_DEFAULT, shown.size);
   }
 
   uic_set(UIC_DEFAULT);
-  ncprint(3, 2, "Current item: %s", cropstr(dir_curpath, width-18));
+  ncprint(3, 2, "Current item: %s", cropstr(shown.curpath, width-18));
+  stats_draw(4, 2, width-4);
   if(confirm_quit_while_scanning_stage_1_passed) {
     ncaddstr(8, width-26, "Press ");
     addchc(UIC_KEY, 'y');
     addstrc(UIC_DEFAULT, " to confirm abort");
+  } else if(dir_output.partial) {
+    ncaddstr(8, width-31, "Press ");
+    addchc(UIC_KEY, 'b');
+    addstrc(UIC_DEFAULT, " to browse, ");
+    addchc(UIC_KEY, 'q');
+    addstrc(UIC_DEFAULT, " to abort");
   } else {
     ncaddstr(8, width-18, "Press ");
     addchc(UIC_KEY, 'q');
@@ -142,11 +216,11 @@ static void draw_progress(void) {
   }
 
   /* show warning if we couldn't open a dir */
-  if(lasterr) {
+  if(shown.lasterr && *shown.lasterr) {
      attron(A_BOLD);
      ncaddstr(5, 2, "Warning:");
      attroff(A_BOLD);
-     ncprint(5, 11, "error scanning %-32s", cropstr(lasterr, width-28));
+     ncprint(5, 11, "error scanning %-32s", cropstr(shown.lasterr, width-28));
      ncaddstr(6, 3, "some directory sizes may not be correct");
   }
 
@@ -181,10 +255,23 @@ static void draw_error(char *cur, char *msg) {
 }
 
 
-void dir_draw(void) {
+static void draw_line(void) {
   float f;
   const char *unit;
 
+  if(shown.size) {
+    f = formatsize(shown.size, &unit);
+    fprintf(stderr, "\r%-55s %8d files /%5.1f %s",
+      cropstr(shown.curpath, 55), shown.items, f, unit);
+  } else
+    fprintf(stderr, "\r%-65s %8d files", cropstr(shown.curpath, 65), shown.items);
+}
+
+
+void dir_draw(void) {
+  if(!progress_running)
+    progress_publish();
+
   switch(dir_ui) {
   case 0:
     if(dir_fatalerr)
@@ -193,12 +280,8 @@ void dir_draw(void) {
   case 1:
     if(dir_fatalerr)
       fprintf(stderr, "\r%s.\n", dir_fatalerr);
-    else if(dir_output.size) {
-      f = formatsize(dir_output.size, &unit);
-      fprintf(stderr, "\r%-55s %8d files /%5.1f %s",
-        cropstr(dir_curpath, 55), dir_output.items, f, unit);
-    } else
-      fprintf(stderr, "\r%-65s %8d files", cropstr(dir_curpath, 65), dir_output.items);
+    else
+      draw_line();
     break;
   case 2:
     browse_draw();
@@ -211,11 +294,8 @@ void dir_draw(void) {
 }
 
 
-/* This function can't be called unless dir_ui == 2
- * (Doesn't really matter either way). */
-int dir_key(int ch) {
-  if(dir_fatalerr)
-    return 1;
+/* Handles a key while scanning, returns whether to abort the scan */
+static int progress_key(int ch) {
   if(confirm_quit && confirm_quit_while_scanning_stage_1_passed) {
     if (ch == 'y'|| ch == 'Y') {
       return 1;
@@ -232,3 +312,171 @@ int dir_key(int ch) {
   }
   return 0;
 }
+
+
+/* This function can't be called unless dir_ui == 2
+ * (Doesn't really matter either way). */
+int dir_key(int ch) {
+  return dir_fatalerr ? 1 : progress_key(ch);
+}
+
+
+#define progress_stopped() __atomic_load_n(&progress_stop, __ATOMIC_RELAXED)
+
+
+/* Has the scan wait in dir_progress(), returns non-zero if it has finished
+ * instead. Called with progress_lock held. */
+static int progress_pause(void) {
+  __atomic_store_n(&progress_want, 2, __ATOMIC_RELAXED);
+  while(!progress_paused && !progress_stopped())
+    pthread_cond_wait(&progress_cond, &progress_lock);
+  return !progress_paused;
+}
+
+
+static void progress_resume(void) {
+  progress_paused = 0;
+  __atomic_store_n(&progress_want, 0, __ATOMIC_RELAXED);
+  pthread_cond_broadcast(&progress_cond);
+}
+
+
+/* Handles a key in the browser, or opens it if it isn't shown yet, and draws
+ * it. The browser is reopened when there are new items, and closed again
+ * when browse_key() says so. Called with progress_lock held. */
+static void progress_browse_key(int ch) {
+  static unsigned int gen;
+  struct dir *root;
+
+  if(progress_pause())
+    return;
+  if(!progress_browse) {
+    if((root = dir_output.partial()) != NULL) {
+      browse_init_partial(browse_last ? browse_last : root, BROWSE_SCAN);
+      dirlist_top(-3);
+      gen = dirlist_gen;
+      progress_browse = 1;
+    }
+    ch = 0;
+  } else if(gen != dirlist_gen) {
+    dirlist_open(dirlist_par);
+    gen = dirlist_gen;
+  }
+  if(ch && progress_browse && browse_key(ch)) {
+    browse_last = dirlist_par;
+    browse_partial = progress_browse = 0;
+  }
+  if(progress_browse)
+    browse_draw();
+  progress_resume();
+  if(!progress_browse)
+    draw_progress();
+}
+
+/* Redraws the progress every update_delay ms and handles the keys in between,
+ * 20 ms at a time so that stopping doesn't take long. The box is drawn over
+ * what the main thread drew before the scan began, the browser when
+ * refreshing; that isn't redrawn while the scan may change it. The browser
+ * for the tree being scanned is drawn by progress_browse_key() instead. */
+static void *progress_run(void *arg) {
+  struct timespec now, next, nap = {0, 20*1000*1000};
+  long left;
+  int ch;
+
+  (void)arg;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while(!progress_stopped()) {
+    __atomic_store_n(&progress_want, 1, __ATOMIC_RELAXED);
+    next.tv_sec += update_delay / 1000;
+    next.tv_nsec += (update_delay % 1000) * 1000000;
+    if(next.tv_nsec >= 1000000000) {
+      next.tv_sec++;
+      next.tv_nsec -= 1000000000;
+    }
+
+    while(!progress_stopped()) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      left = (next.tv_sec - now.tv_sec) * 1000 + (next.tv_nsec - now.tv_nsec) / 1000000;
+      if(left <= 0)
+        break;
+      if(dir_ui == 1) {
+        nanosleep(&nap, NULL);
+        continue;
+      }
+      timeout(left < 20 ? left : 20);
+      errno = 0;
+      if((ch = getch()) == ERR) {
+        if(errno == EPIPE || errno == EBADF || errno == EIO)
+          __atomic_store_n(&progress_abort, 1, __ATOMIC_RELAXED);
+        continue;
+      }
+      pthread_mutex_lock(&progress_lock);
+      if(ch == KEY_RESIZE)
+        screen_resize();
+      if(progress_browse)
+        progress_browse_key(ch == KEY_RESIZE ? 0 : ch);
+      else if(ch == 'b' && dir_output.partial && !confirm_quit_while_scanning_stage_1_passed)
+        progress_browse_key(ch);
+      else {
+        if(ch != KEY_RESIZE && progress_key(ch))
+          __atomic_store_n(&progress_abort, 1, __ATOMIC_RELAXED);
+        draw_progress();
+      }
+      pthread_mutex_unlock(&progress_lock);
+    }
+
+    /* Waking up after a long suspend shouldn't cause a burst of redraws */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(now.tv_sec > next.tv_sec + 1)
+      next = now;
+
+    pthread_mutex_lock(&progress_lock);
+    if(dir_ui == 1)
+      draw_line();
+    else {
+      if(progress_browse)
+        progress_browse_key(0);
+      else
+        draw_progress();
+      refresh();
+    }
+    pthread_mutex_unlock(&progress_lock);
+  }
+
+  if(progress_browse)
+    dir_browsed = dirlist_par;
+  browse_partial = progress_browse = 0;
+  return NULL;
+}
+
+
+void dir_progress_start(void) {
+  __atomic_store_n(&progress_abort, 0, __ATOMIC_RELAXED);
+  dir_browsed = browse_last = NULL;
+  if(dir_ui == 0)
+    return;
+  if(input_handle(-1))
+    __atomic_store_n(&progress_abort, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&progress_stop, 0, __ATOMIC_RELAXED);
+  progress_running = pthread_create(&progress_thread, NULL, progress_run, NULL) == 0;
+}
+
+
+int dir_progress(void) {
+  if(__atomic_load_n(&progress_want, __ATOMIC_RELAXED))
+    progress_publish();
+  return __atomic_load_n(&progress_abort, __ATOMIC_RELAXED);
+}
+
+
+void dir_progress_stop(void) {
+  if(!progress_running)
+    return;
+  pthread_mutex_lock(&progress_lock);
+  __atomic_store_n(&progress_stop, 1, __ATOMIC_RELAXED);
+  pthread_cond_broadcast(&progress_cond);
+  pthread_mutex_unlock(&progress_lock);
+  pthread_join(progress_thread, NULL);
+  progress_running = 0;
+  __atomic_store_n(&progress_want, 0, __ATOMIC_RELAXED);
+}
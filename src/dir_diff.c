@@ -0,0 +1,419 @@
+/* indu - Incremental NCurses Disk Usage
+
+  Based on ncdu by Yorhel (https://dev.yorhel.nl/ncdu)
+  Copyright (c) Yorhel
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include "global.h"
+#include "dir_cache.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+
+/* Both inputs are reduced to a list of their directories, with the sizes of
+ * the files in them added to the directory, so that neither tree has to be
+ * kept in memory. The list is sorted such that a directory is followed by
+ * everything below it, with the subdirectories in the order of their names,
+ * which makes a single pass over both lists at once enough to match them up
+ * and to step over unchanged subtrees. */
+struct diff_dir {
+  char *path;
+  uint64_t dev, ino, mtime;  /* of the directory itself */
+  uint64_t tmtime;           /* latest mtime at or below it */
+  int64_t size, asize;       /* the directory and its files, totals once sorted */
+  uint64_t items;
+  size_t end;                /* first directory after it that isn't below it */
+};
+
+struct diff_list {
+  struct diff_dir *list;
+  size_t n, size;
+  struct arena arena;
+};
+
+struct diff_row {
+  const char *type, *path;
+  int64_t size, asize, items;
+};
+
+static struct diff_row *rows;
+static size_t nrows, rowsize;
+
+/* The list that the import of an export is read into */
+static struct diff_list *reading;
+static int readfail;
+
+/* Directories of the import that haven't been closed yet */
+static struct stack {
+  struct diff_open {
+    size_t dir, parentlen;
+  } *list;
+  int size, top;
+} stack;
+
+static char *path;
+static size_t pathlen, pathsize;
+
+
+static void path_enter(const char *name) {
+  size_t len = strlen(name);
+
+  if(pathlen+len+2 > pathsize) {
+    pathsize = (pathlen+len+2)*2;
+    path = xrealloc(path, pathsize);
+  }
+  if(pathlen && path[pathlen-1] != '/')
+    path[pathlen++] = '/';
+  memcpy(path+pathlen, name, len+1);
+  pathlen += len;
+}
+
+
+static struct diff_dir *diff_add(struct diff_list *l, const char *p) {
+  struct diff_dir *d;
+
+  if(l->n == l->size) {
+    l->size = l->size ? l->size*2 : 1024;
+    l->list = xrealloc(l->list, l->size*sizeof(*l->list));
+  }
+  d = &l->list[l->n++];
+  memset(d, 0, sizeof(*d));
+  d->path = arena_strdup(&l->arena, p);
+  return d;
+}
+
+
+static void diff_file(struct diff_dir *d, int64_t size, int64_t asize, uint64_t mtime) {
+  d->size = adds64(d->size, size);
+  d->asize = adds64(d->asize, asize);
+  d->items++;
+  if(d->tmtime < mtime)
+    d->tmtime = mtime;
+}
+
+
+static int import_item(struct dir *item, const char *name, struct dir_ext *ext, struct dir_link *link) {
+  struct diff_open o;
+  struct diff_dir *d;
+  uint64_t mtime;
+
+  if(!item) {
+    pathlen = stack.list[--stack.top].parentlen;
+    path[pathlen] = 0;
+    return 0;
+  }
+
+  mtime = ext && (ext->flags & FFE_MTIME) ? ext->mtime : 0;
+  if(stack.top)
+    diff_file(&reading->list[stack.list[stack.top-1].dir],
+      item->flags & FF_DIR ? 0 : item->size, item->flags & FF_DIR ? 0 : item->asize, mtime);
+  if(!(item->flags & FF_DIR))
+    return 0;
+
+  o.parentlen = pathlen;
+  path_enter(name);
+  d = diff_add(reading, path);
+  d->dev = link->dev;
+  d->ino = link->ino;
+  d->mtime = d->tmtime = mtime;
+  d->size = item->size;
+  d->asize = item->asize;
+  o.dir = reading->n-1;
+  nstack_push(&stack, o);
+  return 0;
+}
+
+
+static int import_final(int fail) {
+  readfail = fail;
+  return 1;
+}
+
+
+/* Subdirectories of a cache entry that have an entry of their own */
+#define cache_isdir(c) (((c)->flags & FF_DIR) && !((c)->flags & (FF_ERR|FF_EXL|FF_OTHFS|FF_KERNFS|FF_FRMLNK)))
+
+static int cache_add(const struct cache_entry *entry, void *arg) {
+  const struct cache_child *c;
+  struct cache_child tmp;
+  struct diff_dir *d;
+  int i;
+
+  d = diff_add(arg, entry->path);
+  d->dev = entry->dev;
+  d->ino = entry->ino;
+  d->mtime = d->tmtime = entry->mtime;
+  d->size = entry->size;
+  d->asize = entry->asize;
+  for(i=0; i<entry->nchildren; i++) {
+    c = dir_cache_child(entry, i, &tmp);
+    if(cache_isdir(c))
+      d->items++;
+    else
+      diff_file(d, c->size, c->asize, c->mtime);
+  }
+  return 0;
+}
+
+
+/* Like strcmp(), but with '/' before any other character, so that the
+ * directories below a path come right after it */
+static int path_cmp(const char *a, const char *b) {
+  for(; *a && *a == *b; a++, b++)
+    ;
+  if(*a == *b)
+    return 0;
+  if(!*a)
+    return -1;
+  if(!*b)
+    return 1;
+  if(*a == '/' || *b == '/')
+    return *a == '/' ? -1 : 1;
+  return (unsigned char)*a < (unsigned char)*b ? -1 : 1;
+}
+
+
+static int dir_cmp(const void *a, const void *b) {
+  return path_cmp(((const struct diff_dir *)a)->path, ((const struct diff_dir *)b)->path);
+}
+
+
+/* Whether p is below dir */
+static int path_below(const char *dir, const char *p) {
+  size_t len = strlen(dir);
+  return strncmp(dir, p, len) == 0 && (p[len] == '/' || (len && dir[len-1] == '/' && p[len]));
+}
+
+
+/* Sorts the list and adds up the totals of every directory */
+static void diff_totals(struct diff_list *l) {
+  struct { size_t *list; int size, top; } open;
+  struct diff_dir *d, *p;
+  size_t i;
+
+  qsort(l->list, l->n, sizeof(*l->list), dir_cmp);
+  nstack_init(&open);
+  for(i=0; i<=l->n; i++) {
+    while(open.top && (i == l->n || !path_below(l->list[open.list[open.top-1]].path, l->list[i].path))) {
+      d = &l->list[open.list[--open.top]];
+      d->end = i;
+      if(!open.top)
+        continue;
+      p = &l->list[open.list[open.top-1]];
+      p->size = adds64(p->size, d->size);
+      p->asize = adds64(p->asize, d->asize);
+      p->items += d->items;
+      if(p->tmtime < d->tmtime)
+        p->tmtime = d->tmtime;
+    }
+    if(i < l->n)
+      nstack_push(&open, i);
+  }
+  nstack_free(&open);
+}
+
+
+/* Whether a file is a cache rather than an export. JSON caches look like
+ * exports, except that every directory is an item of the top-level array and
+ * the subdirectories in it only have their own information, so it's an
+ * export as soon as a subdirectory in the first item has anything in it. */
+static int diff_iscache(const char *fn) {
+  char magic[8];
+  size_t n;
+  char open[4];
+  int c, depth = 0, items = 0, str = 0, r = 0;
+  FILE *f;
+
+  if(strcmp(fn, "-") == 0)
+    return 0;
+  if((f = fopen(fn, "r")) == NULL)
+    die("Can't open %s: %s\n", fn, strerror(errno));
+  n = fread(magic, 1, sizeof(magic), f);
+  if(n == sizeof(magic) && memcmp(magic, CACHE_MAGIC, sizeof(magic)) == 0)
+    r = 1;
+  else if(n && magic[0] == '[') {
+    rewind(f);
+    while((c = getc(f)) != EOF) {
+      if(str) {
+        if(c == '\\')
+          getc(f);
+        else if(c == '"')
+          str = 0;
+      } else if(c == '"')
+        str = 1;
+      else if(c == '[' && depth == 1 && items++) {
+        r = 1;
+        break;
+      } else if(c == ',' && depth == 3 && open[2] == '[')
+        break;
+      else if(c == '[' || c == '{') {
+        if(depth < 4)
+          open[depth] = c;
+        depth++;
+      } else if(c == ']' || c == '}')
+        depth--;
+    }
+  }
+  fclose(f);
+  return r;
+}
+
+
+static void diff_read(const char *fn, struct diff_list *l) {
+  if(diff_iscache(fn)) {
+    cache_shards = 0;
+    dir_cache_init(fn);
+    if(dir_cache_load())
+      die("Can't read cache file %s.\n", fn);
+    dir_cache_each(cache_add, l);
+    dir_cache_destroy();
+  } else {
+    reading = l;
+    nstack_init(&stack);
+    dir_output.item = import_item;
+    dir_output.final = import_final;
+    dir_output.size = 0;
+    dir_output.items = 0;
+    dir_output.cached = 0;
+    dir_output.partial = NULL;
+    dir_output.browsed = 0;
+    if(dir_import_init(fn))
+      die("Can't open %s: %s\n", fn, strerror(errno));
+    dir_process();
+    nstack_free(&stack);
+    if(readfail)
+      exit(1);
+  }
+  diff_totals(l);
+}
+
+
+static void row_add(const char *type, const struct diff_dir *a, const struct diff_dir *b) {
+  struct diff_row *r;
+
+  if(nrows == rowsize) {
+    rowsize = rowsize ? rowsize*2 : 256;
+    rows = xrealloc(rows, rowsize*sizeof(*rows));
+  }
+  r = &rows[nrows++];
+  r->type = type;
+  r->path = b ? b->path : a->path;
+  r->size = (b ? b->size : 0) - (a ? a->size : 0);
+  r->asize = (b ? b->asize : 0) - (a ? a->asize : 0);
+  r->items = (int64_t)(b ? b->items : 0) - (int64_t)(a ? a->items : 0);
+}
+
+
+/* Whether a directory and everything below it is unchanged. Without the
+ * mtimes, files could have moved around without changing the totals. */
+static int diff_same(const struct diff_dir *a, const struct diff_dir *b) {
+  return a->tmtime && a->tmtime == b->tmtime && a->mtime == b->mtime &&
+    a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+    a->asize == b->asize && a->items == b->items;
+}
+
+
+static int row_cmp(const void *va, const void *vb) {
+  const struct diff_row *a = va, *b = vb;
+  return a->size < b->size ? 1 : a->size > b->size ? -1 : path_cmp(a->path, b->path);
+}
+
+
+/* Added and removed directories are listed, but not the ones below them */
+static void diff_merge(const struct diff_list *a, const struct diff_list *b) {
+  const struct diff_dir *x, *y;
+  size_t i = 0, j = 0;
+  int c;
+
+  while(i < a->n || j < b->n) {
+    x = i < a->n ? &a->list[i] : NULL;
+    y = j < b->n ? &b->list[j] : NULL;
+    c = !x ? 1 : !y ? -1 : path_cmp(x->path, y->path);
+    if(c < 0) {
+      row_add("removed", x, NULL);
+      i = x->end;
+    } else if(c > 0) {
+      row_add("added", NULL, y);
+      j = y->end;
+    } else if(diff_same(x, y)) {
+      i = x->end;
+      j = y->end;
+    } else {
+      if(x->size != y->size || x->asize != y->asize || x->items != y->items)
+        row_add("changed", x, y);
+      i++;
+      j++;
+    }
+  }
+}
+
+
+static void diff_print(void) {
+  const struct diff_row *r;
+  size_t i;
+
+  if(nrows)
+    qsort(rows, nrows, sizeof(*rows), row_cmp);
+  if(dir_summary_format == SUMMARY_FORMAT_CSV)
+    puts("type,path,dsize,asize,items");
+  for(i=0; i<nrows; i++) {
+    r = &rows[i];
+    if(dir_summary_format == SUMMARY_FORMAT_CSV) {
+      printf("%s,", r->type);
+      dir_summary_string(r->path);
+      printf(",%"PRId64",%"PRId64",%"PRId64"\n", r->size, r->asize, r->items);
+    } else {
+      printf("{\"type\":\"%s\",\"path\":", r->type);
+      dir_summary_string(r->path);
+      printf(",\"dsize\":%"PRId64",\"asize\":%"PRId64",\"items\":%"PRId64"}\n", r->size, r->asize, r->items);
+    }
+  }
+}
+
+
+int dir_diff(const char *oldfn, const char *newfn) {
+  struct diff_list a, b;
+  int r = 0;
+
+  memset(&a, 0, sizeof(a));
+  memset(&b, 0, sizeof(b));
+  diff_read(oldfn, &a);
+  diff_read(newfn, &b);
+  diff_merge(&a, &b);
+  diff_print();
+  if(fflush(stdout) || ferror(stdout)) {
+    fprintf(stderr, "Error writing diff: %s\n", strerror(errno));
+    r = 1;
+  }
+
+  free(rows);
+  free(path);
+  free(a.list);
+  free(b.list);
+  arena_clear(&a.arena);
+  arena_clear(&b.arena);
+  return r;
+}
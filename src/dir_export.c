@@ -29,10 +29,32 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <time.h>
 
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+
+/* Size of the write buffer, the output is written in chunks of this size
+ * rather than with a stdio call for every few bytes */
+#define BUF_SIZE (128*1024)
+
+int dir_export_format = EXPORT_FORMAT_JSON;
+int dir_export_compress = 0;
 
 static FILE *stream;
+static char *buf;
+static size_t buflen;
+static int werr; /* errno of the first failed write, 0 if none */
+static uint64_t written; /* bytes of binary export data so far */
+
+#if HAVE_ZSTD
+static ZSTD_CStream *zstd; /* NULL if not compressing */
+static char *zbuf;
+static size_t zbufsize;
+#endif
 
 /* Stack of device IDs, also used to keep track of the level of nesting */
 static struct stack {
@@ -40,24 +62,129 @@ static struct stack {
   int size, top;
 } stack;
 
+/* Binary export: the directories that haven't been closed yet, with the
+ * totals of what has been written of them so far */
+struct bin_dir {
+  uint64_t offset, items, serial;
+  int64_t size, asize;
+};
+
+static struct bin_stack {
+  struct bin_dir *list;
+  int size, top;
+} bin_stack;
+
+/* Min-heap of the largest directories by size, so the smallest is replaced */
+static struct export_top *top;
+static int ntop;
+
+/* Hard links are counted once in every directory for the totals, as they are
+ * by the browser */
+static struct dir_hlinks hlinks;
+
+
+static void write_out(const char *data, size_t len) {
+  if(!werr && fwrite(data, 1, len, stream) != len)
+    werr = errno ? errno : EIO;
+}
+
+
+/* Writes out the buffer, compressing it if needed. The compressed frame is
+ * ended if end is set. */
+static void flush(int end) {
+#if HAVE_ZSTD
+  ZSTD_inBuffer in = { buf, buflen, 0 };
+  ZSTD_outBuffer out;
+  size_t r;
+
+  if(zstd) {
+    do {
+      out.dst = zbuf;
+      out.size = zbufsize;
+      out.pos = 0;
+      r = ZSTD_compressStream2(zstd, &out, &in, end ? ZSTD_e_end : ZSTD_e_continue);
+      if(ZSTD_isError(r)) {
+        if(!werr)
+          werr = EIO;
+        break;
+      }
+      write_out(zbuf, out.pos);
+    } while(end ? r != 0 : in.pos < in.size);
+    buflen = 0;
+    return;
+  }
+#endif
+  write_out(buf, buflen);
+  buflen = 0;
+  (void)end;
+}
+
+
+static inline void output_char(char c) {
+  if(buflen == BUF_SIZE)
+    flush(0);
+  buf[buflen++] = c;
+}
+
+
+/* Only for short strings, which always fit in the buffer */
+static void output_str(const char *str) {
+  size_t len = strlen(str);
+  if(buflen+len > BUF_SIZE)
+    flush(0);
+  memcpy(buf+buflen, str, len);
+  buflen += len;
+}
+
+
+static void output_bytes(const char *p, size_t len) {
+  size_t n;
+
+  while(len > 0) {
+    if(buflen == BUF_SIZE)
+      flush(0);
+    n = BUF_SIZE-buflen < len ? BUF_SIZE-buflen : len;
+    memcpy(buf+buflen, p, n);
+    buflen += n;
+    p += n;
+    len -= n;
+  }
+}
+
 
+static void output_data(const void *data, size_t len) {
+  written += len;
+  output_bytes(data, len);
+}
+
+
+/* The parts without anything to escape are copied as they are */
 static void output_string(const char *str) {
-  for(; *str; str++) {
+  char esc[8];
+  size_t len = strlen(str), n;
+
+  while(1) {
+    n = json_plain(str, len);
+    output_bytes(str, n);
+    str += n;
+    len -= n;
+    if(!len)
+      break;
     switch(*str) {
-    case '\n': fputs("\\n", stream); break;
-    case '\r': fputs("\\r", stream); break;
-    case '\b': fputs("\\b", stream); break;
-    case '\t': fputs("\\t", stream); break;
-    case '\f': fputs("\\f", stream); break;
-    case '\\': fputs("\\\\", stream); break;
-    case '"':  fputs("\\\"", stream); break;
+    case '\n': output_str("\\n"); break;
+    case '\r': output_str("\\r"); break;
+    case '\b': output_str("\\b"); break;
+    case '\t': output_str("\\t"); break;
+    case '\f': output_str("\\f"); break;
+    case '\\': output_str("\\\\"); break;
+    case '"':  output_str("\\\""); break;
     default:
-      if((unsigned char)*str <= 31 || (unsigned char)*str == 127)
-        fprintf(stream, "\\u00%02x", *str);
-      else
-        fputc(*str, stream);
+      snprintf(esc, sizeof(esc), "\\u00%02x", *str);
+      output_str(esc);
       break;
     }
+    str++;
+    len--;
   }
 }
 
@@ -71,90 +198,117 @@ static void output_int(uint64_t n) {
   while((n /= 10) > 0);
 
   while(i--)
-    fputc(tmp[i]+'0', stream);
+    output_char(tmp[i]+'0');
 }
 
 
-static void output_info(struct dir *d, const char *name, struct dir_ext *e, unsigned int nlink) {
+static void output_info(struct dir *d, const char *name, struct dir_ext *e, struct dir_link *l) {
   if(!extended_info || !(d->flags & FF_EXT))
     e = NULL;
 
-  fputs("{\"name\":\"", stream);
+  output_str("{\"name\":\"");
   output_string(name);
-  fputc('"', stream);
+  output_char('"');
 
   /* No need for asize/dsize if they're 0 (which happens with excluded or failed-to-stat files) */
   if(d->asize) {
-    fputs(",\"asize\":", stream);
+    output_str(",\"asize\":");
     output_int((uint64_t)d->asize);
   }
   if(d->size) {
-    fputs(",\"dsize\":", stream);
+    output_str(",\"dsize\":");
     output_int((uint64_t)d->size);
   }
 
-  if(d->dev != nstack_top(&stack, 0)) {
-    fputs(",\"dev\":", stream);
-    output_int(d->dev);
+  if(l->dev != nstack_top(&stack, 0)) {
+    output_str(",\"dev\":");
+    output_int(l->dev);
   }
 
   if(e) {
     if(e->flags & FFE_UID) {
-      fputs(",\"uid\":", stream);
+      output_str(",\"uid\":");
       output_int(e->uid);
     }
     if(e->flags & FFE_GID) {
-      fputs(",\"gid\":", stream);
+      output_str(",\"gid\":");
       output_int(e->gid);
     }
     if(e->flags & FFE_MODE) {
-      fputs(",\"mode\":", stream);
+      output_str(",\"mode\":");
       output_int(e->mode);
     }
     if(e->flags & FFE_MTIME) {
-      fputs(",\"mtime\":", stream);
+      output_str(",\"mtime\":");
       output_int(e->mtime);
     }
   }
 
   if(d->flags & FF_HLNKC) {
-    fputs(",\"ino\":", stream);
-    output_int(d->ino);
-    fputs(",\"hlnkc\":true,\"nlink\":", stream);
-    output_int(nlink);
+    output_str(",\"ino\":");
+    output_int(l->ino);
+    output_str(",\"hlnkc\":true,\"nlink\":");
+    output_int(l->nlink);
   }
   if(d->flags & FF_ERR)
-    fputs(",\"read_error\":true", stream);
+    output_str(",\"read_error\":true");
   /* excluded/error'd files are "unknown" with respect to the "notreg" field. */
   if(!(d->flags & (FF_DIR|FF_FILE|FF_ERR|FF_EXL|FF_OTHFS|FF_KERNFS|FF_FRMLNK)))
-    fputs(",\"notreg\":true", stream);
+    output_str(",\"notreg\":true");
   if(d->flags & FF_EXL)
-    fputs(",\"excluded\":\"pattern\"", stream);
+    output_str(",\"excluded\":\"pattern\"");
   else if(d->flags & FF_OTHFS)
-    fputs(",\"excluded\":\"otherfs\"", stream);
+    output_str(",\"excluded\":\"otherfs\"");
   else if(d->flags & FF_KERNFS)
-    fputs(",\"excluded\":\"kernfs\"", stream);
+    output_str(",\"excluded\":\"kernfs\"");
   else if(d->flags & FF_FRMLNK)
-    fputs(",\"excluded\":\"frmlnk\"", stream);
+    output_str(",\"excluded\":\"frmlnk\"");
 
-  fputc('}', stream);
+  output_char('}');
 }
 
 
-/* Note on error handling: For convenience, we just keep writing to *stream
- * without checking the return values of the functions. Only at the and of each
- * item() call do we check for ferror(). This greatly simplifies the code, but
- * assumes that calls to fwrite()/fput./etc don't do any weird stuff when
- * called with a stream that's in an error state. */
-static int item(struct dir *item, const char *name, struct dir_ext *ext, unsigned int nlink) {
+/* Returns non-zero with errno set if a write has failed */
+static int check(void) {
+  if(werr) {
+    errno = werr;
+    return 1;
+  }
+  return 0;
+}
+
+
+/* Writes out what is left in the buffer, ending the compressed frame, and
+ * closes the stream */
+static int close_stream(void) {
+  flush(1);
+  if(fclose(stream) && !werr)
+    werr = errno;
+  free(buf);
+  buf = NULL;
+#if HAVE_ZSTD
+  ZSTD_freeCStream(zstd);
+  zstd = NULL;
+  free(zbuf);
+  zbuf = NULL;
+#endif
+  return check();
+}
+
+
+/* Note on error handling: For convenience, we just keep writing to the buffer
+ * without checking whether writing it out worked. Only at the end of each
+ * item() call do we check for a failed write, nothing is written after
+ * that. */
+static int item(struct dir *item, const char *name, struct dir_ext *ext, struct dir_link *link) {
   if(!item) {
     nstack_pop(&stack);
     if(!stack.top) { /* closing of the root item */
-      fputs("]]", stream);
-      return fclose(stream);
+      output_str("]]");
+      return close_stream();
     } else /* closing of a regular directory item */
-      fputs("]", stream);
-    return ferror(stream);
+      output_str("]");
+    return check();
   }
 
   dir_output.items++;
@@ -162,26 +316,190 @@ static int item(struct dir *item, const char *name, struct dir_ext *ext, unsigne
   /* File header.
    * TODO: Add scan options? */
   if(!stack.top) {
-    fputs("[1,2,{\"progname\":\""PACKAGE"\",\"progver\":\""PACKAGE_VERSION"\",\"timestamp\":", stream);
+    output_str("[1,2,{\"progname\":\""PACKAGE"\",\"progver\":\""PACKAGE_VERSION"\",\"timestamp\":");
     output_int((uint64_t)time(NULL));
-    fputc('}', stream);
+    output_char('}');
   }
 
-  fputs(",\n", stream);
+  output_str(",\n");
   if(item->flags & FF_DIR)
-    fputc('[', stream);
+    output_char('[');
 
-  output_info(item, name, ext, nlink);
+  output_info(item, name, ext, link);
 
   if(item->flags & FF_DIR)
-    nstack_push(&stack, item->dev);
+    nstack_push(&stack, link->dev);
+
+  return check();
+}
 
-  return ferror(stream);
+
+static void top_sift(int i) {
+  struct export_top t;
+  int c;
+
+  while((c = 2*i+1) < ntop) {
+    if(c+1 < ntop && top[c+1].size < top[c].size)
+      c++;
+    if(top[i].size <= top[c].size)
+      break;
+    t = top[i];
+    top[i] = top[c];
+    top[c] = t;
+    i = c;
+  }
+}
+
+
+static void top_add(const struct bin_dir *d) {
+  struct export_top t;
+  int i;
+
+  t.offset = d->offset;
+  t.size = d->size;
+  t.asize = d->asize;
+  t.items = d->items;
+
+  if(ntop == EXPORT_TOP) {
+    if(t.size <= top[0].size)
+      return;
+    top[0] = t;
+    top_sift(0);
+    return;
+  }
+  for(i=ntop++; i > 0 && t.size < top[(i-1)/2].size; i=(i-1)/2)
+    top[i] = top[(i-1)/2];
+  top[i] = t;
+}
+
+
+static int top_cmp(const void *va, const void *vb) {
+  const struct export_top *a = va, *b = vb;
+  return a->size < b->size ? 1 : a->size > b->size ? -1 :
+    a->offset < b->offset ? -1 : a->offset > b->offset ? 1 : 0;
+}
+
+
+static void bin_add(struct bin_dir *d, int64_t size, int64_t asize, uint64_t items) {
+  d->size = adds64(d->size, size);
+  d->asize = adds64(d->asize, asize);
+  d->items += items;
+}
+
+
+/* Writes the list terminator, the top directories and the footer */
+static int bin_footer(const struct bin_dir *root) {
+  struct export_record end;
+  struct export_footer f;
+
+  memset(&end, 0, sizeof(end));
+  output_data(&end, sizeof(end));
+
+  memset(&f, 0, sizeof(f));
+  f.size = root->size;
+  f.asize = root->asize;
+  f.items = root->items;
+  f.ntop = ntop;
+  f.top = written;
+  memcpy(f.magic, EXPORT_MAGIC, sizeof(f.magic));
+
+  qsort(top, ntop, sizeof(*top), top_cmp);
+  output_data(top, ntop*sizeof(*top));
+  output_data(&f, sizeof(f));
+  return close_stream();
+}
+
+
+static int item_bin(struct dir *item, const char *name, struct dir_ext *ext, struct dir_link *link) {
+  struct export_header h;
+  struct export_record r;
+  struct bin_dir d;
+  size_t len;
+  uint64_t last;
+  int i;
+  static const char pad[8];
+
+  if(!item) {
+    d = bin_stack.list[--bin_stack.top];
+    if(!bin_stack.top)
+      return bin_footer(&d);
+    bin_add(&bin_stack.list[bin_stack.top-1], d.size, d.asize, d.items+1);
+    top_add(&d);
+    return check();
+  }
+
+  dir_output.items++;
+
+  if(!bin_stack.top) {
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, EXPORT_MAGIC, sizeof(h.magic));
+    h.version = EXPORT_VERSION;
+    h.byteorder = EXPORT_BYTEORDER;
+    h.timestamp = (uint64_t)time(NULL);
+    output_data(&h, sizeof(h));
+  }
+
+  if(!extended_info || !(item->flags & FF_EXT))
+    ext = NULL;
+
+  len = strlen(name);
+  memset(&r, 0, sizeof(r));
+  r.namelen = len;
+  r.flags = (item->flags & (FF_DIR|FF_FILE|FF_ERR|FF_OTHFS|FF_EXL|FF_HLNKC|FF_KERNFS|FF_FRMLNK)) | (ext ? FF_EXT : 0);
+  r.parent = bin_stack.top ? bin_stack.list[bin_stack.top-1].offset : 0;
+  r.size = item->size;
+  r.asize = item->asize;
+  r.ino = link->ino;
+  r.dev = link->dev;
+  r.nlink = link->nlink;
+  if(ext) {
+    r.extflags = ext->flags;
+    r.mtime = ext->mtime;
+    r.uid = ext->uid;
+    r.gid = ext->gid;
+    r.mode = ext->mode;
+  }
+
+  d.offset = written;
+  d.size = item->size;
+  d.asize = item->asize;
+  d.items = 0;
+  d.serial = 0;
+
+  output_data(&r, sizeof(r));
+  output_data(name, len);
+  output_data(pad, 8 - len%8);
+
+  if(item->flags & FF_DIR) {
+    d.serial = dir_hlinks_open(&hlinks);
+    nstack_push(&bin_stack, d);
+  } else if(!bin_stack.top) /* the root is a file, that's all there is */
+    return bin_footer(&d);
+  else {
+    bin_add(&bin_stack.list[bin_stack.top-1], d.size, d.asize, 1);
+    /* Taken back out of the directories that have it already */
+    if(item->flags & FF_HLNKC && (last = dir_hlinks_link(&hlinks, link)) != 0) {
+      for(i=bin_stack.top; i>0 && bin_stack.list[i-1].serial > last; i--)
+        ;
+      if(i)
+        bin_add(&bin_stack.list[i-1], -d.size, -d.asize, 0);
+    }
+  }
+
+  return check();
 }
 
 
 static int final(int fail) {
+  /* Whatever got exported before a failure is still written */
+  if(buf)
+    close_stream();
   nstack_free(&stack);
+  nstack_free(&bin_stack);
+  if(top)
+    dir_hlinks_free(&hlinks);
+  free(top);
+  top = NULL;
   return fail ? 1 : 1; /* Silences -Wunused-parameter */
 }
 
@@ -192,13 +510,38 @@ int dir_export_init(const char *fn) {
   else if((stream = fopen(fn, "w")) == NULL)
     return 1;
 
+  buf = xmalloc(BUF_SIZE);
+  buflen = 0;
+  werr = 0;
+#if HAVE_ZSTD
+  if(dir_export_compress) {
+    if((zstd = ZSTD_createCStream()) == NULL) {
+      errno = ENOMEM;
+      return 1;
+    }
+    ZSTD_CCtx_setParameter(zstd, ZSTD_c_checksumFlag, 1);
+    zbufsize = ZSTD_CStreamOutSize();
+    zbuf = xmalloc(zbufsize);
+  }
+#endif
+
   nstack_init(&stack);
+  nstack_init(&bin_stack);
+  written = 0;
+  ntop = 0;
+  if(dir_export_format == EXPORT_FORMAT_BINARY) {
+    top = xmalloc(EXPORT_TOP*sizeof(*top));
+    dir_hlinks_init(&hlinks);
+  }
 
   pstate = ST_CALC;
-  dir_output.item = item;
+  dir_output.item = dir_export_format == EXPORT_FORMAT_BINARY ? item_bin : item;
   dir_output.final = final;
   dir_output.size = 0;
   dir_output.items = 0;
+  dir_output.cached = 0;
+  dir_output.partial = NULL;
+  dir_output.browsed = 0;
   return 0;
 }
 
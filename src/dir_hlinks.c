@@ -0,0 +1,72 @@
+/* indu - Incremental NCurses Disk Usage
+
+  Based on ncdu by Yorhel (https://dev.yorhel.nl/ncdu)
+  Copyright (c) Yorhel
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include "global.h"
+#include <khashl.h>
+
+#include <string.h>
+
+
+struct hlink_key {
+  uint64_t dev, ino;
+};
+
+#define hlink_hash(k)     (kh_hash_uint64((khint64_t)(k).dev) ^ kh_hash_uint64((khint64_t)(k).ino))
+#define hlink_equal(a, b) ((a).dev == (b).dev && (a).ino == (b).ino)
+/* The values are the serials at the last link of the inode */
+KHASHL_MAP_INIT(KH_LOCAL, hn_t, hn, struct hlink_key, uint64_t, hlink_hash, hlink_equal)
+
+
+void dir_hlinks_init(struct dir_hlinks *h) {
+  h->hash = hn_init();
+  h->serial = 0;
+}
+
+
+uint64_t dir_hlinks_open(struct dir_hlinks *h) {
+  return ++h->serial;
+}
+
+
+uint64_t dir_hlinks_link(struct dir_hlinks *h, const struct dir_link *link) {
+  struct hlink_key key;
+  uint64_t last;
+  khint_t k;
+  int absent;
+
+  key.dev = link->dev;
+  key.ino = link->ino;
+  k = hn_put(h->hash, key, &absent);
+  last = absent ? 0 : kh_val((hn_t *)h->hash, k);
+  kh_val((hn_t *)h->hash, k) = h->serial;
+  return last;
+}
+
+
+void dir_hlinks_free(struct dir_hlinks *h) {
+  hn_destroy(h->hash);
+  memset(h, 0, sizeof(*h));
+}
@@ -40,6 +40,16 @@
 #include <string.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 
 /* Max. length of any JSON string we're interested in. A string may of course
@@ -48,6 +58,9 @@
  * import will results in an error. */
 #define MAX_VAL (32*1024)
 
+/* The first bytes of a zstd compressed file */
+#define ZSTD_MAGIC "\x28\xb5\x2f\xfd"
+
 /* Minimum number of bytes we request from fread() */
 #define MIN_READ_SIZE 1024
 
@@ -55,13 +68,38 @@
  * improves performance. */
 #define READ_BUF_SIZE (32*1024)
 
+/* A file imported with several threads is split into jobs of consecutive
+ * items in the root directory, at least this many bytes each unless the item
+ * is the last one */
+#define JOB_SIZE (256*1024)
+
+/* Max. number of jobs that are split off before they are output, per thread */
+#define JOB_AHEAD 4
+
 
 int dir_import_active = 0;
 
 
-/* Use a struct for easy batch-allocation and deallocation of state data. */
-static struct ctx {
+struct job;
+
+/* Use a struct for easy batch-allocation and deallocation of state data. The
+ * main thread has one for the imported file and every worker thread has its
+ * own. */
+struct ctx {
   FILE *stream;
+  char *map;  /* the whole file if it is mapped in memory, NULL if read from stream */
+  size_t mapsize;
+  struct job *job; /* the job being parsed on a worker thread, NULL on the main thread */
+  int compressed;  /* whether the stream is compressed with zstd */
+  int binary;      /* whether the stream is a binary export */
+#if HAVE_ZSTD
+  ZSTD_DStream *zstd;
+  ZSTD_inBuffer zin;
+  char *zbuf;      /* compressed data read from the stream */
+  size_t zerr;     /* error code of a failed decompression, 0 if none */
+  size_t zlast;    /* last return value of ZSTD_decompressStream(), 0 at the end of a frame */
+  int ztrunc;      /* whether the stream ended in the middle of a frame */
+#endif
 
   int line;
   int byte;
@@ -73,19 +111,86 @@ static struct ctx {
   /* scratch space */
   struct dir    *buf_dir;
   struct dir_ext buf_ext[1];
-  unsigned int nlink;
+  struct dir_link buf_link[1];
 
   char buf_name[MAX_VAL];
   char val[MAX_VAL];
   char readbuf[READ_BUF_SIZE];
-} *ctx;
+};
+
+
+/* Items parsed by a job, which are output by the main thread in their order */
+struct job_item {
+  int64_t size, asize;
+  struct dir_ext ext;
+  struct dir_link link;
+  unsigned short flags;
+  size_t name;  /* offset in the names of the job, JOB_LEAVE for the end of a directory */
+};
+
+#define JOB_LEAVE ((size_t)-1)
+
+enum { JOB_QUEUED, JOB_RUNNING, JOB_DONE };
+
+struct job {
+  char *start, *end; /* items in the root directory, separated by commas */
+  int line, byte;    /* position of start */
+  uint64_t dev;
+  int state;         /* JOB_*, protected by job_lock */
+  char err[256];     /* error message if the items could not be parsed */
+  struct job_item *items;
+  int nitems, itemcap;
+  char *names;
+  size_t nameslen, namescap;
+};
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_work = PTHREAD_COND_INITIALIZER; /* job split off or job_stop set */
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER; /* job finished */
+static struct job **jobs;  /* jobs[job_out..njobs) are still to be output */
+static int njobs, jobcap;
+static int job_next;       /* first job that no thread has taken yet */
+static int job_stop;
+
+
+#if HAVE_ZSTD
+/* Reads up to n bytes of decompressed data from the stream, like fread() */
+static size_t zread(struct ctx *ctx, char *dest, size_t n) {
+  ZSTD_outBuffer out = { dest, n, 0 };
+  size_t r, pos;
+
+  while(out.pos < out.size) {
+    if(ctx->zin.pos == ctx->zin.size) {
+      ctx->zin.size = fread(ctx->zbuf, 1, ZSTD_DStreamInSize(), ctx->stream);
+      ctx->zin.pos = 0;
+      if(!ctx->zin.size && !ctx->zlast)
+        break;
+    }
+    /* Without input, this flushes what the decoder still holds */
+    pos = out.pos;
+    r = ZSTD_decompressStream(ctx->zstd, &out, &ctx->zin);
+    if(ZSTD_isError(r)) {
+      ctx->zerr = r;
+      break;
+    }
+    ctx->zlast = r;
+    if(!ctx->zin.size && out.pos == pos) {
+      if(r && feof(ctx->stream))
+        ctx->ztrunc = 1;
+      break;
+    }
+  }
+  return out.pos;
+}
+#endif
 
 
 /* Fills readbuf with data from the stream. *buf will have at least n (<
  * READ_BUF_SIZE) bytes available, unless the stream reached EOF or an error
  * occurred. If the file data contains a null-type, this is considered an error.
- * Returns 0 on success, non-zero on error. */
-static int fill(int n) {
+ * A mapped file is at EOF from the start. Returns 0 on success, non-zero on
+ * error. */
+static int fill(struct ctx *ctx, int n) {
   int r;
 
   if(ctx->eof)
@@ -103,8 +208,23 @@ static int fill(int n) {
   }
 
   do {
+#if HAVE_ZSTD
+    if(ctx->zstd)
+      r = zread(ctx, ctx->lastfill, n);
+    else
+#endif
     r = fread(ctx->lastfill, 1, n, ctx->stream);
     if(r != n) {
+#if HAVE_ZSTD
+      if(ctx->zerr) {
+        dir_seterr("Decompression error: %s", ZSTD_getErrorName(ctx->zerr));
+        return 1;
+      }
+      if(ctx->ztrunc) {
+        dir_seterr("Decompression error: truncated zstd stream");
+        return 1;
+      }
+#endif
       if(feof(ctx->stream))
         ctx->eof = 1;
       else if(ferror(ctx->stream) && errno != EINTR) {
@@ -126,11 +246,30 @@ static int fill(int n) {
 }
 
 
+/* Reports a parse error. Worker threads keep it with their job, so that it is
+ * only set after everything before it has been output. */
+static void seterr(struct ctx *ctx, const char *msg) {
+  char err[256];
+
+  /* A zero byte in a mapped file looks like the end of the data to the
+   * parser, which fails right where it is */
+  if(ctx->map && !*ctx->buf && ctx->buf < ctx->lastfill)
+    snprintf(err, sizeof(err), "Zero-byte found in JSON stream");
+  else
+    snprintf(err, sizeof(err), "Line %d byte %d: %s", ctx->line, ctx->byte, msg);
+
+  if(ctx->job) {
+    if(!*ctx->job->err)
+      strcpy(ctx->job->err, err);
+  } else if(!dir_fatalerr)
+    dir_seterr("%s", err);
+}
+
+
 /* Two macros that break function calling behaviour, but are damn convenient */
 #define E(_x, _m) do {\
     if(_x) {\
-      if(!dir_fatalerr)\
-        dir_seterr("Line %d byte %d: %s", ctx->line, ctx->byte, _m);\
+      seterr(ctx, _m);\
       return 1;\
     }\
   } while(0)
@@ -143,27 +282,27 @@ static int fill(int n) {
 
 /* Require at least n bytes in the buffer, throw an error on early EOF.
  * (Macro to quickly handle the common case) */
-#define rfill1 (!*ctx->buf && _rfill(1))
-#define rfill(_n) ((ctx->lastfill - ctx->buf < (_n)) && _rfill(_n))
+#define rfill1 (!*ctx->buf && _rfill(ctx, 1))
+#define rfill(_n) ((ctx->lastfill - ctx->buf < (_n)) && _rfill(ctx, _n))
 
-static int _rfill(int n) {
-  C(fill(n));
+static int _rfill(struct ctx *ctx, int n) {
+  C(fill(ctx, n));
   E(ctx->lastfill - ctx->buf < n, "Unexpected EOF");
   return 0;
 }
 
 
 /* Consumes n bytes from the buffer. */
-static inline void con(int n) {
+static inline void con(struct ctx *ctx, int n) {
   ctx->buf += n;
   ctx->byte += n;
 }
 
 
 /* Consumes any whitespace. If *ctx->buf == 0 after this function, we've reached EOF. */
-static int cons(void) {
+static int cons(struct ctx *ctx) {
   while(1) {
-    C(!*ctx->buf && fill(1));
+    C(!*ctx->buf && fill(ctx, 1));
 
     switch(*ctx->buf) {
     case 0x0A:
@@ -178,7 +317,7 @@ static int cons(void) {
     case 0x20:
     case 0x09:
     case 0x0D:
-      con(1);
+      con(ctx, 1);
       break;
     default:
       return 0;
@@ -187,27 +326,27 @@ static int cons(void) {
 }
 
 
-static int rstring_esc(char **dest, int *destlen) {
+static int rstring_esc(struct ctx *ctx, char **dest, int *destlen) {
   unsigned int n, s;
 
   C(rfill1);
 
 #define ap(c) if(*destlen > 1) { *((*dest)++) = c; (*destlen)--; }
   switch(*ctx->buf) {
-  case '"':  ap('"');  con(1); break;
-  case '\\': ap('\\'); con(1); break;
-  case '/':  ap('/');  con(1); break;
-  case 'b':  ap(0x08); con(1); break;
-  case 'f':  ap(0x0C); con(1); break;
-  case 'n':  ap(0x0A); con(1); break;
-  case 'r':  ap(0x0D); con(1); break;
-  case 't':  ap(0x09); con(1); break;
+  case '"':  ap('"');  con(ctx, 1); break;
+  case '\\': ap('\\'); con(ctx, 1); break;
+  case '/':  ap('/');  con(ctx, 1); break;
+  case 'b':  ap(0x08); con(ctx, 1); break;
+  case 'f':  ap(0x0C); con(ctx, 1); break;
+  case 'n':  ap(0x0A); con(ctx, 1); break;
+  case 'r':  ap(0x0D); con(ctx, 1); break;
+  case 't':  ap(0x09); con(ctx, 1); break;
   case 'u':
     C(rfill(5));
 #define hn(n) (n >= '0' && n <= '9' ? n-'0' : n >= 'A' && n <= 'F' ? n-'A'+10 : n >= 'a' && n <= 'f' ? n-'a'+10 : 1<<16)
 #define h4(b) (hn((b)[0])<<12) + (hn((b)[1])<<8) + (hn((b)[2])<<4) + hn((b)[3])
     n = h4(ctx->buf+1);
-    con(5);
+    con(ctx, 5);
     E(n >= (1<<16), "Invalid \\u escape");
     E((n & 0xfc00) == 0xdc00, "Unexpected low surrogate");
     if((n & 0xfc00) == 0xd800) { /* high surrogate */
@@ -215,7 +354,7 @@ static int rstring_esc(char **dest, int *destlen) {
       E(ctx->buf[0] != '\\', "Expected low surrogate");
       E(ctx->buf[1] != 'u', "Expected low surrogate");
       s = h4(ctx->buf+2);
-      con(6);
+      con(ctx, 6);
       E(s >= (1<<16), "Invalid \\u escape");
       E((s & 0xfc00) != 0xdc00, "Expected low surrogate");
       n = 0x10000 + (((n & 0x03ff) << 10) | (s & 0x03ff));
@@ -252,28 +391,33 @@ static int rstring_esc(char **dest, int *destlen) {
  * will be null-terminated, dest[destlen-1] = 0 if the string was cut just long
  * enough of was cut off. That byte will be left untouched if the string is
  * small enough. */
-static int rstring(char *dest, int destlen) {
+static int rstring(struct ctx *ctx, char *dest, int destlen) {
+  size_t n, c;
+
   C(rfill1);
   E(*ctx->buf != '"', "Expected string");
-  con(1);
+  con(ctx, 1);
 
   while(1) {
     C(rfill1);
+    /* Runs of plain characters are copied at once */
+    n = json_plain(ctx->buf, ctx->lastfill - ctx->buf);
+    if(dest) {
+      c = n < (size_t)destlen ? n : destlen > 1 ? (size_t)destlen-1 : 0;
+      memcpy(dest, ctx->buf, c);
+      dest += c;
+      destlen -= c;
+    }
+    con(ctx, n);
     if(*ctx->buf == '"')
       break;
-    if(*ctx->buf == '\\') {
-      con(1);
-      C(rstring_esc(&dest, &destlen));
+    if(ctx->buf == ctx->lastfill)
       continue;
-    }
-    E((unsigned char)*ctx->buf <= 0x1F || (unsigned char)*ctx->buf == 0x7F, "Invalid character");
-    if(destlen > 1) {
-      *(dest++) = *ctx->buf;
-      destlen--;
-    }
-    con(1);
+    E(*ctx->buf != '\\', "Invalid character");
+    con(ctx, 1);
+    C(rstring_esc(ctx, &dest, &destlen));
   }
-  con(1);
+  con(ctx, 1);
   if(destlen > 0)
     *dest = 0;
   return 0;
@@ -282,14 +426,14 @@ static int rstring(char *dest, int destlen) {
 
 /* Parse and consume a JSON integer. Throws an error if the value does not fit
  * in an uint64_t, is not an integer or is larger than 'max'. */
-static int rint64(uint64_t *val, uint64_t max) {
+static int rint64(struct ctx *ctx, uint64_t *val, uint64_t max) {
   uint64_t v;
   int haschar = 0;
   *val = 0;
   while(1) {
-    C(!*ctx->buf && fill(1));
+    C(!*ctx->buf && fill(ctx, 1));
     if(*ctx->buf == '0' && !haschar) {
-      con(1);
+      con(ctx, 1);
       break;
     }
     if(*ctx->buf >= '0' && *ctx->buf <= '9') {
@@ -297,7 +441,7 @@ static int rint64(uint64_t *val, uint64_t max) {
       v = (*val)*10 + (*ctx->buf-'0');
       E(v < *val, "Invalid (positive) integer");
       *val = v;
-      con(1);
+      con(ctx, 1);
       continue;
     }
     E(!haschar, "Invalid (positive) integer");
@@ -310,14 +454,14 @@ static int rint64(uint64_t *val, uint64_t max) {
 
 /* Parse and consume a JSON number. The result is discarded.
  * TODO: Improve validation. */
-static int rnum(void) {
+static int rnum(struct ctx *ctx) {
   int haschar = 0;
   C(rfill1);
   while(1) {
-    C(!*ctx->buf && fill(1));
+    C(!*ctx->buf && fill(ctx, 1));
     if(*ctx->buf == 'e' || *ctx->buf == 'E' || *ctx->buf == '-' || *ctx->buf == '+' || *ctx->buf == '.' || (*ctx->buf >= '0' && *ctx->buf <= '9')) {
       haschar = 1;
-      con(1);
+      con(ctx, 1);
     } else {
       E(!haschar, "Invalid JSON value");
       break;
@@ -327,69 +471,69 @@ static int rnum(void) {
 }
 
 
-static int rlit(const char *v, int len) {
+static int rlit(struct ctx *ctx, const char *v, int len) {
   C(rfill(len));
   E(strncmp(ctx->buf, v, len) != 0, "Invalid JSON value");
-  con(len);
+  con(ctx, len);
   return 0;
 }
 
 
 /* Parse the "<space> <string> <space> : <space>" part of an object key. */
-static int rkey(char *dest, int destlen) {
-  C(cons() || rstring(dest, destlen) || cons());
+static int rkey(struct ctx *ctx, char *dest, int destlen) {
+  C(cons(ctx) || rstring(ctx, dest, destlen) || cons(ctx));
   E(*ctx->buf != ':', "Expected ':'");
-  con(1);
-  return cons();
+  con(ctx, 1);
+  return cons(ctx);
 }
 
 
 /* (Recursively) parse and consume any JSON value. The result is discarded. */
-static int rval(void) {
+static int rval(struct ctx *ctx) {
   C(rfill1);
   switch(*ctx->buf) {
   case 't': /* true */
-    C(rlit("true", 4));
+    C(rlit(ctx, "true", 4));
     break;
   case 'f': /* false */
-    C(rlit("false", 5));
+    C(rlit(ctx, "false", 5));
     break;
   case 'n': /* null */
-    C(rlit("null", 4));
+    C(rlit(ctx, "null", 4));
     break;
   case '"': /* string */
-    C(rstring(NULL, 0));
+    C(rstring(ctx, NULL, 0));
     break;
   case '{': /* object */
-    con(1);
+    con(ctx, 1);
     while(1) {
-      C(cons());
+      C(cons(ctx));
       if(*ctx->buf == '}')
         break;
-      C(rkey(NULL, 0) || rval() || cons());
+      C(rkey(ctx, NULL, 0) || rval(ctx) || cons(ctx));
       if(*ctx->buf == '}')
         break;
       E(*ctx->buf != ',', "Expected ',' or '}'");
-      con(1);
+      con(ctx, 1);
     }
-    con(1);
+    con(ctx, 1);
     break;
   case '[': /* array */
-    con(1);
+    con(ctx, 1);
     while(1) {
-      C(cons());
+      C(cons(ctx));
       if(*ctx->buf == ']')
         break;
-      C(cons() || rval() || cons());
+      C(cons(ctx) || rval(ctx) || cons(ctx));
       if(*ctx->buf == ']')
         break;
       E(*ctx->buf != ',', "Expected ',' or ']'");
-      con(1);
+      con(ctx, 1);
     }
-    con(1);
+    con(ctx, 1);
     break;
   default: /* assume number */
-    C(rnum());
+    C(rnum(ctx));
     break;
   }
 
@@ -398,122 +542,162 @@ static int rval(void) {
 
 
 /* Consumes everything up to the root item, and checks that this item is a dir. */
-static int header(void) {
+static int header(struct ctx *ctx) {
   uint64_t v;
 
-  C(cons());
+  C(cons(ctx));
   E(*ctx->buf != '[', "Expected JSON array");
-  con(1);
-  C(cons() || rint64(&v, 10000) || cons());
+  con(ctx, 1);
+  C(cons(ctx) || rint64(ctx, &v, 10000) || cons(ctx));
   E(v != 1, "Incompatible major format version");
   E(*ctx->buf != ',', "Expected ','");
-  con(1);
-  C(cons() || rint64(&v, 10000) || cons()); /* Ignore the minor version for now */
+  con(ctx, 1);
+  C(cons(ctx) || rint64(ctx, &v, 10000) || cons(ctx)); /* Ignore the minor version for now */
   E(*ctx->buf != ',', "Expected ','");
-  con(1);
+  con(ctx, 1);
   /* Metadata block is currently ignored */
-  C(cons() || rval() || cons());
+  C(cons(ctx) || rval(ctx) || cons(ctx));
   E(*ctx->buf != ',', "Expected ','");
-  con(1);
+  con(ctx, 1);
 
-  C(cons());
+  C(cons(ctx));
   E(*ctx->buf != '[', "Top-level item must be a directory");
 
   return 0;
 }
 
 
-static int item(uint64_t);
+static int item(struct ctx *ctx, uint64_t);
+static int itemdir_mt(struct ctx *ctx, uint64_t);
 
 /* Read and add dir contents */
-static int itemdir(uint64_t dev) {
+static int itemdir(struct ctx *ctx, uint64_t dev) {
   while(1) {
-    C(cons());
+    C(cons(ctx));
     if(*ctx->buf == ']')
       break;
     E(*ctx->buf != ',', "Expected ',' or ']'");
-    con(1);
-    C(cons() || item(dev));
+    con(ctx, 1);
+    C(cons(ctx) || item(ctx, dev));
   }
-  con(1);
-  C(cons());
+  con(ctx, 1);
+  C(cons(ctx));
   return 0;
 }
 
 
+static int job_stopped(void) {
+  int r;
+  pthread_mutex_lock(&job_lock);
+  r = job_stop;
+  pthread_mutex_unlock(&job_lock);
+  return r;
+}
+
+
+static void job_add(struct job *j, struct dir *d, const char *name, struct dir_ext *ext, struct dir_link *link) {
+  struct job_item *it;
+  size_t len;
+
+  if(j->nitems == j->itemcap) {
+    j->itemcap = j->itemcap ? j->itemcap*2 : 64;
+    j->items = xrealloc(j->items, j->itemcap*sizeof(struct job_item));
+  }
+  it = &j->items[j->nitems++];
+  if(!d) {
+    it->name = JOB_LEAVE;
+    return;
+  }
+
+  len = strlen(name);
+  if(j->nameslen+len+1 > j->namescap) {
+    j->namescap = j->namescap*2 > j->nameslen+len+1 ? j->namescap*2 : j->nameslen+len+1024;
+    j->names = xrealloc(j->names, j->namescap);
+  }
+  it->size = d->size;
+  it->asize = d->asize;
+  it->flags = d->flags;
+  it->ext = *ext;
+  it->link = *link;
+  it->name = j->nameslen;
+  memcpy(j->names+j->nameslen, name, len+1);
+  j->nameslen += len+1;
+}
+
+
 /* Reads a JSON object representing a struct dir/dir_ext item. Writes to
- * ctx->buf_dir, ctx->buf_ext, ctx->buf_name and ctx->nlink. */
-static int iteminfo(void) {
+ * ctx->buf_dir, ctx->buf_ext, ctx->buf_name and ctx->buf_link. */
+static int iteminfo(struct ctx *ctx) {
   uint64_t iv;
 
   E(*ctx->buf != '{', "Expected JSON object");
-  con(1);
+  con(ctx, 1);
 
   while(1) {
-    C(rkey(ctx->val, MAX_VAL));
+    C(rkey(ctx, ctx->val, MAX_VAL));
     /* TODO: strcmp() in this fashion isn't very fast. */
     if(strcmp(ctx->val, "name") == 0) {              /* name */
       ctx->val[MAX_VAL-1] = 1;
-      C(rstring(ctx->val, MAX_VAL));
+      C(rstring(ctx, ctx->val, MAX_VAL));
       E(ctx->val[MAX_VAL-1] != 1, "Too large string value");
       strcpy(ctx->buf_name, ctx->val);
     } else if(strcmp(ctx->val, "asize") == 0) {      /* asize */
-      C(rint64(&iv, INT64_MAX));
+      C(rint64(ctx, &iv, INT64_MAX));
       ctx->buf_dir->asize = iv;
     } else if(strcmp(ctx->val, "dsize") == 0) {      /* dsize */
-      C(rint64(&iv, INT64_MAX));
+      C(rint64(ctx, &iv, INT64_MAX));
       ctx->buf_dir->size = iv;
     } else if(strcmp(ctx->val, "dev") == 0) {        /* dev */
-      C(rint64(&iv, UINT64_MAX));
-      ctx->buf_dir->dev = iv;
+      C(rint64(ctx, &iv, UINT64_MAX));
+      ctx->buf_link->dev = iv;
     } else if(strcmp(ctx->val, "ino") == 0) {        /* ino */
-      C(rint64(&iv, UINT64_MAX));
-      ctx->buf_dir->ino = iv;
+      C(rint64(ctx, &iv, UINT64_MAX));
+      ctx->buf_link->ino = iv;
     } else if(strcmp(ctx->val, "uid") == 0) {        /* uid */
-      C(rint64(&iv, UINT32_MAX));
+      C(rint64(ctx, &iv, UINT32_MAX));
       ctx->buf_dir->flags |= FF_EXT;
       ctx->buf_ext->flags |= FFE_UID;
       ctx->buf_ext->uid = iv;
     } else if(strcmp(ctx->val, "gid") == 0) {        /* gid */
-      C(rint64(&iv, UINT32_MAX));
+      C(rint64(ctx, &iv, UINT32_MAX));
       ctx->buf_dir->flags |= FF_EXT;
       ctx->buf_ext->flags |= FFE_GID;
       ctx->buf_ext->gid = iv;
     } else if(strcmp(ctx->val, "mode") == 0) {       /* mode */
-      C(rint64(&iv, UINT16_MAX));
+      C(rint64(ctx, &iv, UINT16_MAX));
       ctx->buf_dir->flags |= FF_EXT;
       ctx->buf_ext->flags |= FFE_MODE;
       ctx->buf_ext->mode = iv;
     } else if(strcmp(ctx->val, "mtime") == 0) {      /* mtime */
-      C(rint64(&iv, UINT64_MAX));
+      C(rint64(ctx, &iv, UINT64_MAX));
       ctx->buf_dir->flags |= FF_EXT;
       ctx->buf_ext->flags |= FFE_MTIME;
       ctx->buf_ext->mtime = iv;
       /* Accept decimal numbers, but discard the fractional part because our data model doesn't support it. */
       if(*ctx->buf == '.') {
-          con(1);
+          con(ctx, 1);
           while(*ctx->buf >= '0' && *ctx->buf <= '9')
-              con(1);
+              con(ctx, 1);
       }
     } else if(strcmp(ctx->val, "hlnkc") == 0) {      /* hlnkc */
       if(*ctx->buf == 't') {
-        C(rlit("true", 4));
+        C(rlit(ctx, "true", 4));
         ctx->buf_dir->flags |= FF_HLNKC;
       } else
-        C(rlit("false", 5));
+        C(rlit(ctx, "false", 5));
     } else if(strcmp(ctx->val, "nlink") == 0) {      /* nlink */
-      C(rint64(&iv, UINT32_MAX));
+      C(rint64(ctx, &iv, UINT32_MAX));
       if(iv > 1)
         ctx->buf_dir->flags |= FF_HLNKC;
-      ctx->nlink = iv;
+      ctx->buf_link->nlink = iv;
     } else if(strcmp(ctx->val, "read_error") == 0) { /* read_error */
       if(*ctx->buf == 't') {
-        C(rlit("true", 4));
+        C(rlit(ctx, "true", 4));
         ctx->buf_dir->flags |= FF_ERR;
       } else
-        C(rlit("false", 5));
+        C(rlit(ctx, "false", 5));
     } else if(strcmp(ctx->val, "excluded") == 0) {   /* excluded */
-      C(rstring(ctx->val, 8));
+      C(rstring(ctx, ctx->val, 8));
       if(strcmp(ctx->val, "otherfs") == 0 || strcmp(ctx->val, "othfs") == 0)
         ctx->buf_dir->flags |= FF_OTHFS;
       else if(strcmp(ctx->val, "kernfs") == 0)
@@ -524,110 +708,587 @@ static int iteminfo(void) {
         ctx->buf_dir->flags |= FF_EXL;
     } else if(strcmp(ctx->val, "notreg") == 0) {     /* notreg */
       if(*ctx->buf == 't') {
-        C(rlit("true", 4));
+        C(rlit(ctx, "true", 4));
         ctx->buf_dir->flags &= ~FF_FILE;
       } else
-        C(rlit("false", 5));
+        C(rlit(ctx, "false", 5));
     } else
-      C(rval());
+      C(rval(ctx));
 
-    C(cons());
+    C(cons(ctx));
     if(*ctx->buf == '}')
       break;
     E(*ctx->buf != ',', "Expected ',' or '}'");
-    con(1);
+    con(ctx, 1);
   }
-  con(1);
+  con(ctx, 1);
 
   E(!*ctx->buf_name, "No name field present in item information object");
   ctx->items++;
-  /* Only call input_handle() once for every 32 items. Importing items is so
-   * fast that the time spent in input_handle() dominates when called every
-   * time. Don't set this value too high, either, as feedback should still be
-   * somewhat responsive when our import data comes from a slow-ish source. */
-  return !(ctx->items & 31) ? input_handle(1) : 0;
+  /* Workers only check for an abort once for every 1024 items, that takes a
+   * lock */
+  if(ctx->job)
+    return !(ctx->items & 1023) ? job_stopped() : 0;
+  return dir_progress();
+}
+
+
+/* Passes an item to dir_output, NULL for the end of a directory. On a worker
+ * thread, the item is added to the job instead. */
+static int output(struct ctx *ctx, struct dir *d, const char *name) {
+  if(ctx->job)
+    job_add(ctx->job, d, name, ctx->buf_ext, ctx->buf_link);
+  else if(d ? dir_output.item(d, name, ctx->buf_ext, ctx->buf_link) : dir_output.item(NULL, 0, NULL, NULL)) {
+    dir_seterr("Output error: %s", strerror(errno));
+    return 1;
+  }
+  return 0;
 }
 
 
 /* Recursively reads a file or directory item */
-static int item(uint64_t dev) {
+static int item(struct ctx *ctx, uint64_t dev) {
   int isdir = 0;
-  int isroot = ctx->items == 0;
+  int isroot = !ctx->job && ctx->items == 0;
 
   if(*ctx->buf == '[') {
     isdir = 1;
-    con(1);
-    C(cons());
+    con(ctx, 1);
+    C(cons(ctx));
   }
 
   memset(ctx->buf_dir, 0, offsetof(struct dir, name));
   memset(ctx->buf_ext, 0, sizeof(struct dir_ext));
-  ctx->nlink = 0;
+  memset(ctx->buf_link, 0, sizeof(struct dir_link));
   *ctx->buf_name = 0;
   ctx->buf_dir->flags |= isdir ? FF_DIR : FF_FILE;
-  ctx->buf_dir->dev = dev;
+  ctx->buf_link->dev = dev;
 
-  C(iteminfo());
-  dev = ctx->buf_dir->dev;
+  C(iteminfo(ctx));
+  dev = ctx->buf_link->dev;
 
   if(isroot)
     dir_curpath_set(ctx->buf_name);
-  else
+  else if(!ctx->job)
     dir_curpath_enter(ctx->buf_name);
 
+  C(output(ctx, ctx->buf_dir, ctx->buf_name));
   if(isdir) {
-    if(dir_output.item(ctx->buf_dir, ctx->buf_name, ctx->buf_ext, ctx->nlink)) {
-      dir_seterr("Output error: %s", strerror(errno));
-      return 1;
-    }
-    C(itemdir(dev));
-    if(dir_output.item(NULL, 0, NULL, 0)) {
-      dir_seterr("Output error: %s", strerror(errno));
-      return 1;
-    }
-  } else if(dir_output.item(ctx->buf_dir, ctx->buf_name, ctx->buf_ext, ctx->nlink)) {
-    dir_seterr("Output error: %s", strerror(errno));
-    return 1;
+    /* The root directory of a mapped file is split into jobs for the threads */
+    C(isroot && ctx->map && dir_scan_threads > 1 ? itemdir_mt(ctx, dev) : itemdir(ctx, dev));
+    C(output(ctx, NULL, NULL));
   }
 
-  if(!isroot)
+  if(!isroot && !ctx->job)
     dir_curpath_leave();
 
   return 0;
 }
 
 
-static int footer(void) {
+static int footer(struct ctx *ctx) {
   while(1) {
-    C(cons());
+    C(cons(ctx));
     if(*ctx->buf == ']')
       break;
     E(*ctx->buf != ',', "Expected ',' or ']'");
-    con(1);
-    C(cons() || rval());
+    con(ctx, 1);
+    C(cons(ctx) || rval(ctx));
+  }
+  con(ctx, 1);
+  C(cons(ctx));
+  E(ctx->buf != ctx->lastfill, "Trailing garbage");
+  return 0;
+}
+
+
+/* Characters that skip() stops at, outside and inside strings */
+static const char skip_stop[256] = {
+  [0] = 1, ['"'] = 1, ['['] = 1, [']'] = 1, ['{'] = 1, ['}'] = 1, ['\n'] = 1
+};
+static const char skip_stop_str[256] = {
+  [0] = 1, ['"'] = 1, ['\\'] = 1
+};
+
+/* Skips over an item without parsing it, only looking for the end of its
+ * strings, objects and arrays. The item is validated by the thread that
+ * parses it. Returns non-zero if the data ends before the item does. */
+static int skip(struct ctx *ctx) {
+  unsigned char *p = (unsigned char *)ctx->buf, *nl = NULL;
+  int depth = 0;
+
+  do {
+    while(!skip_stop[*p])
+      p++;
+    switch(*p) {
+    case 0:
+      return 1;
+    case '"':
+      for(p++; !skip_stop_str[*p] || (*p == '\\' && p[1]); p++)
+        if(*p == '\\')
+          p++;
+      if(*p != '"')
+        continue;
+      break;
+    case '[':
+    case '{':
+      depth++;
+      break;
+    case ']':
+    case '}':
+      depth--;
+      break;
+    case '\n':
+      ctx->line++;
+      nl = p;
+      break;
+    }
+    p++;
+  } while(depth > 0);
+
+  ctx->byte = nl ? p-nl-1 : ctx->byte+((char *)p-ctx->buf);
+  ctx->buf = (char *)p;
+  return 0;
+}
+
+
+/* Splits off the next job from the items of the root directory. Sets *end
+ * when the closing bracket of the directory has been reached, or to -1 if the
+ * data is broken in a way that skip() can't get past. The rest of the file is
+ * then left to the last job, whose parser reports the actual error. */
+static int split(struct ctx *ctx, uint64_t dev, int *end) {
+  struct job *j;
+  char *start = NULL;
+  int line = 0, byte = 0;
+
+  while(!start || ctx->buf - start < JOB_SIZE) {
+    C(cons(ctx));
+    if(*ctx->buf == ']') {
+      *end = 1;
+      break;
+    }
+    E(*ctx->buf != ',', "Expected ',' or ']'");
+    con(ctx, 1);
+    C(cons(ctx));
+    if(!start) {
+      start = ctx->buf;
+      line = ctx->line;
+      byte = ctx->byte;
+    }
+    if(skip(ctx)) {
+      ctx->buf = ctx->lastfill;
+      *end = -1;
+      break;
+    }
+  }
+  if(!start)
+    return 0;
+
+  j = xcalloc(1, sizeof(struct job));
+  j->start = start;
+  j->end = ctx->buf;
+  j->line = line;
+  j->byte = byte;
+  j->dev = dev;
+
+  pthread_mutex_lock(&job_lock);
+  if(njobs == jobcap) {
+    jobcap = jobcap ? jobcap*2 : 64;
+    jobs = xrealloc(jobs, jobcap*sizeof(struct job *));
+  }
+  jobs[njobs++] = j;
+  pthread_cond_signal(&job_work);
+  pthread_mutex_unlock(&job_lock);
+  return 0;
+}
+
+
+static int job_items(struct ctx *ctx, struct job *j) {
+  while(1) {
+    C(item(ctx, j->dev) || cons(ctx));
+    if(ctx->buf >= j->end)
+      return 0;
+    E(*ctx->buf != ',', "Expected ',' or ']'");
+    con(ctx, 1);
+    C(cons(ctx));
+  }
+}
+
+
+/* Parses the items of a job and marks it as done */
+static void job_parse(struct ctx *ctx, struct job *j) {
+  ctx->job = j;
+  ctx->buf = j->start;
+  ctx->line = j->line;
+  ctx->byte = j->byte;
+  ctx->items = 0;
+  job_items(ctx, j);
+  ctx->job = NULL;
+
+  pthread_mutex_lock(&job_lock);
+  j->state = JOB_DONE;
+  pthread_cond_signal(&job_done);
+  pthread_mutex_unlock(&job_lock);
+}
+
+
+static void *job_run(void *arg) {
+  struct ctx *ctx = arg;
+  struct job *j;
+
+  while(1) {
+    pthread_mutex_lock(&job_lock);
+    while(!job_stop && job_next == njobs)
+      pthread_cond_wait(&job_work, &job_lock);
+    if((j = job_stop ? NULL : jobs[job_next]) != NULL) {
+      job_next++;
+      j->state = JOB_RUNNING;
+    }
+    pthread_mutex_unlock(&job_lock);
+
+    if(!j)
+      return NULL;
+    job_parse(ctx, j);
+  }
+}
+
+
+/* Waits for a job to finish, parsing it on the main thread with ctx if no
+ * worker has picked it up yet. Checks for an abort while waiting. */
+static int job_wait(struct ctx *ctx, struct job *j) {
+  struct timespec ts;
+
+  pthread_mutex_lock(&job_lock);
+  while(j->state != JOB_DONE) {
+    /* Jobs are taken in order, and all jobs before this one are done */
+    if(j->state == JOB_QUEUED) {
+      job_next++;
+      j->state = JOB_RUNNING;
+      pthread_mutex_unlock(&job_lock);
+      job_parse(ctx, j);
+      pthread_mutex_lock(&job_lock);
+      continue;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += 50*1000*1000;
+    if(ts.tv_nsec >= 1000*1000*1000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000*1000*1000;
+    }
+    pthread_cond_timedwait(&job_done, &job_lock, &ts);
+    if(j->state != JOB_DONE) {
+      pthread_mutex_unlock(&job_lock);
+      if(dir_progress())
+        return 1;
+      pthread_mutex_lock(&job_lock);
+    }
+  }
+  pthread_mutex_unlock(&job_lock);
+  return 0;
+}
+
+
+/* Outputs the items of a finished job, followed by its error if it failed
+ * halfway */
+static int job_output(struct ctx *ctx, struct job *j) {
+  struct job_item *it;
+  const char *name;
+  int i;
+
+  for(i=0; i<j->nitems; i++) {
+    it = &j->items[i];
+    if(it->name == JOB_LEAVE) {
+      C(output(ctx, NULL, NULL));
+      dir_curpath_leave();
+    } else {
+      name = j->names + it->name;
+      dir_curpath_enter(name);
+      memset(ctx->buf_dir, 0, offsetof(struct dir, name));
+      ctx->buf_dir->size = it->size;
+      ctx->buf_dir->asize = it->asize;
+      ctx->buf_dir->flags = it->flags;
+      *ctx->buf_ext = it->ext;
+      *ctx->buf_link = it->link;
+      C(output(ctx, ctx->buf_dir, name));
+      if(!(it->flags & FF_DIR))
+        dir_curpath_leave();
+    }
+    C(dir_progress());
+  }
+
+  if(*j->err) {
+    dir_seterr("%s", j->err);
+    return 1;
   }
-  con(1);
-  C(cons());
-  E(*ctx->buf, "Trailing garbage");
   return 0;
 }
 
 
+static void job_free(struct job *j) {
+  free(j->items);
+  free(j->names);
+  free(j);
+}
+
+
+static struct ctx *ctx_new(FILE *stream, char *map, size_t mapsize) {
+  struct ctx *ctx = xmalloc(sizeof(struct ctx));
+  ctx->stream = stream;
+  ctx->map = map;
+  ctx->mapsize = mapsize;
+  ctx->job = NULL;
+  ctx->compressed = ctx->binary = 0;
+#if HAVE_ZSTD
+  ctx->zstd = NULL;
+  ctx->zbuf = NULL;
+  ctx->zerr = ctx->zlast = 0;
+  ctx->ztrunc = 0;
+#endif
+  ctx->line = 1;
+  ctx->byte = ctx->eof = ctx->items = 0;
+  ctx->buf = ctx->lastfill = ctx->readbuf;
+  ctx->buf_dir = xmalloc(dir_memsize(""));
+  ctx->readbuf[0] = 0;
+  if(map) {
+    ctx->buf = map;
+    ctx->lastfill = map + mapsize;
+    ctx->eof = 1;
+  }
+  return ctx;
+}
+
+
+static void ctx_free(struct ctx *ctx) {
+#if HAVE_ZSTD
+  ZSTD_freeDStream(ctx->zstd);
+  free(ctx->zbuf);
+#endif
+  free(ctx->buf_dir);
+  free(ctx);
+}
+
+
+/* Reads the contents of the root directory of a mapped file with
+ * dir_scan_threads threads. The main thread splits the items into jobs, which
+ * are parsed by the workers into lists of items. These are output in order
+ * by the main thread, which parses a job itself if no worker has got to it
+ * yet. */
+static int itemdir_mt(struct ctx *ctx, uint64_t dev) {
+  struct ctx **ctxs;
+  pthread_t *threads;
+  int i, out, started, end = 0, fail = 0, n = dir_scan_threads;
+
+  jobs = NULL;
+  njobs = jobcap = job_next = job_stop = 0;
+
+  /* The last ctx belongs to the main thread */
+  ctxs = xmalloc(n*sizeof(struct ctx *));
+  for(i=0; i<n; i++)
+    ctxs[i] = ctx_new(NULL, ctx->map, ctx->mapsize);
+  threads = xmalloc(n*sizeof(pthread_t));
+  for(started=0; started<n-1; started++)
+    if(pthread_create(&threads[started], NULL, job_run, ctxs[started]))
+      break;
+
+  for(out=0; !fail; out++) {
+    while(!fail && !end && njobs-out < JOB_AHEAD*n)
+      fail = split(ctx, dev, &end);
+    if(fail || out == njobs || (fail = job_wait(ctxs[n-1], jobs[out])))
+      break;
+    fail = job_output(ctx, jobs[out]);
+    job_free(jobs[out]);
+    jobs[out] = NULL;
+  }
+
+  pthread_mutex_lock(&job_lock);
+  job_stop = 1;
+  pthread_cond_broadcast(&job_work);
+  pthread_mutex_unlock(&job_lock);
+  for(i=0; i<started; i++)
+    pthread_join(threads[i], NULL);
+
+  for(i=0; i<njobs; i++)
+    if(jobs[i])
+      job_free(jobs[i]);
+  free(jobs);
+  for(i=0; i<n; i++)
+    ctx_free(ctxs[i]);
+  free(ctxs);
+  free(threads);
+
+  C(fail);
+  E(end < 0, "Unexpected EOF");
+  con(ctx, 1);
+  return cons(ctx);
+}
+
+
+/* Maps a regular file in memory. An anonymous page is mapped right after the
+ * file, so the data is always followed by a zero byte like in readbuf. */
+static char *map_file(FILE *stream, size_t *size) {
+  struct stat st;
+  char *map;
+
+  if(fstat(fileno(stream), &st) || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+      (uint64_t)st.st_size >= SIZE_MAX/2)
+    return NULL;
+  *size = st.st_size;
+  if((map = mmap(NULL, *size+1, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+    return NULL;
+  if(mmap(map, *size, PROT_READ, MAP_PRIVATE|MAP_FIXED, fileno(stream), 0) == MAP_FAILED) {
+    munmap(map, *size+1);
+    return NULL;
+  }
+  return map;
+}
+
+
+/* Reads n bytes of a binary export, starting with what is left in readbuf */
+static int bin_read(struct ctx *ctx, void *dest, size_t n, uint64_t off) {
+  size_t r = ctx->lastfill - ctx->buf;
+
+  if(r > n)
+    r = n;
+  memcpy(dest, ctx->buf, r);
+  ctx->buf += r;
+  if(r < n && fread((char *)dest+r, 1, n-r, ctx->stream) != n-r) {
+    if(ferror(ctx->stream))
+      dir_seterr("Read error: %s", strerror(errno));
+    else
+      dir_seterr("Offset %"PRIu64": Unexpected EOF", off);
+    return 1;
+  }
+  return 0;
+}
+
+
+/* Reads the records of a binary export. Directories are left when a record
+ * refers to a parent further up, the footer isn't needed for this. */
+static int bin_items(struct ctx *ctx) {
+  struct export_header h;
+  struct export_record r;
+  struct stack { uint64_t *list; int size, top; } stack;
+  uint64_t off = sizeof(h);
+  size_t len;
+  int i, fail = 0;
+
+  if(bin_read(ctx, &h, sizeof(h), 0))
+    return 1;
+  if(h.byteorder != EXPORT_BYTEORDER) {
+    dir_seterr("Binary export was written on a machine with a different byte order");
+    return 1;
+  }
+  if(h.version != EXPORT_VERSION) {
+    dir_seterr("Incompatible binary export version");
+    return 1;
+  }
+
+  nstack_init(&stack);
+  while(!fail) {
+    if((fail = bin_read(ctx, &r, sizeof(r), off)))
+      break;
+    if(!r.namelen)
+      break;
+    len = r.namelen + 8 - r.namelen%8;
+    if(r.namelen >= MAX_VAL-8 || (fail = bin_read(ctx, ctx->buf_name, len, off)))
+      break;
+    if(strlen(ctx->buf_name) != r.namelen || (!ctx->items && !(r.flags & FF_DIR)))
+      break;
+
+    /* Leave the directories that this item is not in */
+    for(i=stack.top-1; i>=0 && stack.list[i] != r.parent; i--)
+      ;
+    if(ctx->items && i < 0)
+      break;
+    while(stack.top > i+1 && !fail) {
+      nstack_pop(&stack);
+      fail = output(ctx, NULL, NULL);
+      dir_curpath_leave();
+    }
+    if(fail)
+      break;
+
+    memset(ctx->buf_dir, 0, offsetof(struct dir, name));
+    memset(ctx->buf_ext, 0, sizeof(struct dir_ext));
+    memset(ctx->buf_link, 0, sizeof(struct dir_link));
+    ctx->buf_dir->flags = r.flags & (FF_DIR|FF_FILE|FF_ERR|FF_OTHFS|FF_EXL|FF_HLNKC|FF_KERNFS|FF_FRMLNK);
+    ctx->buf_dir->size = r.size;
+    ctx->buf_dir->asize = r.asize;
+    ctx->buf_link->ino = r.ino;
+    ctx->buf_link->dev = r.dev;
+    ctx->buf_link->nlink = r.nlink;
+    if(r.flags & FF_EXT) {
+      ctx->buf_dir->flags |= FF_EXT;
+      ctx->buf_ext->flags = r.extflags;
+      ctx->buf_ext->mtime = r.mtime;
+      ctx->buf_ext->uid = r.uid;
+      ctx->buf_ext->gid = r.gid;
+      ctx->buf_ext->mode = r.mode;
+    }
+
+    if(!ctx->items)
+      dir_curpath_set(ctx->buf_name);
+    else
+      dir_curpath_enter(ctx->buf_name);
+    if((fail = output(ctx, ctx->buf_dir, ctx->buf_name)))
+      break;
+    if(r.flags & FF_DIR)
+      nstack_push(&stack, off);
+    else
+      dir_curpath_leave();
+
+    off += sizeof(r) + len;
+    ctx->items++;
+    if((fail = dir_progress()))
+      break;
+  }
+
+  if(!fail && r.namelen) {
+    dir_seterr("Offset %"PRIu64": Invalid item", off);
+    fail = 1;
+  }
+  while(!fail && stack.top) {
+    nstack_pop(&stack);
+    fail = output(ctx, NULL, NULL);
+    if(stack.top)
+      dir_curpath_leave();
+  }
+  nstack_free(&stack);
+  return fail;
+}
+
+
+static struct ctx *import_ctx;
+
 static int process(void) {
+  struct ctx *ctx = import_ctx;
   int fail = 0;
 
-  header();
+  dir_progress_start();
 
-  if(!dir_fatalerr)
-    fail = item(0);
+#if !HAVE_ZSTD
+  if(ctx->compressed)
+    dir_seterr("Compressed file, indu was built without zstd support");
+  else
+#endif
+  if(ctx->binary)
+    fail = bin_items(ctx);
+  else {
+    header(ctx);
+
+    if(!dir_fatalerr)
+      fail = item(ctx, 0);
 
-  if(!dir_fatalerr && !fail)
-    footer();
+    if(!dir_fatalerr && !fail)
+      footer(ctx);
+  }
 
+  if(ctx->map)
+    munmap(ctx->map, ctx->mapsize+1);
   if(fclose(ctx->stream) && !dir_fatalerr && !fail)
     dir_seterr("Error closing file: %s", strerror(errno));
-  free(ctx->buf_dir);
-  free(ctx);
+  ctx_free(ctx);
+  dir_progress_stop();
 
   while(dir_fatalerr && !input_handle(0))
     ;
@@ -635,20 +1296,49 @@ static int process(void) {
 }
 
 
+/* Regular files are mapped in memory, anything else (like stdin) and
+ * compressed or binary files are streamed through readbuf */
 int dir_import_init(const char *fn) {
   FILE *stream;
+  char *map = NULL, magic[8];
+  size_t mapsize = 0, n;
+  int compressed, binary;
+
   if(strcmp(fn, "-") == 0)
     stream = stdin;
   else if((stream = fopen(fn, "r")) == NULL)
     return 1;
 
-  ctx = xmalloc(sizeof(struct ctx));
-  ctx->stream = stream;
-  ctx->line = 1;
-  ctx->byte = ctx->eof = ctx->items = 0;
-  ctx->buf = ctx->lastfill = ctx->readbuf;
-  ctx->buf_dir = xmalloc(dir_memsize(""));
-  ctx->readbuf[0] = 0;
+  /* The peeked bytes are kept if the stream can't be rewound */
+  n = fread(magic, 1, sizeof(magic), stream);
+  compressed = n >= 4 && memcmp(magic, ZSTD_MAGIC, 4) == 0;
+  binary = n == sizeof(magic) && memcmp(magic, EXPORT_MAGIC, sizeof(magic)) == 0;
+  if(stream != stdin && fseek(stream, 0, SEEK_SET) == 0) {
+    n = 0;
+    if(!compressed && !binary)
+      map = map_file(stream, &mapsize);
+  }
+
+  import_ctx = ctx_new(stream, map, mapsize);
+  import_ctx->compressed = compressed;
+  import_ctx->binary = binary;
+  if(compressed) {
+#if HAVE_ZSTD
+    if((import_ctx->zstd = ZSTD_createDStream()) == NULL) {
+      errno = ENOMEM;
+      return 1;
+    }
+    import_ctx->zbuf = xmalloc(ZSTD_DStreamInSize());
+    memcpy(import_ctx->zbuf, magic, n);
+    import_ctx->zin.src = import_ctx->zbuf;
+    import_ctx->zin.size = n;
+    import_ctx->zin.pos = 0;
+#endif
+  } else if(n) {
+    memcpy(import_ctx->readbuf, magic, n);
+    import_ctx->lastfill = import_ctx->readbuf + n;
+    *import_ctx->lastfill = 0;
+  }
 
   dir_curpath_set(fn);
   dir_process = process;
@@ -656,3 +1346,106 @@ int dir_import_init(const char *fn) {
   return 0;
 }
 
+
+
+/* Binary export mapped by dir_import_query() */
+static const char *qmap;
+static size_t qsize;
+
+/* Returns the record at off, dies if it's not within the list of records */
+static const struct export_record *query_record(uint64_t off) {
+  const struct export_record *r;
+
+  if(off < sizeof(struct export_header) || off % 8 || off > qsize - sizeof(struct export_footer) - sizeof(*r))
+    die("Invalid record offset in binary export.\n");
+  r = (const struct export_record *)(qmap + off);
+  if(r->namelen == 0 || r->namelen >= qsize - off - sizeof(*r) || qmap[off + sizeof(*r) + r->namelen])
+    die("Invalid record in binary export.\n");
+  return r;
+}
+
+
+/* Builds the path of the record at off from its parents, which always come
+ * before it in the file */
+static char *query_path(uint64_t off) {
+  const struct export_record *r;
+  char *path = NULL, *tmp;
+  size_t len = 0, n;
+
+  while(1) {
+    r = query_record(off);
+    n = r->namelen;
+    tmp = xmalloc(n + 1 + len + 1);
+    memcpy(tmp, qmap + off + sizeof(*r), n);
+    if(path) {
+      if(tmp[n-1] != '/')
+        tmp[n++] = '/';
+      memcpy(tmp+n, path, len);
+      free(path);
+    }
+    len += n;
+    tmp[len] = 0;
+    path = tmp;
+    if(!r->parent)
+      break;
+    if(r->parent >= off)
+      die("Invalid parent offset in binary export.\n");
+    off = r->parent;
+  }
+  return path;
+}
+
+
+int dir_import_query(const char *fn, const char *query) {
+  const struct export_header *h;
+  const struct export_footer *f;
+  const struct export_top *t;
+  struct stat st;
+  char *path;
+  uint64_t i, n;
+  long top = 0;
+  int fd;
+
+  /* N starts with a digit, strtol() would take a sign or spaces as well */
+  if(strcmp(query, "totals") != 0 && (strncmp(query, "top=", 4) != 0 || query[4] < '0' || query[4] > '9' ||
+      (top = strtol(query+4, &path, 10)) <= 0 || *path))
+    die("Unknown query: %s\n", query);
+
+  if((fd = open(fn, O_RDONLY)) < 0 || fstat(fd, &st))
+    die("Can't open %s: %s\n", fn, strerror(errno));
+  if(!S_ISREG(st.st_mode) || (uint64_t)st.st_size < sizeof(*h) + sizeof(*f) || (uint64_t)st.st_size >= SIZE_MAX/2)
+    die("%s is not a binary export.\n", fn);
+  qsize = st.st_size;
+  if((qmap = mmap(NULL, qsize, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    die("Can't map %s: %s\n", fn, strerror(errno));
+  close(fd);
+
+  h = (const struct export_header *)qmap;
+  f = (const struct export_footer *)(qmap + qsize - sizeof(*f));
+  if(memcmp(h->magic, EXPORT_MAGIC, sizeof(h->magic)) != 0 || qsize % 8 ||
+      memcmp(f->magic, EXPORT_MAGIC, sizeof(f->magic)) != 0)
+    die("%s is not a binary export.\n", fn);
+  if(h->byteorder != EXPORT_BYTEORDER)
+    die("Binary export was written on a machine with a different byte order.\n");
+  if(h->version != EXPORT_VERSION)
+    die("Incompatible binary export version.\n");
+  if(f->top % 8 || f->top > qsize - sizeof(*f) || f->ntop > (qsize - sizeof(*f) - f->top) / sizeof(*t))
+    die("Invalid footer in binary export.\n");
+  n = (uint64_t)top < f->ntop ? (uint64_t)top : f->ntop;
+
+  if(!top) {
+    path = query_path(sizeof(*h));
+    printf("%"PRId64"\t%"PRId64"\t%"PRIu64"\t%s\n", f->size, f->asize, f->items, path);
+    free(path);
+  }
+
+  t = (const struct export_top *)(qmap + f->top);
+  for(i=0; i<n; i++) {
+    path = query_path(t[i].offset);
+    printf("%"PRId64"\t%"PRId64"\t%"PRIu64"\t%s\n", t[i].size, t[i].asize, t[i].items, path);
+    free(path);
+  }
+
+  munmap((void *)qmap, qsize);
+  return 0;
+}
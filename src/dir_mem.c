@@ -25,9 +25,15 @@
 */
 
 #include "global.h"
+#include "dir_cache.h"
+#include "stats.h"
 
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <khashl.h>
 
@@ -36,12 +42,443 @@ static struct dir *root;   /* root directory struct we're scanning */
 static struct dir *curdir; /* directory item that we're currently adding items to */
 static struct dir *orig;   /* original directory, when refreshing an already scanned dir */
 
+/* All struct dir items live in this arena, they're released with freedir() */
+static struct arena nodes;
+
 /* Table of struct dir items with more than one link (in order to detect hard links) */
-#define hlink_hash(d)     (kh_hash_uint64((khint64_t)d->dev) ^ kh_hash_uint64((khint64_t)d->ino))
-#define hlink_equal(a, b) ((a)->dev == (b)->dev && (a)->ino == (b)->ino)
+#define hlink_hash(d)     (kh_hash_uint64((khint64_t)dir_link_ptr(d)->dev) ^ kh_hash_uint64((khint64_t)dir_link_ptr(d)->ino))
+#define hlink_equal(a, b) (dir_link_ptr(a)->dev == dir_link_ptr(b)->dev && dir_link_ptr(a)->ino == dir_link_ptr(b)->ino)
 KHASHL_SET_INIT(KH_LOCAL, hl_t, hl, struct dir *, hlink_hash, hlink_equal)
 static hl_t *links = NULL;
 
+/* Hard link candidates added during this scan, in order */
+static struct {
+  struct dir **list;
+  int size, top;
+} newlinks;
+
+/* Directories that have counted the inode that hlink_sizes() is working on,
+ * the stack holds the same items so that they can be cleared quickly */
+#define mark_hash(d) kh_hash_uint64((khint64_t)(uintptr_t)(d))
+KHASHL_SET_INIT(KH_LOCAL, hs_t, hs, struct dir *, mark_hash, kh_eq_generic)
+static hs_t *marked = NULL;
+static struct {
+  struct dir **list;
+  int size, top;
+} markstack;
+
+uint64_t dir_mem_limit = 0;
+
+/* The spill file is unlinked as soon as it has been created. Every spilled
+ * directory is a struct spill_block followed by its items, each a struct
+ * spill_item and a copy of the node. The file starts with a few unused bytes,
+ * so that block 0 can mean "not spilled". */
+struct spill_block {
+  uint64_t len; /* including this header */
+  uint32_t n, pad;
+};
+
+struct spill_item {
+  uint64_t block; /* of the item if it is a spilled directory, else 0 */
+  uint32_t size;  /* of the node copy, a multiple of 8 */
+  uint32_t pad;
+};
+
+static int spill_fd = -1;
+static uint64_t spill_len = 8;
+static size_t spill_at;   /* size of the nodes arena at which to spill again */
+static int spill_busy;    /* set while dir_mem_expand() adds items, which are
+                             neither spilled nor offered to the top lists */
+static char *spill_buf;
+static size_t spill_bufsize;
+
+/* Blocks of the stubs that are in the tree now */
+#define spill_hash(d) kh_hash_uint64((khint64_t)(uintptr_t)(d))
+KHASHL_MAP_INIT(KH_LOCAL, sp_t, sp, struct dir *, uint64_t, spill_hash, kh_eq_generic)
+static sp_t *spilled = NULL;
+
+/* The largest files [0] and directories [1], as min-heaps on disk usage so
+ * that the smallest is the first to be replaced. They hold twice the number
+ * that dir_mem_top() gives, the others take the place of deleted items. The
+ * size of a node is read from the node itself: when that changes, the heap
+ * is put back in order with top_heapify(). Items by path are always below an
+ * FF_CACHED stub, see top_walk(). */
+#define TOP_KEEP (2*DIR_TOP)
+struct top_heap {
+  struct dir_top list[TOP_KEEP];
+  int n;
+};
+static struct top_heap tops[2];
+
+#define top_size(t)  ((t)->rel ? (t)->size : (t)->d->size)
+#define top_asize(t) ((t)->rel ? (t)->asize : (t)->d->asize)
+
+/* Items by full path, sorted. Cached directories take theirs from this list,
+ * it holds those of <cache>.top during the first scan and those of the
+ * directory that is being refreshed later on. Without a usable <cache>.top,
+ * they're read from the cache entries instead. The items of <cache>.top that
+ * are outside of the tree are kept aside, to be saved again. */
+struct top_saved {
+  char *path;
+  int64_t size, asize;
+  int dir;
+};
+static struct top_saved *saved, *other;
+static int nsaved, nother;
+static int saved_ok; /* whether saved has the items of all cached directories */
+
+/* Root of the complete tree, once there is one */
+static struct dir *tree;
+
+/* <cache>.top starts with a line identifying the cache file, like the one of
+ * <cache>.watch:
+ *   indu-top <version> <dev> <ino> <size> <mtime> <journal length>
+ * followed by the items as "<f|d> <size> <asize> <path>", each terminated by
+ * a 0 byte */
+#define TOP_MAGIC   "indu-top"
+#define TOP_VERSION 1
+
+
+static void top_sift(struct top_heap *h, int i) {
+  struct dir_top t;
+  int c;
+
+  while((c = 2*i+1) < h->n) {
+    if(c+1 < h->n && top_size(&h->list[c+1]) < top_size(&h->list[c]))
+      c++;
+    if(top_size(&h->list[i]) <= top_size(&h->list[c]))
+      break;
+    t = h->list[i];
+    h->list[i] = h->list[c];
+    h->list[c] = t;
+    i = c;
+  }
+}
+
+
+static void top_heapify(struct top_heap *h) {
+  int i;
+  for(i=h->n/2-1; i>=0; i--)
+    top_sift(h, i);
+}
+
+
+static void top_release(struct dir_top *t) {
+  if(t->rel)
+    free(t->rel);
+  else
+    t->d->flags &= ~FF_TOP;
+}
+
+
+/* Removes the item at i, the heap has to be put in order afterwards */
+static void top_remove(struct top_heap *h, int i) {
+  top_release(&h->list[i]);
+  h->list[i] = h->list[--h->n];
+}
+
+
+/* Moves t down to the node of its item, as far as the tree has been read */
+static void top_walk(struct dir_top *t) {
+  struct dir *c;
+  char *p;
+  size_t len;
+
+  while(t->rel && !(t->d->flags & FF_CACHED)) {
+    p = strchr(t->rel, '/');
+    len = p ? (size_t)(p - t->rel) : strlen(t->rel);
+    for(c=t->d->sub; c && (strncmp(c->name, t->rel, len) || c->name[len]); c=c->next)
+      ;
+    if(!c)
+      break;
+    t->d = c;
+    if(p)
+      memmove(t->rel, p+1, strlen(p+1)+1);
+    else {
+      free(t->rel);
+      t->rel = NULL;
+    }
+  }
+}
+
+
+/* Adds the item at rel below d, or d itself if rel is NULL, if it is among
+ * the largest. rel is taken over. */
+static void top_add(struct dir *d, char *rel, int64_t size, int64_t asize, int dir) {
+  struct top_heap *h = &tops[dir];
+  struct dir_top t;
+  int i;
+
+  if(size <= 0 || (h->n == TOP_KEEP && size <= top_size(&h->list[0]))) {
+    free(rel);
+    return;
+  }
+  t.d = d;
+  t.rel = rel;
+  t.size = size;
+  t.asize = asize;
+  top_walk(&t);
+  if(!t.rel) {
+    if(t.d->flags & FF_TOP)
+      return;
+    t.d->flags |= FF_TOP;
+  }
+
+  if(h->n == TOP_KEEP) {
+    top_release(&h->list[0]);
+    h->list[0] = t;
+    top_sift(h, 0);
+    return;
+  }
+  for(i=h->n++; i > 0 && size < top_size(&h->list[(i-1)/2]); i=(i-1)/2)
+    h->list[i] = h->list[(i-1)/2];
+  h->list[i] = t;
+}
+
+
+static void top_offer(struct dir *d) {
+  if(!(d->flags & FF_TOP))
+    top_add(d, NULL, d->size, d->asize, !!(d->flags & FF_DIR));
+}
+
+
+/* Returns the path of d relative to base, or NULL if d isn't below base */
+static char *top_relpath(struct dir *d, struct dir *base) {
+  struct dir *t;
+  size_t len = 0, l;
+  char *r;
+
+  for(t=d; t && t != base; t=t->parent)
+    len += strlen(t->name)+1;
+  if(!t || d == base)
+    return NULL;
+
+  r = xmalloc(len);
+  r[--len] = 0;
+  for(t=d; t != base; t=t->parent) {
+    l = strlen(t->name);
+    len -= l;
+    memcpy(r+len, t->name, l);
+    if(len)
+      r[--len] = '/';
+  }
+  return r;
+}
+
+
+/* Whether the item of t is dr or below it */
+static int top_within(const struct dir_top *t, struct dir *dr) {
+  struct dir *p;
+  char *rel;
+  size_t len;
+  int r;
+
+  for(p=t->d; p; p=p->parent)
+    if(p == dr)
+      return 1;
+  if(!t->rel || (rel = top_relpath(dr, t->d)) == NULL)
+    return 0;
+  len = strlen(rel);
+  r = strncmp(t->rel, rel, len) == 0 && (t->rel[len] == '/' || !t->rel[len]);
+  free(rel);
+  return r;
+}
+
+
+/* Whether path is dir or below it, dir being len bytes without a trailing
+ * slash */
+static int top_under(const char *path, const char *dir, size_t len) {
+  return strncmp(path, dir, len) == 0 && (path[len] == '/' || !path[len]);
+}
+
+
+static int top_saved_cmp(const void *a, const void *b) {
+  return strcmp(((const struct top_saved *)a)->path, ((const struct top_saved *)b)->path);
+}
+
+
+static void top_saved_free(struct top_saved **list, int *n) {
+  while(*n > 0)
+    free((*list)[--*n].path);
+  free(*list);
+  *list = NULL;
+}
+
+
+/* Whether an item of this size would be added */
+static int top_wanted(int dir, int64_t size) {
+  return size > 0 && (tops[dir].n < TOP_KEEP || size > top_size(&tops[dir].list[0]));
+}
+
+
+/* Adds the items below the cached directory d from its cache entries, for
+ * when there's no saved list to take them from. *path holds the path of
+ * entry relative to d, which is len bytes long. The totals of entry are
+ * added to *tsize and *tasize; a stub has no hard links below it, so they
+ * add up the way item() would. */
+static void top_cached(struct dir *d, struct cache_entry *entry, char **path, size_t *pathsize, size_t len, int64_t *tsize, int64_t *tasize) {
+  const struct cache_child *child;
+  struct cache_child tmp;
+  struct cache_entry *sub;
+  size_t l;
+  int64_t size, asize;
+  int i, dir;
+
+  for(i=0; i<entry->nchildren; i++) {
+    child = dir_cache_child(entry, i, &tmp);
+    l = len + strlen(child->name) + 2;
+    if(*pathsize < l)
+      *path = xrealloc(*path, *pathsize = l < 256 ? 256 : l*2);
+    if(len)
+      (*path)[len] = '/';
+    strcpy(*path + (len ? len+1 : 0), child->name);
+    l = len ? len+1+strlen(child->name) : strlen(child->name);
+
+    size = child->size;
+    asize = child->asize;
+    dir = !!(child->flags & FF_DIR);
+    if(dir && !(child->flags & (FF_ERR|FF_EXL|FF_OTHFS|FF_KERNFS|FF_FRMLNK)) && (sub = dir_cache_sub(entry, i)) != NULL) {
+      top_cached(d, sub, path, pathsize, l, &size, &asize);
+      (*path)[l] = 0;
+    }
+    if(top_wanted(dir, size))
+      top_add(d, xstrdup(*path), size, asize, dir);
+    *tsize = adds64(*tsize, size);
+    *tasize = adds64(*tasize, asize);
+  }
+}
+
+
+/* Adds the items below d, for a cached directory that hasn't been read */
+static void top_merge(struct dir *d) {
+  struct cache_entry *entry;
+  char *rel = NULL;
+  size_t relsize = 0;
+  int64_t size = 0, asize = 0;
+  const char *path;
+  size_t len;
+  int lo = 0, hi = nsaved, m;
+
+  if(!saved_ok) {
+    if((entry = dir_cache_get(getpath(d))) != NULL)
+      top_cached(d, entry, &rel, &relsize, 0, &size, &asize);
+    free(rel);
+    return;
+  }
+  if(!nsaved)
+    return;
+  path = getpath(d);
+  len = strlen(path);
+  if(path[len-1] == '/')
+    len--;
+
+  while(lo < hi) {
+    m = (lo+hi)/2;
+    if(strncmp(saved[m].path, path, len) < 0)
+      lo = m+1;
+    else
+      hi = m;
+  }
+  for(; lo < nsaved && strncmp(saved[lo].path, path, len) == 0; lo++)
+    if(saved[lo].path[len] == '/')
+      top_add(d, xstrdup(saved[lo].path+len+1), saved[lo].size, saved[lo].asize, saved[lo].dir);
+}
+
+
+/* Moves the items below d before its contents are spilled, the nodes are
+ * about to be freed */
+static void top_rebase(struct dir *d) {
+  struct dir_top *t;
+  char *rel, *tmp;
+  int i, j;
+
+  for(j=0; j<2; j++)
+    for(i=0; i<tops[j].n; i++) {
+      t = &tops[j].list[i];
+      if((rel = top_relpath(t->d, d)) == NULL)
+        continue;
+      if(t->rel) {
+        tmp = xmalloc(strlen(rel) + strlen(t->rel) + 2);
+        sprintf(tmp, "%s/%s", rel, t->rel);
+        free(rel);
+        free(t->rel);
+        rel = tmp;
+      } else {
+        t->size = t->d->size;
+        t->asize = t->d->asize;
+      }
+      t->d = d;
+      t->rel = rel;
+    }
+}
+
+
+/* Moves the items below d to the nodes that have just been read, and offers
+ * those that were only known as part of d */
+static void top_expand(struct dir *d) {
+  struct dir_top *t;
+  struct dir *c;
+  int i, j;
+
+  for(j=0; j<2; j++) {
+    for(i=tops[j].n-1; i>=0; i--) {
+      t = &tops[j].list[i];
+      if(t->d != d || !t->rel)
+        continue;
+      top_walk(t);
+      /* the node may have been added already */
+      if(!t->rel && t->d->flags & FF_TOP)
+        *t = tops[j].list[--tops[j].n];
+      else if(!t->rel)
+        t->d->flags |= FF_TOP;
+    }
+    top_heapify(&tops[j]);
+  }
+  for(c=d->sub; c; c=c->next)
+    top_offer(c);
+}
+
+
+/* Takes the items of orig out of the lists before it is refreshed, into the
+ * saved list for the cached directories that the refresh finds. The parents
+ * of orig are taken out too, they're added again with their new sizes. */
+static void top_refresh(struct dir *orig) {
+  struct dir_top *t;
+  struct dir *p;
+  int i, j;
+
+  top_saved_free(&saved, &nsaved);
+  saved = xmalloc(sizeof(*saved) * TOP_KEEP * 2);
+  saved_ok = 1;
+  for(j=0; j<2; j++) {
+    for(i=tops[j].n-1; i>=0; i--) {
+      t = &tops[j].list[i];
+      if(top_within(t, orig)) {
+        saved[nsaved].path = xstrdup(dir_mem_top_path(t));
+        saved[nsaved].size = top_size(t);
+        saved[nsaved].asize = top_asize(t);
+        saved[nsaved++].dir = j;
+        top_remove(&tops[j], i);
+      } else if(!t->rel)
+        for(p=orig->parent; p; p=p->parent)
+          if(p == t->d) {
+            top_remove(&tops[j], i);
+            break;
+          }
+    }
+    top_heapify(&tops[j]);
+  }
+  qsort(saved, nsaved, sizeof(*saved), top_saved_cmp);
+}
+
+
+/* Offers d and its parents, up to but not including the root */
+static void top_parents(struct dir *d) {
+  for(; d && d->parent; d=d->parent)
+    top_offer(d);
+}
+
+
 
 /* recursively checks a dir structure for hard links and fills the lookup array */
 static void hlink_init(struct dir *d) {
@@ -57,46 +494,304 @@ static void hlink_init(struct dir *d) {
 }
 
 
-/* checks an individual file for hard links and updates its cicrular linked
- * list, also updates the sizes of the parent dirs */
+/* Adds an individual file to the links table and its circular linked list.
+ * The sizes of the parent dirs are updated by hlink_sizes() at the end of
+ * the scan. */
 static void hlink_check(struct dir *d) {
-  struct dir *t, *pt, *par;
-  int i;
+  struct dir *t;
+  struct dir_link *l = dir_link_ptr(d), *tl;
+  int absent;
 
   /* add to links table */
-  khint_t k = hl_put(links, d, &i);
+  khint_t k = hl_put(links, d, &absent);
 
   /* found in the table? update hlnk */
-  if(!i) {
+  if(!absent) {
     t = kh_key(links, k);
-    d->hlnk = t->hlnk == NULL ? t : t->hlnk;
-    t->hlnk = d;
-  }
-
-  /* now update the sizes of the parent directories,
-   * This works by only counting this file in the parent directories where this
-   * file hasn't been counted yet, which can be determined from the hlnk list.
-   * Stop at cached directories - their sizes already include this item.
-   * XXX: This may not be the most efficient algorithm to do this */
-  for(i=1,par=d->parent; i&&par; par=par->parent) {
-    /* Stop at cached directories - sizes already include all descendants */
-    if(par->flags & FF_CACHED)
+    tl = dir_link_ptr(t);
+    l->hlnk = tl->hlnk == NULL ? t : tl->hlnk;
+    tl->hlnk = d;
+  }
+  nstack_push(&newlinks, d);
+}
+
+
+/* Whether d is part of the tree that is being scanned, rather than a link
+ * elsewhere in the tree that is being refreshed */
+static int hlink_isnew(struct dir *d) {
+  if(!orig)
+    return 1;
+  for(; d; d=d->parent)
+    if(d == root)
+      return 1;
+  return 0;
+}
+
+
+/* Marks d and its parents as directories in which the current inode has been
+ * counted. When add is set, the size of the inode is added to every directory
+ * that wasn't marked yet, up to the first cached directory: those already
+ * include all of their descendants. Marked directories have all of their
+ * parents marked as well, so the walk stops at the first one. */
+static void hlink_mark(struct dir *d, struct dir *link, int add) {
+  int r;
+
+  for(; d; d=d->parent) {
+    hs_put(marked, d, &r);
+    if(!r)
       break;
-    if(d->hlnk)
-      for(t=d->hlnk; i&&t!=d; t=t->hlnk)
-        for(pt=t->parent; i&&pt; pt=pt->parent)
-          if(pt==par)
-            i=0;
-    if(i) {
-      par->size = adds64(par->size, d->size);
-      par->asize = adds64(par->asize, d->asize);
+    nstack_push(&markstack, d);
+    if(d->flags & FF_CACHED)
+      add = 0;
+    if(add) {
+      d->size = adds64(d->size, link->size);
+      d->asize = adds64(d->asize, link->asize);
+    }
+  }
+}
+
+
+/* Adds the sizes of the new hard links to their parent directories. A file is
+ * counted once in every directory that contains at least one of its links, so
+ * directories that already counted it before a refresh are left alone. Each
+ * directory is visited about once per inode it contains, which keeps this
+ * roughly linear in the number of links. */
+static void hlink_sizes(void) {
+  struct dir *d, *t;
+  uint64_t start = stats_clock();
+  khint_t k;
+  int i;
+
+  stats_add(STATS_HLINKS, newlinks.top);
+  for(i=0; i<newlinks.top; i++) {
+    d = newlinks.list[i];
+    /* every inode is handled once, its entry is removed from the table afterwards */
+    if((k = hl_get(links, d)) == kh_end(links))
+      continue;
+    hl_del(links, k);
+
+    /* fast path for files with only one link in the tree */
+    if(!dir_hlnk(d)) {
+      for(t=d->parent; t && !(t->flags & FF_CACHED); t=t->parent) {
+        t->size = adds64(t->size, d->size);
+        t->asize = adds64(t->asize, d->asize);
+      }
+      continue;
+    }
+
+    t = d;
+    if(orig)
+      do {
+        if(!hlink_isnew(t))
+          hlink_mark(t->parent, t, 0);
+      } while((t = dir_hlnk(t)) != d);
+    do {
+      if(hlink_isnew(t))
+        hlink_mark(t->parent, t, 1);
+    } while((t = dir_hlnk(t)) != d);
+
+    while(markstack.top > 0) {
+      hs_del(marked, hs_get(marked, markstack.list[markstack.top-1]));
+      nstack_pop(&markstack);
     }
   }
+
+  /* The directories with links in them have grown since they were added */
+  if(newlinks.top) {
+    top_heapify(&tops[1]);
+    for(i=0; i<newlinks.top; i++)
+      top_parents(newlinks.list[i]->parent);
+  }
+  newlinks.top = 0;
+  stats_phase(STATS_PHASE_HLINK, start);
+}
+
+
+static void spill_grow(size_t size) {
+  if(spill_bufsize < size) {
+    spill_bufsize = size < 65536 ? 65536 : size < spill_bufsize*2 ? spill_bufsize*2 : size;
+    spill_buf = xrealloc(spill_buf, spill_bufsize);
+  }
+}
+
+
+/* Writes the items in d to a new block of the spill file, returns its
+ * offset or 0 on error */
+static uint64_t spill_write(struct dir *d) {
+  struct spill_block *b;
+  struct spill_item *it;
+  struct dir *t;
+  size_t len = sizeof(struct spill_block), size;
+  uint64_t off;
+  khint_t k;
+
+  for(t=d->sub; t; t=t->next)
+    len += sizeof(struct spill_item) + ((dir_node_memsize(t->name, t->flags) + 7) & ~(size_t)7);
+  spill_grow(len);
+
+  b = (struct spill_block *)spill_buf;
+  memset(b, 0, sizeof(struct spill_block));
+  b->len = len;
+  len = sizeof(struct spill_block);
+  for(t=d->sub; t; t=t->next) {
+    size = (dir_node_memsize(t->name, t->flags) + 7) & ~(size_t)7;
+    it = (struct spill_item *)(spill_buf + len);
+    it->block = t->flags & FF_CACHED && (k = sp_get(spilled, t)) != kh_end(spilled) ? kh_val(spilled, k) : 0;
+    it->size = size;
+    it->pad = 0;
+    memcpy(it+1, t, size);
+    len += sizeof(struct spill_item) + size;
+    b->n++;
+  }
+
+  if(pwrite(spill_fd, spill_buf, len, spill_len) != (ssize_t)len)
+    return 0;
+  off = spill_len;
+  spill_len += len;
+  stats_inc(STATS_SPILLED);
+  stats_add(STATS_SPILL_BYTES, len);
+  return off;
+}
+
+
+/* Spills the directories below d from the bottom up and then d itself,
+ * unless it contains hard links, which hlink_sizes() still needs. Returns -1
+ * if d was kept. */
+static int spill_dir(struct dir *d) {
+  struct dir *t, *n;
+  uint64_t off;
+  khint_t k;
+  int keep = 0, absent;
+
+  for(t=d->sub; t; t=t->next)
+    if(t->flags & FF_HLNKC)
+      keep = 1;
+    else if(t->flags & FF_DIR && t->sub && !(t->flags & FF_CACHED) && spill_dir(t))
+      keep = 1;
+  if(keep || !d->sub || !(off = spill_write(d)))
+    return -1;
+
+  top_rebase(d);
+  for(t=d->sub; t; t=n) {
+    n = t->next;
+    if(t->flags & FF_CACHED)
+      dir_mem_forget(t);
+    arena_free(t);
+  }
+  d->sub = NULL;
+  d->flags |= FF_CACHED;
+  k = sp_put(spilled, d, &absent);
+  kh_val(spilled, k) = off;
+  dirlist_gen++;
+  return 0;
+}
+
+
+/* Moves a stub to a new node, so that the chunk it was allocated in, which
+ * mostly held the items that have just been spilled, can be released */
+static void spill_move(struct dir *d) {
+  size_t size = dir_node_memsize(d->name, d->flags);
+  struct dir *n = arena_alloc(&nodes, size);
+  khint_t k = sp_get(spilled, d);
+  uint64_t off = kh_val(spilled, k);
+  int absent, i, j;
+
+  memcpy(n, d, size);
+  for(i=0; i<2; i++)
+    for(j=0; j<tops[i].n; j++)
+      if(tops[i].list[j].d == d)
+        tops[i].list[j].d = n;
+  if(n->parent->sub == d)
+    n->parent->sub = n;
+  if(n->prev)
+    n->prev->next = n;
+  if(n->next)
+    n->next->prev = n;
+  sp_del(spilled, k);
+  k = sp_put(spilled, n, &absent);
+  kh_val(spilled, k) = off;
+  arena_free(d);
+}
+
+
+/* Whether d is the directory open in the browser or one of its parents */
+static int spill_isopen(struct dir *d) {
+  struct dir *t;
+  for(t=dirlist_par; t; t=t->parent)
+    if(t == d)
+      return 1;
+  return 0;
+}
+
+
+/* Spills the completed directories next to the path that is being scanned,
+ * from the root down, until the tree is back at 3/4 of the limit. The next
+ * attempt waits until it has grown by another 1/8 if that didn't work out. */
+static void spill(void) {
+  struct dir *d, *t, *n, *next;
+
+  for(d=root; d && nodes.size > dir_mem_limit/4*3; d=next) {
+    /* the child of d that is being scanned */
+    for(next=curdir; next && next->parent != d; next=next->parent)
+      ;
+    for(t=d->sub; t && nodes.size > dir_mem_limit/4*3; t=n) {
+      n = t->next;
+      /* the rows of the browser still point to the children of dirlist_par */
+      if(t != next && t->flags & FF_DIR && !(t->flags & FF_CACHED) && t->sub && !spill_isopen(t)
+          && !spill_dir(t) && d != dirlist_par)
+        spill_move(t);
+    }
+  }
+  spill_at = nodes.size > dir_mem_limit/4*3 ? nodes.size + dir_mem_limit/8 : dir_mem_limit;
+}
+
+
+/* Reads the block of a spilled stub back into the tree */
+static int spill_expand(struct dir *d, khint_t k) {
+  struct spill_block b;
+  struct spill_item *it;
+  struct dir *t, *last = NULL;
+  size_t len;
+  uint32_t i;
+  int absent;
+
+  if(pread(spill_fd, &b, sizeof(b), kh_val(spilled, k)) != sizeof(b))
+    return -1;
+  spill_grow(b.len);
+  if(pread(spill_fd, spill_buf, b.len, kh_val(spilled, k)) != (ssize_t)b.len)
+    return -1;
+
+  dirlist_gen++;
+  sp_del(spilled, k);
+  len = sizeof(struct spill_block);
+  for(i=0; i<b.n; i++) {
+    it = (struct spill_item *)(spill_buf + len);
+    t = arena_alloc(&nodes, it->size);
+    memcpy(t, it+1, it->size);
+    t->flags &= ~FF_TOP;
+    t->parent = d;
+    t->sub = t->next = NULL;
+    t->prev = last;
+    if(last)
+      last->next = t;
+    else
+      d->sub = t;
+    last = t;
+    if(it->block) {
+      k = sp_put(spilled, t, &absent);
+      kh_val(spilled, k) = it->block;
+    }
+    len += sizeof(struct spill_item) + it->size;
+  }
+  d->flags &= ~FF_CACHED;
+  stats_inc(STATS_UNSPILLED);
+  return 0;
 }
 
 
 /* Add item to the correct place in the memory structure */
 static void item_add(struct dir *item) {
+  dirlist_gen++;
   if(!root) {
     root = item;
     /* Make sure that the *root appears to be part of the same dir structure as
@@ -114,12 +809,19 @@ static void item_add(struct dir *item) {
 }
 
 
-static int item(struct dir *dir, const char *name, struct dir_ext *ext, unsigned int nlink) {
+static int item(struct dir *dir, const char *name, struct dir_ext *ext, struct dir_link *link) {
   struct dir *t, *item;
-  (void)nlink;
+  struct dir_ext *e;
+  struct dir_link *l;
 
   /* Go back to parent dir */
   if(!dir) {
+    if(!spill_busy) {
+      if(curdir->parent)
+        top_offer(curdir);
+      if(curdir->flags & FF_CACHED)
+        top_merge(curdir);
+    }
     curdir = curdir->parent;
     return 0;
   }
@@ -129,11 +831,22 @@ static int item(struct dir *dir, const char *name, struct dir_ext *ext, unsigned
 
   if(!extended_info)
     dir->flags &= ~FF_EXT;
-  item = xmalloc(dir->flags & FF_EXT ? dir_ext_memsize(name) : dir_memsize(name));
+  item = arena_alloc(&nodes, dir_node_memsize(name, dir->flags));
   memcpy(item, dir, offsetof(struct dir, name));
   strcpy(item->name, name);
-  if(item->flags & FF_EXT)
-    memcpy(dir_ext_ptr(item), ext, sizeof(struct dir_ext));
+  if((e = dir_ext_ptr(item)) != NULL) {
+    if(ext)
+      memcpy(e, ext, sizeof(struct dir_ext));
+    else
+      memset(e, 0, sizeof(struct dir_ext));
+  }
+  if((l = dir_link_ptr(item)) != NULL) {
+    if(link)
+      memcpy(l, link, sizeof(struct dir_link));
+    else
+      memset(l, 0, sizeof(struct dir_link));
+    l->hlnk = NULL;
+  }
 
   item_add(item);
 
@@ -147,7 +860,7 @@ static int item(struct dir *dir, const char *name, struct dir_ext *ext, unsigned
     item->name[0] = 0;
 
   /* Update stats of parents. Don't update the size/asize fields if this is a
-   * possible hard link, because hlnk_check() will take care of it in that
+   * possible hard link, because hlink_sizes() will take care of it in that
    * case.
    * For cached directories (FF_CACHED), add items+1 to parent because the
    * cached size already includes all descendants, and we need to count the
@@ -169,6 +882,9 @@ static int item(struct dir *dir, const char *name, struct dir_ext *ext, unsigned
     addparentstats(item->parent, item->size, item->asize, 0, 1);
   }
 
+  if(!spill_busy && !(item->flags & FF_DIR))
+    top_offer(item);
+
   /* propagate ERR and SERR back up to the root */
   if(item->flags & FF_SERR || item->flags & FF_ERR)
     for(t=item->parent; t; t=t->parent)
@@ -177,17 +893,62 @@ static int item(struct dir *dir, const char *name, struct dir_ext *ext, unsigned
   dir_output.size = root->size;
   dir_output.items = root->items;
 
+  if(dir_mem_limit && !spill_busy && nodes.size > spill_at)
+    spill();
   return 0;
 }
 
 
+static struct dir *partial(void) {
+  return root;
+}
+
+
+/* Drops the saved items after a scan, except for those of <cache>.top that
+ * are outside of the new tree */
+static void top_done(void) {
+  const char *path;
+  size_t len;
+  int i;
+
+  tree = getroot(root);
+  if(!orig && nsaved) {
+    path = getpath(tree);
+    len = strlen(path);
+    if(path[len-1] == '/')
+      len--;
+    other = xmalloc(nsaved * sizeof(*other));
+    for(i=0; i<nsaved; i++)
+      if(top_under(saved[i].path, path, len))
+        free(saved[i].path);
+      else
+        other[nother++] = saved[i];
+    free(saved);
+    saved = NULL;
+    nsaved = 0;
+  }
+  top_saved_free(&saved, &nsaved);
+}
+
+
 static int final(int fail) {
+  dirlist_gen++;
+  /* Done even on failure, freedir() expects the sizes to be complete */
+  hlink_sizes();
   hl_destroy(links);
   links = NULL;
+  hs_destroy(marked);
+  marked = NULL;
+  nstack_free(&newlinks);
+  nstack_free(&markstack);
 
   if(fail) {
     freedir(root);
     if(orig) {
+      /* orig keeps the items that were taken out by top_refresh() */
+      top_merge(orig);
+      top_parents(orig);
+      top_saved_free(&saved, &nsaved);
       browse_init(orig);
       return 0;
     } else
@@ -207,8 +968,10 @@ static int final(int fail) {
     orig->next = orig->prev = NULL;
     freedir(orig);
   }
+  top_done();
+  dir_mem_top_save();
 
-  browse_init(root);
+  browse_init(dir_browsed ? dir_browsed : root);
   dirlist_top(-3);
   return 0;
 }
@@ -223,10 +986,430 @@ void dir_mem_init(struct dir *_orig) {
   dir_output.final = final;
   dir_output.size = 0;
   dir_output.items = 0;
+  dir_output.cached = cache_lazy;
+  /* A refresh replaces orig only at the end, there's nothing to browse yet */
+  dir_output.partial = orig ? NULL : partial;
+  dir_output.browsed = 1;
 
   /* Init hash table for hard link detection */
   links = hl_init();
-  if(orig)
+  marked = hs_init();
+  nstack_init(&newlinks);
+  nstack_init(&markstack);
+  if(orig) {
     hlink_init(getroot(orig));
+    top_refresh(orig);
+  }
+  spill_at = dir_mem_limit;
+}
+
+
+int dir_mem_spill_open(void) {
+  const char *dir = getenv("TMPDIR");
+  char *fn;
+  size_t len;
+
+  if(!dir || !*dir)
+    dir = "/tmp";
+  len = strlen(dir) + 20;
+  fn = xmalloc(len);
+  snprintf(fn, len, "%s/indu-spill.XXXXXX", dir);
+  spill_fd = mkstemp(fn);
+  if(spill_fd >= 0)
+    unlink(fn);
+  free(fn);
+  if(spill_fd < 0)
+    return -1;
+  spilled = sp_init();
+  return 0;
+}
+
+
+void dir_mem_forget(struct dir *d) {
+  khint_t k;
+  if(spilled && (k = sp_get(spilled, d)) != kh_end(spilled))
+    sp_del(spilled, k);
+}
+
+
+int dir_mem_expand(struct dir *d) {
+  struct dir *oroot = root, *ocurdir = curdir;
+  struct cache_entry *entry, *sub;
+  const struct cache_child *child;
+  struct cache_child tmp;
+  struct dir c;
+  struct dir_ext ext;
+  struct dir_link link;
+  int64_t osize = dir_output.size;
+  int oitems = dir_output.items;
+  khint_t k;
+  int i;
+
+  if(!(d->flags & FF_CACHED))
+    return 0;
+  if(spilled && (k = sp_get(spilled, d)) != kh_end(spilled)) {
+    if(spill_expand(d, k))
+      return -1;
+    top_expand(d);
+    return 0;
+  }
+  if((entry = dir_cache_get(getpath(d))) == NULL)
+    return -1;
+
+  /* Add the children with item(), which doesn't touch the sizes of a
+   * directory that is still marked FF_CACHED */
+  root = curdir = d;
+  spill_busy = 1;
+  for(i=0; i<entry->nchildren; i++) {
+    child = dir_cache_child(entry, i, &tmp);
+    dir_cache_child_item(child, &c, &ext, &link);
+    if((child->flags & FF_DIR) && !(child->flags & (FF_ERR|FF_EXL|FF_OTHFS|FF_KERNFS|FF_FRMLNK)))
+      if((sub = dir_cache_sub(entry, i)) != NULL)
+        dir_cache_stub(sub, &c, &ext);
+    item(&c, child->name, &ext, &link);
+    if(c.flags & FF_DIR)
+      item(NULL, NULL, NULL, NULL);
+  }
+  d->flags &= ~FF_CACHED;
+  spill_busy = 0;
+  top_expand(d);
+
+  root = oroot;
+  curdir = ocurdir;
+  dir_output.size = osize;
+  dir_output.items = oitems;
+  return 0;
+}
+
+
+/* Items that are counted in the rollups, excluded ones have no sizes */
+#define ROLLUP_SKIP (FF_DIR|FF_EXL|FF_OTHFS|FF_KERNFS|FF_FRMLNK)
+
+static void rollup_node(struct dir_rollup *r, struct dir *t) {
+  struct dir_ext *e = t->flags & FF_EXT ? dir_ext_ptr(t) : NULL;
+  if(!(t->flags & ROLLUP_SKIP))
+    dir_rollup_add(r, t->name, e && e->flags & FFE_UID ? (int64_t)e->uid : -1, t->size, t->asize);
+}
+
+
+/* Adds the items below a cached directory from its cache entries */
+static void rollup_cached(struct dir_rollup *r, struct cache_entry *entry) {
+  const struct cache_child *child;
+  struct cache_child tmp;
+  struct cache_entry *sub;
+  int i;
+
+  for(i=0; i<entry->nchildren; i++) {
+    child = dir_cache_child(entry, i, &tmp);
+    if(!(child->flags & FF_DIR)) {
+      if(!(child->flags & ROLLUP_SKIP))
+        dir_rollup_add(r, child->name, child->uid, child->size, child->asize);
+    } else if(!(child->flags & (FF_ERR|FF_EXL|FF_OTHFS|FF_KERNFS|FF_FRMLNK)) && (sub = dir_cache_sub(entry, i)) != NULL)
+      rollup_cached(r, sub);
+  }
+}
+
+
+/* Appends name to the path in *path, which is len bytes long, and returns
+ * the new length */
+static size_t rollup_path(char **path, size_t *pathsize, size_t len, const char *name) {
+  size_t l = len + strlen(name) + 2;
+
+  if(*pathsize < l)
+    *path = xrealloc(*path, *pathsize = l < 256 ? 256 : l*2);
+  if(len && (*path)[len-1] != '/')
+    (*path)[len++] = '/';
+  strcpy(*path + len, name);
+  return len + strlen(name);
+}
+
+
+/* Adds the items of the spilled directory at *path from the block at off,
+ * without reading it back into the tree */
+static int rollup_spilled(struct dir_rollup *r, uint64_t off, char **path, size_t *pathsize, size_t len) {
+  struct spill_block b;
+  struct spill_item *it;
+  struct cache_entry *entry;
+  struct dir *t;
+  char *buf;
+  size_t pos, l;
+  uint32_t i;
+  int ret = 0;
+
+  if(pread(spill_fd, &b, sizeof(b), off) != sizeof(b))
+    return -1;
+  buf = xmalloc(b.len);
+  if(pread(spill_fd, buf, b.len, off) != (ssize_t)b.len) {
+    free(buf);
+    return -1;
+  }
+
+  pos = sizeof(struct spill_block);
+  for(i=0; i<b.n; i++) {
+    it = (struct spill_item *)(buf + pos);
+    t = (struct dir *)(it+1);
+    pos += sizeof(struct spill_item) + it->size;
+    if(!(t->flags & FF_DIR)) {
+      rollup_node(r, t);
+      continue;
+    }
+    /* other than spilled directories and cache stubs, only empty
+     * directories are spilled */
+    if(!it->block && !(t->flags & FF_CACHED))
+      continue;
+    l = rollup_path(path, pathsize, len, t->name);
+    if(it->block)
+      ret |= rollup_spilled(r, it->block, path, pathsize, l);
+    else if((entry = dir_cache_get(*path)) != NULL)
+      rollup_cached(r, entry);
+    else
+      ret = -1;
+    (*path)[len] = 0;
+  }
+  free(buf);
+  return ret;
+}
+
+
+static int rollup_stub(struct dir_rollup *r, struct dir *d) {
+  struct cache_entry *entry;
+  char *path = NULL;
+  size_t pathsize = 0;
+  khint_t k;
+  int ret;
+
+  if(spilled && (k = sp_get(spilled, d)) != kh_end(spilled)) {
+    ret = rollup_spilled(r, kh_val(spilled, k), &path, &pathsize, rollup_path(&path, &pathsize, 0, getpath(d)));
+    free(path);
+    return ret;
+  }
+  if((entry = dir_cache_get(getpath(d))) == NULL)
+    return -1;
+  rollup_cached(r, entry);
+  return 0;
+}
+
+
+int dir_mem_rollup(struct dir *d, struct dir_rollup *r) {
+  struct dir *t;
+  int ret = 0;
+
+  if(!(d->flags & FF_DIR)) {
+    rollup_node(r, d);
+    return 0;
+  }
+  if(d->flags & FF_CACHED)
+    return rollup_stub(r, d);
+  for(t=d->sub; t; t=t->next)
+    if(t->flags & FF_DIR)
+      ret |= dir_mem_rollup(t, r);
+    else
+      rollup_node(r, t);
+  return ret;
+}
+
+
+int dir_mem_busy(struct dir *d) {
+  struct dir *t;
+
+  for(t=curdir; t; t=t->parent)
+    if(t == d)
+      return 1;
+  return 0;
+}
+
+
+static int top_cmp(const void *a, const void *b) {
+  const struct dir_top *x = a, *y = b;
+  return x->size > y->size ? -1 : x->size < y->size ? 1 :
+    x->asize > y->asize ? -1 : x->asize < y->asize ? 1 : 0;
+}
+
+
+int dir_mem_top(int dirs, const struct dir_top **list) {
+  static struct dir_top sorted[TOP_KEEP];
+  struct top_heap *h = &tops[!!dirs];
+  int i;
+
+  for(i=0; i<h->n; i++) {
+    sorted[i] = h->list[i];
+    sorted[i].size = top_size(&h->list[i]);
+    sorted[i].asize = top_asize(&h->list[i]);
+  }
+  qsort(sorted, h->n, sizeof(*sorted), top_cmp);
+  *list = sorted;
+  return h->n < DIR_TOP ? h->n : DIR_TOP;
+}
+
+
+const char *dir_mem_top_path(const struct dir_top *t) {
+  static char *buf;
+  static size_t bufsize;
+  const char *path = getpath(t->d);
+  size_t len = strlen(path);
+
+  if(!t->rel)
+    return path;
+  if(path[len-1] == '/')
+    len--;
+  if(bufsize < len + strlen(t->rel) + 2) {
+    bufsize = len + strlen(t->rel) + 2;
+    buf = xrealloc(buf, bufsize);
+  }
+  memcpy(buf, path, len);
+  buf[len] = '/';
+  strcpy(buf+len+1, t->rel);
+  return buf;
 }
 
+
+struct dir *dir_mem_top_find(const struct dir_top *t) {
+  struct dir *d = t->d, *c;
+  char *rel, *p, *n;
+
+  if(!t->rel)
+    return d;
+  /* t->rel changes as the directories are read */
+  rel = xstrdup(t->rel);
+  for(p=rel; d && p; p=n) {
+    if((n = strchr(p, '/')) != NULL)
+      *n++ = 0;
+    if(dir_mem_expand(d)) {
+      d = NULL;
+      break;
+    }
+    for(c=d->sub; c && strcmp(c->name, p); c=c->next)
+      ;
+    d = c;
+  }
+  free(rel);
+  return d;
+}
+
+
+void dir_mem_top_forget(struct dir *dr) {
+  int i, j;
+
+  for(j=0; j<2; j++)
+    for(i=tops[j].n-1; i>=0; i--)
+      if(top_within(&tops[j].list[i], dr))
+        top_remove(&tops[j], i);
+}
+
+
+void dir_mem_top_fix(struct dir *parent) {
+  top_heapify(&tops[0]);
+  top_heapify(&tops[1]);
+  top_parents(parent);
+}
+
+
+static char *top_file(const char *cache) {
+  char *fn = xmalloc(strlen(cache) + 5);
+  sprintf(fn, "%s.top", cache);
+  return fn;
+}
+
+
+void dir_mem_top_load(void) {
+  unsigned long long dev, ino, size, mtime, len;
+  long long isize, iasize;
+  struct stat st;
+  uint64_t jlen;
+  const char *cache = dir_cache_filename();
+  char *fn, *buf = NULL, *p, *q, *end, type;
+  size_t n = 0, bufsize = 0;
+  ssize_t r;
+  int fd, version, off, cap = 0;
+
+  if(!cache || dir_cache_base(&st, &jlen))
+    return;
+  fn = top_file(cache);
+  fd = open(fn, O_RDONLY|O_CLOEXEC);
+  free(fn);
+  if(fd < 0)
+    return;
+
+  do {
+    if(bufsize - n < 4096)
+      buf = xrealloc(buf, bufsize = bufsize ? bufsize*2 : 65536);
+    r = read(fd, buf+n, bufsize-n);
+    if(r > 0)
+      n += r;
+  } while(r > 0 || (r < 0 && errno == EINTR));
+  close(fd);
+  if(r < 0 || (p = memchr(buf, '\n', n)) == NULL)
+    goto done;
+  *p++ = 0;
+  end = buf + n;
+
+  if(sscanf(buf, TOP_MAGIC " %d %llu %llu %llu %llu %llu", &version, &dev, &ino, &size, &mtime, &len) != 6 ||
+      version != TOP_VERSION || dev != (unsigned long long)st.st_dev || ino != (unsigned long long)st.st_ino ||
+      size != (unsigned long long)st.st_size || mtime != (unsigned long long)st.st_mtime || len != jlen)
+    goto done;
+
+  top_saved_free(&saved, &nsaved);
+  for(; p < end && (q = memchr(p, 0, end-p)) != NULL; p=q+1) {
+    if(sscanf(p, "%c %lld %lld %n", &type, &isize, &iasize, &off) != 3 || (type != 'f' && type != 'd') || p[off] != '/')
+      continue;
+    if(nsaved == cap)
+      saved = xrealloc(saved, (cap = cap ? cap*2 : 256) * sizeof(*saved));
+    saved[nsaved].path = xstrdup(p+off);
+    saved[nsaved].size = isize;
+    saved[nsaved].asize = iasize;
+    saved[nsaved++].dir = type == 'd';
+  }
+  qsort(saved, nsaved, sizeof(*saved), top_saved_cmp);
+  saved_ok = 1;
+
+done:
+  free(buf);
+}
+
+
+static int top_write(FILE *f, char type, int64_t size, int64_t asize, const char *path) {
+  return fprintf(f, "%c %lld %lld %s", type, (long long)size, (long long)asize, path) < 0 || fputc(0, f) == EOF;
+}
+
+
+void dir_mem_top_save(void) {
+  struct stat st;
+  uint64_t jlen;
+  const char *cache = dir_cache_filename();
+  char *fn, *tmp;
+  FILE *f;
+  int i, j, fd, fail;
+
+  /* Without a saved cache file to belong to, the list would be of no use.
+   * One that was saved earlier still is if the cache file hasn't changed. */
+  if(!cache || !tree || dir_cache_base(&st, &jlen))
+    return;
+
+  fn = top_file(cache);
+  tmp = xmalloc(strlen(fn) + 8);
+  sprintf(tmp, "%s.XXXXXX", fn);
+  if((fd = mkstemp(tmp)) < 0 || (f = fdopen(fd, "w")) == NULL) {
+    if(fd >= 0) {
+      close(fd);
+      unlink(tmp);
+    }
+    free(tmp);
+    free(fn);
+    return;
+  }
+
+  fail = fprintf(f, "%s %d %llu %llu %llu %llu %llu\n", TOP_MAGIC, TOP_VERSION,
+    (unsigned long long)st.st_dev, (unsigned long long)st.st_ino, (unsigned long long)st.st_size,
+    (unsigned long long)st.st_mtime, (unsigned long long)jlen) < 0;
+  for(j=0; j<2; j++)
+    for(i=0; !fail && i<tops[j].n; i++)
+      fail = top_write(f, j ? 'd' : 'f', top_size(&tops[j].list[i]), top_asize(&tops[j].list[i]),
+        dir_mem_top_path(&tops[j].list[i]));
+  for(i=0; !fail && i<nother; i++)
+    fail = top_write(f, other[i].dir ? 'd' : 'f', other[i].size, other[i].asize, other[i].path);
+
+  if(fclose(f) || fail || rename(tmp, fn))
+    unlink(tmp);
+  free(tmp);
+  free(fn);
+}
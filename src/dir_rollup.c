@@ -0,0 +1,130 @@
+/* indu - Incremental NCurses Disk Usage
+
+  Based on ncdu by Yorhel (https://dev.yorhel.nl/ncdu)
+  Copyright (c) Yorhel
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include "global.h"
+#include <khashl.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+
+/* Rows by uid and by extension, the values are indices into the rows */
+KHASHL_MAP_INIT(KH_LOCAL, ru_t, ru, khint64_t, int, kh_hash_uint64, kh_eq_generic)
+KHASHL_MAP_INIT(KH_LOCAL, rx_t, rx, const char *, int, kh_hash_str, kh_eq_str)
+
+
+void dir_rollup_init(struct dir_rollup *r) {
+  memset(r, 0, sizeof(*r));
+  r->hash[ROLLUP_UID] = ru_init();
+  r->hash[ROLLUP_EXT] = rx_init();
+}
+
+
+/* Returns a new row of the given kind */
+static struct dir_rollup_row *row_new(struct dir_rollup *r, int kind) {
+  struct dir_rollup_row *row;
+
+  if(r->n[kind] == r->size[kind]) {
+    r->size[kind] = r->size[kind] ? r->size[kind]*2 : 16;
+    r->rows[kind] = xrealloc(r->rows[kind], r->size[kind]*sizeof(**r->rows));
+  }
+  row = &r->rows[kind][r->n[kind]++];
+  memset(row, 0, sizeof(*row));
+  row->uid = -1;
+  return row;
+}
+
+
+static void row_add(struct dir_rollup_row *row, int64_t size, int64_t asize) {
+  row->size = adds64(row->size, size);
+  row->asize = adds64(row->asize, asize);
+  row->items++;
+}
+
+
+void dir_rollup_add(struct dir_rollup *r, const char *name, int64_t uid, int64_t size, int64_t asize) {
+  struct dir_rollup_row *row;
+  const char *dot = strrchr(name, '.');
+  char ext[ROLLUP_EXTLEN+1];
+  khint_t k;
+  int absent;
+
+  k = ru_put(r->hash[ROLLUP_UID], (khint64_t)uid, &absent);
+  if(absent) {
+    kh_val((ru_t *)r->hash[ROLLUP_UID], k) = r->n[ROLLUP_UID];
+    row_new(r, ROLLUP_UID)->uid = uid;
+  }
+  row_add(&r->rows[ROLLUP_UID][kh_val((ru_t *)r->hash[ROLLUP_UID], k)], size, asize);
+
+  /* "name.", ".name" and overly long extensions have none */
+  if(dot && dot != name && dot[1] && strlen(dot+1) <= ROLLUP_EXTLEN)
+    strcpy(ext, dot+1);
+  else
+    ext[0] = 0;
+  k = rx_get(r->hash[ROLLUP_EXT], ext);
+  if(k == kh_end((rx_t *)r->hash[ROLLUP_EXT])) {
+    row = row_new(r, ROLLUP_EXT);
+    row->ext = xstrdup(ext);
+    k = rx_put(r->hash[ROLLUP_EXT], row->ext, &absent);
+    kh_val((rx_t *)r->hash[ROLLUP_EXT], k) = r->n[ROLLUP_EXT]-1;
+  }
+  row_add(&r->rows[ROLLUP_EXT][kh_val((rx_t *)r->hash[ROLLUP_EXT], k)], size, asize);
+}
+
+
+static int row_cmp(const void *va, const void *vb) {
+  const struct dir_rollup_row *a = va, *b = vb;
+  if(a->size != b->size)
+    return a->size < b->size ? 1 : -1;
+  if(a->ext)
+    return strcmp(a->ext, b->ext);
+  return a->uid < b->uid ? -1 : a->uid > b->uid;
+}
+
+
+void dir_rollup_sort(struct dir_rollup *r) {
+  int i;
+
+  /* the indices in the hash tables don't survive the sort */
+  for(i=0; i<2; i++)
+    qsort(r->rows[i], r->n[i], sizeof(**r->rows), row_cmp);
+  ru_destroy(r->hash[ROLLUP_UID]);
+  rx_destroy(r->hash[ROLLUP_EXT]);
+  r->hash[ROLLUP_UID] = r->hash[ROLLUP_EXT] = NULL;
+}
+
+
+void dir_rollup_free(struct dir_rollup *r) {
+  int i;
+
+  for(i=0; i<r->n[ROLLUP_EXT]; i++)
+    free(r->rows[ROLLUP_EXT][i].ext);
+  free(r->rows[ROLLUP_UID]);
+  free(r->rows[ROLLUP_EXT]);
+  ru_destroy(r->hash[ROLLUP_UID]);
+  rx_destroy(r->hash[ROLLUP_EXT]);
+  memset(r, 0, sizeof(*r));
+}
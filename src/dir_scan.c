@@ -26,15 +26,21 @@
 
 #include "global.h"
 #include "dir_cache.h"
+#include "dir_uring.h"
+#include "dir_watch.h"
+#include "stats.h"
 
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <time.h>
+#include <pthread.h>
 
 #if HAVE_SYS_ATTR_H && HAVE_GETATTRLIST && HAVE_DECL_ATTR_CMNEXT_NOFIRMLINKPATH
 #include <sys/attr.h>
@@ -54,13 +60,45 @@
 
 int dir_scan_smfs; /* Stay on the same filesystem */
 int exclude_kernfs; /* Exclude Linux pseudo filesystems */
+int dir_scan_validate = 1; /* Validate nested cached directories */
+int dir_scan_uring; /* lstat() through io_uring */
 
 static uint64_t curdev;   /* current device we're scanning on */
+static int curkernfs;     /* whether that is a pseudo filesystem, with exclude_kernfs */
+static uint64_t walkdev;  /* device of the directory being walked */
 
 /* scratch space */
 static struct dir    *buf_dir;
 static struct dir_ext buf_ext[1];
-static unsigned int buf_nlink;
+static struct dir_link buf_link[1];
+
+/* io_uring of the single-threaded scanner, NULL if not used */
+static struct dir_uring *uring;
+
+/* Names of a directory that have been lstat()ed ahead through io_uring */
+struct stat_window {
+  const char *names[DIR_URING_BATCH];
+  struct stat st[DIR_URING_BATCH];
+  char ok[DIR_URING_BATCH];
+  int n, i;
+};
+
+/* An entry of a directory, as read by dir_readdir() */
+struct dir_entry {
+  size_t name;  /* offset in the names of the list */
+  size_t len;
+};
+
+/* The entries of a directory, without . and .. */
+struct dir_entries {
+  struct dir_entry *list;
+  int n, cap;
+  char *names;  /* zero-terminated, back to back */
+  size_t nameslen, namescap;
+  int tag;      /* has an entry that may be a CACHEDIR.TAG, with cachedir_tags */
+};
+
+#define entry_name(e, i) ((e)->names + (e)->list[i].name)
 
 /* Context for collecting children during walk */
 struct walk_context {
@@ -69,8 +107,34 @@ struct walk_context {
   int children_cap;
 };
 
+/* State for replaying a cached directory. rel is the path of the directory
+ * being replayed relative to the working directory, basefd is an fd of the
+ * working directory, opened when a nested directory has to be rescanned. */
+struct replay_context {
+  char *rel;
+  size_t len, size;
+  int basefd;
+};
+
+/* A cached directory that replay_lookup() used without checking it, under a
+ * --cache-trust window, and what the cache has for it. These are checked by
+ * a background thread once the scan is done, see dir_scan_verified(). */
+struct verify_item {
+  char *path;
+  uint64_t mtime, dev, ino;
+  int changed;
+};
+
+static struct verify_item *verify_items;
+static int verify_n, verify_size;
+static pthread_t verify_thread;
+static pthread_mutex_t verify_lock = PTHREAD_MUTEX_INITIALIZER;
+static int verify_state; /* 0: idle, 1: thread running, 2: thread done */
+static int verify_stop;
+
 /* Forward declarations */
-static int dir_walk_ctx(char *dir, struct walk_context *ctx);
+static int dir_walk_ctx(struct dir_entries *e, struct walk_context *ctx);
+static int dir_scan_item_ctx(const char *name, struct walk_context *parent_ctx, const struct stat *pre);
 static void walk_context_add_child(struct walk_context *ctx, const char *name);
 static void walk_context_free(struct walk_context *ctx);
 
@@ -121,65 +185,67 @@ static int is_kernfs(unsigned long type) {
 
   return 0;
 }
+
+
+/* Returns whether the directory at path, on device dev, is on a pseudo
+ * filesystem, or -1 if statfs() failed. Only mount points need a statfs():
+ * anything on the device of its parent, pdev, is on the same filesystem, and
+ * directories below a pseudo filesystem aren't read unless it's the root. */
+static int dir_kernfs(const char *path, uint64_t dev, uint64_t pdev) {
+  struct statfs fst;
+  if(dev == pdev)
+    return dev == curdev && curkernfs;
+  if(statfs(path, &fst))
+    return -1;
+  return is_kernfs(fst.f_type);
+}
 #endif
 
-/* Populates the buf_dir and buf_ext with information from the stat struct.
- * Sets everything necessary for output_dir.item() except FF_ERR and FF_EXL. */
-static void stat_to_dir(struct stat *fs) {
-  buf_dir->flags |= FF_EXT; /* We always read extended data because it doesn't have an additional cost */
-  buf_dir->ino = (uint64_t)fs->st_ino;
-  buf_dir->dev = (uint64_t)fs->st_dev;
+/* Populates d, ext and link with information from the stat struct. Sets
+ * everything necessary for output_dir.item() except FF_ERR and FF_EXL. */
+static void stat_to_dir(struct dir *d, struct dir_ext *ext, struct dir_link *link, struct stat *fs) {
+  d->flags |= FF_EXT; /* We always read extended data because it doesn't have an additional cost */
+  link->ino = (uint64_t)fs->st_ino;
+  link->dev = (uint64_t)fs->st_dev;
 
   if(S_ISREG(fs->st_mode))
-    buf_dir->flags |= FF_FILE;
+    d->flags |= FF_FILE;
   else if(S_ISDIR(fs->st_mode))
-    buf_dir->flags |= FF_DIR;
+    d->flags |= FF_DIR;
 
   if(!S_ISDIR(fs->st_mode) && fs->st_nlink > 1) {
-    buf_dir->flags |= FF_HLNKC;
-    buf_nlink = fs->st_nlink;
+    d->flags |= FF_HLNKC;
+    link->nlink = fs->st_nlink;
   } else
-    buf_nlink = 0;
+    link->nlink = 0;
 
-  if(dir_scan_smfs && curdev != buf_dir->dev)
-    buf_dir->flags |= FF_OTHFS;
+  if(dir_scan_smfs && curdev != link->dev)
+    d->flags |= FF_OTHFS;
 
-  if(!(buf_dir->flags & (FF_OTHFS|FF_EXL|FF_KERNFS))) {
-    buf_dir->size = fs->st_blocks * S_BLKSIZE;
-    buf_dir->asize = fs->st_size;
+  if(!(d->flags & (FF_OTHFS|FF_EXL|FF_KERNFS))) {
+    d->size = fs->st_blocks * S_BLKSIZE;
+    d->asize = fs->st_size;
   }
 
-  buf_ext->mode  = fs->st_mode;
-  buf_ext->mtime = fs->st_mtime;
-  buf_ext->uid   = (unsigned int)fs->st_uid;
-  buf_ext->gid   = (unsigned int)fs->st_gid;
-  buf_ext->flags = FFE_MTIME | FFE_UID | FFE_GID | FFE_MODE;
+  ext->mode  = fs->st_mode;
+  ext->mtime = fs->st_mtime;
+  ext->uid   = (unsigned int)fs->st_uid;
+  ext->gid   = (unsigned int)fs->st_gid;
+  ext->flags = FFE_MTIME | FFE_UID | FFE_GID | FFE_MODE;
 }
 
 
-/* Reads all filenames in the currently chdir'ed directory and stores it as a
- * nul-separated list of filenames. The list ends with an empty filename (i.e.
- * two nuls). . and .. are not included. Returned memory should be freed. *err
- * is set to 1 if some error occurred. Returns NULL if that error was fatal.
- * The reason for reading everything in memory first and then walking through
- * the list is to avoid eating too many file descriptors in a deeply recursive
- * directory. */
-static char *dir_read(int *err) {
-  DIR *dir;
+/* Reads the entries of an open directory into e, which must be freed with
+ * dir_entries_free(). . and .. are not included. *err is set to 1 if some
+ * error occurred. The directory is not closed. */
+static void dir_readdir(DIR *dir, struct dir_entries *e, int *err) {
   struct dirent *item;
-  char *buf = NULL;
-  size_t buflen = 512;
-  size_t off = 0;
-
-  if((dir = opendir(".")) == NULL) {
-    *err = 1;
-    return NULL;
-  }
+  size_t len;
 
-  buf = xmalloc(buflen);
+  memset(e, 0, sizeof(struct dir_entries));
+  stats_inc(STATS_DIRS);
 
   while(1) {
-    size_t len, req;
     errno = 0;
     if ((item = readdir(dir)) == NULL) {
       if(errno)
@@ -189,49 +255,99 @@ static char *dir_read(int *err) {
     if(item->d_name[0] == '.' && (item->d_name[1] == 0 || (item->d_name[1] == '.' && item->d_name[2] == 0)))
       continue;
     len = strlen(item->d_name);
-    req = off+3+len;
-    if(req > buflen) {
-      buflen = req < buflen*2 ? buflen*2 : req;
-      buf = xrealloc(buf, buflen);
+    if(e->n == e->cap) {
+      e->cap = e->cap ? e->cap*2 : 32;
+      e->list = xrealloc(e->list, e->cap*sizeof(struct dir_entry));
     }
-    strcpy(buf+off, item->d_name);
-    off += len+1;
+    if(e->nameslen+len+1 > e->namescap) {
+      e->namescap = e->namescap*2 > e->nameslen+len+1 ? e->namescap*2 : e->nameslen+len+512;
+      e->names = xrealloc(e->names, e->namescap);
+    }
+    e->list[e->n].name = e->nameslen;
+    e->list[e->n++].len = len;
+    memcpy(e->names+e->nameslen, item->d_name, len+1);
+    e->nameslen += len+1;
+
+    if(cachedir_tags && len == sizeof CACHEDIR_TAG_FILENAME - 1 && memcmp(item->d_name, CACHEDIR_TAG_FILENAME, len) == 0)
+#if HAVE_STRUCT_DIRENT_D_TYPE
+      e->tag = item->d_type == DT_REG || item->d_type == DT_LNK || item->d_type == DT_UNKNOWN;
+#else
+      e->tag = 1;
+#endif
   }
-  if(closedir(dir) < 0)
+}
+
+
+static void dir_entries_free(struct dir_entries *e) {
+  free(e->list);
+  free(e->names);
+}
+
+
+/* Reads the entries of the currently chdir'ed directory. *err is set to 1 if
+ * some error occurred. Returns -1 if that error was fatal, e is left empty
+ * in that case. The reason for reading everything in memory first and then
+ * walking through the list is to avoid eating too many file descriptors in a
+ * deeply recursive directory. */
+static int dir_read(struct dir_entries *e, int *err) {
+  DIR *dir;
+
+  if((dir = opendir(".")) == NULL) {
+    memset(e, 0, sizeof(struct dir_entries));
     *err = 1;
+    return -1;
+  }
 
-  buf[off] = 0;
-  buf[off+1] = 0;
-  return buf;
+  dir_readdir(dir, e, err);
+  if(closedir(dir) < 0)
+    *err = 1;
+  return 0;
 }
 
 
-static int dir_walk(char *);
+/* Returns the lstat() information of entry i of a directory, submitting the
+ * next batch of entries to the ring when the window has been used up. Returns
+ * NULL if the entry has to be lstat()ed the regular way. */
+static const struct stat *stat_window_next(struct stat_window *win, struct dir_uring *r, int dirfd,
+                                           const struct dir_entries *e, int i) {
+  if(win->i == win->n) {
+    for(win->n=0; win->n<DIR_URING_BATCH && i<e->n; i++)
+      win->names[win->n++] = entry_name(e, i);
+    win->i = 0;
+    dir_uring_lstat(r, dirfd, win->names, win->n, win->st, win->ok);
+    stats_add(STATS_URING_STATS, win->n);
+  }
+  win->i++;
+  return win->ok[win->i-1] ? &win->st[win->i-1] : NULL;
+}
 
 
-/* Tries to recurse into the current directory item (buf_dir is assumed to be the current dir) */
-static int dir_scan_recurse(const char *name) {
+/* Tries to recurse into the current directory item (buf_dir is assumed to be
+ * the current dir). parent_ctx has the item as its last child already. */
+static int dir_scan_recurse(const char *name, struct walk_context *parent_ctx) {
   int fail = 0;
-  char *dir;
+  uint64_t oldwalkdev;
+  struct dir_entries e;
   /* Save directory info before walk (buf_dir/buf_ext get overwritten by children) */
   struct dir saved_dir;
   struct dir_ext saved_ext;
+  struct dir_link saved_link;
   struct walk_context ctx = {NULL, 0, 0};
 
   if(chdir(name)) {
     dir_setlasterr(dir_curpath);
     buf_dir->flags |= FF_ERR;
-    if(dir_output.item(buf_dir, name, buf_ext, buf_nlink) || dir_output.item(NULL, 0, NULL, 0)) {
+    if(dir_output.item(buf_dir, name, buf_ext, buf_link) || dir_output.item(NULL, 0, NULL, NULL)) {
       dir_seterr("Output error: %s", strerror(errno));
       return 1;
     }
     return 0;
   }
 
-  if((dir = dir_read(&fail)) == NULL) {
+  if(dir_read(&e, &fail)) {
     dir_setlasterr(dir_curpath);
     buf_dir->flags |= FF_ERR;
-    if(dir_output.item(buf_dir, name, buf_ext, buf_nlink) || dir_output.item(NULL, 0, NULL, 0)) {
+    if(dir_output.item(buf_dir, name, buf_ext, buf_link) || dir_output.item(NULL, 0, NULL, NULL)) {
       dir_seterr("Output error: %s", strerror(errno));
       return 1;
     }
@@ -246,25 +362,50 @@ static int dir_scan_recurse(const char *name) {
   if(fail)
     buf_dir->flags |= FF_ERR;
 
+  /* Only directories that list a CACHEDIR.TAG need to be checked for one */
+  if(e.tag && has_cachedir_tag(AT_FDCWD, ".")) {
+    dir_entries_free(&e);
+    buf_dir->flags |= FF_EXL;
+    buf_dir->size = buf_dir->asize = 0;
+    if(parent_ctx) {
+      parent_ctx->children[parent_ctx->nchildren-1].flags = buf_dir->flags;
+      parent_ctx->children[parent_ctx->nchildren-1].size = 0;
+      parent_ctx->children[parent_ctx->nchildren-1].asize = 0;
+    }
+    if(dir_output.item(buf_dir, name, buf_ext, buf_link) || dir_output.item(NULL, 0, NULL, NULL)) {
+      dir_seterr("Output error: %s", strerror(errno));
+      return 1;
+    }
+    if(chdir("..")) {
+      dir_seterr("Error going back to parent directory: %s", strerror(errno));
+      return 1;
+    }
+    return 0;
+  }
+
   /* Save directory info before walking children */
   memcpy(&saved_dir, buf_dir, offsetof(struct dir, name));
   memcpy(&saved_ext, buf_ext, sizeof(struct dir_ext));
+  saved_link = *buf_link;
 
-  if(dir_output.item(buf_dir, name, buf_ext, buf_nlink)) {
+  if(dir_output.item(buf_dir, name, buf_ext, buf_link)) {
+    dir_entries_free(&e);
     dir_seterr("Output error: %s", strerror(errno));
     return 1;
   }
 
   /* Walk children, collecting info for cache if caching is enabled */
-  fail = dir_walk_ctx(dir, cache_file ? &ctx : NULL);
+  oldwalkdev = walkdev;
+  walkdev = saved_link.dev;
+  fail = dir_walk_ctx(&e, cache_file ? &ctx : NULL);
+  walkdev = oldwalkdev;
 
-  if(!fail && cache_file) {
+  if(!fail && cache_file)
     dir_cache_store(dir_curpath, &saved_dir, saved_dir.flags & FF_EXT ? &saved_ext : NULL,
-                    ctx.children, ctx.nchildren);
-    walk_context_free(&ctx);
-  }
+                    &saved_link, ctx.children, ctx.nchildren);
+  walk_context_free(&ctx);
 
-  if(dir_output.item(NULL, 0, NULL, 0)) {
+  if(dir_output.item(NULL, 0, NULL, NULL)) {
     dir_seterr("Output error: %s", strerror(errno));
     return 1;
   }
@@ -279,11 +420,363 @@ static int dir_scan_recurse(const char *name) {
 }
 
 
+/* Appends a path component to rc->rel, returns the previous length */
+static size_t replay_enter(struct replay_context *rc, const char *name) {
+  size_t old = rc->len, l = strlen(name);
+  if(rc->size < old+l+2) {
+    rc->size = old+l+2 < 128 ? 128 : old+l+2 < rc->size*2 ? rc->size*2 : old+l+2;
+    rc->rel = xrealloc(rc->rel, rc->size);
+  }
+  if(old)
+    rc->rel[rc->len++] = '/';
+  strcpy(rc->rel+rc->len, name);
+  rc->len += l;
+  return old;
+}
+
+
+static void replay_leave(struct replay_context *rc, size_t old) {
+  rc->len = old;
+  rc->rel[old] = 0;
+}
+
+
+/* Rescans a nested directory of a cached subtree that failed validation. rc->rel
+ * points to the directory, parent is the length of the path to the directory
+ * containing it. The fresh information of the directory itself is written back
+ * to *child, so that the parent's cache entry stays in sync. */
+static int dir_scan_rescan(struct replay_context *rc, size_t parent, struct cache_child *child) {
+  struct walk_context ctx = {NULL, 0, 0};
+  int fail;
+
+  if(rc->basefd < 0 && (rc->basefd = open(".", O_RDONLY|O_DIRECTORY)) < 0) {
+    dir_seterr("Error opening current directory: %s", strerror(errno));
+    return 1;
+  }
+
+  rc->rel[parent] = 0;
+  fail = chdir(rc->rel);
+  rc->rel[parent] = '/';
+  if(fail) {
+    dir_seterr("Error changing directory: %s", strerror(errno));
+    return 1;
+  }
+
+  memset(buf_dir, 0, offsetof(struct dir, name));
+  memset(buf_ext, 0, sizeof(struct dir_ext));
+  memset(buf_link, 0, sizeof(struct dir_link));
+  fail = dir_scan_item_ctx(child->name, &ctx, NULL);
+
+  if(ctx.nchildren == 1) {
+    struct cache_child *cc = ctx.children;
+    child->flags = cc->flags;
+    child->size = cc->size;
+    child->asize = cc->asize;
+    child->ino = cc->ino;
+    child->dev = cc->dev;
+    child->mtime = cc->mtime;
+    child->uid = cc->uid;
+    child->gid = cc->gid;
+    child->mode = cc->mode;
+    child->nlink = cc->nlink;
+  }
+  walk_context_free(&ctx);
+
+  if(!dir_fatalerr && fchdir(rc->basefd)) {
+    dir_seterr("Error going back to cached directory: %s", strerror(errno));
+    return 1;
+  }
+  return fail;
+}
+
+
+static void verify_add(const struct cache_entry *sub) {
+  struct verify_item *it;
+
+  if(verify_n == verify_size)
+    verify_items = xrealloc(verify_items, (verify_size = verify_size ? verify_size*2 : 256) * sizeof(struct verify_item));
+  it = &verify_items[verify_n++];
+  it->path = xstrdup(dir_curpath);
+  it->mtime = sub->mtime;
+  it->dev = sub->dev;
+  it->ino = sub->ino;
+  it->changed = 0;
+}
+
+
+static void verify_free(void) {
+  int i;
+  for(i=0; i<verify_n; i++)
+    free(verify_items[i].path);
+  free(verify_items);
+  verify_items = NULL;
+  verify_n = verify_size = 0;
+}
+
+
+/* Checks the trusted directories the way replay_lookup() would have. Only
+ * touches verify_items, the results are applied to the cache by
+ * dir_scan_verified() in the main thread. */
+static void *verify_run(void *arg) {
+  struct verify_item *it;
+  struct stat st;
+  int i, stop = 0;
+
+  (void)arg;
+  for(i=0; !stop && i<verify_n; i++) {
+    it = &verify_items[i];
+    it->changed = fstatat(AT_FDCWD, it->path, &st, AT_SYMLINK_NOFOLLOW) || !S_ISDIR(st.st_mode) ||
+      (uint64_t)st.st_mtime != it->mtime || (uint64_t)st.st_dev != it->dev || (uint64_t)st.st_ino != it->ino;
+    pthread_mutex_lock(&verify_lock);
+    stop = verify_stop;
+    pthread_mutex_unlock(&verify_lock);
+  }
+
+  pthread_mutex_lock(&verify_lock);
+  verify_state = 2;
+  pthread_mutex_unlock(&verify_lock);
+  return NULL;
+}
+
+
+/* Stops a verification that is still running and forgets its results, the
+ * scan that is about to start checks those directories again */
+static void verify_cancel(void) {
+  if(verify_state) {
+    pthread_mutex_lock(&verify_lock);
+    verify_stop = 1;
+    pthread_mutex_unlock(&verify_lock);
+    pthread_join(verify_thread, NULL);
+    verify_state = verify_stop = 0;
+  }
+  verify_free();
+}
+
+
+int dir_scan_verifying(void) {
+  int r;
+  pthread_mutex_lock(&verify_lock);
+  r = verify_state;
+  pthread_mutex_unlock(&verify_lock);
+  return r;
+}
+
+
+int dir_scan_verified(void) {
+  int i, n = 0;
+
+  if(dir_scan_verifying() != 2)
+    return -1;
+  pthread_join(verify_thread, NULL);
+  verify_state = 0;
+
+  /* Unchanged directories get their verification time updated through the
+   * lookup, changed ones are read again by the next scan */
+  if(!dir_cache_reopen()) {
+    for(i=0; i<verify_n; i++) {
+      if(verify_items[i].changed) {
+        dir_cache_drop(verify_items[i].path);
+        n++;
+      } else
+        dir_cache_lookup(verify_items[i].path, verify_items[i].mtime, verify_items[i].dev, verify_items[i].ino);
+    }
+    dir_cache_save();
+    dir_cache_close();
+  }
+  stats_add(STATS_TRUST_CHANGED, n);
+  verify_free();
+  return n;
+}
+
+
+/* Looks up the cache entry of the nested directory of a cached subtree that
+ * rc->rel and dir_curpath point to, child i of entry. With dir_scan_validate, the directory is
+ * checked with a single fstatat() against its own cache entry, without
+ * reading it or stat()ing any file in it, unless it has been verified within
+ * its --cache-trust window and the results are browsed. Below the root of a --daemon, the entry is up to
+ * date if it is still in the cache. */
+static struct cache_entry *replay_lookup(struct replay_context *rc, struct cache_entry *entry, int i) {
+  struct cache_entry *sub = NULL;
+  struct stat st;
+
+  stats_inc(STATS_LOOKUPS);
+  if(!dir_scan_validate || dir_watch_trusted(dir_curpath))
+    sub = dir_cache_sub(entry, i);
+  else if(dir_output.browsed && (sub = dir_cache_sub_trusted(entry, i)) != NULL) {
+    stats_inc(STATS_TRUSTED);
+    verify_add(sub);
+  } else {
+    stats_inc(STATS_STATS);
+    if(!fstatat(AT_FDCWD, rc->rel, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode))
+      sub = dir_cache_sub_lookup(entry, i, (uint64_t)st.st_mtime, (uint64_t)st.st_dev, (uint64_t)st.st_ino);
+  }
+  if(sub)
+    stats_inc(STATS_HITS);
+  return sub;
+}
+
+
+/* Returns whether a cached child is a directory that has a cache entry of
+ * its own */
+#define replay_isdir(c) (((c)->flags & FF_DIR) && !((c)->flags & (FF_ERR|FF_EXL|FF_OTHFS|FF_KERNFS|FF_FRMLNK)))
+
+/* Whether the nested directory that dir_curpath points to is rescanned when
+ * replay_lookup() doesn't find it */
+#define replay_checked() (dir_scan_validate || dir_watch_trusted(dir_curpath))
+
+
+/* Checks the subtree of a cached directory and adds up its totals the way
+ * dir_mem.c would, so that it can be output as an FF_CACHED stub. A nested
+ * directory that changed marks the totals of all its parents stale; those
+ * are replayed by dir_scan_replay() instead and the changed directory is
+ * rescanned there. rc->rel and dir_curpath point to the directory. */
+static int dir_scan_totals(struct replay_context *rc, struct cache_entry *entry) {
+  const struct cache_child *child;
+  struct cache_child tmp;
+  struct cache_entry *sub;
+  size_t old;
+  int i, fail = 0;
+
+  entry->tsize = entry->tasize = 0;
+  entry->tmtime = 0;
+  entry->titems = 0;
+  entry->tflags = CACHE_TOTALS;
+
+  for(i=0; !fail && i<entry->nchildren; i++) {
+    child = dir_cache_child(entry, i, &tmp);
+    entry->tsize = adds64(entry->tsize, child->size);
+    entry->tasize = adds64(entry->tasize, child->asize);
+    entry->titems++;
+    if(entry->tmtime < child->mtime)
+      entry->tmtime = child->mtime;
+    if(child->flags & FF_HLNKC)
+      entry->tflags |= CACHE_TOTALS_HLNK;
+    if(child->flags & (FF_ERR|FF_SERR))
+      entry->tflags |= CACHE_TOTALS_SERR;
+    if(!replay_isdir(child))
+      continue;
+
+    dir_curpath_enter(child->name);
+    old = replay_enter(rc, child->name);
+    if((sub = replay_lookup(rc, entry, i)) != NULL && !(fail = dir_scan_totals(rc, sub))) {
+      entry->tsize = adds64(entry->tsize, sub->tsize);
+      entry->tasize = adds64(entry->tasize, sub->tasize);
+      entry->titems += sub->titems;
+      if(entry->tmtime < sub->tmtime)
+        entry->tmtime = sub->tmtime;
+      entry->tflags |= sub->tflags;
+    } else if(!sub && replay_checked())
+      entry->tflags |= CACHE_TOTALS_STALE;
+    replay_leave(rc, old);
+    dir_curpath_leave();
+    if(!fail)
+      fail = dir_progress();
+  }
+  return fail;
+}
+
+
+/* Replays the children of a cached directory to dir_output. When
+ * dir_scan_validate is set, every cached subdirectory is checked with
+ * replay_lookup(). Subdirectories that changed are rescanned and their fresh
+ * results are spliced into the replay in place of the cached ones. If
+ * dir_output accepts stubs, the subtree has been checked by dir_scan_totals()
+ * already, and unchanged subdirectories are output as stubs. */
+static int dir_scan_replay(struct replay_context *rc, struct cache_entry *entry) {
+  const struct cache_child *child;
+  struct cache_child tmp;
+  struct cache_entry *sub;
+  struct dir d;
+  struct dir_ext ext;
+  struct dir_link link;
+  size_t old;
+  int i, stub, fail = 0;
+
+  for(i=0; !fail && i<entry->nchildren; i++) {
+    child = dir_cache_child(entry, i, &tmp);
+    dir_curpath_enter(child->name);
+
+    if(replay_isdir(child)) {
+      old = replay_enter(rc, child->name);
+      if(!dir_output.cached)
+        sub = replay_lookup(rc, entry, i);
+      else if((sub = dir_cache_sub(entry, i)) != NULL && !(sub->tflags & CACHE_TOTALS))
+        sub = NULL; /* failed the check in dir_scan_totals() */
+
+      if(!sub && replay_checked())
+        fail = dir_scan_rescan(rc, old, &dir_cache_children(entry)[i]);
+      else {
+        dir_cache_child_item(child, &d, &ext, &link);
+        stub = sub && dir_output.cached && dir_cache_stub(sub, &d, &ext);
+        stats_inc(STATS_REPLAYED);
+        if(stub)
+          stats_inc(STATS_STUBS);
+        if(dir_output.item(&d, child->name, &ext, &link)) {
+          dir_seterr("Output error: %s", strerror(errno));
+          fail = 1;
+        }
+        if(!fail && sub && !stub)
+          fail = dir_scan_replay(rc, sub);
+        if(!fail && dir_output.item(NULL, 0, NULL, NULL)) {
+          dir_seterr("Output error: %s", strerror(errno));
+          fail = 1;
+        }
+        if(!fail)
+          fail = dir_progress();
+      }
+      replay_leave(rc, old);
+
+    } else {
+      dir_cache_child_item(child, &d, &ext, &link);
+      stats_inc(STATS_REPLAYED);
+      if(dir_output.item(&d, child->name, &ext, &link) ||
+          ((child->flags & FF_DIR) && dir_output.item(NULL, 0, NULL, NULL))) {
+        dir_seterr("Output error: %s", strerror(errno));
+        fail = 1;
+      }
+    }
+
+    dir_curpath_leave();
+  }
+  return fail;
+}
+
+
+/* Outputs the directory item in buf_dir, which resides in the current working
+ * directory, followed by the replayed contents of its cache entry, or as a
+ * stub if possible. */
+static int dir_scan_cached(const char *name, struct cache_entry *cached) {
+  struct replay_context rc = {NULL, 0, 0, -1};
+  int fail = 0, stub = 0;
+
+  replay_enter(&rc, name);
+  if(dir_output.cached && !(fail = dir_scan_totals(&rc, cached)))
+    stub = dir_cache_stub(cached, buf_dir, buf_ext);
+  if(stub)
+    stats_inc(STATS_STUBS);
+
+  if(!fail && dir_output.item(buf_dir, name, buf_dir->flags & FF_EXT ? buf_ext : NULL, buf_link)) {
+    dir_seterr("Output error: %s", strerror(errno));
+    fail = 1;
+  }
+  if(!fail && !stub)
+    fail = dir_scan_replay(&rc, cached);
+  free(rc.rel);
+  if(rc.basefd >= 0)
+    close(rc.basefd);
+  if(!fail && dir_output.item(NULL, 0, NULL, NULL)) {
+    dir_seterr("Output error: %s", strerror(errno));
+    fail = 1;
+  }
+  return fail;
+}
+
+
 /* Scans and adds a single item. Recurses into dir_walk() again if this is a
  * directory. Assumes we're chdir'ed in the directory in which this item
  * resides. If parent_ctx is provided, the item will be added to it before
  * recursion (to capture correct values for directories). */
-static int dir_scan_item_ctx(const char *name, struct walk_context *parent_ctx) {
+static int dir_scan_item_ctx(const char *name, struct walk_context *parent_ctx, const struct stat *pre) {
   static struct stat st, stl;
   int fail = 0;
 
@@ -298,18 +791,25 @@ static int dir_scan_item_ctx(const char *name, struct walk_context *parent_ctx)
   if(exclude_match(dir_curpath))
     buf_dir->flags |= FF_EXL;
 
-  if(!(buf_dir->flags & (FF_ERR|FF_EXL)) && lstat(name, &st)) {
-    buf_dir->flags |= FF_ERR;
-    dir_setlasterr(dir_curpath);
+  if(!(buf_dir->flags & (FF_ERR|FF_EXL))) {
+    if(pre)
+      st = *pre;
+    else {
+      stats_inc(STATS_STATS);
+      if(lstat(name, &st)) {
+        buf_dir->flags |= FF_ERR;
+        dir_setlasterr(dir_curpath);
+      }
+    }
   }
 
 #if HAVE_LINUX_MAGIC_H && HAVE_SYS_STATFS_H && HAVE_STATFS
   if(exclude_kernfs && !(buf_dir->flags & (FF_ERR|FF_EXL)) && S_ISDIR(st.st_mode)) {
-    struct statfs fst;
-    if(statfs(name, &fst)) {
+    int kernfs = dir_kernfs(name, (uint64_t)st.st_dev, walkdev);
+    if(kernfs < 0) {
       buf_dir->flags |= FF_ERR;
       dir_setlasterr(dir_curpath);
-    } else if(is_kernfs(fst.f_type))
+    } else if(kernfs)
       buf_dir->flags |= FF_KERNFS;
   }
 #endif
@@ -335,9 +835,9 @@ static int dir_scan_item_ctx(const char *name, struct walk_context *parent_ctx)
 
   if(!(buf_dir->flags & (FF_ERR|FF_EXL))) {
     if(follow_symlinks && S_ISLNK(st.st_mode) && !stat(name, &stl) && !S_ISDIR(stl.st_mode))
-      stat_to_dir(&stl);
+      stat_to_dir(buf_dir, buf_ext, buf_link, &stl);
     else
-      stat_to_dir(&st);
+      stat_to_dir(buf_dir, buf_ext, buf_link, &st);
   }
 
   /* Cache lookup for directories */
@@ -346,90 +846,74 @@ static int dir_scan_item_ctx(const char *name, struct walk_context *parent_ctx)
      cache_file != NULL) {
     struct dir_ext *dext = buf_dir->flags & FF_EXT ? buf_ext : NULL;
     uint64_t mtime = dext ? dext->mtime : 0;
-    struct cache_entry *cached = dir_cache_lookup(dir_curpath, mtime, buf_dir->dev, buf_dir->ino);
+    struct cache_entry *cached = dir_cache_lookup(dir_curpath, mtime, buf_link->dev, buf_link->ino);
+    stats_inc(STATS_LOOKUPS);
     if(cached) {
-      buf_dir->flags |= FF_CACHED;
-      buf_dir->size = cached->size;
-      buf_dir->asize = cached->asize;
-      buf_dir->items = cached->items;  /* Set items from cache for correct propagation */
+      stats_inc(STATS_HITS);
       /* Add to parent context BEFORE output (values are correct now) */
       if (parent_ctx && cache_file)
         walk_context_add_child(parent_ctx, name);
-      dir_output.item(buf_dir, name, dext, buf_nlink);
-      dir_cache_replay(cached);
-      dir_output.item(NULL, NULL, NULL, 0);
-      return input_handle(1);
+      return dir_scan_cached(name, cached) || dir_progress();
     }
   }
 
-  if(cachedir_tags && (buf_dir->flags & FF_DIR) && !(buf_dir->flags & (FF_ERR|FF_EXL|FF_OTHFS|FF_KERNFS|FF_FRMLNK)))
-    if(has_cachedir_tag(name)) {
-      buf_dir->flags |= FF_EXL;
-      buf_dir->size = buf_dir->asize = 0;
-    }
-
   /* Add to parent context BEFORE recursion (values are correct now) */
   if (parent_ctx && cache_file)
     walk_context_add_child(parent_ctx, name);
 
   /* Recurse into the dir or output the item */
   if(buf_dir->flags & FF_DIR && !(buf_dir->flags & (FF_ERR|FF_EXL|FF_OTHFS|FF_KERNFS|FF_FRMLNK)))
-    fail = dir_scan_recurse(name);
+    fail = dir_scan_recurse(name, parent_ctx && cache_file ? parent_ctx : NULL);
   else if(buf_dir->flags & FF_DIR) {
-    if(dir_output.item(buf_dir, name, buf_ext, 0) || dir_output.item(NULL, 0, NULL, 0)) {
+    if(dir_output.item(buf_dir, name, buf_ext, buf_link) || dir_output.item(NULL, 0, NULL, NULL)) {
       dir_seterr("Output error: %s", strerror(errno));
       fail = 1;
     }
-  } else if(dir_output.item(buf_dir, name, buf_ext, buf_nlink)) {
+  } else if(dir_output.item(buf_dir, name, buf_ext, buf_link)) {
     dir_seterr("Output error: %s", strerror(errno));
     fail = 1;
   }
 
-  return fail || input_handle(1);
+  return fail || dir_progress();
 }
 
 /* Legacy wrapper without context */
 static int dir_scan_item(const char *name) {
-  return dir_scan_item_ctx(name, NULL);
+  return dir_scan_item_ctx(name, NULL, NULL);
 }
 
 
 /* Add a child to the walk context using saved values */
 static void walk_context_add_child_from_saved(struct walk_context *ctx, const char *name,
-                                              struct dir *d, struct dir_ext *ext, unsigned int nlink) {
+                                              struct dir *d, struct dir_ext *ext, struct dir_link *link) {
   if (ctx->nchildren >= ctx->children_cap) {
     ctx->children_cap = ctx->children_cap ? ctx->children_cap * 2 : 16;
     ctx->children = xrealloc(ctx->children, ctx->children_cap * sizeof(struct cache_child));
   }
 
   struct cache_child *cc = &ctx->children[ctx->nchildren++];
-  cc->name = xstrdup(name);
+  cc->name = dir_cache_strdup(name);
   cc->flags = d->flags;
   cc->size = d->size;
   cc->asize = d->asize;
-  cc->ino = d->ino;
-  cc->dev = d->dev;
+  cc->ino = link->ino;
+  cc->dev = link->dev;
   cc->mtime = (ext && (ext->flags & FFE_MTIME)) ? ext->mtime : 0;
   cc->uid = (ext && (ext->flags & FFE_UID)) ? ext->uid : 0;
   cc->gid = (ext && (ext->flags & FFE_GID)) ? ext->gid : 0;
   cc->mode = (ext && (ext->flags & FFE_MODE)) ? ext->mode : 0;
-  cc->nlink = nlink;
+  cc->nlink = link->nlink;
   cc->children = NULL;
   cc->nchildren = 0;
 }
 
 /* Add a child to the walk context using current buf_dir values */
 static void walk_context_add_child(struct walk_context *ctx, const char *name) {
-  walk_context_add_child_from_saved(ctx, name, buf_dir, buf_ext, buf_nlink);
+  walk_context_add_child_from_saved(ctx, name, buf_dir, buf_ext, buf_link);
 }
 
-/* Free walk context children names */
+/* Free walk context children, the names belong to the cache */
 static void walk_context_free(struct walk_context *ctx) {
-  int i;
-  for (i = 0; i < ctx->nchildren; i++) {
-    if (ctx->children[i].name)
-      free(ctx->children[i].name);
-  }
   if (ctx->children)
     free(ctx->children);
   ctx->children = NULL;
@@ -437,43 +921,575 @@ static void walk_context_free(struct walk_context *ctx) {
   ctx->children_cap = 0;
 }
 
-/* Walks through the directory that we're currently chdir'ed to. *dir contains
- * the filenames as returned by dir_read(), and will be freed automatically by
+/* Walks through the directory that we're currently chdir'ed to. *e contains
+ * the entries as returned by dir_read(), and will be freed automatically by
  * this function. Populates ctx with children info if ctx is not NULL. */
-static int dir_walk_ctx(char *dir, struct walk_context *ctx) {
-  int fail = 0;
-  char *cur;
+static int dir_walk_ctx(struct dir_entries *e, struct walk_context *ctx) {
+  int i, fail = 0;
+  const char *cur;
+  struct stat_window *win = NULL;
+  const struct stat *pre = NULL;
+
+  if(uring) {
+    win = xmalloc(sizeof(struct stat_window));
+    win->n = win->i = 0;
+  }
 
-  fail = 0;
-  for(cur=dir; !fail&&cur&&*cur; cur+=strlen(cur)+1) {
+  for(i=0; !fail && i<e->n; i++) {
+    cur = entry_name(e, i);
+    if(win)
+      pre = stat_window_next(win, uring, AT_FDCWD, e, i);
     dir_curpath_enter(cur);
     memset(buf_dir, 0, offsetof(struct dir, name));
     memset(buf_ext, 0, sizeof(struct dir_ext));
-    buf_nlink = 0;
+    memset(buf_link, 0, sizeof(struct dir_link));
     /* Pass context to dir_scan_item_ctx - it will add children at the right moment */
-    fail = dir_scan_item_ctx(cur, ctx);
+    fail = dir_scan_item_ctx(cur, ctx, pre);
+    dir_curpath_leave();
+  }
+
+  free(win);
+  dir_entries_free(e);
+  return fail;
+}
+
+
+/* Multi-threaded scanning.
+ *
+ * With dir_scan_threads > 1, directories are read and stat()ed by a pool of
+ * worker threads. Every directory is a job: a worker opens it by its absolute
+ * path, reads the names, fstatat()s every entry relative to the directory fd
+ * and buffers the results in the job. Subdirectories become new jobs, pushed
+ * on the worker's own deque. A worker takes the most recently pushed job from
+ * its own deque and, when that is empty, steals the oldest job of another
+ * worker, which tends to be the largest remaining subtree.
+ *
+ * The main thread walks the job tree in the same order as the single-threaded
+ * scanner and feeds the buffered results to dir_output, waiting for jobs that
+ * are still being read and reading those that no worker has picked up yet.
+ * Cache hits are replayed by the main thread as well, so dir_output,
+ * dir_curpath and the working directory are never touched by the workers.
+ */
+
+int dir_scan_threads = 1;
+
+enum { MT_QUEUED, MT_RUNNING, MT_DONE, MT_RELEASED };
+
+struct mt_job;
+
+struct mt_item {
+  int64_t size, asize;
+  uint64_t ino, dev;
+  struct dir_ext ext;
+  unsigned int nlink;
+  unsigned short flags;
+  size_t name;                /* offset in the names of the job */
+  struct mt_job *sub;         /* job reading this directory */
+  struct cache_entry *cached; /* cache entry to replay for this directory */
+};
+
+struct mt_job {
+  char *path;                 /* absolute path of the directory */
+  uint64_t dev;               /* device of the directory */
+  int state;                  /* MT_*, protected by mt_lock */
+  int queued;                 /* still in a deque, protected by mt_lock */
+  int err;                    /* directory could not be (fully) read */
+  int tagged;                 /* excluded with a CACHEDIR.TAG, its items are not read */
+  struct mt_item *items;
+  int nitems, itemcap;
+  char *names;
+  size_t nameslen, namescap;
+};
+
+struct mt_worker {
+  pthread_t thread;
+  pthread_mutex_t lock;       /* protects the deque */
+  struct mt_job **jobs;       /* deque, jobs[lo..hi) */
+  size_t lo, hi, cap;
+  struct dir *d;              /* scratch space */
+  char *path;
+  size_t pathsize;
+  struct dir_uring *ring;     /* NULL if io_uring is not used */
+  struct stat_window *win;
+};
+
+/* Workers, the last one belongs to the main thread and has no thread */
+static struct mt_worker *mt_workers;
+static int mt_nworkers;
+
+static pthread_mutex_t mt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mt_work = PTHREAD_COND_INITIALIZER; /* job queued or mt_stop set */
+static pthread_cond_t mt_done = PTHREAD_COND_INITIALIZER; /* job finished */
+static int mt_queued;       /* number of jobs in all deques */
+static int mt_stop;
+
+
+static struct mt_job *mt_job_new(const char *path) {
+  struct mt_job *j = xcalloc(1, sizeof(struct mt_job));
+  j->path = xstrdup(path);
+  return j;
+}
+
+
+static void mt_job_free(struct mt_job *j) {
+  int i;
+  for(i=0; i<j->nitems; i++)
+    if(j->items[i].sub)
+      mt_job_free(j->items[i].sub);
+  free(j->items);
+  free(j->names);
+  free(j->path);
+  free(j);
+}
+
+
+/* Frees a job once it has been output. A job that the main thread read itself
+ * may still be in a deque, in which case the worker that takes it out frees
+ * it. */
+static void mt_job_release(struct mt_job *j) {
+  int queued;
+
+  free(j->items);
+  free(j->names);
+  free(j->path);
+  j->items = NULL;
+  j->names = j->path = NULL;
+  j->nitems = 0;
+
+  pthread_mutex_lock(&mt_lock);
+  if((queued = j->queued))
+    j->state = MT_RELEASED;
+  pthread_mutex_unlock(&mt_lock);
+  if(!queued)
+    free(j);
+}
+
+
+static void mt_push(struct mt_worker *w, struct mt_job *j) {
+  j->queued = 1;
+  pthread_mutex_lock(&w->lock);
+  if(w->hi == w->cap) {
+    if(w->lo > 0) {
+      memmove(w->jobs, w->jobs+w->lo, (w->hi-w->lo)*sizeof(*w->jobs));
+      w->hi -= w->lo;
+      w->lo = 0;
+    } else {
+      w->cap = w->cap ? w->cap*2 : 64;
+      w->jobs = xrealloc(w->jobs, w->cap*sizeof(*w->jobs));
+    }
+  }
+  w->jobs[w->hi++] = j;
+  pthread_mutex_unlock(&w->lock);
+
+  pthread_mutex_lock(&mt_lock);
+  mt_queued++;
+  pthread_cond_signal(&mt_work);
+  pthread_mutex_unlock(&mt_lock);
+}
+
+
+/* Takes a job from the bottom of our own deque, or steals one from the top of
+ * another. */
+static struct mt_job *mt_take(struct mt_worker *w) {
+  struct mt_job *j = NULL;
+  struct mt_worker *v;
+  int i, self = w - mt_workers;
+
+  for(i=0; !j && i<=mt_nworkers; i++) {
+    v = &mt_workers[(self+i) % (mt_nworkers+1)];
+    pthread_mutex_lock(&v->lock);
+    if(v->hi > v->lo)
+      j = v == w ? v->jobs[--v->hi] : v->jobs[v->lo++];
+    if(v->lo == v->hi)
+      v->lo = v->hi = 0;
+    pthread_mutex_unlock(&v->lock);
+  }
+  return j;
+}
+
+
+/* Scans a single item in the directory of job j, open as dfd. */
+static void mt_scan_item(struct mt_worker *w, struct mt_job *j, int dfd, const char *name, size_t len,
+                         const struct stat *pre) {
+  struct dir *d = w->d;
+  struct dir_ext ext;
+  struct stat st, stl;
+  struct mt_item *it;
+  struct cache_entry *cached = NULL;
+  struct dir_link link;
+  size_t plen = strlen(j->path);
+
+  memset(d, 0, offsetof(struct dir, name));
+  memset(&ext, 0, sizeof(struct dir_ext));
+  memset(&link, 0, sizeof(struct dir_link));
+
+  if(w->pathsize < plen+len+2) {
+    w->pathsize = plen+len+2 < 256 ? 256 : plen+len+2;
+    w->path = xrealloc(w->path, w->pathsize);
+  }
+  memcpy(w->path, j->path, plen);
+  if(j->path[1])
+    w->path[plen++] = '/';
+  memcpy(w->path+plen, name, len+1);
+
+#ifdef __CYGWIN__
+  /* /proc/registry names may contain slashes */
+  if(strchr(name, '/') || strchr(name,  '\\'))
+    d->flags |= FF_ERR;
+#endif
+
+  if(exclude_match(w->path))
+    d->flags |= FF_EXL;
+
+  if(!(d->flags & (FF_ERR|FF_EXL))) {
+    if(pre)
+      st = *pre;
+    else {
+      stats_inc(STATS_STATS);
+      if(fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW))
+        d->flags |= FF_ERR;
+    }
+  }
+
+#if HAVE_LINUX_MAGIC_H && HAVE_SYS_STATFS_H && HAVE_STATFS
+  if(exclude_kernfs && !(d->flags & (FF_ERR|FF_EXL)) && S_ISDIR(st.st_mode)) {
+    int kernfs = dir_kernfs(w->path, (uint64_t)st.st_dev, j->dev);
+    if(kernfs < 0)
+      d->flags |= FF_ERR;
+    else if(kernfs)
+      d->flags |= FF_KERNFS;
+  }
+#endif
+
+  if(!(d->flags & (FF_ERR|FF_EXL))) {
+    if(follow_symlinks && S_ISLNK(st.st_mode) && !fstatat(dfd, name, &stl, 0) && !S_ISDIR(stl.st_mode))
+      stat_to_dir(d, &ext, &link, &stl);
+    else
+      stat_to_dir(d, &ext, &link, &st);
+  }
+
+  if((d->flags & FF_DIR) && !(d->flags & (FF_ERR|FF_EXL|FF_OTHFS|FF_KERNFS)) && cache_file) {
+    cached = dir_cache_lookup(w->path, ext.mtime, link.dev, link.ino);
+    stats_inc(STATS_LOOKUPS);
+    if(cached)
+      stats_inc(STATS_HITS);
+  }
+
+  if(j->nitems == j->itemcap) {
+    j->itemcap = j->itemcap ? j->itemcap*2 : 16;
+    j->items = xrealloc(j->items, j->itemcap*sizeof(struct mt_item));
+  }
+  if(j->nameslen+len+1 > j->namescap) {
+    j->namescap = j->namescap*2 > j->nameslen+len+1 ? j->namescap*2 : j->nameslen+len+256;
+    j->names = xrealloc(j->names, j->namescap);
+  }
+
+  it = &j->items[j->nitems++];
+  it->size = d->size;
+  it->asize = d->asize;
+  it->ino = link.ino;
+  it->dev = link.dev;
+  it->flags = d->flags;
+  it->ext = ext;
+  it->nlink = link.nlink;
+  it->name = j->nameslen;
+  it->cached = cached;
+  it->sub = NULL;
+  memcpy(j->names+j->nameslen, name, len+1);
+  j->nameslen += len+1;
+
+  if(!cached && (d->flags & FF_DIR) && !(d->flags & (FF_ERR|FF_EXL|FF_OTHFS|FF_KERNFS))) {
+    it->sub = mt_job_new(w->path);
+    it->sub->dev = link.dev;
+    mt_push(w, it->sub);
+  }
+}
+
+
+/* Reads the directory of a job and marks it as done. Returns -1 with errno set
+ * if the directory could not be opened. Directories are opened by their
+ * absolute path, so anything deeper than PATH_MAX is reported as an error. */
+static int mt_scan(struct mt_worker *w, struct mt_job *j, int root) {
+  struct dir_entries e;
+  DIR *dir = NULL;
+  int i, fd, err = 0, r = 0;
+
+  if((fd = open(j->path, O_RDONLY|O_DIRECTORY)) < 0 || (dir = fdopendir(fd)) == NULL) {
+    r = -1;
+    err = errno;
+    if(fd >= 0)
+      close(fd);
+    j->err = 1;
+  } else {
+    dir_readdir(dir, &e, &j->err);
+    /* Only directories that list a CACHEDIR.TAG need to be checked for one */
+    j->tagged = !root && e.tag && has_cachedir_tag(dirfd(dir), ".");
+    if(w->ring)
+      w->win->n = w->win->i = 0;
+    for(i=0; !j->tagged && i<e.n; i++)
+      mt_scan_item(w, j, dirfd(dir), entry_name(&e, i), e.list[i].len,
+                   w->ring ? stat_window_next(w->win, w->ring, dirfd(dir), &e, i) : NULL);
+    dir_entries_free(&e);
+    closedir(dir);
+  }
+
+  pthread_mutex_lock(&mt_lock);
+  j->state = MT_DONE;
+  pthread_cond_signal(&mt_done);
+  pthread_mutex_unlock(&mt_lock);
+  errno = err;
+  return r;
+}
+
+
+static void *mt_worker_run(void *arg) {
+  struct mt_worker *w = arg;
+  struct mt_job *j;
+  int claim = 0, released = 0, stop;
+
+  while(1) {
+    j = mt_take(w);
+    pthread_mutex_lock(&mt_lock);
+    if(j) {
+      mt_queued--;
+      j->queued = 0;
+      /* The main thread may have claimed this job already */
+      if((claim = !mt_stop && j->state == MT_QUEUED))
+        j->state = MT_RUNNING;
+      released = j->state == MT_RELEASED;
+    } else if(!mt_stop && !mt_queued)
+      pthread_cond_wait(&mt_work, &mt_lock);
+    stop = mt_stop;
+    pthread_mutex_unlock(&mt_lock);
+
+    if(j && claim)
+      mt_scan(w, j, 0);
+    else if(j && released)
+      free(j);
+    else if(!j && stop)
+      break;
+  }
+  return NULL;
+}
+
+
+/* Waits for a job to finish, reading it on the main thread if no worker has
+ * picked it up yet. Checks for an abort while waiting. */
+static int mt_wait(struct mt_job *j) {
+  struct timespec ts;
+
+  pthread_mutex_lock(&mt_lock);
+  while(j->state != MT_DONE) {
+    if(j->state == MT_QUEUED) {
+      j->state = MT_RUNNING;
+      pthread_mutex_unlock(&mt_lock);
+      mt_scan(&mt_workers[mt_nworkers], j, 0);
+      pthread_mutex_lock(&mt_lock);
+      continue;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += 50*1000*1000;
+    if(ts.tv_nsec >= 1000*1000*1000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000*1000*1000;
+    }
+    pthread_cond_timedwait(&mt_done, &mt_lock, &ts);
+    if(j->state != MT_DONE) {
+      pthread_mutex_unlock(&mt_lock);
+      if(dir_progress())
+        return 1;
+      pthread_mutex_lock(&mt_lock);
+    }
+  }
+  pthread_mutex_unlock(&mt_lock);
+  return 0;
+}
+
+
+/* Outputs the directory item in buf_dir, followed by the contents of job j,
+ * which must be done. dir_curpath is the path of the directory. The
+ * directory is stored in the cache if store is set. */
+static int mt_output(struct mt_job *j, const char *name, int store) {
+  struct walk_context ctx = {NULL, 0, 0};
+  struct dir saved_dir;
+  struct dir_ext saved_ext;
+  struct dir_link saved_link;
+  struct mt_item *it;
+  const char *iname;
+  int i, incwd = 0, fail = 0;
+
+  memcpy(&saved_dir, buf_dir, offsetof(struct dir, name));
+  memcpy(&saved_ext, buf_ext, sizeof(struct dir_ext));
+  saved_link = *buf_link;
+
+  if(dir_output.item(buf_dir, name, buf_ext, buf_link)) {
+    dir_seterr("Output error: %s", strerror(errno));
+    return 1;
+  }
+
+  for(i=0; !fail && i<j->nitems; i++) {
+    it = &j->items[i];
+    iname = j->names + it->name;
+    dir_curpath_enter(iname);
+
+    if(it->sub)
+      fail = mt_wait(it->sub);
+    if(!fail && it->sub && it->sub->tagged) {
+      it->flags |= FF_EXL;
+      it->size = it->asize = 0;
+      mt_job_release(it->sub);
+      it->sub = NULL;
+    }
+
+    memset(buf_dir, 0, offsetof(struct dir, name));
+    buf_dir->size = it->size;
+    buf_dir->asize = it->asize;
+    buf_link->ino = it->ino;
+    buf_link->dev = it->dev;
+    buf_dir->flags = it->flags;
+    *buf_ext = it->ext;
+    buf_link->nlink = it->nlink;
+    if(it->sub && it->sub->err)
+      buf_dir->flags |= FF_ERR;
+    if(buf_dir->flags & FF_ERR)
+      dir_setlasterr(dir_curpath);
+
+    if(!fail && store)
+      walk_context_add_child(&ctx, iname);
+
+    if(fail)
+      ;
+    else if(it->sub) {
+      /* On failure the job may still have running children, it is freed by
+       * mt_process() after all workers have stopped */
+      if(!(fail = mt_output(it->sub, iname, cache_file != NULL))) {
+        mt_job_release(it->sub);
+        it->sub = NULL;
+      }
+      incwd = 0;
+    } else if(it->cached) {
+      /* Replaying needs the working directory to be the parent */
+      if(!incwd && path_chdir(j->path)) {
+        dir_seterr("Error changing directory: %s", strerror(errno));
+        fail = 1;
+      } else {
+        incwd = 1;
+        fail = dir_scan_cached(iname, it->cached);
+      }
+    } else if(dir_output.item(buf_dir, iname, buf_ext, buf_link) ||
+        ((buf_dir->flags & FF_DIR) && dir_output.item(NULL, 0, NULL, NULL))) {
+      dir_seterr("Output error: %s", strerror(errno));
+      fail = 1;
+    }
+
+    if(!fail)
+      fail = dir_progress();
     dir_curpath_leave();
   }
 
-  free(dir);
+  if(!fail && store)
+    dir_cache_store(dir_curpath, &saved_dir, saved_dir.flags & FF_EXT ? &saved_ext : NULL,
+                    &saved_link, ctx.children, ctx.nchildren);
+  walk_context_free(&ctx);
+
+  if(!fail && dir_output.item(NULL, 0, NULL, NULL)) {
+    dir_seterr("Output error: %s", strerror(errno));
+    fail = 1;
+  }
   return fail;
 }
 
-/* Legacy wrapper for backward compatibility */
-static int dir_walk(char *dir) {
-  return dir_walk_ctx(dir, NULL);
+
+/* Scans the directory in dir_curpath, whose information is in fs. */
+static int mt_process(struct stat *fs) {
+  struct dir saved_dir;
+  struct dir_ext saved_ext;
+  struct dir_link saved_link;
+  struct mt_job *root;
+  struct mt_worker *w;
+  int i, started = 0, fail = 0;
+
+  mt_nworkers = dir_scan_threads;
+  mt_workers = xcalloc(mt_nworkers+1, sizeof(struct mt_worker));
+  for(i=0; i<=mt_nworkers; i++) {
+    pthread_mutex_init(&mt_workers[i].lock, NULL);
+    mt_workers[i].d = xmalloc(dir_memsize(""));
+    if(dir_scan_uring && (mt_workers[i].ring = dir_uring_open()) != NULL)
+      mt_workers[i].win = xmalloc(sizeof(struct stat_window));
+  }
+  mt_queued = mt_stop = 0;
+
+  /* The root is read on the main thread, so that failing to read it can be
+   * reported as a fatal error */
+  root = mt_job_new(dir_curpath);
+  root->dev = curdev;
+  root->state = MT_RUNNING;
+  if(mt_scan(&mt_workers[mt_nworkers], root, 1) < 0)
+    dir_seterr("Error reading directory: %s", strerror(errno));
+
+  if(!dir_fatalerr) {
+    /* If no thread could be created at all, the main thread reads everything itself */
+    for(; started<mt_nworkers; started++)
+      if(pthread_create(&mt_workers[started].thread, NULL, mt_worker_run, &mt_workers[started]))
+        break;
+
+    if(root->err)
+      buf_dir->flags |= FF_ERR;
+    stat_to_dir(buf_dir, buf_ext, buf_link, fs);
+    memcpy(&saved_dir, buf_dir, offsetof(struct dir, name));
+    memcpy(&saved_ext, buf_ext, sizeof(struct dir_ext));
+    saved_link = *buf_link;
+    fail = mt_output(root, dir_curpath, cache_file != NULL);
+    if(!fail && cache_file)
+      dir_cache_update_child(dir_curpath, &saved_dir, saved_dir.flags & FF_EXT ? &saved_ext : NULL, &saved_link);
+  }
+
+  pthread_mutex_lock(&mt_lock);
+  mt_stop = 1;
+  pthread_cond_broadcast(&mt_work);
+  pthread_mutex_unlock(&mt_lock);
+  for(i=0; i<started; i++)
+    pthread_join(mt_workers[i].thread, NULL);
+
+  /* Released jobs that are left in a deque are no longer part of the tree */
+  for(i=0; i<=mt_nworkers; i++) {
+    w = &mt_workers[i];
+    for(; w->lo<w->hi; w->lo++)
+      if(w->jobs[w->lo]->state == MT_RELEASED)
+        free(w->jobs[w->lo]);
+  }
+  mt_job_free(root);
+  for(i=0; i<=mt_nworkers; i++) {
+    w = &mt_workers[i];
+    pthread_mutex_destroy(&w->lock);
+    free(w->jobs);
+    free(w->d);
+    free(w->path);
+    dir_uring_close(w->ring);
+    free(w->win);
+  }
+  free(mt_workers);
+  mt_workers = NULL;
+  return fail;
 }
 
 
 static int process(void) {
+  struct walk_context ctx = {NULL, 0, 0};
+  struct dir saved_dir;
+  struct dir_ext saved_ext;
+  struct dir_link saved_link;
+  struct dir_entries e;
   char *path;
-  char *dir;
   int fail = 0;
   struct stat fs;
+  uint64_t start = stats_clock();
 
+  verify_cancel();
   memset(buf_dir, 0, offsetof(struct dir, name));
   memset(buf_ext, 0, sizeof(struct dir_ext));
-  buf_nlink = 0;
+  memset(buf_link, 0, sizeof(struct dir_link));
+  dir_progress_start();
 
   if((path = path_real(dir_curpath)) == NULL)
     dir_seterr("Error obtaining full path: %s", strerror(errno));
@@ -491,36 +1507,90 @@ static int process(void) {
   if(!dir_fatalerr && !S_ISDIR(fs.st_mode))
     dir_seterr("Not a directory");
 
-  if(!dir_fatalerr && !(dir = dir_read(&fail)))
-    dir_seterr("Error reading directory: %s", strerror(errno));
-
   if(!dir_fatalerr) {
-    curdev = (uint64_t)fs.st_dev;
+    curdev = walkdev = (uint64_t)fs.st_dev;
+#if HAVE_LINUX_MAGIC_H && HAVE_SYS_STATFS_H && HAVE_STATFS
+    if(exclude_kernfs) {
+      struct statfs fst;
+      curkernfs = !statfs(".", &fst) && is_kernfs(fst.f_type);
+    }
+#endif
+  }
+
+  if(!dir_fatalerr && cache_file)
+    dir_cache_scope(dir_curpath);
+
+  /* Falls back to lstat() if io_uring can't be used */
+  if(!dir_fatalerr && dir_scan_uring && dir_scan_threads <= 1)
+    uring = dir_uring_open();
+
+  if(!dir_fatalerr && dir_scan_threads > 1)
+    fail = mt_process(&fs);
+  else if(!dir_fatalerr && dir_read(&e, &fail))
+    dir_seterr("Error reading directory: %s", strerror(errno));
+  else if(!dir_fatalerr) {
     if(fail)
       buf_dir->flags |= FF_ERR;
-    stat_to_dir(&fs);
+    stat_to_dir(buf_dir, buf_ext, buf_link, &fs);
+
+    memcpy(&saved_dir, buf_dir, offsetof(struct dir, name));
+    memcpy(&saved_ext, buf_ext, sizeof(struct dir_ext));
+    saved_link = *buf_link;
 
-    if(dir_output.item(buf_dir, dir_curpath, buf_ext, buf_nlink)) {
+    if(dir_output.item(buf_dir, dir_curpath, buf_ext, buf_link)) {
       dir_seterr("Output error: %s", strerror(errno));
       fail = 1;
     }
     if(!fail)
-      fail = dir_walk(dir);
-    if(!fail && dir_output.item(NULL, 0, NULL, 0)) {
+      fail = dir_walk_ctx(&e, cache_file ? &ctx : NULL);
+    else
+      dir_entries_free(&e);
+    /* The root is stored as well, so that refreshing it next time can use
+     * the cache entries below it */
+    if(!fail && cache_file) {
+      dir_cache_store(dir_curpath, &saved_dir, saved_dir.flags & FF_EXT ? &saved_ext : NULL,
+                      &saved_link, ctx.children, ctx.nchildren);
+      dir_cache_update_child(dir_curpath, &saved_dir, saved_dir.flags & FF_EXT ? &saved_ext : NULL, &saved_link);
+    }
+    walk_context_free(&ctx);
+    if(!fail && dir_output.item(NULL, 0, NULL, NULL)) {
       dir_seterr("Output error: %s", strerror(errno));
       fail = 1;
     }
   }
 
+  dir_uring_close(uring);
+  uring = NULL;
+
+  stats_phase(STATS_PHASE_SCAN, start);
+  dir_progress_stop();
+
   while(dir_fatalerr && !input_handle(0))
     ;
 
-  if(!dir_fatalerr && !fail && cache_file) {
-    dir_cache_save();
-    dir_cache_destroy();
+  /* The cache is kept around for expanding stubs and refreshing while
+   * browsing */
+  if(cache_file) {
+    if(!dir_fatalerr && !fail)
+      dir_cache_save();
+    dir_cache_close();
   }
 
-  return dir_output.final(dir_fatalerr || fail);
+  fail = dir_output.final(dir_fatalerr || fail);
+
+  /* The trusted directories are checked while the results are browsed,
+   * there is nobody to tell about changes otherwise */
+  if(verify_n && !fail && pstate == ST_BROWSE) {
+    /* Set before the thread starts, it may well be done before we get here
+     * otherwise */
+    verify_state = 1;
+    if(pthread_create(&verify_thread, NULL, verify_run, NULL)) {
+      verify_state = 0;
+      verify_free();
+    }
+  } else
+    verify_free();
+  return fail;
 }
 
 
@@ -529,6 +1599,11 @@ void dir_scan_init(const char *path) {
   dir_setlasterr(NULL);
   dir_seterr(NULL);
   dir_process = process;
+#if HAVE_SYS_ATTR_H && HAVE_GETATTRLIST && HAVE_DECL_ATTR_CMNEXT_NOFIRMLINKPATH
+  /* Firmlink detection works on paths relative to the working directory */
+  if(!follow_firmlinks)
+    dir_scan_threads = 1;
+#endif
   if (!buf_dir)
     buf_dir = xmalloc(dir_memsize(""));
   pstate = ST_CALC;
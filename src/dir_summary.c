@@ -0,0 +1,373 @@
+/* indu - Incremental NCurses Disk Usage
+
+  Based on ncdu by Yorhel (https://dev.yorhel.nl/ncdu)
+  Copyright (c) Yorhel
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+
+#include "global.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+
+int dir_summary_format = SUMMARY_FORMAT_JSON;
+int dir_summary_top = 10;
+int dir_summary_rollups = 0;
+
+struct summary_item {
+  char *path;
+  int64_t size, asize;
+  uint64_t items;
+};
+
+/* Min-heap of the largest items seen so far, so that the smallest one is the
+ * first to be replaced */
+struct heap {
+  struct summary_item *list;
+  int n;
+};
+
+static struct heap dirs, files;
+static struct summary_item total;
+static struct dir_rollup rollup;
+static struct dir_hlinks hlinks;
+
+/* Directories that haven't been closed yet, with the totals of what has been
+ * seen of them so far and the length of the path of their parent */
+static struct stack {
+  struct summary_dir {
+    int64_t size, asize;
+    uint64_t items, serial;
+    size_t parentlen;
+  } *list;
+  int size, top;
+} stack;
+
+/* Path of the current directory, or of the current item while it is added */
+static char *path;
+static size_t pathlen, pathsize;
+
+
+static void path_enter(const char *name) {
+  size_t len = strlen(name);
+
+  if(pathlen+len+2 > pathsize) {
+    pathsize = (pathlen+len+2)*2;
+    path = xrealloc(path, pathsize);
+  }
+  if(pathlen && path[pathlen-1] != '/')
+    path[pathlen++] = '/';
+  memcpy(path+pathlen, name, len+1);
+  pathlen += len;
+}
+
+
+static void path_leave(size_t len) {
+  pathlen = len;
+  path[pathlen] = 0;
+}
+
+
+static void heap_sift(struct heap *h, int i) {
+  struct summary_item t;
+  int c;
+
+  while((c = 2*i+1) < h->n) {
+    if(c+1 < h->n && h->list[c+1].size < h->list[c].size)
+      c++;
+    if(h->list[i].size <= h->list[c].size)
+      break;
+    t = h->list[i];
+    h->list[i] = h->list[c];
+    h->list[c] = t;
+    i = c;
+  }
+}
+
+
+/* Adds the item at the current path if it is among the largest */
+static void heap_add(struct heap *h, int64_t size, int64_t asize, uint64_t items) {
+  struct summary_item t;
+  int i;
+
+  if(h->n == dir_summary_top && (!h->n || size <= h->list[0].size))
+    return;
+
+  t.path = xstrdup(path);
+  t.size = size;
+  t.asize = asize;
+  t.items = items;
+
+  if(h->n == dir_summary_top) {
+    free(h->list[0].path);
+    h->list[0] = t;
+    heap_sift(h, 0);
+    return;
+  }
+  for(i=h->n++; i > 0 && t.size < h->list[(i-1)/2].size; i=(i-1)/2)
+    h->list[i] = h->list[(i-1)/2];
+  h->list[i] = t;
+}
+
+
+static int item_cmp(const void *va, const void *vb) {
+  const struct summary_item *a = va, *b = vb;
+  return a->size < b->size ? 1 : a->size > b->size ? -1 : strcmp(a->path, b->path);
+}
+
+
+static void add(struct summary_dir *d, int64_t size, int64_t asize, uint64_t items) {
+  d->size = adds64(d->size, size);
+  d->asize = adds64(d->asize, asize);
+  d->items += items;
+}
+
+
+/* Sizes are added up while the items come in, only the directories that are
+ * still open and the largest items are kept in memory. Hard links are counted
+ * once in every directory, see dir_hlinks_link(). */
+static int item(struct dir *item, const char *name, struct dir_ext *ext, struct dir_link *link) {
+  struct summary_dir d;
+  uint64_t last;
+  int i;
+
+  if(!item) {
+    d = stack.list[--stack.top];
+    if(!stack.top) {
+      total.path = xstrdup(path);
+      total.size = d.size;
+      total.asize = d.asize;
+      total.items = d.items;
+    } else {
+      add(&stack.list[stack.top-1], d.size, d.asize, d.items+1);
+      heap_add(&dirs, d.size, d.asize, d.items);
+    }
+    path_leave(d.parentlen);
+    return 0;
+  }
+
+  dir_output.items++;
+  dir_output.size = adds64(dir_output.size, item->size);
+
+  d.size = item->size;
+  d.asize = item->asize;
+  d.items = 0;
+  d.serial = 0;
+  d.parentlen = pathlen;
+  path_enter(name);
+
+  if(item->flags & FF_DIR) {
+    d.serial = dir_hlinks_open(&hlinks);
+    nstack_push(&stack, d);
+  }
+  else if(!stack.top) {
+    total.path = xstrdup(path);
+    total.size = d.size;
+    total.asize = d.asize;
+    total.items = 0;
+  } else {
+    add(&stack.list[stack.top-1], d.size, d.asize, 1);
+    /* Taken back out of the directories that have it already, it isn't
+     * added to their parents when they are closed either */
+    if(item->flags & FF_HLNKC && (last = dir_hlinks_link(&hlinks, link)) != 0) {
+      for(i=stack.top; i>0 && stack.list[i-1].serial > last; i--)
+        ;
+      if(i)
+        add(&stack.list[i-1], -d.size, -d.asize, 0);
+    }
+    heap_add(&files, d.size, d.asize, 0);
+    path_leave(d.parentlen);
+  }
+
+  if(dir_summary_rollups && !(item->flags & (FF_DIR|FF_EXL|FF_OTHFS|FF_KERNFS|FF_FRMLNK)))
+    dir_rollup_add(&rollup, name, ext && ext->flags & FFE_UID ? (int64_t)ext->uid : -1, item->size, item->asize);
+  return 0;
+}
+
+
+static void print_json_string(const char *str) {
+  size_t len = strlen(str), n;
+
+  putchar('"');
+  while(1) {
+    n = json_plain(str, len);
+    fwrite(str, 1, n, stdout);
+    str += n;
+    len -= n;
+    if(!len)
+      break;
+    switch(*str) {
+    case '\n': fputs("\\n", stdout); break;
+    case '\r': fputs("\\r", stdout); break;
+    case '\b': fputs("\\b", stdout); break;
+    case '\t': fputs("\\t", stdout); break;
+    case '\f': fputs("\\f", stdout); break;
+    case '\\': fputs("\\\\", stdout); break;
+    case '"':  fputs("\\\"", stdout); break;
+    default:
+      printf("\\u00%02x", *str);
+      break;
+    }
+    str++;
+    len--;
+  }
+  putchar('"');
+}
+
+
+static void print_csv_string(const char *str) {
+  if(!strpbrk(str, ",\"\r\n")) {
+    fputs(str, stdout);
+    return;
+  }
+  putchar('"');
+  for(; *str; str++) {
+    if(*str == '"')
+      putchar('"');
+    putchar(*str);
+  }
+  putchar('"');
+}
+
+
+void dir_summary_string(const char *str) {
+  if(dir_summary_format == SUMMARY_FORMAT_CSV)
+    print_csv_string(str);
+  else
+    print_json_string(str);
+}
+
+
+static void print_item(const char *type, const struct summary_item *it) {
+  if(dir_summary_format == SUMMARY_FORMAT_CSV) {
+    printf("%s,", type);
+    print_csv_string(it->path);
+    printf(",%"PRId64",%"PRId64",%"PRIu64"\n", it->size, it->asize, it->items);
+  } else {
+    printf("{\"type\":\"%s\",\"path\":", type);
+    print_json_string(it->path);
+    printf(",\"dsize\":%"PRId64",\"asize\":%"PRId64",\"items\":%"PRIu64"}\n", it->size, it->asize, it->items);
+  }
+}
+
+
+static void print_heap(const char *type, struct heap *h) {
+  int i;
+
+  qsort(h->list, h->n, sizeof(*h->list), item_cmp);
+  for(i=0; i<h->n; i++)
+    print_item(type, &h->list[i]);
+}
+
+
+static void print_rollup(void) {
+  const struct dir_rollup_row *row;
+  int i, j;
+
+  dir_rollup_sort(&rollup);
+  for(j=0; j<2; j++)
+    for(i=0; i<rollup.n[j]; i++) {
+      row = &rollup.rows[j][i];
+      if(dir_summary_format == SUMMARY_FORMAT_CSV) {
+        if(j == ROLLUP_EXT) {
+          fputs("ext,", stdout);
+          print_csv_string(row->ext);
+        } else if(row->uid >= 0)
+          printf("uid,%"PRId64, row->uid);
+        else
+          fputs("uid,", stdout);
+        printf(",%"PRId64",%"PRId64",%"PRIu64"\n", row->size, row->asize, row->items);
+      } else {
+        if(j == ROLLUP_EXT) {
+          fputs("{\"type\":\"ext\",\"ext\":", stdout);
+          print_json_string(row->ext);
+        } else if(row->uid >= 0)
+          printf("{\"type\":\"uid\",\"uid\":%"PRId64, row->uid);
+        else
+          fputs("{\"type\":\"uid\",\"uid\":null", stdout);
+        printf(",\"dsize\":%"PRId64",\"asize\":%"PRId64",\"items\":%"PRIu64"}\n", row->size, row->asize, row->items);
+      }
+    }
+}
+
+
+static void free_heap(struct heap *h) {
+  int i;
+
+  for(i=0; i<h->n; i++)
+    free(h->list[i].path);
+  free(h->list);
+  h->list = NULL;
+  h->n = 0;
+}
+
+
+static int final(int fail) {
+  if(!fail && total.path) {
+    if(dir_summary_format == SUMMARY_FORMAT_CSV)
+      puts("type,path,dsize,asize,items");
+    print_item("total", &total);
+    print_heap("dir", &dirs);
+    print_heap("file", &files);
+    if(dir_summary_rollups)
+      print_rollup();
+    if(fflush(stdout) || ferror(stdout))
+      fprintf(stderr, "Error writing summary: %s\n", strerror(errno));
+  }
+
+  free(total.path);
+  total.path = NULL;
+  free_heap(&dirs);
+  free_heap(&files);
+  dir_rollup_free(&rollup);
+  dir_hlinks_free(&hlinks);
+  nstack_free(&stack);
+  free(path);
+  path = NULL;
+  return 1;
+}
+
+
+void dir_summary_init(void) {
+  nstack_init(&stack);
+  path = NULL;
+  pathlen = pathsize = 0;
+  total.path = NULL;
+  dirs.list = xmalloc((dir_summary_top ? dir_summary_top : 1)*sizeof(*dirs.list));
+  files.list = xmalloc((dir_summary_top ? dir_summary_top : 1)*sizeof(*files.list));
+  dirs.n = files.n = 0;
+  dir_rollup_init(&rollup);
+  dir_hlinks_init(&hlinks);
+
+  pstate = ST_CALC;
+  dir_output.item = item;
+  dir_output.final = final;
+  dir_output.size = 0;
+  dir_output.items = 0;
+  dir_output.cached = 0;
+  dir_output.partial = NULL;
+  dir_output.browsed = 0;
+}
@@ -0,0 +1,210 @@
+/* indu - Incremental NCurses Disk Usage
+
+  Based on ncdu by Yorhel (https://dev.yorhel.nl/ncdu)
+  Copyright (c) Yorhel
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include "global.h"
+#include "dir_uring.h"
+
+#if HAVE_LINUX_IO_URING_H && HAVE_DECL_IORING_OP_STATX && HAVE_DECL___NR_IO_URING_SETUP && HAVE_STRUCT_STATX
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+
+
+/* The fields that stat_to_dir() needs */
+#define STATX_MASK (STATX_TYPE|STATX_MODE|STATX_NLINK|STATX_UID|STATX_GID|STATX_MTIME|STATX_INO|STATX_SIZE|STATX_BLOCKS)
+
+struct dir_uring {
+  int fd, broken;
+  unsigned int entries;
+  /* submission queue */
+  void *sqring;
+  size_t sqsize;
+  unsigned int *sqhead, *sqtail, *sqmask, *sqarray;
+  struct io_uring_sqe *sqes;
+  /* completion queue, may share the mapping of the submission queue */
+  void *cqring;
+  size_t cqsize;
+  unsigned int *cqhead, *cqtail, *cqmask;
+  struct io_uring_cqe *cqes;
+  struct statx buf[DIR_URING_BATCH];
+};
+
+
+struct dir_uring *dir_uring_open(void) {
+  struct io_uring_params p;
+  struct dir_uring *r = xcalloc(1, sizeof(struct dir_uring));
+  char *sq, *cq;
+
+  memset(&p, 0, sizeof(p));
+  if((r->fd = syscall(__NR_io_uring_setup, DIR_URING_BATCH, &p)) < 0) {
+    free(r);
+    return NULL;
+  }
+  r->entries = p.sq_entries;
+
+  r->sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  r->cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if((p.features & IORING_FEAT_SINGLE_MMAP) && r->cqsize > r->sqsize)
+    r->sqsize = r->cqsize;
+
+  r->sqring = mmap(NULL, r->sqsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if(r->sqring == MAP_FAILED)
+    goto err;
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+    r->cqring = r->sqring;
+    r->cqsize = 0;
+  } else if((r->cqring = mmap(NULL, r->cqsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+    goto err_sq;
+  r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if(r->sqes == MAP_FAILED)
+    goto err_cq;
+
+  sq = r->sqring;
+  r->sqhead  = (unsigned int *)(sq + p.sq_off.head);
+  r->sqtail  = (unsigned int *)(sq + p.sq_off.tail);
+  r->sqmask  = (unsigned int *)(sq + p.sq_off.ring_mask);
+  r->sqarray = (unsigned int *)(sq + p.sq_off.array);
+  cq = r->cqring;
+  r->cqhead  = (unsigned int *)(cq + p.cq_off.head);
+  r->cqtail  = (unsigned int *)(cq + p.cq_off.tail);
+  r->cqmask  = (unsigned int *)(cq + p.cq_off.ring_mask);
+  r->cqes    = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return r;
+
+err_cq:
+  if(r->cqsize)
+    munmap(r->cqring, r->cqsize);
+err_sq:
+  munmap(r->sqring, r->sqsize);
+err:
+  close(r->fd);
+  free(r);
+  return NULL;
+}
+
+
+void dir_uring_close(struct dir_uring *r) {
+  if(!r)
+    return;
+  munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+  if(r->cqsize)
+    munmap(r->cqring, r->cqsize);
+  munmap(r->sqring, r->sqsize);
+  close(r->fd);
+  free(r);
+}
+
+
+static void statx_to_stat(const struct statx *x, struct stat *st) {
+  memset(st, 0, sizeof(struct stat));
+  st->st_mode   = x->stx_mode;
+  st->st_ino    = x->stx_ino;
+  st->st_dev    = makedev(x->stx_dev_major, x->stx_dev_minor);
+  st->st_nlink  = x->stx_nlink;
+  st->st_uid    = x->stx_uid;
+  st->st_gid    = x->stx_gid;
+  st->st_size   = x->stx_size;
+  st->st_blocks = x->stx_blocks;
+  st->st_mtime  = x->stx_mtime.tv_sec;
+}
+
+
+/* Submits at most r->entries requests and waits for all of them */
+static void uring_batch(struct dir_uring *r, int dirfd, const char **names, int n, struct stat *st, char *ok) {
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  unsigned int tail, head, idx;
+  int i, ret, submitted = 0, done = 0, einval = 0;
+
+  tail = *r->sqtail;
+  for(i=0; i<n; i++) {
+    idx = tail & *r->sqmask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dirfd;
+    sqe->addr = (uint64_t)(uintptr_t)names[i];
+    sqe->len = STATX_MASK;
+    sqe->off = (uint64_t)(uintptr_t)&r->buf[i];
+    sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+    sqe->user_data = i;
+    r->sqarray[idx] = idx;
+    tail++;
+    ok[i] = 0;
+  }
+  __atomic_store_n(r->sqtail, tail, __ATOMIC_RELEASE);
+
+  while(done < n) {
+    ret = syscall(__NR_io_uring_enter, r->fd, n-submitted, n-done, IORING_ENTER_GETEVENTS, NULL, 0);
+    if(ret < 0 && errno != EINTR) {
+      /* Whatever didn't complete is stat()ed by the caller, and the ring
+       * is not used again. */
+      r->broken = 1;
+      return;
+    }
+    if(ret > 0)
+      submitted += ret;
+
+    head = *r->cqhead;
+    while(head != __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE)) {
+      cqe = &r->cqes[head & *r->cqmask];
+      if(cqe->res == 0 && cqe->user_data < (uint64_t)n) {
+        statx_to_stat(&r->buf[cqe->user_data], &st[cqe->user_data]);
+        ok[cqe->user_data] = 1;
+      } else if(cqe->res == -EINVAL)
+        einval++;
+      head++;
+      done++;
+    }
+    __atomic_store_n(r->cqhead, head, __ATOMIC_RELEASE);
+  }
+
+  /* Kernels before 5.6 have io_uring but don't support IORING_OP_STATX */
+  if(einval == n)
+    r->broken = 1;
+}
+
+
+void dir_uring_lstat(struct dir_uring *r, int dirfd, const char **names, int n, struct stat *st, char *ok) {
+  int i, c;
+
+  memset(ok, 0, n);
+  for(i=0; !r->broken && i<n; i+=c) {
+    c = n-i < (int)r->entries ? n-i : (int)r->entries;
+    if(c > DIR_URING_BATCH)
+      c = DIR_URING_BATCH;
+    uring_batch(r, dirfd, names+i, c, st+i, ok+i);
+  }
+}
+
+#endif
@@ -0,0 +1,65 @@
+/* indu - Incremental NCurses Disk Usage
+
+  Based on ncdu by Yorhel (https://dev.yorhel.nl/ncdu)
+  Copyright (c) Yorhel
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#ifndef _dir_uring_h
+#define _dir_uring_h
+
+#include "global.h"
+
+/* Batched lstat() of directory entries through io_uring statx requests, used
+ * by the scanner when --io-uring is given. io_uring is used through the raw
+ * system calls, liburing is not needed. */
+
+#if HAVE_LINUX_IO_URING_H && HAVE_DECL_IORING_OP_STATX && HAVE_DECL___NR_IO_URING_SETUP && HAVE_STRUCT_STATX
+
+/* Maximum number of names that dir_uring_lstat() submits at once */
+#define DIR_URING_BATCH 256
+
+struct dir_uring;
+
+/* Sets up a ring, returns NULL if io_uring is not available. A ring must
+ * not be shared between threads. */
+struct dir_uring *dir_uring_open(void);
+void dir_uring_close(struct dir_uring *);
+
+/* lstat()s n names relative to dirfd. ok[i] is set when st[i] has been filled
+ * in; entries that failed for any reason have ok[i] cleared and should be
+ * stat()ed the regular way, which also takes care of reporting the error.
+ * Only the fields used by the scanner are filled in. */
+void dir_uring_lstat(struct dir_uring *, int dirfd, const char **names, int n, struct stat *st, char *ok);
+
+#else
+
+/* Without io_uring support a ring can never be opened */
+#define DIR_URING_BATCH 1
+struct dir_uring;
+#define dir_uring_open() NULL
+#define dir_uring_close(r) ((void)(r))
+#define dir_uring_lstat(r, dirfd, names, n, st, ok) memset((ok), 0, (n))
+
+#endif
+
+#endif
@@ -0,0 +1,564 @@
+/* indu - Incremental NCurses Disk Usage
+
+  Based on ncdu by Yorhel (https://dev.yorhel.nl/ncdu)
+  Copyright (c) Yorhel
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include "global.h"
+#include "dir_cache.h"
+#include "dir_watch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+#if HAVE_SYS_INOTIFY_H
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/inotify.h>
+
+#include <khashl.h>
+#endif
+
+
+/* <cache>.watch starts with a line identifying the cache file:
+ *   indu-watch <version> <dev> <ino> <size> <mtime> <journal length>
+ * followed by the watched root and the directories that changed since the
+ * cache file was written, each terminated by a 0 byte. The daemon appends to
+ * the list as changes come in, and replaces the file after saving the cache. */
+#define WATCH_MAGIC   "indu-watch"
+#define WATCH_VERSION 1
+
+/* Root of the tree that the entries of the loaded cache are known to be up to
+ * date for, NULL if there is none */
+static char *watch_root = NULL;
+static size_t watch_root_len;
+
+
+static char *watch_file(const char *cache) {
+  char *fn = xmalloc(strlen(cache) + 7);
+  sprintf(fn, "%s.watch", cache);
+  return fn;
+}
+
+
+static void watch_trust(const char *path) {
+  free(watch_root);
+  watch_root = path ? xstrdup(path) : NULL;
+  watch_root_len = path ? strlen(path) : 0;
+  if(watch_root_len && path[watch_root_len-1] == '/')
+    watch_root_len--;
+}
+
+
+int dir_watch_load(void) {
+  unsigned long long dev, ino, size, mtime, len;
+  struct stat st;
+  uint64_t jlen;
+  char *fn, *buf = NULL, *p, *q, *end;
+  size_t n = 0, bufsize = 0;
+  ssize_t r;
+  int fd, version, ok = 0;
+
+  watch_trust(NULL);
+  if(!cache_file || dir_cache_base(&st, &jlen))
+    return 0;
+
+  fn = watch_file(cache_file);
+  fd = open(fn, O_RDONLY|O_CLOEXEC);
+  free(fn);
+  if(fd < 0)
+    return 0;
+
+  /* The daemon holds an exclusive lock on the file as long as it runs */
+  if(flock(fd, LOCK_SH|LOCK_NB) == 0 || errno != EWOULDBLOCK) {
+    close(fd);
+    return 0;
+  }
+
+  do {
+    if(bufsize - n < 4096)
+      buf = xrealloc(buf, bufsize = bufsize ? bufsize*2 : 65536);
+    r = read(fd, buf+n, bufsize-n);
+    if(r > 0)
+      n += r;
+  } while(r > 0 || (r < 0 && errno == EINTR));
+  close(fd);
+  if(r < 0 || (p = memchr(buf, '\n', n)) == NULL)
+    goto done;
+  *p++ = 0;
+  end = buf + n;
+
+  if(sscanf(buf, WATCH_MAGIC " %d %llu %llu %llu %llu %llu", &version, &dev, &ino, &size, &mtime, &len) != 6 ||
+      version != WATCH_VERSION || dev != (unsigned long long)st.st_dev || ino != (unsigned long long)st.st_ino ||
+      size != (unsigned long long)st.st_size || mtime != (unsigned long long)st.st_mtime || len != jlen)
+    goto done;
+
+  if((q = memchr(p, 0, end-p)) == NULL)
+    goto done;
+  fn = p;
+  for(p=q+1; p < end && (q = memchr(p, 0, end-p)) != NULL; p=q+1)
+    dir_cache_drop(p);
+
+  /* A path that is still being appended leaves the list incomplete */
+  if(p == end) {
+    watch_trust(fn);
+    ok = 1;
+  }
+
+done:
+  free(buf);
+  return ok;
+}
+
+
+int dir_watch_trusted(const char *path) {
+  return watch_root && strncmp(path, watch_root, watch_root_len) == 0 &&
+    (path[watch_root_len] == '/' || path[watch_root_len] == 0);
+}
+
+
+#if HAVE_SYS_INOTIFY_H
+
+/* Events that change what scanning the directory would find */
+#define WATCH_MASK (IN_MODIFY|IN_ATTRIB|IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|\
+                    IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR|IN_DONT_FOLLOW|IN_EXCL_UNLINK)
+
+/* Changed directories are rescanned once no events have come in for
+ * WATCH_SETTLE milliseconds, or WATCH_MAXDELAY milliseconds after the first
+ * change if they keep coming */
+#define WATCH_SETTLE   1000
+#define WATCH_MAXDELAY 10000
+
+KHASHL_MAP_INIT(KH_LOCAL, wd_t, wd, int, char *, kh_hash_uint32, kh_eq_generic)
+KHASHL_SET_INIT(KH_LOCAL, ch_t, ch, char *, kh_hash_str, kh_eq_str)
+
+static int ifd = -1;          /* inotify instance */
+static wd_t *watches;         /* watch descriptor -> path of the directory */
+static ch_t *changed;         /* directories that changed since the last update */
+static long long first, last; /* time of the first and the last change */
+static char *root;            /* watched directory */
+static char *cache;           /* cache file */
+static char *cache_dir, *cache_name; /* same, split, to ignore changes to it */
+static char *state_file;      /* <cache>.watch */
+static int state_fd = -1;     /* current <cache>.watch, -1 if there is none */
+static int watch_err;         /* errno of a directory that couldn't be watched */
+static int overflow;          /* events have been lost */
+static volatile sig_atomic_t stop;
+
+
+/* The daemon only needs the cache that scanning leaves behind */
+static int null_item(struct dir *d, const char *name, struct dir_ext *ext, struct dir_link *link) {
+  (void)d;
+  (void)name;
+  (void)ext;
+  (void)link;
+  return 0;
+}
+
+
+static int null_final(int fail) {
+  return fail;
+}
+
+
+static void watch_stop(int sig) {
+  (void)sig;
+  stop = 1;
+}
+
+
+static long long watch_msec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+
+static int write_all(int fd, const char *buf, size_t len) {
+  ssize_t r;
+  while(len > 0) {
+    if((r = write(fd, buf, len)) < 0) {
+      if(errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += r;
+    len -= r;
+  }
+  return 0;
+}
+
+
+/* Removes <cache>.watch, scans go back to checking every directory */
+static void watch_unpublish(void) {
+  if(state_fd >= 0) {
+    unlink(state_file);
+    close(state_fd);
+    state_fd = -1;
+  }
+}
+
+
+/* Replaces <cache>.watch with one for the cache file as it has just been
+ * saved, listing what changed in the meantime */
+static void watch_publish(void) {
+  char hdr[160], *tmp;
+  struct stat st;
+  uint64_t jlen;
+  khint_t k;
+  int fd, fail;
+
+  if(dir_cache_base(&st, &jlen)) {
+    watch_unpublish();
+    return;
+  }
+
+  tmp = xmalloc(strlen(state_file) + 8);
+  sprintf(tmp, "%s.XXXXXX", state_file);
+  if((fd = mkstemp(tmp)) < 0) {
+    free(tmp);
+    watch_unpublish();
+    return;
+  }
+
+  snprintf(hdr, sizeof(hdr), "%s %d %llu %llu %llu %llu %llu\n", WATCH_MAGIC, WATCH_VERSION,
+    (unsigned long long)st.st_dev, (unsigned long long)st.st_ino, (unsigned long long)st.st_size,
+    (unsigned long long)st.st_mtime, (unsigned long long)jlen);
+  fail = flock(fd, LOCK_EX) || write_all(fd, hdr, strlen(hdr)) || write_all(fd, root, strlen(root)+1);
+  for(k=0; !fail && k<kh_end(changed); k++)
+    if(__kh_used(changed->used, k))
+      fail = write_all(fd, kh_key(changed, k), strlen(kh_key(changed, k))+1);
+
+  if(fail || rename(tmp, state_file)) {
+    close(fd);
+    unlink(tmp);
+    watch_unpublish();
+  } else {
+    if(state_fd >= 0)
+      close(state_fd);
+    state_fd = fd;
+  }
+  free(tmp);
+}
+
+
+static void changed_add(const char *path) {
+  int absent;
+
+  last = watch_msec();
+  if(ch_get(changed, (char *)path) < kh_end(changed))
+    return;
+  if(!kh_size(changed))
+    first = last;
+  ch_put(changed, xstrdup(path), &absent);
+  if(state_fd >= 0 && write_all(state_fd, path, strlen(path)+1))
+    watch_unpublish();
+}
+
+
+static int watch_add(const char *path, void *arg) {
+  int wd, absent;
+  khint_t k;
+
+  (void)arg;
+  if((wd = inotify_add_watch(ifd, path, WATCH_MASK)) < 0) {
+    /* Gone or unreadable by now, the event on its parent tells when that
+     * changes */
+    if(errno != ENOENT && errno != ENOTDIR && errno != EACCES)
+      watch_err = errno;
+    return 0;
+  }
+  k = wd_put(watches, wd, &absent);
+  if(!absent)
+    free(kh_val(watches, k));
+  kh_val(watches, k) = xstrdup(path);
+  return 0;
+}
+
+
+/* Stops watching a directory that has been moved or removed, along with
+ * everything below it. If it has been moved within the tree, it is watched
+ * again under its new path when the parent of that is rescanned. */
+static void watch_forget(const char *path) {
+  size_t len = strlen(path), n = 0, i;
+  int *wds = NULL;
+  khint_t k;
+
+  for(k=0; k<kh_end(watches); k++)
+    if(__kh_used(watches->used, k) && strncmp(kh_val(watches, k), path, len) == 0 &&
+        (kh_val(watches, k)[len] == '/' || kh_val(watches, k)[len] == 0)) {
+      wds = xrealloc(wds, (n+1) * sizeof(int));
+      wds[n++] = kh_key(watches, k);
+    }
+  for(i=0; i<n; i++) {
+    k = wd_get(watches, wds[i]);
+    inotify_rm_watch(ifd, wds[i]);
+    free(kh_val(watches, k));
+    wd_del(watches, k);
+  }
+  free(wds);
+}
+
+
+static void watch_event(const struct inotify_event *ev) {
+  char *path, *sub;
+  khint_t k;
+
+  if(ev->mask & IN_Q_OVERFLOW) {
+    overflow = 1;
+    return;
+  }
+  if((k = wd_get(watches, ev->wd)) == kh_end(watches))
+    return;
+  if(ev->mask & IN_IGNORED) {
+    free(kh_val(watches, k));
+    wd_del(watches, k);
+    return;
+  }
+  path = kh_val(watches, k);
+
+  /* Writing the cache would otherwise trigger another update */
+  if(ev->len && cache_dir && strcmp(path, cache_dir) == 0 && strncmp(ev->name, cache_name, strlen(cache_name)) == 0)
+    return;
+  changed_add(path);
+
+  /* New directories are watched right away, so that nothing that happens in
+   * them before they are scanned gets lost */
+  if(ev->len && (ev->mask & IN_ISDIR)) {
+    sub = xmalloc(strlen(path) + strlen(ev->name) + 2);
+    sprintf(sub, "%s%s%s", path, path[strlen(path)-1] == '/' ? "" : "/", ev->name);
+    if(ev->mask & (IN_DELETE|IN_MOVED_FROM))
+      watch_forget(sub);
+    else if(ev->mask & (IN_CREATE|IN_MOVED_TO))
+      watch_add(sub, NULL);
+    free(sub);
+  }
+}
+
+
+/* Handles the events that have come in so far */
+static void watch_read(void) {
+  static char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  ssize_t n;
+  char *p;
+
+  while((n = read(ifd, buf, sizeof(buf))) > 0)
+    for(p=buf; p<buf+n; p+=sizeof(struct inotify_event)+ev->len) {
+      ev = (const struct inotify_event *)p;
+      watch_event(ev);
+    }
+  if(n < 0 && errno != EAGAIN && errno != EINTR) {
+    watch_unpublish();
+    die("Error reading inotify events: %s.\n", strerror(errno));
+  }
+}
+
+
+/* Time at which the directories that changed are to be rescanned */
+static long long watch_due(void) {
+  return last + WATCH_SETTLE < first + WATCH_MAXDELAY ? last + WATCH_SETTLE : first + WATCH_MAXDELAY;
+}
+
+
+/* Whether the cache file has been written by another scan since the daemon
+ * saved it */
+static int watch_foreign(void) {
+  struct stat st, cur;
+  uint64_t jlen;
+  char *journal;
+  int r;
+
+  if(dir_cache_base(&st, &jlen))
+    return 0;
+  if(stat(cache, &cur) || cur.st_dev != st.st_dev || cur.st_ino != st.st_ino ||
+      cur.st_size != st.st_size || cur.st_mtime != st.st_mtime)
+    return 1;
+  journal = xmalloc(strlen(cache) + 9);
+  sprintf(journal, "%s.journal", cache);
+  r = stat(journal, &cur) ? jlen != 0 : (uint64_t)cur.st_size != jlen;
+  free(journal);
+  return r;
+}
+
+
+/* Drops the directories that changed from the cache and scans the tree again,
+ * which only reads those directories. With check, it instead checks every
+ * cached directory for changes, for when events may have been missed. */
+static int watch_update(int check) {
+  char **paths;
+  size_t n = 0, i;
+  khint_t k;
+  int fail, validate = dir_scan_validate;
+
+  paths = xmalloc((kh_size(changed)+1) * sizeof(char *));
+  for(k=0; k<kh_end(changed); k++)
+    if(__kh_used(changed->used, k))
+      paths[n++] = kh_key(changed, k);
+  ch_s_clear(changed);
+
+  if(!cache_file)
+    dir_cache_reopen();
+  for(i=0; i<n; i++)
+    dir_cache_drop(paths[i]);
+  if(check) {
+    watch_trust(NULL);
+    dir_scan_validate = 1;
+  } else
+    watch_trust(root);
+  dir_scan_init(root);
+  fail = dir_process();
+  dir_scan_validate = validate;
+
+  /* The directories that changed may have new subdirectories */
+  if(!fail && check)
+    dir_cache_walk(root, watch_add, NULL);
+  for(i=0; !fail && !check && i<n; i++)
+    dir_cache_walk(paths[i], watch_add, NULL);
+  if(fail) {
+    for(i=0; i<n; i++)
+      free(paths[i]);
+    free(paths);
+    return 1;
+  }
+
+  /* What changed during the scan goes into the new <cache>.watch */
+  watch_read();
+  watch_publish();
+
+  /* If the cache couldn't be saved, it is tried again with the next update.
+   * Otherwise the file that has just been written is loaded again, which
+   * gets rid of the replaced entries that stay in memory until the cache is
+   * destroyed. */
+  if(state_fd < 0) {
+    for(i=0; i<n; i++)
+      changed_add(paths[i]);
+  } else {
+    dir_cache_destroy();
+    dir_cache_init(cache);
+    dir_cache_load();
+  }
+  for(i=0; i<n; i++)
+    free(paths[i]);
+  free(paths);
+  return 0;
+}
+
+
+int dir_watch_run(void) {
+  struct sigaction sa;
+  struct pollfd pfd;
+  long long timeout;
+  char *tmp;
+  int fd, r;
+
+  cache = xstrdup(cache_file);
+  state_file = watch_file(cache);
+  if((fd = open(state_file, O_RDONLY|O_CLOEXEC)) >= 0) {
+    r = flock(fd, LOCK_SH|LOCK_NB) && errno == EWOULDBLOCK;
+    close(fd);
+    if(r)
+      die("Another indu --daemon is already keeping %s up to date.\n", cache);
+  }
+
+  if((ifd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) < 0)
+    die("Error initializing inotify: %s.\n", strerror(errno));
+  watches = wd_init();
+  changed = ch_init();
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = watch_stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  dir_output.item = null_item;
+  dir_output.final = null_final;
+  dir_output.cached = 1;
+  dir_output.partial = NULL;
+  dir_output.browsed = 0;
+
+  if((root = path_real(dir_curpath)) == NULL)
+    die("Error obtaining full path: %s.\n", strerror(errno));
+  if(dir_process())
+    return 1;
+
+  if((tmp = path_real(cache)) != NULL && strrchr(tmp, '/') != NULL) {
+    cache_name = xstrdup(strrchr(tmp, '/') + 1);
+    *strrchr(tmp, '/') = 0;
+    cache_dir = *tmp ? tmp : xstrdup("/");
+    if(!*tmp)
+      free(tmp);
+  } else
+    free(tmp);
+
+  /* The tree is watched once it is in the cache. What changed before the
+   * watches were in place is found by checking all directories once more. */
+  dir_cache_walk(root, watch_add, NULL);
+  if(!watch_err && watch_update(1))
+    return 1;
+
+  while(!stop && !watch_err) {
+    if(overflow) {
+      overflow = 0;
+      watch_unpublish();
+      watch_read();
+      if(watch_update(1))
+        break;
+      continue;
+    }
+
+    timeout = WATCH_SETTLE;
+    if(kh_size(changed) && (timeout = watch_due() - watch_msec()) < 0)
+      timeout = 0;
+    pfd.fd = ifd;
+    pfd.events = POLLIN;
+    if((r = poll(&pfd, 1, (int)timeout)) < 0 && errno != EINTR)
+      die("Error waiting for changes: %s.\n", strerror(errno));
+    if(r > 0)
+      watch_read();
+
+    /* The directories that another scan got from the cache can't be trusted
+     * until the daemon has saved its own view of them again */
+    if(!kh_size(changed) && watch_foreign()) {
+      watch_unpublish();
+      changed_add(root);
+    }
+
+    if(!stop && !overflow && kh_size(changed) && watch_msec() >= watch_due() && watch_update(0))
+      break;
+  }
+
+  watch_unpublish();
+  if(watch_err)
+    die("Error watching directories: %s.\n%s", strerror(watch_err), watch_err == ENOSPC ?
+      "The number of watches is limited by the fs.inotify.max_user_watches sysctl.\n" : "");
+  return stop ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,59 @@
+/* indu - Incremental NCurses Disk Usage
+
+  Based on ncdu by Yorhel (https://dev.yorhel.nl/ncdu)
+  Copyright (c) Yorhel
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#ifndef _dir_watch_h
+#define _dir_watch_h
+
+#include "global.h"
+
+/* With --daemon, indu scans a directory into the cache and then keeps
+ * watching it with inotify. Directories that change are dropped from the
+ * cache and rescanned shortly after, and the cache is saved again. Next to
+ * the cache the daemon keeps <cache>.watch, which holds its lock as long as it
+ * runs, identifies the cache file that is up to date and lists the
+ * directories that changed since that file was written.
+ *
+ * Scans that load a cache with such a file don't have to check the nested
+ * directories below the watched root for changes: everything still in the
+ * cache is known to be current once the listed directories are dropped. */
+
+/* Loads <cache>.watch after the cache has been loaded or saved, returns
+ * whether a running daemon vouches for the cache */
+int dir_watch_load(void);
+
+/* Whether the cache entry of the directory at path is known to be up to date
+ * without checking it */
+int dir_watch_trusted(const char *path);
+
+#if HAVE_SYS_INOTIFY_H
+
+/* Runs the daemon on the scan set up with dir_scan_init(), returns the exit
+ * status of indu */
+int dir_watch_run(void);
+
+#endif
+
+#endif
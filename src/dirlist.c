@@ -26,6 +26,7 @@
 
 #include "global.h"
 #include "strnatcmp.h"
+#include "khashl.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -43,9 +44,40 @@ int    dirlist_sort_desc   = 1,
        dirlist_hidden      = 0,
        dirlist_natsort     = 1;
 
+unsigned int dirlist_gen = 0;
+
 /* private state vars */
 static struct dir *parent_alloc, *head, *head_real, *selected, *top = NULL;
 
+/* The items of the opened dir in list order, including the parent reference.
+ * Used to look up items by position when nothing is hidden, as long as the
+ * tree hasn't been modified since the list was built. */
+static struct dir **rows = NULL;
+static int nrows, rowcap, selpos, getpos;
+static unsigned int rows_gen;
+
+
+/* Directories with at least MEMO_MIN items remember their sorted order for
+ * each sort configuration they have been shown with, so that reopening them
+ * or switching back to an earlier sort column doesn't sort them again. All
+ * orders are forgotten when the tree is modified (see dirlist_gen), and when
+ * more than MEMO_MAX items are remembered in total. */
+#define MEMO_MIN 1000
+#define MEMO_MAX (1<<22)
+
+struct sort_memo {
+  struct sort_memo *next;
+  int key, n;
+  struct dir *list[];
+};
+
+#define memo_hash(d) kh_hash_uint64((khint64_t)(uintptr_t)(d))
+KHASHL_MAP_INIT(KH_LOCAL, memo_t, memo, struct dir *, struct sort_memo *, memo_hash, kh_eq_generic)
+
+static memo_t *memos = NULL;
+static unsigned int memo_gen;
+static int memo_total;
+
 
 
 #define ISHIDDEN(d) (dirlist_hidden && (d) != dirlist_parent && (\
@@ -160,6 +192,92 @@ static struct dir *dirlist_sort(struct dir *list) {
 }
 
 
+static int memo_key(void) {
+  return dirlist_sort_col | dirlist_sort_desc<<3 | dirlist_sort_df<<4 | dirlist_natsort<<5;
+}
+
+
+static void memo_clear(void) {
+  struct sort_memo *m, *n;
+  khint_t k;
+
+  if(memos) {
+    for(k=0; k<kh_end(memos); k++)
+      if(__kh_used(memos->used, k))
+        for(m=kh_val(memos, k); m; m=n) {
+          n = m->next;
+          free(m);
+        }
+    memo_destroy(memos);
+    memos = NULL;
+  }
+  memo_total = 0;
+  memo_gen = dirlist_gen;
+}
+
+
+/* Sorts the items of d, or relinks them in a remembered order */
+static struct dir *dirlist_order(struct dir *d) {
+  struct sort_memo *m;
+  struct dir *t;
+  khint_t k;
+  int i, n, absent, key = memo_key();
+
+  if(memo_gen != dirlist_gen)
+    memo_clear();
+
+  if(memos && (k = memo_get(memos, d)) != kh_end(memos))
+    for(m=kh_val(memos, k); m; m=m->next)
+      if(m->key == key) {
+        for(i=0; i<m->n; i++) {
+          m->list[i]->prev = i ? m->list[i-1] : NULL;
+          m->list[i]->next = i+1 < m->n ? m->list[i+1] : NULL;
+        }
+        return d->sub = m->list[0];
+      }
+
+  d->sub = dirlist_sort(d->sub);
+
+  for(n=0, t=d->sub; t; t=t->next)
+    n++;
+  if(n < MEMO_MIN || n > MEMO_MAX)
+    return d->sub;
+  if(memo_total + n > MEMO_MAX)
+    memo_clear();
+
+  m = xmalloc(sizeof(struct sort_memo) + n*sizeof(struct dir *));
+  m->key = key;
+  m->n = n;
+  for(i=0, t=d->sub; t; t=t->next)
+    m->list[i++] = t;
+  if(!memos)
+    memos = memo_init();
+  k = memo_put(memos, d, &absent);
+  m->next = absent ? NULL : kh_val(memos, k);
+  kh_val(memos, k) = m;
+  memo_total += n;
+  return d->sub;
+}
+
+
+/* (re)builds the row index of the opened dir */
+static void dirlist_rows(void) {
+  struct dir *t;
+
+  nrows = selpos = getpos = 0;
+  rows_gen = dirlist_gen;
+  for(t=head; t; t=t->next) {
+    if(nrows == rowcap) {
+      rowcap = rowcap ? rowcap*2 : 256;
+      rows = xrealloc(rows, rowcap*sizeof(struct dir *));
+    }
+    if(t == selected)
+      selpos = nrows;
+    rows[nrows++] = t;
+  }
+}
+
+
 /* passes through the dir listing once and:
  * - makes sure one, and only one, visible item is selected
  * - updates the dirlist_(maxs|maxa) values
@@ -195,12 +313,18 @@ static void dirlist_fixup(void) {
   if(!selected)
     if((selected = dirlist_next(NULL)))
       selected->flags |= FF_BSEL;
+
+  dirlist_rows();
 }
 
 
 void dirlist_open(struct dir *d) {
   dirlist_par = d;
 
+  /* read the contents of a lazily loaded cached directory */
+  if(d != NULL && d->flags & FF_CACHED)
+    dir_mem_expand(d);
+
   /* set the head of the list */
   head_real = head = d == NULL ? NULL : d->sub;
 
@@ -215,7 +339,7 @@ void dirlist_open(struct dir *d) {
 
   /* sort the dir listing */
   if(head)
-    head_real = head = dirlist_sort(head);
+    head_real = head = dirlist_order(d);
 
   /* set the reference to the parent dir */
   if(d->parent) {
@@ -280,6 +404,12 @@ struct dir *dirlist_get(int i) {
   if(!i)
     return selected;
 
+  /* nothing hidden? look it up in the row index */
+  if(!dirlist_hidden && rows_gen == dirlist_gen) {
+    getpos = i > nrows-1-selpos ? nrows-1 : i < -selpos ? 0 : selpos+i;
+    return rows[getpos];
+  }
+
   /* positive number? simply move forward */
   while(i > 0) {
     d = dirlist_next(t);
@@ -309,6 +439,17 @@ void dirlist_select(struct dir *d) {
   selected->flags &= ~FF_BSEL;
   selected = d;
   selected->flags |= FF_BSEL;
+
+  if(rows_gen == dirlist_gen) {
+    if(rows[getpos] != d)
+      for(getpos=0; getpos<nrows && rows[getpos] != d; getpos++)
+        ;
+    /* not in the index? it is out of date, don't use it anymore */
+    if(getpos == nrows)
+      rows_gen = dirlist_gen-1;
+    else
+      selpos = getpos;
+  }
 }
 
 
@@ -384,11 +525,12 @@ void dirlist_set_sort(int col, int desc, int df) {
 
   /* sort the list (excluding the parent, which is always on top) */
   if(head_real)
-    head_real = dirlist_sort(head_real);
+    head_real = dirlist_order(dirlist_par);
   if(dirlist_parent)
     dirlist_parent->next = head_real;
   else
     head = head_real;
+  dirlist_rows();
   dirlist_top(-3);
 }
 
@@ -65,6 +65,11 @@ void dirlist_set_sort(int column, int desc, int df);
 void dirlist_set_hidden(int hidden);
 
 
+/* Incremented whenever items are added to, removed from or resized in the
+ * tree. Sort orders remembered by dirlist_open() are dropped when it changes. */
+extern unsigned int dirlist_gen;
+
+
 /* DO NOT WRITE TO ANY OF THE BELOW VARIABLES FROM OUTSIDE OF dirlist.c! */
 
 /* The 'reference to parent dir' */
@@ -30,17 +30,135 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fnmatch.h>
+#include <unistd.h>
+#include <fcntl.h>
 
+#include <khashl.h>
+
+
+/* A pattern matches a path if fnmatch() matches it against the full path or
+ * against any part of the path that follows a '/'. Patterns are sorted by
+ * the kind of matching they need when they are added, so that scanning
+ * doesn't have to call fnmatch() for most of them:
+ *   literal    "node_modules", "src/.git": looked up in a hash set, once for
+ *              each suffix of the path with no more slashes than the longest
+ *              literal
+ *   "*suffix"  "*.o": the '*' also matches slashes, so this is just a check
+ *              of the end of the path, done by walking a trie in reverse
+ *   "prefix*"  "build*": walked through a trie at the start of each path
+ *              component
+ * Everything else is a glob that remains in the excludes list. */
 
 static struct exclude {
   char *pattern;
   struct exclude *next;
 } *excludes = NULL;
 
+KHASHL_SET_INIT(KH_LOCAL, lit_t, lit, const char *, kh_hash_str, kh_eq_str)
+static lit_t *literals = NULL;
+static int literal_slashes = 0; /* most slashes in a literal */
+
+/* Nodes are stored in an array, node 0 is the root. Children are a linked
+ * list through next, 0 ends the list. */
+struct trie {
+  struct trie_node {
+    int child, next;
+    unsigned char c, end;
+  } *nodes;
+  int n, size;
+};
+static struct trie suffixes, prefixes;
+
+
+static int trie_child(const struct trie *t, int node, unsigned char c) {
+  int i;
+  for(i=t->nodes[node].child; i; i=t->nodes[i].next)
+    if(t->nodes[i].c == c)
+      return i;
+  return 0;
+}
+
+
+/* Adds the first len bytes of str, in reverse if rev is set */
+static void trie_add(struct trie *t, const char *str, int len, int rev) {
+  int node = 0, i, nxt;
+  unsigned char c;
+
+  if(!t->nodes) {
+    t->size = 16;
+    t->n = 1;
+    t->nodes = xcalloc(t->size, sizeof(struct trie_node));
+  }
+  for(i=0; i<len; i++) {
+    c = str[rev ? len-1-i : i];
+    if(!(nxt = trie_child(t, node, c))) {
+      if(t->n == t->size) {
+        t->size *= 2;
+        t->nodes = xrealloc(t->nodes, t->size*sizeof(struct trie_node));
+      }
+      nxt = t->n++;
+      memset(&t->nodes[nxt], 0, sizeof(struct trie_node));
+      t->nodes[nxt].c = c;
+      t->nodes[nxt].next = t->nodes[node].child;
+      t->nodes[node].child = nxt;
+    }
+    node = nxt;
+  }
+  t->nodes[node].end = 1;
+}
+
+
+/* Whether the path ends with a string in the trie */
+static int trie_suffix(const struct trie *t, const char *path, size_t len) {
+  int node = 0;
+
+  if(t->nodes[0].end)
+    return 1;
+  while(len > 0 && (node = trie_child(t, node, path[--len])))
+    if(t->nodes[node].end)
+      return 1;
+  return 0;
+}
+
+
+/* Whether str starts with a string in the trie */
+static int trie_prefix(const struct trie *t, const char *str) {
+  int node = 0;
+
+  for(; *str && (node = trie_child(t, node, *str)); str++)
+    if(t->nodes[node].end)
+      return 1;
+  return 0;
+}
 
 
 void exclude_add(char *pat) {
   struct exclude **n;
+  size_t len = strlen(pat), special = strcspn(pat, "*?[\\");
+  const char *c;
+  khint_t k;
+  int r;
+
+  if(special == len) {
+    if(!literals)
+      literals = lit_init();
+    k = lit_put(literals, pat, &r);
+    if(r)
+      kh_key(literals, k) = xstrdup(pat);
+    for(r=0, c=pat; *c; c++)
+      r += *c == '/';
+    if(r > literal_slashes)
+      literal_slashes = r;
+    return;
+  }
+  if(pat[0] == '*' && strcspn(pat+1, "*?[\\") == len-1) {
+    trie_add(&suffixes, pat+1, len-1, 1);
+    return;
+  }
+  if(special == len-1 && pat[len-1] == '*') {
+    trie_add(&prefixes, pat, len-1, 0);
+    return;
+  }
 
   n = &excludes;
   while(*n != NULL)
@@ -76,7 +194,32 @@ int exclude_addfile(char *file) {
 
 int exclude_match(char *path) {
   struct exclude *n;
+  size_t len = strlen(path);
   char *c;
+  int slashes;
+
+  if(suffixes.nodes && trie_suffix(&suffixes, path, len))
+    return 1;
+
+  /* Walk back through the path, trying each part that follows a '/' */
+  if(literals) {
+    for(c=path+len, slashes=0; c>path && slashes<=literal_slashes; c--)
+      if(c[-1] == '/') {
+        if(*c != '/' && lit_get(literals, c) != kh_end(literals))
+          return 1;
+        slashes++;
+      }
+    if(c == path && slashes <= literal_slashes && lit_get(literals, path) != kh_end(literals))
+      return 1;
+  }
+
+  if(prefixes.nodes) {
+    if(trie_prefix(&prefixes, path))
+      return 1;
+    for(c = path; *c; c++)
+      if(*c == '/' && c[1] != '/' && trie_prefix(&prefixes, c+1))
+        return 1;
+  }
 
   for(n=excludes; n!=NULL; n=n->next) {
     if(!fnmatch(n->pattern, path, 0))
@@ -91,6 +234,7 @@ int exclude_match(char *path) {
 
 void exclude_clear(void) {
   struct exclude *n, *l;
+  khint_t k;
 
   for(n=excludes; n!=NULL; n=l) {
     l = n->next;
@@ -98,6 +242,19 @@ void exclude_clear(void) {
     free(n);
   }
   excludes = NULL;
+
+  if(literals) {
+    for(k=0; k<kh_end(literals); k++)
+      if(__kh_used(literals->used, k))
+        free((char *)kh_key(literals, k));
+    lit_destroy(literals);
+    literals = NULL;
+  }
+  literal_slashes = 0;
+  free(suffixes.nodes);
+  free(prefixes.nodes);
+  memset(&suffixes, 0, sizeof(suffixes));
+  memset(&prefixes, 0, sizeof(prefixes));
 }
 
 
@@ -105,35 +262,28 @@ void exclude_clear(void) {
  * Exclusion of directories that contain only cached information.
  * See http://www.brynosaurus.com/cachedir/
  */
-#define CACHEDIR_TAG_FILENAME "CACHEDIR.TAG"
 #define CACHEDIR_TAG_SIGNATURE "Signature: 8a477f597d28d172789f06886806bc55"
 
-int has_cachedir_tag(const char *name) {
-  static int path_l = 1024;
-  static char *path = NULL;
-  int l;
+/* Checks whether the directory name, relative to dirfd, contains a valid
+ * CACHEDIR.TAG. Safe to call from multiple threads. */
+int has_cachedir_tag(int dirfd, const char *name) {
+  char pathbuf[256], *path = pathbuf;
   char buf[sizeof CACHEDIR_TAG_SIGNATURE - 1];
-  FILE *f;
-  int match = 0;
-
-  /* Compute the required length for `path`. */
-  l = strlen(name) + sizeof CACHEDIR_TAG_FILENAME + 2;
-  if(l > path_l || path == NULL) {
-    path_l = path_l * 2;
-    if(path_l < l)
-      path_l = l;
-    /* We don't need to copy the content of `path`, so it's more efficient to
-     * use `free` + `malloc`. */
+  size_t l;
+  int fd, match = 0;
+
+  l = strlen(name) + sizeof CACHEDIR_TAG_FILENAME + 1;
+  if(l > sizeof pathbuf)
+    path = xmalloc(l);
+  snprintf(path, l, "%s/%s", name, CACHEDIR_TAG_FILENAME);
+  fd = openat(dirfd, path, O_RDONLY);
+  if(path != pathbuf)
     free(path);
-    path = xmalloc(path_l);
-  }
-  snprintf(path, path_l, "%s/%s", name, CACHEDIR_TAG_FILENAME);
-  f = fopen(path, "rb");
 
-  if(f != NULL) {
-    match = ((fread(buf, 1, sizeof buf, f) == sizeof buf) &&
-                !memcmp(buf, CACHEDIR_TAG_SIGNATURE, sizeof buf));
-    fclose(f);
+  if(fd >= 0) {
+    match = read(fd, buf, sizeof buf) == (ssize_t)sizeof buf &&
+            !memcmp(buf, CACHEDIR_TAG_SIGNATURE, sizeof buf);
+    close(fd);
   }
   return match;
 }
@@ -31,6 +31,8 @@ void exclude_add(char *);
 int  exclude_addfile(char *);
 int  exclude_match(char *);
 void exclude_clear(void);
-int  has_cachedir_tag(const char *name);
+int  has_cachedir_tag(int dirfd, const char *name);
+
+#define CACHEDIR_TAG_FILENAME "CACHEDIR.TAG"
 
 #endif
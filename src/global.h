@@ -55,6 +55,7 @@
 #define FF_KERNFS 0x200 /* excluded because it was a Linux pseudo filesystem */
 #define FF_FRMLNK 0x400 /* excluded because it was a firmlink */
 #define FF_CACHED 0x800
+#define FF_TOP   0x1000 /* in the lists of largest items, see dir_mem_top() */
 
 /* Ext mode flags (struct dir_ext -> flags) */
 #define FFE_MTIME 0x01
@@ -69,18 +70,34 @@
 #define ST_HELP   3
 #define ST_SHELL  4
 #define ST_QUIT   5
+#define ST_TOP    6
+#define ST_ROLLUP 7
 
 
-/* structure representing a file or directory */
+/* structure representing a file or directory. The fixed part is 54 bytes on
+ * 64-bit systems; the name follows it, then the optional struct dir_ext
+ * (FF_EXT) and struct dir_link (FF_HLNKC), see dir_node_memsize().
+ * The links are kept as pointers: nodes have the name inline and are moved
+ * around by the spill file and freed one by one when deleting, so 32-bit
+ * indices would need a table from index to node, at 8 bytes per node that
+ * would cost half of what they save. */
 struct dir {
   int64_t size, asize;
-  uint64_t ino, dev;
-  struct dir *parent, *next, *prev, *sub, *hlnk;
+  struct dir *parent, *next, *prev, *sub;
   int items;
   unsigned short flags;
   char name[FLEXIBLE_ARRAY_MEMBER];
 };
 
+
+/* Identity of an item. Given to dir_output.item() for every item, but only
+ * kept in memory for hard link candidates. */
+struct dir_link {
+  uint64_t ino, dev;
+  struct dir *hlnk; /* circular list of items with the same dev/ino */
+  unsigned int nlink;
+};
+
 /* A note on the ino and dev fields above: ino is usually represented as ino_t,
  * which POSIX specifies to be an unsigned integer.  dev is usually represented
  * as dev_t, which may be either a signed or unsigned integer, and in practice
@@ -135,6 +152,9 @@ extern int show_mtime;
 /* handle input from keyboard and update display */
 int input_handle(int);
 
+/* adapt to a changed terminal size, after a KEY_RESIZE */
+void screen_resize(void);
+
 /* de-initialize ncurses */
 void close_nc(void);
 
@@ -150,5 +170,7 @@ void close_nc(void);
 #include "util.h"
 #include "shell.h"
 #include "quit.h"
+#include "top.h"
+#include "rollup.h"
 
 #endif
@@ -33,7 +33,7 @@
 static int page, start;
 
 
-#define KEYS 19
+#define KEYS 21
 static const char *keys[KEYS*2] = {
 /*|----key----|  |----------------description----------------|*/
         "up, k", "Move cursor up",
@@ -53,12 +53,14 @@ static const char *keys[KEYS*2] = {
             "e", "Show/hide hidden or excluded files",
             "i", "Show information about selected item",
             "r", "Recalculate the current directory",
+            "T", "Show the largest files and directories",
+            "U", "Show the sizes by owner and file type",
             "b", "Spawn shell in current directory",
             "q", "Quit indu"
 };
 
 
-#define FLAGS 9
+#define FLAGS 10
 static const char *flags[FLAGS*2] = {
     "!", "An error occurred while reading this directory",
     ".", "An error occurred while reading a subdirectory",
@@ -69,6 +71,7 @@ static const char *flags[FLAGS*2] = {
     "^", "Excluded Linux pseudo-filesystem",
     "H", "Same file was already counted (hard link)",
     "F", "Excluded firmlink",
+    "*", "Directory is still being scanned",
 };
 
 void help_draw(void) {
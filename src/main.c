@@ -26,6 +26,8 @@
 
 #include "global.h"
 #include "dir_cache.h"
+#include "dir_watch.h"
+#include "stats.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -67,10 +69,18 @@ static void screen_draw(void) {
     case ST_SHELL:  shell_draw();  break;
     case ST_DEL:    delete_draw(); break;
     case ST_QUIT:   quit_draw();   break;
+    case ST_TOP:    top_draw();    break;
+    case ST_ROLLUP: rollup_draw(); break;
   }
 }
 
 
+void screen_resize(void) {
+  if(ncresize(min_rows, min_cols))
+    min_rows = min_cols = 0;
+}
+
+
 /* wait:
  *  -1: non-blocking, always draw screen
  *   0: blocking wait for input and always draw screen
@@ -96,11 +106,13 @@ int input_handle(int wait) {
     return wait == 0 ? 1 : 0;
 
   nodelay(stdscr, wait?1:0);
+  /* Wake up now and then to show the outcome of the check */
+  if(!wait && dir_scan_verifying())
+    timeout(500);
   errno = 0;
   while((ch = getch()) != ERR) {
     if(ch == KEY_RESIZE) {
-      if(ncresize(min_rows, min_cols))
-        min_rows = min_cols = 0;
+      screen_resize();
       /* ncresize() may change nodelay state, make sure to revert it. */
       nodelay(stdscr, wait?1:0);
       screen_draw();
@@ -112,6 +124,8 @@ int input_handle(int wait) {
       case ST_HELP:   return help_key(ch);
       case ST_DEL:    return delete_key(ch);
       case ST_QUIT:   return quit_key(ch);
+      case ST_TOP:    return top_key(ch);
+      case ST_ROLLUP: return rollup_key(ch);
     }
     screen_draw();
   }
@@ -195,6 +209,32 @@ static char *argparser_arg(struct argparser *p) {
 #define OPT(_s) (strcmp(argparser_state.last, (_s)) == 0)
 #define ARG (argparser_arg(&argparser_state))
 
+/* Parses a number of bytes with an optional K, M, G or T suffix */
+static int parse_size(const char *arg, uint64_t *size) {
+  char *end;
+  int shift = 0;
+
+  errno = 0;
+  *size = strtoull(arg, &end, 10);
+  if(end == arg || errno)
+    return -1;
+  switch(*end) {
+  case 'k': case 'K': shift = 10; end++; break;
+  case 'm': case 'M': shift = 20; end++; break;
+  case 'g': case 'G': shift = 30; end++; break;
+  case 't': case 'T': shift = 40; end++; break;
+  }
+  if(*end == 'i' && shift)
+    end++;
+  if(*end == 'B' || *end == 'b')
+    end++;
+  if(*end || *size > (UINT64_MAX >> shift))
+    return -1;
+  *size <<= shift;
+  return 0;
+}
+
+
 static int arg_option(int infile) {
   char *arg, *tmp;
   if(OPT("-q") || OPT("--slow-ui-updates")) update_delay = 2000;
@@ -288,7 +328,58 @@ static int arg_option(int infile) {
     arg = ARG;
     if(!arg) return 1;
     cache_file = xstrdup(arg);
-  } else if(OPT("--confirm-quit")) confirm_quit = 1;
+  } else if(OPT("--cache-format")) {
+    arg = ARG;
+    if (!arg) return 1;
+    else if(strcmp(arg, "binary") == 0) cache_format = CACHE_FORMAT_BINARY;
+    else if(strcmp(arg, "json") == 0) cache_format = CACHE_FORMAT_JSON;
+    else if (!argparser_state.ignerror) die("Unknown --cache-format option: %s\n", arg);
+  } else if(OPT("--cache-journal")) cache_journal = 1;
+  else if(OPT("--no-cache-journal")) cache_journal = 0;
+  else if(OPT("--cache-shards")) cache_shards = 1;
+  else if(OPT("--no-cache-shards")) cache_shards = 0;
+  else if(OPT("--lazy-cache")) cache_lazy = 1;
+  else if(OPT("--no-lazy-cache")) cache_lazy = 0;
+  else if(OPT("--cache-trust")) {
+    uint64_t secs;
+    arg = ARG;
+    if(!arg) return 1;
+    errno = 0;
+    secs = strtoull(arg, &tmp, 10);
+    if(*arg < '0' || *arg > '9' || errno || (*tmp && (*tmp != ':' || !tmp[1]))) {
+      if(argparser_state.ignerror) return 1;
+      die("Invalid argument to --cache-trust: '%s'.\n", arg);
+    }
+    if(!*tmp)
+      dir_cache_trust_set(NULL, secs);
+    else {
+      arg = infile ? expanduser(tmp+1) : tmp+1;
+      dir_cache_trust_set(arg, secs);
+      if(infile) free(arg);
+    }
+  } else if(OPT("--no-cache-trust")) dir_cache_trust_clear();
+  else if(OPT("-t") || OPT("--threads")) {
+    arg = ARG;
+    if(!arg) return 1;
+    dir_scan_threads = strtol(arg, &tmp, 10);
+    if(*tmp || dir_scan_threads < 1 || dir_scan_threads > 256) {
+      dir_scan_threads = 1;
+      if(argparser_state.ignerror) return 1;
+      die("Invalid argument to --threads: '%s'.\n", arg);
+    }
+  } else if(OPT("--memory-limit")) {
+    arg = ARG;
+    if(!arg) return 1;
+    if(parse_size(arg, &dir_mem_limit)) {
+      dir_mem_limit = 0;
+      if(argparser_state.ignerror) return 1;
+      die("Invalid argument to --memory-limit: '%s'.\n", arg);
+    }
+  } else if(OPT("--io-uring")) dir_scan_uring = 1;
+  else if(OPT("--no-io-uring")) dir_scan_uring = 0;
+  else if(OPT("--cache-validate")) dir_scan_validate = 1;
+  else if(OPT("--no-cache-validate")) dir_scan_validate = 0;
+  else if(OPT("--confirm-quit")) confirm_quit = 1;
   else if(OPT("--no-confirm-quit")) confirm_quit = 0;
   else if(OPT("--confirm-delete")) delete_confirm = 1;
   else if(OPT("--no-confirm-delete")) delete_confirm = 0;
@@ -311,8 +402,26 @@ static void arg_help(void) {
   "  -h, --help                 This help message\n"
   "  -v, -V, --version          Print version\n"
   "  -f FILE                    Import scanned directory from FILE\n"
-  "  -o FILE                    Export scanned directory to FILE in JSON format\n"
+  "  -o FILE                    Export scanned directory to FILE\n"
+  "  --export-format FORMAT     json / binary\n"
+#if HAVE_ZSTD
+  "  --compress                 Compress the export with zstd (default for FILE.zst)\n"
+#endif
+  "  --query QUERY              Answer QUERY (totals / top=N) from the binary export given with -f\n"
+  "  --summary FORMAT           Print totals and the largest items as json / csv\n"
+  "  --summary-top NUM          Number of directories and files in the summary (10)\n"
+  "  --summary-rollups          Add the sizes by owner and by extension to the summary\n"
+  "  --diff OLD NEW             Print the growth of every directory between two caches or exports\n"
+  "  --stats[=FILE]             Write scan counters and timings to FILE or stderr\n"
   "  -C, --cache FILE           Use FILE as incremental scan cache\n"
+  "  --cache-format FORMAT      binary / json\n"
+  "  --cache-journal            Append updates to a journal next to the cache\n"
+  "  --cache-shards             Use a separate cache file for every device\n"
+  "  --no-lazy-cache            Load all cached directories into memory after scanning\n"
+#if HAVE_SYS_INOTIFY_H
+  "  --daemon                   Keep the cache up to date by watching for changes\n"
+#endif
+  "  --memory-limit SIZE        Move scanned directories to a temporary file past SIZE\n"
   "  -e, --extended             Enable extended information\n"
   "  --ignore-config            Don't load config files\n"
   "\n"
@@ -322,11 +431,17 @@ static void arg_help(void) {
   "  -X, --exclude-from FILE    Exclude files that match any pattern in FILE\n"
   "  --exclude-caches           Exclude directories containing CACHEDIR.TAG\n"
   "  -L, --follow-symlinks      Follow symbolic links (excluding directories)\n"
+  "  -t, --threads NUM          Number of threads to scan with\n"
+  "  --no-cache-validate        Don't check nested cached directories for changes\n"
+  "  --cache-trust SECS[:PATH]  Trust cached directories checked in the last SECS seconds\n"
 #if HAVE_LINUX_MAGIC_H && HAVE_SYS_STATFS_H && HAVE_STATFS
   "  --exclude-kernfs           Exclude Linux pseudo filesystems (procfs,sysfs,cgroup,...)\n"
 #endif
 #if HAVE_SYS_ATTR_H && HAVE_GETATTRLIST && HAVE_DECL_ATTR_CMNEXT_NOFIRMLINKPATH
   "  --exclude-firmlinks        Exclude firmlinks on macOS\n"
+#endif
+#if HAVE_LINUX_IO_URING_H && HAVE_DECL_IORING_OP_STATX && HAVE_DECL___NR_IO_URING_SETUP && HAVE_STRUCT_STATX
+  "  --io-uring                 Use io_uring to read file information\n"
 #endif
   "\n"
   "Interface options:\n"
@@ -425,11 +540,18 @@ static void config_load(int argc, char **argv) {
 }
 
 
+static int daemon_mode = 0;
+
 static void argv_parse(int argc, char **argv) {
   int r;
   char *export = NULL;
   char *import = NULL;
+  char *query = NULL;
+  char *diff = NULL;
+  char *tmp;
+  int summary = 0;
   char *dir = NULL;
+  char *arg;
 
   memset(&argparser_state, 0, sizeof(struct argparser));
   argparser_state.argv = argv;
@@ -444,6 +566,33 @@ static void argv_parse(int argc, char **argv) {
     } else if(OPT("-h") || OPT("-?") || OPT("--help")) arg_help();
     else if(OPT("-o")) export = ARG;
     else if(OPT("-f")) import = ARG;
+    else if(OPT("--daemon")) daemon_mode = 1;
+    else if(OPT("--compress")) dir_export_compress = 1;
+    else if(OPT("--export-format")) {
+      arg = ARG;
+      if(strcmp(arg, "json") == 0) dir_export_format = EXPORT_FORMAT_JSON;
+      else if(strcmp(arg, "binary") == 0) dir_export_format = EXPORT_FORMAT_BINARY;
+      else die("Unknown --export-format option: %s\n", arg);
+    } else if(OPT("--query")) query = ARG;
+    else if(OPT("--diff")) diff = ARG;
+    else if(OPT("--summary")) {
+      arg = ARG;
+      summary = 1;
+      if(strcmp(arg, "json") == 0) dir_summary_format = SUMMARY_FORMAT_JSON;
+      else if(strcmp(arg, "csv") == 0) dir_summary_format = SUMMARY_FORMAT_CSV;
+      else die("Unknown --summary option: %s\n", arg);
+    } else if(OPT("--summary-top")) {
+      arg = ARG;
+      dir_summary_top = strtol(arg, &tmp, 10);
+      if(*tmp || dir_summary_top < 0 || dir_summary_top > 1000000)
+        die("Invalid argument to --summary-top: '%s'.\n", arg);
+    } else if(OPT("--summary-rollups")) dir_summary_rollups = 1;
+    else if(OPT("--stats")) {
+      /* The file is optional, so it can only be given as --stats=FILE */
+      stats_enabled = 1;
+      stats_file = argparser_state.last_arg;
+      argparser_state.last_arg = NULL;
+    }
     else if(OPT("--ignore-config")) {}
     else if(!arg_option(0)) die("Unknown option '%s'.\n", argparser_state.last);
   }
@@ -452,11 +601,52 @@ static void argv_parse(int argc, char **argv) {
   if(exclude_kernfs) die("The --exclude-kernfs flag is currently only supported on Linux.\n");
 #endif
 
-  if(export) {
+  if(daemon_mode) {
+#if !HAVE_SYS_INOTIFY_H
+    die("The --daemon flag is currently only supported on Linux.\n");
+#endif
+    if(!cache_file) die("The --daemon flag requires a cache file, see --cache.\n");
+    if(cache_shards) die("The --daemon flag can't be combined with --cache-shards.\n");
+    if(export || import || summary) die("The --daemon flag can't be combined with -o, -f or --summary.\n");
+    if(dir_ui == -1) dir_ui = 0;
+  }
+
+  if(export && strlen(export) > 4 && strcmp(export+strlen(export)-4, ".zst") == 0)
+    dir_export_compress = 1;
+  if(dir_export_compress) {
+#if !HAVE_ZSTD
+    die("Compressed exports require indu to be built with zstd.\n");
+#endif
+    if(!export) die("The --compress flag requires -o.\n");
+    if(dir_export_format == EXPORT_FORMAT_BINARY) die("Binary exports can't be compressed.\n");
+  }
+
+  if(query) {
+    if(!import || strcmp(import, "-") == 0) die("The --query flag requires a binary export file, see -f.\n");
+    r = dir_import_query(import, query);
+    dir_cache_destroy();
+    exit(r);
+  }
+
+  if(diff) {
+    if(!dir) die("The --diff flag requires a second file to compare with.\n");
+    if(export || import) die("The --diff flag can't be combined with -o or -f.\n");
+    if(dir_ui != 1) dir_ui = 0;
+    exit(dir_diff(diff, dir));
+  }
+
+  if(summary && export) die("The --summary flag can't be combined with -o.\n");
+
+  if(summary)
+    dir_summary_init();
+  else if(export) {
     if(dir_export_init(export)) die("Can't open %s: %s\n", export, strerror(errno));
     if(strcmp(export, "-") == 0) ncurses_tty = 1;
-  } else
+  } else {
     dir_mem_init(NULL);
+    if(dir_mem_limit && dir_mem_spill_open())
+      die("Can't create a spill file for --memory-limit: %s\n", strerror(errno));
+  }
 
   if(import) {
     if(dir_import_init(import)) die("Can't open %s: %s\n", import, strerror(errno));
@@ -466,14 +656,19 @@ static void argv_parse(int argc, char **argv) {
       dir_cache_init(cache_file);
       if(dir_cache_load())
         fprintf(stderr, "Warning: could not load cache file\n");
+      else if(!daemon_mode) {
+        if(!summary && !export)
+          dir_mem_top_load();
+        dir_watch_load();
+      }
     }
     dir_scan_init(dir ? dir : ".");
   }
 
   /* Use the single-line scan feedback by default when exporting to file, no
-   * feedback when exporting to stdout. */
+   * feedback when exporting to stdout or printing a summary. */
   if(dir_ui == -1)
-    dir_ui = export && strcmp(export, "-") == 0 ? 0 : export ? 1 : 2;
+    dir_ui = summary ? 0 : export && strcmp(export, "-") == 0 ? 0 : export ? 1 : 2;
 
   if(can_delete == -1)  can_delete  = import ? 0 : 1;
   if(can_shell == -1)   can_shell   = import ? 0 : 1;
@@ -514,8 +709,7 @@ static void init_nc(void) {
   curs_set(0);
   keypad(stdscr, TRUE);
   bkgd(COLOR_PAIR(UIC_DEFAULT+1));
-  if(ncresize(min_rows, min_cols))
-    min_rows = min_cols = 0;
+  screen_resize();
 }
 
 
@@ -533,6 +727,15 @@ int main(int argc, char **argv) {
   config_load(argc, argv);
   argv_parse(argc, argv);
 
+#if HAVE_SYS_INOTIFY_H
+  if(daemon_mode) {
+    int r = dir_watch_run();
+    dir_cache_destroy();
+    stats_write();
+    return r;
+  }
+#endif
+
   if(dir_ui == 2)
     init_nc();
 
@@ -553,12 +756,20 @@ int main(int argc, char **argv) {
       }
     } else if(pstate == ST_DEL)
       delete_process();
-    else if(input_handle(0))
-      break;
+    else {
+      if(pstate == ST_BROWSE)
+        browse_verified();
+      if(input_handle(0))
+        break;
+    }
   }
 
   close_nc();
+  dir_mem_top_save();
+  /* joins the thread that loads a JSON cache, if it's still around */
+  dir_cache_destroy();
   exclude_clear();
+  stats_write();
 
   return 0;
 }
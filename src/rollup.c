@@ -0,0 +1,172 @@
+/* indu - Incremental NCurses Disk Usage
+
+  Based on ncdu by Yorhel (https://dev.yorhel.nl/ncdu)
+  Copyright (c) Yorhel
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include "global.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pwd.h>
+#include <ncurses.h>
+
+
+static struct dir_rollup rollup;
+static struct dir *rdir;
+static int page, start, sel, incomplete;
+
+
+/* Rows of the list in the window */
+#define ROLLUP_ROWS (winrows-9)
+
+static const char *rowname(const struct dir_rollup_row *row) {
+  static char buf[ROLLUP_EXTLEN+64];
+  struct passwd *pw;
+
+  if(page == ROLLUP_EXT) {
+    if(!*row->ext)
+      return "(none)";
+    snprintf(buf, sizeof(buf), "*.%s", row->ext);
+  } else if(row->uid < 0)
+    return "(unknown)";
+  else if((pw = getpwuid((uid_t)row->uid)) != NULL)
+    snprintf(buf, sizeof(buf), "%.40s (%"PRId64")", pw->pw_name, row->uid);
+  else
+    snprintf(buf, sizeof(buf), "%"PRId64, row->uid);
+  return buf;
+}
+
+
+void rollup_draw(void) {
+  const struct dir_rollup_row *row;
+  enum ui_coltype c;
+  int width = wincols-4, n = rollup.n[page], i, r;
+
+  browse_draw();
+
+  if(sel >= n)
+    sel = n > 0 ? n-1 : 0;
+  if(start > sel)
+    start = sel;
+  if(start < sel-ROLLUP_ROWS+1)
+    start = sel-ROLLUP_ROWS+1;
+
+  nccreate(winrows-4, width, "Rollups");
+  nctab(width-34, page == ROLLUP_UID, 1, "Owners");
+  nctab(width-24, page == ROLLUP_EXT, 2, "Extensions");
+
+  attron(A_BOLD);
+  ncaddstr(1, 3, "Disk usage");
+  ncaddstr(1, 19, "Items");
+  ncaddstr(1, 26, page == ROLLUP_EXT ? "Extension" : "Owner");
+  attroff(A_BOLD);
+  if(!n)
+    ncaddstr(3, 3, "No files to display.");
+
+  for(i=start, r=2; i<n && r<ROLLUP_ROWS+2; i++, r++) {
+    row = &rollup.rows[page][i];
+    c = i == sel ? UIC_SEL : UIC_DEFAULT;
+    uic_set(c);
+    if(i == sel)
+      mvhline(subwinr+r, subwinc+1, ' ', width-2);
+    ncmove(r, 3);
+    printsize(c, row->size);
+    uic_set(c);
+    ncprint(r, 14, "%10"PRIu64, row->items);
+    ncaddstrc(c, r, 26, cropstr(rowname(row), width-28));
+    uic_set(UIC_DEFAULT);
+  }
+
+  ncaddstr(winrows-6, 3, incomplete ? "Cached contents are missing." : cropstr(getpath(rdir), width-26));
+  ncaddstr(winrows-6, width-18, "Press ");
+  uic_set(UIC_KEY);
+  addch('q');
+  uic_set(UIC_DEFAULT);
+  addstr(" to close");
+  ncmove(sel-start+2, 1);
+}
+
+
+int rollup_key(int ch) {
+  int n = rollup.n[page];
+
+  switch(ch) {
+    case '1':
+    case '2':
+      page = ch == '1' ? ROLLUP_UID : ROLLUP_EXT;
+      sel = start = 0;
+      break;
+    case KEY_RIGHT:
+    case KEY_LEFT:
+    case 'l':
+    case 'h':
+    case '\t':
+      page = page == ROLLUP_UID ? ROLLUP_EXT : ROLLUP_UID;
+      sel = start = 0;
+      break;
+    case KEY_UP:
+    case 'k':
+      if(sel > 0)
+        sel--;
+      break;
+    case KEY_DOWN:
+    case 'j':
+      if(sel < n-1)
+        sel++;
+      break;
+    case KEY_PPAGE:
+      sel = sel > ROLLUP_ROWS ? sel-ROLLUP_ROWS : 0;
+      break;
+    case KEY_NPAGE:
+      sel = sel+ROLLUP_ROWS < n ? sel+ROLLUP_ROWS : n-1;
+      break;
+    case KEY_HOME:
+      sel = 0;
+      break;
+    case KEY_END:
+      sel = n-1;
+      break;
+    case 'q':
+    case 'U':
+      dir_rollup_free(&rollup);
+      pstate = ST_BROWSE;
+      break;
+  }
+  if(sel < 0)
+    sel = 0;
+  return 0;
+}
+
+
+/* The rollups are computed once, the tree can't change while they're shown */
+void rollup_init(struct dir *d) {
+  dir_rollup_free(&rollup);
+  dir_rollup_init(&rollup);
+  incomplete = dir_mem_rollup(d, &rollup) != 0;
+  dir_rollup_sort(&rollup);
+  rdir = d;
+  page = ROLLUP_UID;
+  sel = start = 0;
+  pstate = ST_ROLLUP;
+}
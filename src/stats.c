@@ -0,0 +1,113 @@
+/* indu - Incremental NCurses Disk Usage
+
+  Based on ncdu by Yorhel (https://dev.yorhel.nl/ncdu)
+  Copyright (c) Yorhel
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include "global.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+
+int stats_enabled = 0;
+const char *stats_file = NULL;
+uint64_t stats_counters[STATS_NUM];
+
+static uint64_t phase_ns[STATS_PHASES];
+static uint64_t phase_runs[STATS_PHASES];
+
+static const char *counter_names[STATS_NUM] = {
+  "dirs_read", "stat_calls", "uring_stats", "cache_lookups", "cache_hits",
+  "items_replayed", "stubs", "load_bytes", "load_entries", "save_bytes",
+  "save_entries", "hard_links", "spilled_dirs", "spill_bytes", "unspilled_dirs",
+  "trusted_dirs", "trust_changed"
+};
+
+static const char *phase_names[STATS_PHASES] = {
+  "load", "parse", "wait", "scan", "hlink", "save"
+};
+
+
+uint64_t stats_clock(void) {
+  struct timespec ts;
+  if(!stats_enabled)
+    return 0;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+
+void stats_phase(enum stats_phase phase, uint64_t start) {
+  if(!stats_enabled)
+    return;
+  __atomic_fetch_add(&phase_ns[phase], stats_clock()-start, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&phase_runs[phase], 1, __ATOMIC_RELAXED);
+}
+
+
+#define counter(c) ((unsigned long long)__atomic_load_n(&stats_counters[c], __ATOMIC_RELAXED))
+
+void stats_draw(int row, int col, int width) {
+  char buf[256];
+  unsigned long long lookups = counter(STATS_LOOKUPS);
+
+  if(!stats_enabled)
+    return;
+  if(lookups)
+    snprintf(buf, sizeof(buf), "Stat calls: %llu  cache hits: %llu/%llu (%d%%)  replayed: %llu",
+        counter(STATS_STATS) + counter(STATS_URING_STATS), counter(STATS_HITS), lookups,
+        (int)(counter(STATS_HITS)*100/lookups), counter(STATS_REPLAYED));
+  else
+    snprintf(buf, sizeof(buf), "Stat calls: %llu  directories read: %llu",
+        counter(STATS_STATS) + counter(STATS_URING_STATS), counter(STATS_DIRS));
+  ncaddstr(row, col, cropstr(buf, width));
+}
+
+
+void stats_write(void) {
+  FILE *f = stderr;
+  int i;
+
+  if(!stats_enabled)
+    return;
+  if(stats_file && (f = fopen(stats_file, "w")) == NULL) {
+    fprintf(stderr, "Can't write stats to %s: %s\n", stats_file, strerror(errno));
+    return;
+  }
+
+  fputs("{\"counters\":{", f);
+  for(i=0; i<STATS_NUM; i++)
+    fprintf(f, "%s\"%s\":%llu", i ? "," : "", counter_names[i], counter(i));
+  fputs("},\"phases\":{", f);
+  for(i=0; i<STATS_PHASES; i++)
+    fprintf(f, "%s\"%s\":{\"runs\":%llu,\"seconds\":%.6f}", i ? "," : "", phase_names[i],
+        (unsigned long long)phase_runs[i], (double)phase_ns[i]/1e9);
+  fputs("}}\n", f);
+
+  if(f != stderr)
+    fclose(f);
+}
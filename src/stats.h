@@ -0,0 +1,91 @@
+/* indu - Incremental NCurses Disk Usage
+
+  Based on ncdu by Yorhel (https://dev.yorhel.nl/ncdu)
+  Copyright (c) Yorhel
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#ifndef _stats_h
+#define _stats_h
+
+#include "global.h"
+
+/* With --stats, indu counts what the scan and the cache do and times the
+ * phases of every scan. The counters are shown on the progress screen and
+ * written as JSON when indu exits. Without --stats, counting is a single
+ * branch on stats_enabled and the clock is never read. */
+
+enum stats_counter {
+  STATS_DIRS,          /* directories read */
+  STATS_STATS,         /* lstat() and fstatat() calls */
+  STATS_URING_STATS,   /* lstat()s submitted through io_uring */
+  STATS_LOOKUPS,       /* cache lookups */
+  STATS_HITS,          /* cache lookups that found an up to date entry */
+  STATS_REPLAYED,      /* items output from the cache */
+  STATS_STUBS,         /* cached directories output as FF_CACHED stub */
+  STATS_LOAD_BYTES,    /* bytes of cache file parsed or mapped */
+  STATS_LOAD_ENTRIES,  /* cache entries loaded */
+  STATS_SAVE_BYTES,    /* bytes of cache file or journal written */
+  STATS_SAVE_ENTRIES,  /* cache entries written */
+  STATS_HLINKS,        /* hard link candidates counted by hlink_sizes() */
+  STATS_SPILLED,       /* directories written to the --memory-limit spill file */
+  STATS_SPILL_BYTES,   /* bytes written to the spill file */
+  STATS_UNSPILLED,     /* spilled directories read back */
+  STATS_TRUSTED,       /* cached directories used under --cache-trust without a check */
+  STATS_TRUST_CHANGED, /* of those, found changed by the verification afterwards */
+  STATS_NUM
+};
+
+enum stats_phase {
+  STATS_PHASE_LOAD,  /* opening or mapping the cache */
+  STATS_PHASE_PARSE, /* parsing a JSON cache in the background */
+  STATS_PHASE_WAIT,  /* scan waiting for the background parse */
+  STATS_PHASE_SCAN,
+  STATS_PHASE_HLINK,
+  STATS_PHASE_SAVE,
+  STATS_PHASES
+};
+
+extern int stats_enabled;
+extern const char *stats_file; /* NULL for stderr */
+extern uint64_t stats_counters[STATS_NUM];
+
+/* Can be used from any thread */
+#define stats_add(c, n) do {\
+    if(stats_enabled)\
+      __atomic_fetch_add(&stats_counters[c], (uint64_t)(n), __ATOMIC_RELAXED);\
+  } while(0)
+#define stats_inc(c) stats_add(c, 1)
+
+/* Returns the monotonic clock in nanoseconds, or 0 without --stats */
+uint64_t stats_clock(void);
+
+/* Adds the time since start, as returned by stats_clock(), to a phase */
+void stats_phase(enum stats_phase phase, uint64_t start);
+
+/* Draws the counters on a line of the progress screen */
+void stats_draw(int row, int col, int width);
+
+/* Writes the JSON report to stats_file */
+void stats_write(void);
+
+#endif
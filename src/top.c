@@ -0,0 +1,162 @@
+/* indu - Incremental NCurses Disk Usage
+
+  Based on ncdu by Yorhel (https://dev.yorhel.nl/ncdu)
+  Copyright (c) Yorhel
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include "global.h"
+
+#include <ncurses.h>
+
+
+static int page, start, sel;
+static const char *message;
+
+
+/* Rows of the list in the window */
+#define TOP_ROWS (winrows-9)
+
+void top_draw(void) {
+  const struct dir_top *list;
+  enum ui_coltype c;
+  int width = wincols-4, n, i, row;
+
+  browse_draw();
+
+  n = dir_mem_top(page, &list);
+  if(sel >= n)
+    sel = n > 0 ? n-1 : 0;
+  if(start > sel)
+    start = sel;
+  if(start < sel-TOP_ROWS+1)
+    start = sel-TOP_ROWS+1;
+
+  nccreate(winrows-4, width, "Largest items");
+  nctab(width-30, page == 0, 1, "Files");
+  nctab(width-20, page == 1, 2, "Directories");
+
+  attron(A_BOLD);
+  ncaddstr(1, 3, "Disk usage");
+  ncaddstr(1, 14, "Path");
+  attroff(A_BOLD);
+  if(!n)
+    ncaddstr(3, 3, "No items to display.");
+
+  for(i=start, row=2; i<n && row<TOP_ROWS+2; i++, row++) {
+    c = i == sel ? UIC_SEL : UIC_DEFAULT;
+    uic_set(c);
+    if(i == sel)
+      mvhline(subwinr+row, subwinc+1, ' ', width-2);
+    ncmove(row, 3);
+    printsize(c, list[i].size);
+    ncaddstrc(c, row, 14, cropstr(dir_mem_top_path(&list[i]), width-16));
+    uic_set(UIC_DEFAULT);
+  }
+
+  if(message)
+    ncaddstr(winrows-6, 3, message);
+  else {
+    ncaddstr(winrows-6, width-41, "Press ");
+    uic_set(UIC_KEY);
+    addstr("enter");
+    uic_set(UIC_DEFAULT);
+    addstr(" to go there, ");
+    uic_set(UIC_KEY);
+    addch('q');
+    uic_set(UIC_DEFAULT);
+    addstr(" to close");
+  }
+  ncmove(sel-start+2, 1);
+}
+
+
+int top_key(int ch) {
+  const struct dir_top *list;
+  struct dir *d;
+  int n = dir_mem_top(page, &list);
+
+  message = NULL;
+  switch(ch) {
+    case '1':
+    case '2':
+      page = ch-'1';
+      sel = start = 0;
+      break;
+    case KEY_RIGHT:
+    case KEY_LEFT:
+    case 'l':
+    case 'h':
+    case '\t':
+      page = !page;
+      sel = start = 0;
+      break;
+    case KEY_UP:
+    case 'k':
+      if(sel > 0)
+        sel--;
+      break;
+    case KEY_DOWN:
+    case 'j':
+      if(sel < n-1)
+        sel++;
+      break;
+    case KEY_PPAGE:
+      sel = sel > TOP_ROWS ? sel-TOP_ROWS : 0;
+      break;
+    case KEY_NPAGE:
+      sel = sel+TOP_ROWS < n ? sel+TOP_ROWS : n-1;
+      break;
+    case KEY_HOME:
+      sel = 0;
+      break;
+    case KEY_END:
+      sel = n-1;
+      break;
+    case 10:
+      if(sel >= n)
+        break;
+      if((d = dir_mem_top_find(&list[sel])) == NULL) {
+        message = "This item can't be found anymore.";
+        break;
+      }
+      browse_init(d->parent);
+      dirlist_select(d);
+      dirlist_top(-3);
+      break;
+    case 'q':
+    case 'T':
+      pstate = ST_BROWSE;
+      break;
+  }
+  if(sel < 0)
+    sel = 0;
+  return 0;
+}
+
+
+void top_init(void) {
+  page = 0;
+  sel = start = 0;
+  message = NULL;
+  pstate = ST_TOP;
+}
@@ -28,6 +28,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <ncurses.h>
 #include <stdarg.h>
 #include <unistd.h>
@@ -301,9 +302,10 @@ void uic_set(enum ui_coltype c) {
 /* removes item from the hlnk circular linked list and size counts of the parents */
 static void freedir_hlnk(struct dir *d) {
   struct dir *t, *par, *pt;
+  struct dir_link *l = dir_link_ptr(d);
   int i;
 
-  if(!(d->flags & FF_HLNKC))
+  if(!l)
     return;
 
   /* remove size from parents.
@@ -313,22 +315,22 @@ static void freedir_hlnk(struct dir *d) {
    * XXX: Same note as for dir_mem.c / hlink_check():
    *      this is probably not the most efficient algorithm */
   for(i=1,par=d->parent; i&&par; par=par->parent) {
-    if(d->hlnk)
-      for(t=d->hlnk; i&&t!=d; t=t->hlnk)
+    if(l->hlnk)
+      for(t=l->hlnk; i&&t!=d; t=dir_link_ptr(t)->hlnk)
         for(pt=t->parent; i&&pt; pt=pt->parent)
           if(pt==par)
             i=0;
     if(i) {
       par->size = adds64(par->size, -d->size);
-      par->asize = adds64(par->size, -d->asize);
+      par->asize = adds64(par->asize, -d->asize);
     }
   }
 
   /* remove from hlnk */
-  if(d->hlnk) {
-    for(t=d->hlnk; t->hlnk!=d; t=t->hlnk)
+  if(l->hlnk) {
+    for(t=l->hlnk; dir_link_ptr(t)->hlnk!=d; t=dir_link_ptr(t)->hlnk)
       ;
-    t->hlnk = d->hlnk;
+    dir_link_ptr(t)->hlnk = l->hlnk;
   }
 }
 
@@ -338,10 +340,12 @@ static void freedir_rec(struct dir *dr) {
   tmp2 = dr;
   while((tmp = tmp2) != NULL) {
     freedir_hlnk(tmp);
+    if(tmp->flags & FF_CACHED)
+      dir_mem_forget(tmp);
     /* remove item */
     if(tmp->sub) freedir_rec(tmp->sub);
     tmp2 = tmp->next;
-    free(tmp);
+    arena_free(tmp);
   }
 }
 
@@ -349,6 +353,8 @@ static void freedir_rec(struct dir *dr) {
 void freedir(struct dir *dr) {
   if(!dr)
     return;
+  dirlist_gen++;
+  dir_mem_top_forget(dr);
 
   /* free dr->sub recursively */
   if(dr->sub)
@@ -363,6 +369,8 @@ void freedir(struct dir *dr) {
     dr->next->prev = dr->prev;
 
   freedir_hlnk(dr);
+  if(dr->flags & FF_CACHED)
+    dir_mem_forget(dr);
 
   /* update sizes of parent directories if this isn't a hard link.
    * If this is a hard link, freedir_hlnk() would have done so already
@@ -370,8 +378,9 @@ void freedir(struct dir *dr) {
    * mtime is 0 here because recalculating the maximum at every parent
    * dir is expensive, but might be good feature to add later if desired */
   addparentstats(dr->parent, dr->flags & FF_HLNKC ? 0 : -dr->size, dr->flags & FF_HLNKC ? 0 : -dr->asize, 0, -(dr->items+1));
+  dir_mem_top_fix(dr->parent);
 
-  free(dr);
+  arena_free(dr);
 }
 
 
@@ -423,6 +432,7 @@ struct dir *getroot(struct dir *d) {
 
 void addparentstats(struct dir *d, int64_t size, int64_t asize, uint64_t mtime, int items) {
   struct dir_ext *e;
+  dirlist_gen++;
   while(d) {
     /* Stop propagation at cached directories - their sizes/items already
      * include all descendants from the cache. This prevents double-counting
@@ -465,6 +475,99 @@ char *xstrdup(const char *str) {
 }
 
 
+/* Chunks are aligned to their size, so that the chunk of an item can be found
+ * from its address. Items larger than a chunk get a chunk of their own, which
+ * still works because they start within the first ARENA_CHUNK bytes. */
+#define ARENA_CHUNK (256*1024)
+
+struct arena_chunk {
+  struct arena *arena;
+  struct arena_chunk *prev, *next;
+  size_t used, size;
+  size_t live; /* number of items that haven't been freed */
+};
+
+#define arena_hdr ((sizeof(struct arena_chunk)+15) & ~(size_t)15)
+
+static void *arena_memalign(size_t size) {
+  void *p;
+  return posix_memalign(&p, ARENA_CHUNK, size) ? NULL : p;
+}
+
+static void *arena_xmemalign(size_t size) { wrap_oom(arena_memalign(size)) }
+
+
+void *arena_alloc(struct arena *a, size_t size) {
+  struct arena_chunk *c = a->cur, *n;
+
+  size = (size + 7) & ~(size_t)7;
+  if(!c || c->used + size > c->size) {
+    n = arena_xmemalign(arena_hdr + size > ARENA_CHUNK ? arena_hdr + size : ARENA_CHUNK);
+    n->arena = a;
+    n->used = arena_hdr;
+    n->size = arena_hdr + size > ARENA_CHUNK ? arena_hdr + size : ARENA_CHUNK;
+    n->live = 0;
+    a->size += n->size;
+    /* Chunks are kept in a list with the current one first. An oversized
+     * chunk goes right behind it, since nothing else will fit in it anyway. */
+    if(c && n->size > ARENA_CHUNK) {
+      n->prev = c;
+      n->next = c->next;
+      c->next = n;
+    } else {
+      n->prev = NULL;
+      n->next = c;
+      if(c)
+        c->prev = n;
+      a->cur = n;
+    }
+    if(n->next)
+      n->next->prev = n;
+    c = n;
+  }
+  c->live++;
+  c->used += size;
+  return (char *)c + c->used - size;
+}
+
+
+char *arena_strdup(struct arena *a, const char *str) {
+  char *r = arena_alloc(a, strlen(str)+1);
+  strcpy(r, str);
+  return r;
+}
+
+
+void arena_free(void *ptr) {
+  struct arena_chunk *c = (struct arena_chunk *)((uintptr_t)ptr & ~(uintptr_t)(ARENA_CHUNK-1));
+
+  if(--c->live > 0)
+    return;
+  /* The current chunk is reused rather than freed */
+  if(c == c->arena->cur) {
+    c->used = arena_hdr;
+    return;
+  }
+  if(c->prev)
+    c->prev->next = c->next;
+  if(c->next)
+    c->next->prev = c->prev;
+  c->arena->size -= c->size;
+  free(c);
+}
+
+
+void arena_clear(struct arena *a) {
+  struct arena_chunk *c, *n;
+  for(c=a->cur; c; c=n) {
+    n = c->next;
+    free(c);
+  }
+  a->cur = NULL;
+  a->size = 0;
+}
+
+
 /* Expands '~' and '~user' */
 char *expanduser(const char *path) {
   size_t len, size;
@@ -77,12 +77,20 @@ extern int subwinr, subwinc;
 extern int si;
 
 
-/* Macros for managing struct dir and struct dir_ext */
+/* Macros for managing struct dir, struct dir_ext and struct dir_link. The
+ * dir_ext struct follows the name if FF_EXT is set, the dir_link struct
+ * comes after that if FF_HLNKC is set. */
 
 #define dir_memsize(n)     (offsetof(struct dir, name)+1+strlen(n))
 #define dir_ext_offset(n)  ((dir_memsize(n) + 7) & ~7)
 #define dir_ext_memsize(n) (dir_ext_offset(n) + sizeof(struct dir_ext))
 #define dir_ext_ptr(d)     ((d)->flags & FF_EXT ? (struct dir_ext *) ( ((char *)(d)) + dir_ext_offset((d)->name) ) : NULL)
+#define dir_link_offset(n, f) (dir_ext_offset(n) + ((f) & FF_EXT ? sizeof(struct dir_ext) : 0))
+#define dir_link_ptr(d)    ((d)->flags & FF_HLNKC ? (struct dir_link *) ( ((char *)(d)) + dir_link_offset((d)->name, (d)->flags) ) : NULL)
+#define dir_node_memsize(n, f) (\
+  (f) & FF_HLNKC ? dir_link_offset(n, f) + sizeof(struct dir_link) :\
+  (f) & FF_EXT ? dir_ext_memsize(n) : dir_memsize(n))
+#define dir_hlnk(d)        ((d)->flags & FF_HLNKC ? dir_link_ptr(d)->hlnk : NULL)
 
 
 /* Instead of using several ncurses windows, we only draw to stdscr.
@@ -191,7 +199,53 @@ void *xrealloc(void *, size_t);
 
 char *xstrdup(const char *);
 
+
+/* A bump allocator that hands out memory from large chunks. Freeing an item
+ * only gives memory back once every item in its chunk has been freed;
+ * arena_clear() frees everything at once. Not thread-safe. */
+struct arena_chunk;
+struct arena {
+  struct arena_chunk *cur;
+  size_t size; /* of all chunks */
+};
+
+void *arena_alloc(struct arena *, size_t);
+char *arena_strdup(struct arena *, const char *);
+void arena_free(void *);
+void arena_clear(struct arena *);
+
 char *expanduser(const char *);
 
+/* Returns the length of the part at the start of str, of at most len bytes,
+ * that goes into a JSON string as it is: everything before the first quote,
+ * backslash, control character or zero byte. Looks at 8 bytes at a time, so
+ * that JSON strings can be escaped and parsed in runs instead of bytes. Of the
+ * bytes that json_hasless() flags, the first one in memory is always right,
+ * the ones after it may not be. */
+#define json_ones 0x0101010101010101ULL
+#define json_hasless(x, n) (((x) - json_ones*(n)) & ~(x) & json_ones*0x80)
+#define json_special(c) ((unsigned char)(c) < 0x20 || (c) == '"' || (c) == '\\' || (c) == 0x7f)
+
+static inline size_t json_plain(const char *str, size_t len) {
+  const char *p = str, *end = str + len;
+  uint64_t x, m;
+
+  for(; end - p >= 8; p += 8) {
+    memcpy(&x, p, 8);
+    m = json_hasless(x, 0x20) | json_hasless(x ^ json_ones*'"', 1) |
+        json_hasless(x ^ json_ones*'\\', 1) | json_hasless(x ^ json_ones*0x7f, 1);
+    if(m) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      return p - str + __builtin_ctzll(m) / 8;
+#else
+      break;
+#endif
+    }
+  }
+  while(p < end && !json_special(*p))
+    p++;
+  return p - str;
+}
+
 #endif
 
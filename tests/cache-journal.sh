@@ -0,0 +1,33 @@
+#!/bin/sh
+# A nested directory of a cached directory that fails validation is rescanned
+# and its record in the entry of its parent updated; with --cache-journal,
+# that entry has to end up in the journal as well.
+
+set -e
+t=$(mktemp -d)
+trap 'rm -rf "$t"' EXIT
+
+mkdir -p "$t/root/a/b/c"
+# Enough other directories to keep the journal small next to the cache file
+for p in 1 2 3 4 5 6 7 8 9 10; do
+  for d in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20; do
+    mkdir -p "$t/root/p$p/d$d"
+  done
+done
+touch -d @1000000000 "$t/root/a/b/c"
+
+scan() {
+  "$INDU" -C "$t/cache" --cache-journal -e -o "$t/out.json" "$t/root" </dev/null >/dev/null 2>&1
+}
+mtime() {
+  grep -o '"name":"c"[^}]*"mtime":[0-9]*' "$1" | sed 's/.*"mtime"://'
+}
+
+scan
+scan
+touch -d @1000000100 "$t/root/a/b/c"
+scan
+test -f "$t/cache.journal" || { echo "journal not used"; exit 1; }
+scan
+m=$(mtime "$t/out.json")
+test "$m" = 1000000100 || { echo "stale record for c: mtime $m"; exit 1; }
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Importing a compressed export that was cut short has to fail with a
+# decompression error, rather than as a JSON error or with part of the tree.
+
+set -e
+t=$(mktemp -d)
+trap 'rm -rf "$t"' EXIT
+
+mkdir -p "$t/root/a" "$t/root/b"
+for f in 1 2 3 4 5 6 7 8 9 10; do
+  echo "$f" > "$t/root/a/file$f"
+  echo "$f" > "$t/root/b/file$f"
+done
+
+# Not built with zstd: skipped
+"$INDU" -o "$t/full.json.zst" "$t/root" </dev/null >/dev/null 2>&1 || exit 77
+
+"$INDU" -f "$t/full.json.zst" -o "$t/out.json" </dev/null >"$t/log" 2>&1
+if grep -q error "$t/log"; then
+  echo "full export fails to import:"; cat "$t/log"; exit 1
+fi
+
+size=$(wc -c < "$t/full.json.zst")
+head -c $((size / 2)) "$t/full.json.zst" > "$t/cut.json.zst"
+"$INDU" -f "$t/cut.json.zst" -o "$t/out.json" </dev/null >"$t/log" 2>&1 || true
+grep -q "truncated zstd stream" "$t/log" || { echo "no decompression error:"; cat "$t/log"; exit 1; }